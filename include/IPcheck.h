@@ -12,6 +12,7 @@ extern int IPcheck_remote_connect(aClient *cptr, const char *hostname,
     int is_burst);
 extern void IPcheck_disconnect(aClient *cptr);
 extern unsigned short IPcheck_nr(aClient *cptr);
+extern void IPcheck_report(aClient *cptr, char *name);
 
 #if defined(BDD_CLONES)
 extern int IPbusca_clones(aClient *cptr);
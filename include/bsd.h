@@ -5,7 +5,10 @@
  * Proto types
  */
 
+struct iovec;
+
 extern int deliver_it(aClient *cptr, const char *str, int len);
+extern int deliver_iov(aClient *cptr, const struct iovec *iov, int count);
 
 extern int writecalls;
 extern int writeb[10];
@@ -164,6 +164,8 @@ extern int m_opmode(aClient *cptr, aClient *sptr, int parc, char *parv[]);
  * Structures
  */
 
+struct BanCache;
+
 struct SMode {
   unsigned int mode;
   unsigned int limit;
@@ -188,6 +190,11 @@ struct Channel {
   struct SLink *members;
   struct SLink *invites;
   struct SLink *banlist;
+  struct BanCache *bancache;    /* Bans compilados, NULL si hay que rehacerlos */
+  struct Channel *lnext;        /* Siguiente con los mismos usuarios (/LIST) */
+  struct Channel **lprevp;      /* Puntero que nos apunta en esa lista */
+  struct Channel **snext;       /* Siguientes en el indice por nombre, por nivel */
+  unsigned int listed;          /* Listados de /LIST parados en este canal */
   char chname[1];
 };
 
@@ -199,8 +206,11 @@ struct ListingArgs {
   unsigned int flags;
   time_t max_topic_time;
   time_t min_topic_time;
-  unsigned int bucket;
+  int level;                    /* Lista de usuarios en curso (hash.c) */
   char wildcard[CHANNELLEN];
+  struct Channel *chptr;        /* Siguiente canal de esa lista, o NULL */
+  char prefix[CHANNELLEN];      /* Prefijo fijo del comodin, si lo hay */
+  char last[CHANNELLEN + 1];    /* Ultimo canal enviado por prefijo */
 };
 
 /*=============================================================================
@@ -240,5 +250,6 @@ extern void mascara_canal_flags(char *modos, int *add, int *del);
 void channel_modes(aClient *cptr, char *mbuf, char *pbuf, aChannel *chptr);
 extern aChannel *channel;
 extern void spam_set_kickban(aChannel *chptr, aClient *sptr, char *comment);
+extern size_t ban_cache_memory(aChannel *chptr);
 
 #endif /* CHANNEL_H */
@@ -179,12 +179,16 @@ extern int strnCasecmp(const char *a, const char *b, const size_t n);
 #define DelReadEvent(x)        DelEvent(x, evread)
 #define DelWriteEvent(x)       DelEvent(x, evwrite)
 #define DelTimerEvent(x)       DelEvent(x, evtimer)
-#define DelCheckPingEvent(x)   DelEvent(x, evcheckping)
+#define DelCheckPingEvent(x)   do { \
+                                 assert(MyConnect(x)); \
+                                 timer_del(&(x)->checkping); \
+                               } while (0)
 #define DelRWEvent(x)          do { \
                                  DelReadEvent(x); \
                                  DelWriteEvent(x); \
                                } while (0)
 #define DelClientEvent(x)      do { \
+                                 io_del(x); \
                                  DelReadEvent(x); \
                                  DelWriteEvent(x); \
                                  DelTimerEvent(x); \
@@ -200,16 +204,23 @@ extern int strnCasecmp(const char *a, const char *b, const size_t n);
                                  assert(MyConnect(x)); \
                                  assert(event_add((x)->evread, NULL)!=-1); \
                                } while (0)
+#if defined(HAVE_SYS_EPOLL_H)
+#define UpdateWrite(x)         do { \
+                                 assert(MyConnect(x)); \
+                                 io_update_write(x); \
+                               } while (0)
+#else
 #define UpdateWrite(x)         do { \
                                  assert(MyConnect(x)); \
                                  if((x)->evwrite) \
                                  { \
-                                   if(DBufLength(&(x)->sendQ) || (x)->listing) \
+                                   if(DBufLength(&(x)->sendQ) || (x)->listing || (x)->burst) \
                                      assert(event_add((x)->evwrite, NULL)!=-1); \
                                    else \
                                      event_del((x)->evwrite); \
                                  } \
                                } while (0)
+#endif
 #define UpdateGTimer(x,y,z,w)  do { \
                                   assert(MyConnect(x)); \
                                   assert(!IsListening(x)); \
@@ -222,7 +233,12 @@ extern int strnCasecmp(const char *a, const char *b, const size_t n);
                                   assert(evtimer_add((x)->z, (x)->w)!=-1); \
                                } while (0)
 #define UpdateTimer(x,y)       UpdateGTimer(x,y,evtimer,tm_timer)
-#define UpdateCheckPing(x,y)   UpdateGTimer(x,y,evcheckping,tm_checkping)
+#define UpdateCheckPing(x,y)   do { \
+                                  assert(MyConnect(x)); \
+                                  assert(!IsListening(x)); \
+                                  Debug((DEBUG_DEBUG, "checkping on %s time %ld", (x)->name, (long)(y))); \
+                                  timer_add(&(x)->checkping, (y)); \
+                               } while (0)
 #define CreateGTimerEvent(x,y,z,w) \
                                do { \
                                   assert(MyConnect(x)); \
@@ -235,7 +251,10 @@ extern int strnCasecmp(const char *a, const char *b, const size_t n);
                                   evtimer_set((x)->z, (void *)(y), (void *)(x)); \
                                 } while (0)
 #define CreateTimerEvent(x,y)   CreateGTimerEvent(x,y,evtimer,tm_timer)
-#define CreateCheckPingEvent(x) CreateGTimerEvent(x,event_checkping_callback,evcheckping,tm_checkping)
+#define CreateCheckPingEvent(x) do { \
+                                  assert(MyConnect(x)); \
+                                  timer_set(&(x)->checkping, (void (*)(void *))event_checkping_callback, (void *)(x)); \
+                                } while (0)
 #define CreateEvent(x,y,z,w,v)  do { \
                                   assert(MyConnect(x) || (x) == &me); \
                                   if((x)->z) \
@@ -252,13 +271,22 @@ extern int strnCasecmp(const char *a, const char *b, const size_t n);
                                   CreateWEvent(x,y); \
                                   CreateTimerEvent(x,y); \
                                 } while (0)
+#if defined(HAVE_SYS_EPOLL_H)
+#define CreateClientEvent(x)    do { \
+                                  io_add(x); \
+                                  CreateTimerEvent(x,event_client_read_callback); \
+                                  CreateCheckPingEvent(x); \
+                                  UpdateCheckPing(x, CONNECTTIMEOUT); \
+                                } while (0)
+#else
 #define CreateClientEvent(x)    do { \
                                   CreateREvent(x,event_client_read_callback); \
                                   CreateWEvent(x,event_client_write_callback); \
                                   CreateTimerEvent(x,event_client_read_callback); \
                                   CreateCheckPingEvent(x); \
                                   UpdateCheckPing(x, CONNECTTIMEOUT); \
-                                } while (0) 
+                                } while (0)
+#endif
 #define CreateRAuthEvent(x)     CreateEvent(x,event_auth_callback,evauthread,(EV_READ|EV_PERSIST),authfd)
 #define CreateWAuthEvent(x)     CreateEvent(x,event_auth_callback,evauthwrite,(EV_WRITE|EV_PERSIST),authfd)
 #define CreateRWAuthEvent(x)    do { \
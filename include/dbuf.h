@@ -28,8 +28,30 @@
  */
 extern int DBufAllocCount;      /* GLOBAL - count of dbufs allocated */
 extern int DBufUsedCount;       /* GLOBAL - count of dbufs in use */
+extern int DBufRefCount;        /* GLOBAL - count of shared references queued */
+extern int DBufSharedAllocCount;  /* GLOBAL - count of shared messages allocated */
+extern int DBufSharedUsedCount; /* GLOBAL - count of shared messages in use */
 
 struct DBufBuffer;
+struct iovec;
+
+/*
+ * Size of the data area of a shared message; one protocol line
+ * (BUFSIZE) plus the terminating "\r\n" and '\0'.
+ */
+#define DBUF_SHARED_SIZE 515
+
+/*
+ * A message formatted only once and queued *by reference* in the
+ * sendQ of every recipient. It is released when the last sendQ
+ * that holds it has written it out (and the creator has dropped
+ * its own reference with dbuf_shared_free).
+ */
+struct DBufShared {
+  unsigned int refcount;        /* Creator plus the queued references */
+  size_t length;                /* Number of bytes used in data */
+  char data[DBUF_SHARED_SIZE];  /* The formatted message, including CRLF */
+};
 
 struct DBuf {
   size_t length;                /* Current number of bytes stored */
@@ -55,9 +77,18 @@ extern void dbuf_delete(struct DBuf *dyn, size_t length);
 extern int dbuf_put(struct Client *cptr, struct DBuf *dyn, const char *buf,
     size_t length);
 extern const char *dbuf_map(const struct DBuf *dyn, size_t *length);
+extern int dbuf_mapiov(const struct DBuf *dyn, struct iovec *iov, int count,
+    size_t *length);
 extern size_t dbuf_get(struct DBuf *dyn, char *buf, size_t length);
 extern size_t dbuf_getmsg(struct DBuf *dyn, char *buf, size_t length);
 extern void dbuf_count_memory(size_t *allocated, size_t *used);
+extern void dbuf_count_shared_memory(size_t *refs, size_t *shared);
+extern struct DBufShared *dbuf_shared_alloc(void);
+extern void dbuf_shared_free(struct DBufShared *shared);
+extern int dbuf_put_shared(struct Client *cptr, struct DBuf *dyn,
+    struct DBufShared *shared);
+extern int dbuf_append(struct Client *cptr, struct DBuf *dst,
+    struct DBuf *src);
 
 #if defined(ESNET_NEG) && defined(ZLIB_ESNET)
 void inicia_microburst(void);
@@ -29,7 +29,6 @@ typedef struct Channel aChannel;
 typedef struct SMode Mode;
 typedef struct ConfItem aConfItem;
 typedef struct Message aMessage;
-typedef struct MessageTree aMessageTree;
 typedef struct Gline aGline;
 typedef struct ListingArgs aListingArgs;
 typedef struct MotdItem aMotdItem;
@@ -70,7 +70,7 @@ extern aChannel *hSeekChannel(char *name);
 
 extern int m_hash(aClient *cptr, aClient *sptr, int parc, char *parv[]);
 
-int db_hash_registro(char *clave, int hash_size);
+int db_hash_registro(const char *clave, int hash_size);
 
 extern int hAddWatch(aWatch * wptr);
 extern int hRemWatch(aWatch * wptr);
@@ -79,6 +79,26 @@ extern aWatch *hSeekWatch(char *nick);
 #define SeekWatch(nick)          hSeekWatch((nick))
 #define FindWatch(nick)          (BadPtr((nick))?NULL:SeekWatch(nick))
 
+extern int hAddMember(aChannel *chptr, aClient *cptr, Link *member);
+extern int hRemMember(aChannel *chptr, aClient *cptr);
+extern Link *hSeekMember(aChannel *chptr, aClient *cptr);
+extern size_t member_hash_mem(aClient *cptr, char *nick);
+extern size_t watch_hash_mem(aClient *cptr, char *nick);
+
+/* Link of cptr in chptr->members (zombies included), or NULL */
+#define FindMember(chptr, cptr)  hSeekMember((chptr), (cptr))
+
+extern void hChannelUsers(aChannel *chptr, unsigned int old_users);
+extern void list_start_channels(struct Client *cptr);
 extern void list_next_channels(struct Client *cptr);
+extern void list_stop_channels(struct Client *cptr);
+
+extern void who_index_add(struct Client *acptr);
+extern void who_index_del(struct Client *acptr);
+extern void *who_index_suffix(int idx, const char *suffix, int exact);
+extern void *who_index_ip(const struct irc_in_addr *mask, unsigned char bits);
+extern unsigned int who_index_count(void *p);
+extern void who_index_walk(void *p, void (*fn)(struct Client *));
+extern size_t who_index_mem(struct Client *cptr, char *nick);
 
 #endif /* HASH_H */
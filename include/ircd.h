@@ -38,7 +38,6 @@ extern void restart(char *mesg);
 extern void server_reboot(void);
 extern void update_nextdnscheck(int timeout);
 extern void update_nextconnect(int timeout);
-extern void update_nextexpire(int timeout);
 extern void init_timers(void);
 
 extern aClient me;
@@ -58,6 +57,5 @@ extern char *debugmode;
 extern int nicklen;
 
 extern struct timeval tm_nextdnscheck;
-extern struct timeval tm_nextexpire;
 
 #endif /* IRCD_H */
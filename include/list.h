@@ -56,6 +56,7 @@ extern void free_link(Link *lp);
 extern Link *make_link(void);
 extern Link *find_user_link(Link *lp, aClient *ptr);
 extern void initlists(void);
+extern unsigned int client_seq;
 extern void outofmemory(void);
 extern aClient *make_client(aClient *from, int status);
 extern void free_client(aClient *cptr);
@@ -71,10 +72,11 @@ extern void delist_conf(struct ConfItem *aconf);
 extern void free_conf(struct ConfItem *aconf);
 extern aGline *make_gline(char *host, char *reason, char *name,
     time_t expire, time_t lastmod, time_t lifetime);
-extern aGline *find_gline(aClient *cptr, aGline **pgline);
-extern void free_gline(aGline *agline, aGline *pgline);
+extern aGline *find_gline(aClient *cptr);
+extern void free_gline(aGline *agline);
 extern void send_listinfo(aClient *cptr, char *name);
 extern int bad_channel(char *name);
+extern struct MaskIndex gline_index;
 extern aWatch *make_watch(char *nick);
 extern void free_watch(aWatch * wptr);
 
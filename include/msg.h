@@ -21,6 +21,8 @@
 #if !defined(MSG_H)
 #define MSG_H
 
+#include <stdint.h>             /* uint64_t */
+
 /*=============================================================================
  * General defines
  */
@@ -398,12 +400,7 @@ struct Message {
                                    to be used only on the average of once per 2
                                    seconds -SRB */
   unsigned int bytes;
-};
-
-struct MessageTree {
-  char *final;
-  struct Message *msg;
-  struct MessageTree *pointers[26];
+  uint64_t nsec;                /* Tiempo total en `func', para /STATS m */
 };
 
 /*=============================================================================
@@ -2,6 +2,8 @@
 #define OPERCMDS_H
 
 #include "res.h"
+#include "s_mask.h"
+#include "s_timer.h"
 #include <pcre.h>
 
 /*=============================================================================
@@ -42,6 +44,7 @@
 
 struct Gline {
   struct Gline *next;
+  struct Gline **prevp;         /* Puntero que nos apunta en gline o badchan */
   char *host;
   char *reason;
   char *name;
@@ -52,6 +55,8 @@ struct Gline {
   unsigned char gl_bits;    /**< Usable bits in gl_addr. */
   pcre *re;
   unsigned int gflags;
+  struct MaskEntry gl_index;    /* Entrada en gline_index */
+  struct WheelTimer gl_timer;   /* Caducidad */
 };
 
 /*=============================================================================
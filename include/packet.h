@@ -6,6 +6,6 @@
  */
 
 extern int dopacket(aClient *cptr, char *buffer, int length);
-extern int client_dopacket(aClient *cptr, size_t length);
+extern int client_dopacket(aClient *cptr, char *buffer, size_t length);
 
 #endif /* PACKET_H */
@@ -81,7 +81,6 @@ extern struct hostent *get_res(char *lp);
 extern void flush_cache(void);
 extern int m_dns(aClient *cptr, aClient *sptr, int parc, char *parv[]);
 extern size_t cres_mem(aClient *sptr);
-extern void event_expire_cache_callback(int fd, short event, struct event *ev);
 extern void event_timeout_query_list_callback(int fd, short event, struct event *ev);
 
 #endif /* RES_H */
@@ -1,6 +1,16 @@
 #if !defined(S_AUTH_H)
 #define S_AUTH_H
 
+/*=============================================================================
+ * Macros
+ */
+
+/* Fases del registro de un cliente local, para los histogramas */
+#define AUTH_STAGE_DNS          0       /* PTR y su confirmacion */
+#define AUTH_STAGE_IDENT        1
+#define AUTH_STAGE_TOTAL        2       /* Hasta el 001 */
+#define AUTH_STAGES             3
+
 /*=============================================================================
  * Proto types
  */
@@ -8,5 +18,8 @@
 extern void start_auth(aClient *cptr);
 extern void send_authports(aClient *cptr);
 extern void read_authports(aClient *cptr);
+extern void auth_close(aClient *cptr);
+extern void auth_stage_done(aClient *cptr, int stage);
+extern void auth_report(aClient *cptr, char *name);
 
 #endif /* S_AUTH_H */
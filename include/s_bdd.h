@@ -153,7 +153,8 @@ void tx_num_serie_dbs(aClient *cptr);
 int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[]);
 
 void tea(unsigned int v[], unsigned int k[], unsigned int x[]);
-struct db_reg *db_buscar_registro(unsigned char tabla, char *clave);
+const struct db_reg *db_buscar_registro(unsigned char tabla,
+    const char *clave);
 int db_es_residente(unsigned char tabla);
 unsigned int db_num_serie(unsigned char tabla);
 unsigned int db_cuantos(unsigned char tabla);
@@ -166,6 +167,7 @@ void db_persistent_commit(void);
 #endif
 
 int m_dbq(aClient *cptr, aClient *sptr, int parc, char *parv[]);
+void db_report(aClient *cptr, char *name);
 
 extern char *bot_nickserv;
 extern char *bot_chanserv;
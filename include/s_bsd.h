@@ -111,6 +111,7 @@
 #define DoingAuth(x)		(assert(MyConnect(x)),((x)->flags_local & FLAGS_AUTH))
 #define DoingWRAuth(x)		(assert(MyConnect(x)),((x)->flags_local & FLAGS_WRAUTH))
 #define NoNewLine(x)		((x)->flags & FLAGS_NONL)
+#define RecvQFull(x)		(IsUser(x) && DBufLength(&(x)->recvQ) > 6090)
 #define DoPing(x)		((x)->flags & FLAGS_PING)
 #define SetAskedPing(x)		((x)->flags |= FLAGS_ASKEDPING)
 #define AskedPing(x)		((x)->flags & FLAGS_ASKEDPING)
@@ -220,7 +221,7 @@ extern void event_auth_callback(int fd, short event, aClient *cptr);
 extern void event_client_read_callback(int fd, short event, aClient *cptr);
 extern void event_client_write_callback(int fd, short event, aClient *cptr);
 extern void event_connection_callback(int fd, short event, aClient *cptr);
-extern void event_checkping_callback(int fd, short event, aClient *cptr);
+extern void event_checkping_callback(aClient *cptr);
 extern void update_now(void);
 
 extern int highest_fd, resfd;
@@ -143,6 +143,7 @@ extern aConfItem *conf_negociacion;
 #endif
 extern aGline *gline;
 extern aGline *badchan;
+extern struct MaskIndex kline_index;
 extern time_t motd_TS;
 extern aMotdItem *motd;
 extern aMotdItem *rmotd;
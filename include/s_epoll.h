@@ -0,0 +1,53 @@
+#if !defined(S_EPOLL_H)
+#define S_EPOLL_H
+
+struct Client;
+
+#if defined(HAVE_SYS_EPOLL_H)
+
+/*=============================================================================
+ * Macros
+ */
+
+/* Flags de cptr->ioflags */
+#define IO_REGISTERED   0x0001  /* El fd esta en el epoll */
+#define IO_READ         0x0002  /* Puede quedar algo por leer del socket */
+#define IO_WRITE        0x0004  /* Hay que llamar al callback de escritura */
+
+#define IORead(x)       ((x)->ioflags & IO_READ)
+#define ClearIORead(x)  ((x)->ioflags &= ~IO_READ)
+
+/*=============================================================================
+ * Proto types
+ */
+
+extern void io_init(void);
+extern void io_add(struct Client *cptr);
+extern int io_del(struct Client *cptr);
+extern void io_update_write(struct Client *cptr);
+extern void io_read_again(struct Client *cptr);
+extern int io_pending(void);
+extern void io_dispatch(void);
+extern void io_report(struct Client *cptr, char *name);
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+/* Sin epoll los sockets de los clientes van por libevent */
+#define IORead(x)               0
+#define ClearIORead(x)          ((void)0)
+#define io_init()               ((void)0)
+#define io_add(x)               ((void)0)
+#define io_read_again(x)        ((void)0)
+#define io_pending()            0
+#define io_dispatch()           ((void)0)
+#define io_report(x, y)         ((void)0)
+
+/* Funcion y no macro: DelClientEvent descarta el valor devuelto */
+static __inline__ int io_del(struct Client *cptr)
+{
+  return 0;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+#endif /* S_EPOLL_H */
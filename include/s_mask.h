@@ -0,0 +1,67 @@
+#if !defined(S_MASK_H)
+#define S_MASK_H
+
+struct Client;
+struct irc_in_addr;
+struct MaskNode;
+
+/*=============================================================================
+ * Structures
+ */
+
+/*
+ * Entrada del indice. Va embebida en la estructura indexada (o en
+ * una referencia a ella), asi que anadir y quitar no reservan nada
+ * salvo, si hace falta, el nodo de su mascara.
+ */
+struct MaskEntry {
+  struct MaskEntry *next;       /* Siguiente en el mismo nodo (o en wild) */
+  struct MaskEntry **prevp;     /* Puntero que nos apunta */
+  struct MaskNode *node;        /* Nodo de la mascara, NULL si va en wild */
+  void *data;                   /* La estructura indexada */
+};
+
+/*
+ * Indice de mascaras de host:
+ *  - Las de IP (o CIDR) en un arbol radix sobre la direccion.
+ *  - Los hosts sin comodines en una tabla hash.
+ *  - Las "*.dominio" en un arbol de sufijos, por etiquetas empezando
+ *    por la derecha (sus nodos van en la misma tabla hash).
+ *  - El resto en una lista (wild) que se recorre entera.
+ */
+struct MaskIndex {
+  const char *name;             /* Nombre para /STATS t */
+  struct MaskNode *iproot;      /* Raiz del arbol de IPs */
+  struct MaskNode **hash;       /* Hosts exactos y sufijos */
+  unsigned int hsize;           /* Taman~o de la tabla (potencia de 2) */
+  unsigned int hcount;          /* Nodos en la tabla */
+  struct MaskEntry *wild;       /* Mascaras con comodines */
+  unsigned int nip, nexact, nsuffix, nwild;
+  unsigned int lookups;         /* Busquedas */
+  unsigned int candidates;      /* Entradas pasadas a la funcion */
+};
+
+#define MASK_INDEX_INIT(name)   { (name), NULL, NULL, 0, 0, NULL, 0, 0, 0, 0, 0, 0 }
+
+/*=============================================================================
+ * Macros
+ */
+
+/* La mascara de host de las entradas wild la tiene que comprobar el llamante */
+#define MaskEntryIsWild(e)      ((e)->node == NULL)
+
+/*=============================================================================
+ * Proto types
+ */
+
+extern void mask_index_add(struct MaskIndex *idx, struct MaskEntry *entry,
+    const char *host, const struct irc_in_addr *addr, unsigned char bits,
+    void *data);
+extern void mask_index_del(struct MaskIndex *idx, struct MaskEntry *entry);
+extern void *mask_index_find(struct MaskIndex *idx, const char *host,
+    const struct irc_in_addr *ip, int (*check) (void *data, void *arg),
+    void *arg);
+extern void mask_index_report(struct MaskIndex *idx, struct Client *cptr,
+    char *name);
+
+#endif /* S_MASK_H */
@@ -42,6 +42,14 @@ struct stats {
   unsigned int is_abad;         /* bad auth requests */
   unsigned int is_udp;          /* packets recv'd on udp port */
   unsigned int is_loc;          /* local connections made */
+  unsigned int is_wv;           /* writev() calls flushing a sendQ */
+  unsigned int is_wvb;          /* sendQ blocks written by them */
+  unsigned int is_wvs;          /* write syscalls saved by them */
+  unsigned int is_dfp;          /* dirty sendQ flush passes */
+  unsigned int is_dfc;          /* sendQs flushed by them */
+  unsigned int is_dfm;          /* messages queued in between */
+  unsigned int is_pfr;          /* fan-out messages formatted */
+  unsigned int is_pfs;          /* recipients served a cached copy */
 };
 
 /*=============================================================================
@@ -21,6 +21,15 @@
                                         reenvio de GLINEs en burst
                                         86400 segundos (1 dia) */
 
+/*
+ * Rafaga de red: se sigue generando mientras el sendQ del enlace
+ * tenga menos de BURST_SENDQ bytes, y como mucho BURST_STEP usuarios
+ * o canales de cada vez. El callback de escritura la reanuda cuando
+ * el sendQ baja de la mitad.
+ */
+#define BURST_SENDQ            (64 * 1024)
+#define BURST_STEP             1024
+
 #define STAT_PING		0
 #define STAT_LOG		1           /* logfile for -x */
 #define STAT_CONNECTING               2
@@ -98,6 +107,12 @@ extern int m_end_of_burst(aClient *cptr, aClient *sptr, int parc, char *parv[]);
 extern int m_end_of_burst_ack(aClient *cptr, aClient *sptr,
     int parc, char *parv[]);
 extern int m_desynch(aClient *cptr, aClient *sptr, int parc, char *parv[]);
+extern void burst_next(aClient *cptr);
+extern void burst_stop(aClient *cptr);
+extern struct DBuf *burst_queue(aClient *cptr);
+extern void burst_client_gone(aClient *cptr);
+extern void burst_channel_gone(aChannel *chptr);
+extern void burst_report(aClient *cptr, char *name);
 
 extern unsigned int max_connection_count, max_client_count;
 extern unsigned int max_global_count;
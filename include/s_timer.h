@@ -0,0 +1,41 @@
+#if !defined(S_TIMER_H)
+#define S_TIMER_H
+
+#include <sys/types.h>          /* time_t */
+
+struct Client;
+
+/*=============================================================================
+ * Structures
+ */
+
+/*
+ * Temporizador de la rueda (granularidad de un segundo).
+ * Va embebido en la estructura que lo usa, asi que no hay que
+ * reservar memoria para armarlo ni para rearmarlo.
+ */
+struct WheelTimer {
+  struct WheelTimer *next;      /* Siguiente en la misma casilla */
+  struct WheelTimer **prevp;    /* Puntero que nos apunta, NULL si no esta armado */
+  time_t expire;                /* Segundo en el que vence */
+  void (*func) (void *);        /* Funcion a llamar al vencer */
+  void *data;                   /* Argumento para func */
+};
+
+/*=============================================================================
+ * Macros
+ */
+
+#define TimerArmed(t)           ((t)->prevp != NULL)
+
+/*=============================================================================
+ * Proto types
+ */
+
+extern void timer_set(struct WheelTimer *timer, void (*func) (void *),
+    void *data);
+extern void timer_add(struct WheelTimer *timer, time_t delay);
+extern void timer_del(struct WheelTimer *timer);
+extern void timer_report(struct Client *cptr, char *name);
+
+#endif /* S_TIMER_H */
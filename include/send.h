@@ -11,6 +11,7 @@
  * Proto types
  */
 
+extern void dead_link(aClient *to, char *notice);
 extern void sendto_one(aClient *to, char *pattern, ...)
     __attribute__ ((format(printf, 2, 3)));
 extern void sendto_one_hunt(aClient *to, aClient *from, char *cmd,
@@ -34,6 +35,8 @@ extern void sendto_highprot_butone(aClient *cptr, int p, char *pattern, ...)
 extern void sendto_prefix_one(Reg1 aClient *to, Reg2 aClient *from,
     char *pattern, ...) __attribute__ ((format(printf, 3, 4)));
 extern void flush_connections(int fd);
+extern void flush_dirty_sendqs(void);
+extern void sendq_dirty_del(aClient *cptr);
 extern void send_queued(aClient *to);
 extern void vsendto_one(aClient *to, char *pattern, va_list vl);
 extern void sendto_channel_butone(aClient *one, aClient *from,
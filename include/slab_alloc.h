@@ -1,7 +1,38 @@
 /* $Id: slab_alloc.h,v 1.4 2004/02/04 13:26:29 jcea Exp $ */
 
+#if !defined(SLAB_ALLOC_H)
+#define SLAB_ALLOC_H
+
 #include <sys/types.h>          /* size_t */
 
+struct Client;
+
+/*
+ * Pool de objetos de taman~o fijo.
+ *
+ * Los objetos se sacan de bloques de SLAB_BLOCK_SIZE bytes y al
+ * liberarlos vuelven a la lista libre del pool, nunca al malloc
+ * general; asi los objetos de cada tipo quedan agrupados y no
+ * fragmentan el heap con cada split y cada rejoin.
+ */
+struct SlabPool {
+  const char *name;             /* Nombre para /STATS z */
+  size_t size;                  /* Taman~o de cada objeto */
+  struct SlabPool *next;        /* Siguiente pool con memoria reservada */
+  void *free;                   /* Lista de objetos libres */
+  unsigned int blocks;          /* Bloques reservados */
+  unsigned int total;           /* Objetos en esos bloques */
+  unsigned int inuse;           /* Objetos en uso */
+};
+
+#define SLAB_POOL_INIT(name, size)  { (name), (size), NULL, NULL, 0, 0, 0 }
+
+void *SlabAlloc(struct SlabPool *pool);
+void SlabFree(struct SlabPool *pool, void *obj);
+size_t slab_count_memory(struct Client *cptr, char *nick);
+
 char *SlabStringAlloc(size_t size);
 void SlabStringAllocDup(char **old, char *new, size_t max_len);
 void SlabStringFree(char *string);
+
+#endif /* SLAB_ALLOC_H */
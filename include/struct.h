@@ -31,6 +31,8 @@
 
 #include "../libevent/event.h"
 #include "res.h"
+#include "s_timer.h"
+#include "s_epoll.h"
 
 /*=============================================================================
  * General defines
@@ -117,6 +119,7 @@ struct Client {
   char *name;                   /* Unique name of the client, nick or host */
   char *username;               /* username here now for auth stuff */
   char *info;                   /* Free form additional client information */
+  unsigned int seq;             /* Orden de presentacion, ver client_seq */
   
   /*
    *  The following fields are allocated only for local clients
@@ -131,6 +134,7 @@ struct Client {
   char buffer[BUFSIZE];         /* Incoming message buffer; or the error that
                                    caused this clients socket to be `dead' */
   unsigned short int lastsq;    /* # of 2k blocks when sendqueued called last */
+  unsigned int dirty;           /* Position + 1 in the dirty sendQ list, 0 if not there */
   time_t nextnick;              /* Next time that a nick change is allowed */
   time_t nexttarget;            /* Next time that a target change is allowed */
   unsigned char targets[MAXTARGETS];  /* Hash values of current targets */
@@ -147,6 +151,7 @@ struct Client {
   struct Client *acpt;          /* listening client which we accepted from */
   struct SLink *confs;          /* Configuration record associated */
   int authfd;                   /* fd for rfc931 authentication */
+  struct timeval regstart;      /* accept(), para los histogramas de registro */
 #if defined(ESNET_NEG)
   unsigned long negociacion;
 #if defined(ZLIB_ESNET)
@@ -161,6 +166,7 @@ struct Client {
   unsigned short int port;      /* and the remote port# too :-) */
   struct hostent *hostp;
   struct ListingArgs *listing;
+  struct Burst *burst;          /* Rafaga de red en curso, si es servidor */
 #if defined(pyr)
   struct timeval lw;
 #endif
@@ -181,6 +187,8 @@ struct Client {
   
   struct event *evread;         /* Evento que controla este cliente EV_READ */
   struct event *evwrite;        /* Evento que controla este cliente EV_WRITE */
+  unsigned int ioflags;         /* Estado del socket en el epoll (s_epoll.c) */
+  struct Client **iopend;       /* Casilla en la lista de pendientes, o NULL */
   
   struct event *evtimer;        /* Evento de temporizacion */
   struct timeval *tm_timer;     /* Temporizador del evento */
@@ -188,8 +196,7 @@ struct Client {
   struct event *evauthread;     /* Evento que controla este auth EV_READ */
   struct event *evauthwrite;    /* Evento que controla este auth EV_WRITE */
   
-  struct event *evcheckping;    /* Evento para controlar cuando se debe revisar el ping */
-  struct timeval *tm_checkping; /* Temporizador del chequeo del proximo ping */
+  struct WheelTimer checkping;  /* Temporizador para revisar el ping (s_timer.c) */
   uint64_t privs;  /* Privilegios de ejecución */
 };
 
@@ -220,6 +227,18 @@ struct Server {
   char *by;
 };
 
+/* Indices de /WHO sobre los usuarios (hash.c) */
+#define WHO_INDEX_IP    0       /* Arbol por bits de la IP */
+#define WHO_INDEX_HOST  1       /* Arbol por host real al reves */
+#define WHO_INDEX_USER  2       /* Arbol por username al reves */
+#define WHO_INDICES     3
+
+struct WhoLink {
+  struct WhoLeaf *leaf;         /* Hoja del indice con nuestra clave */
+  struct Client *prev;          /* Usuarios con la misma clave */
+  struct Client *next;
+};
+
 struct User {
   struct User *nextu;
   struct Client *server;        /* client structure of server */
@@ -237,6 +256,7 @@ struct User {
   char *vhost;
   char *vhostperso;
 #endif
+  struct WhoLink who[WHO_INDICES];      /* Enlaces en los indices de /WHO */
 #if defined(LIST_DEBUG)
   struct Client *bcptr;
 #endif
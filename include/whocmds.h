@@ -11,5 +11,6 @@
 
 extern int m_who(aClient *cptr, aClient *sptr, int parc, char *parv[]);
 extern int m_whois(aClient *cptr, aClient *sptr, int parc, char *parv[]);
+extern void who_report(aClient *cptr, char *name);
 
 #endif /* WHOCMDS_H */
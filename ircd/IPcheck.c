@@ -34,6 +34,8 @@
 #include "numnicks.h"
 #endif
 #include "send.h"
+#include "s_timer.h"
+#include "numeric.h"
 
 #if defined(BDD_CLONES)
 #include "s_bdd.h"
@@ -73,25 +75,38 @@ struct IPregistry {
                                        was less then IPCHECK_CLONE_PERIOD seconds ago, it should considered to be 0 otherwise. */
   unsigned int free_targets:4;  /* Number of free targets that the next local client will inherit on connect,
                                    or HAS_TARGETS_MAGIC when ip_targets.ptr is a pointer to a ip_targets_st. */
+  unsigned int in_use:1;        /* Casilla ocupada en IPregistry_table */
 };
 
-struct IPregistry_vector {
-  unsigned short length;
-  unsigned short allocated_length;
-  struct IPregistry *vector;
-};
-
-#define HASHTABSIZE 0x2000      /* Must be power of 2 */
-static struct IPregistry_vector IPregistry_hashtable[HASHTABSIZE];
-
 /*
- * Calculate a `hash' value between 0 and HASHTABSIZE, from the internet address `in_addr'.
- * Apply it immedeately to the table, effectively hiding the table itself.
+ * Los registros van directamente en una tabla de direccionamiento
+ * abierto con sondeo lineal. La dispersion mezcla los 64 bits del
+ * prefijo canonico (con las IPv4 en 2002::/16 el primer grupo es
+ * siempre el mismo, asi que no vale con un XOR de grupos). La tabla
+ * dobla su tamano al pasar de la mitad de ocupacion, y los huecos se
+ * cierran al borrar desplazando hacia atras los registros siguientes,
+ * asi que una busqueda nunca recorre lapidas.
+ *
+ * La caducidad de los registros desconectados no se hace al buscar:
+ * un temporizador de la rueda revisa cada segundo una parte de la
+ * tabla, de forma que da la vuelta completa en IPREGISTRY_SWEEP
+ * segundos. Al completar cada vuelta se encoge la tabla si ha quedado
+ * muy vacia.
+ *
+ * Los punteros a registros solo son validos hasta la siguiente
+ * insercion o barrido, asi que no se guardan fuera de cada funcion.
  */
-#define CALCULATE_HASH(irc_in_addr) \
-  struct IPregistry_vector *hash; \
-  do { unsigned int ip = (irc_in_addr).in6_16[0] ^ (irc_in_addr).in6_16[1] ^ (irc_in_addr).in6_16[2] ^ (irc_in_addr).in6_16[3]; \
-       hash = &IPregistry_hashtable[ip & (HASHTABSIZE - 1)]; } while(0)
+#define IPREGISTRY_MIN 0x2000   /* Casillas minimas, potencia de 2 */
+#define IPREGISTRY_SWEEP 60     /* Segundos por vuelta del barrido */
+
+static struct IPregistry *IPregistry_table;
+static unsigned int IPregistry_size;    /* Casillas, potencia de 2 */
+static unsigned int IPregistry_used;    /* Casillas ocupadas */
+static unsigned int IPregistry_cursor;  /* Siguiente casilla a barrer */
+static struct WheelTimer IPregistry_timer;
+
+static unsigned int IPregistry_expired = 0; /* Registros caducados */
+static unsigned int IPregistry_resizes = 0; /* Cambios de tamano */
 
 /*
  * Fit `now' in an unsigned short, the advantage is that we use less memory `struct IPregistry::last_connect' can be smaller
@@ -118,8 +133,6 @@ static struct IPregistry_vector IPregistry_hashtable[HASHTABSIZE];
 #define IP(entry) (HAS_TARGETS(entry) ? &(entry)->ip_targets.ptr->ip : &(entry)->ip_targets.ip)
 #define FREE_TARGETS(entry) (HAS_TARGETS(entry) ? (entry)->ip_targets.ptr->free_targets : (entry)->free_targets)
 
-static unsigned short count = 10000, average_length = 4;
-
 /** Convert IP addresses to canonical form for comparison.  IPv4
  * addresses are translated into 6to4 form; IPv6 addresses are left
  * alone.
@@ -144,65 +157,157 @@ static void IPregistry_canonicalize(struct irc_in_addr *out, const struct irc_in
     out->in6_16[6] = out->in6_16[7] = 0;
 }
 
-static struct IPregistry *IPregistry_add(struct IPregistry_vector *iprv)
+/*
+ * IPregistry_key
+ *
+ * Prefijo de 64 bits que identifica al registro. Como las 6to4 se
+ * comparan con /48, en ellas no cuenta el cuarto grupo.
+ */
+static uint64_t IPregistry_key(const struct irc_in_addr *ip)
+{
+  uint64_t key;
+
+  key = ((uint64_t)ip->in6_16[0] << 48) | ((uint64_t)ip->in6_16[1] << 32) |
+      ((uint64_t)ip->in6_16[2] << 16);
+  if (ip->in6_16[0] != htons(0x2002))
+    key |= ip->in6_16[3];
+  return key;
+}
+
+/*
+ * IPregistry_hash
+ *
+ * Casilla natural de una clave (finalizador de MurmurHash3).
+ */
+static unsigned int IPregistry_hash(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return (unsigned int)key & (IPregistry_size - 1);
+}
+
+static void IPregistry_resize(unsigned int size)
 {
-  if (iprv->length == iprv->allocated_length)
+  struct IPregistry *old = IPregistry_table;
+  unsigned int old_size = IPregistry_size, i, j;
+
+  IPregistry_table =
+      (struct IPregistry *)RunCalloc(size, sizeof(struct IPregistry));
+  IPregistry_size = size;
+  IPregistry_cursor = 0;
+  IPregistry_resizes++;
+
+  for (i = 0; i < old_size; i++)
   {
-    iprv->allocated_length += 4;
-    iprv->vector =
-        (struct IPregistry *)RunRealloc(iprv->vector,
-        iprv->allocated_length * sizeof(struct IPregistry));
+    if (!old[i].in_use)
+      continue;
+    for (j = IPregistry_hash(IPregistry_key(IP(&old[i])));
+        IPregistry_table[j].in_use; j = (j + 1) & (size - 1));
+    IPregistry_table[j] = old[i];
   }
-  return &iprv->vector[iprv->length++];
+  if (old)
+    RunFree(old);
 }
 
-static struct IPregistry *IPregistry_find(struct IPregistry_vector *iprv,
-    struct irc_in_addr ip)
+static struct IPregistry *IPregistry_find(const struct irc_in_addr *ip)
 {
-  if (iprv->length > 0)
+  uint64_t key;
+  unsigned int i;
+
+  if (!IPregistry_used)
+    return NULL;
+
+  key = IPregistry_key(ip);
+  for (i = IPregistry_hash(key); IPregistry_table[i].in_use;
+      i = (i + 1) & (IPregistry_size - 1))
   {
-    struct IPregistry *i, *end = &iprv->vector[iprv->length];
-    for (i = &iprv->vector[0]; i < end; ++i) {
-      int bits = (ip.in6_16[0] == htons(0x2002)) ? 48 : 64;
-      if (ipmask_check(&ip, IP(i), bits))
-        return i;
-    }
+    if (IPregistry_key(IP(&IPregistry_table[i])) == key)
+      return &IPregistry_table[i];
   }
   return NULL;
 }
 
-static struct IPregistry *IPregistry_find_with_expire(struct IPregistry_vector
-    *iprv, struct irc_in_addr ip)
+static void IPregistry_sweep(void *data);
+
+/*
+ * IPregistry_add
+ *
+ * Reserva una casilla (a cero) para `ip', que no debe estar ya.
+ */
+static struct IPregistry *IPregistry_add(const struct irc_in_addr *ip)
 {
-  struct IPregistry *last = &iprv->vector[iprv->length - 1];  /* length always > 0 because searched element always exists */
-  struct IPregistry *curr;
-  struct IPregistry *retval = NULL; /* Core dump if we find nothing :/ - can be removed when code is stable */
-  int bits;
+  struct IPregistry *entry;
+  unsigned int i;
 
-  bits = (ip.in6_16[0] == htons(0x2002)) ? 48 : 64;
+  if (2 * (IPregistry_used + 1) > IPregistry_size)
+    IPregistry_resize(IPregistry_size ? 2 * IPregistry_size : IPREGISTRY_MIN);
+  if (!TimerArmed(&IPregistry_timer))
+  {
+    timer_set(&IPregistry_timer, IPregistry_sweep, NULL);
+    timer_add(&IPregistry_timer, 1);
+  }
+
+  for (i = IPregistry_hash(IPregistry_key(ip)); IPregistry_table[i].in_use;
+      i = (i + 1) & (IPregistry_size - 1));
+  entry = &IPregistry_table[i];
+  memset(entry, 0, sizeof(struct IPregistry));
+  entry->in_use = 1;
+  IPregistry_used++;
+  return entry;
+}
 
-  for (curr = &iprv->vector[0]; curr < last;)
+/*
+ * IPregistry_remove
+ *
+ * Borra la casilla `i' y rellena el hueco con los registros siguientes
+ * del mismo grupo que no puedan quedar por delante de su casilla natural.
+ */
+static void IPregistry_remove(unsigned int i)
+{
+  unsigned int mask = IPregistry_size - 1, j, k;
+
+  if (HAS_TARGETS(&IPregistry_table[i]))
+    RunFree(IPregistry_table[i].ip_targets.ptr);
+
+  for (j = (i + 1) & mask; IPregistry_table[j].in_use; j = (j + 1) & mask)
+  {
+    k = IPregistry_hash(IPregistry_key(IP(&IPregistry_table[j])));
+    /* Se puede mover si su casilla natural `k' no esta en (i, j] */
+    if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j))
+    {
+      IPregistry_table[i] = IPregistry_table[j];
+      i = j;
+    }
+  }
+  memset(&IPregistry_table[i], 0, sizeof(struct IPregistry));
+  IPregistry_used--;
+}
+
+/*
+ * IPregistry_sweep
+ *
+ * Temporizador del barrido: caduca los registros desconectados de
+ * la parte de la tabla que toca en este segundo.
+ */
+static void IPregistry_sweep(void *UNUSED(data))
+{
+  unsigned int n = (IPregistry_size + IPREGISTRY_SWEEP - 1) / IPREGISTRY_SWEEP;
+  unsigned int size;
+  struct IPregistry *curr;
+
+  while (n-- > 0)
   {
-    if (ipmask_check(&ip, IP(curr), bits))
-      /* `curr' is element we looked for */
-      retval = curr;
-    else if (curr->connected == 0)
+    curr = &IPregistry_table[IPregistry_cursor];
+    if (curr->in_use && curr->connected == 0)
     {
       if (CONNECTED_SINCE(curr) > 600U) /* Don't touch this number, it has statistical significance */
       {
-        /* `curr' expired */
-        if (HAS_TARGETS(curr))
-          RunFree(curr->ip_targets.ptr);
-        *curr = *last--;
-        iprv->length--;
-        if (--count == 0)
-        {
-          /* Make ever 10000 disconnects an estimation of the average vector length */
-          count = 10000;
-          average_length =
-              (nrof.clients + nrof.unknowns + nrof.local_servers) / HASHTABSIZE;
-        }
-        /* Now check the new element (last) that was moved to this position */
+        /* `curr' expired, y en su casilla puede entrar otro registro */
+        IPregistry_remove(IPregistry_cursor);
+        IPregistry_expired++;
         continue;
       }
       else if (CONNECTED_SINCE(curr) > 120U && HAS_TARGETS(curr))
@@ -214,56 +319,30 @@ static struct IPregistry *IPregistry_find_with_expire(struct IPregistry_vector
         curr->ip_targets.ip = ip1;
       }
     }
-    /* Did not expire, check next element */
-    ++curr;
-  }
-  /* Now check the last element in the list (curr == last) */
-  if (ipmask_check(&ip, IP(curr), bits))
-    /* `curr' is element we looked for */
-    retval = curr;
-  else if (curr->connected == 0)
-  {
-    if (CONNECTED_SINCE(curr) > 600U) /* Don't touch this number, it has statistical significance */
+    IPregistry_cursor = (IPregistry_cursor + 1) & (IPregistry_size - 1);
+    if (IPregistry_cursor == 0)
     {
-      /* `curr' expired */
-      if (HAS_TARGETS(curr))
-        RunFree(curr->ip_targets.ptr);
-      iprv->length--;
-      if (--count == 0)
-      {
-        /* Make ever 10000 disconnects an estimation of the average vector length */
-        count = 10000;
-        average_length =
-            (nrof.clients + nrof.unknowns + nrof.local_servers) / HASHTABSIZE;
-      }
-    }
-    else if (CONNECTED_SINCE(curr) > 120U && HAS_TARGETS(curr))
-    {
-      /* Expire storage of targets */
-      struct irc_in_addr ip1 = curr->ip_targets.ptr->ip;
-      curr->free_targets = curr->ip_targets.ptr->free_targets;
-      RunFree(curr->ip_targets.ptr);
-      curr->ip_targets.ip = ip1;
+      /* Fin de la vuelta: encoger si ha quedado por debajo de 1/8 */
+      for (size = IPregistry_size;
+          size > IPREGISTRY_MIN && 8 * IPregistry_used < size; size /= 2);
+      if (size != IPregistry_size)
+        IPregistry_resize(size);
+      break;
     }
   }
-  /* Do we need to shrink the vector? */
-  if (iprv->allocated_length > average_length
-      && iprv->allocated_length - iprv->length >= 4)
-  {
-    struct IPregistry *newpos;
-    iprv->allocated_length = iprv->length;
-    newpos =
-        (struct IPregistry *)RunRealloc(iprv->vector,
-        iprv->allocated_length * sizeof(struct IPregistry));
-    if (newpos != iprv->vector) /* Is this ever true? */
-    {
-      retval =
-          (struct IPregistry *)((char *)retval + ((char *)newpos -
-          (char *)iprv->vector));
-      iprv->vector = newpos;
-    }
-  }
-  return retval;
+  timer_add(&IPregistry_timer, 1);
+}
+
+/*
+ * IPcheck_report
+ *
+ * Estadisticas del registro de IPs para /STATS t.
+ */
+void IPcheck_report(aClient *cptr, char *name)
+{
+  sendto_one(cptr, ":%s %d %s :ipcheck entries %u slots %u expired %u resizes %u",
+      me.name, RPL_STATSDEBUG, name, IPregistry_used, IPregistry_size,
+      IPregistry_expired, IPregistry_resizes);
 }
 
 static void reset_connect_time(struct IPregistry *entry)
@@ -318,7 +397,6 @@ int IPcheck_local_connect(aClient *cptr)
   struct irc_in_addr canon;
 
   IPregistry_canonicalize(&canon, &cptr->ip);
-  CALCULATE_HASH(canon);
   SetIPChecked(cptr);           /* Mark that we did add/update an IPregistry entry */
 #if defined(BDD_CLONES)
 /*
@@ -329,9 +407,9 @@ int IPcheck_local_connect(aClient *cptr)
     clones = !0;
 #endif
 
-  if (!(entry = IPregistry_find(hash, canon)))
+  if (!(entry = IPregistry_find(&canon)))
   { 
-    entry = IPregistry_add(hash);
+    entry = IPregistry_add(&canon);
     entry->ip_targets.ip = canon;  /* The IP number of registry entry */
     entry->last_connect = NOW;  /* Seconds since last connect (attempt) */
     entry->connected = 1;       /* Number of currently connected clients with this IP number */
@@ -406,11 +484,10 @@ int IPcheck_remote_connect(aClient *cptr, const char *UNUSED(hostname),
   struct irc_in_addr canon;
 
   IPregistry_canonicalize(&canon, &cptr->ip);
-  CALCULATE_HASH(canon);
   SetIPChecked(cptr);           /* Mark that we did add/update an IPregistry entry */
-  if (!(entry = IPregistry_find(hash, canon)))
+  if (!(entry = IPregistry_find(&canon)))
   {
-    entry = IPregistry_add(hash);
+    entry = IPregistry_add(&canon);
     entry->ip_targets.ip = canon;  /* The IP number of registry entry */
     entry->last_connect = NOW;  /* Seconds since last connect (attempt) */
     entry->connected = 1;       /* Number of currently connected clients with this IP number */
@@ -456,8 +533,7 @@ void IPcheck_connect_fail(aClient *cptr)
   struct irc_in_addr canon;
 
   IPregistry_canonicalize(&canon, &cptr->ip);
-  CALCULATE_HASH(canon);
-  entry = IPregistry_find(hash, canon);
+  entry = IPregistry_find(&canon);
   entry->connect_attempts--;
 }
 
@@ -476,8 +552,7 @@ void IPcheck_connect_succeeded(aClient *cptr)
   const char *tr = "";
 
   IPregistry_canonicalize(&canon, &cptr->ip);
-  CALCULATE_HASH(canon);
-  entry = IPregistry_find(hash, canon);
+  entry = IPregistry_find(&canon);
   if (HAS_TARGETS(entry))
   {
     memcpy(cptr->targets, entry->ip_targets.ptr->targets, MAXTARGETS);
@@ -496,8 +571,7 @@ void IPcheck_connect_succeeded(aClient *cptr)
  *
  * Action:
  *   Update the IPcheck registry.
- *   Remove all expired IPregistry structures from the hash bucket
- *     that belongs to this clients IP number.
+ *   Expired IPregistry structures are removed later by IPregistry_sweep.
  */
 void IPcheck_disconnect(aClient *cptr)
 {
@@ -505,8 +579,7 @@ void IPcheck_disconnect(aClient *cptr)
   struct irc_in_addr canon;
 
   IPregistry_canonicalize(&canon, &cptr->ip);
-  CALCULATE_HASH(canon);
-  entry = IPregistry_find_with_expire(hash, canon);
+  entry = IPregistry_find(&canon);
   if (--(entry->connected) == 0)  /* If this was the last one, set `last_connect' to disconnect time (used for expiration) */
   {
     if (CONNECTED_SINCE(entry) > IPCHECK_CLONE_LIMIT * IPCHECK_CLONE_PERIOD)
@@ -565,15 +638,14 @@ unsigned short IPcheck_nr(aClient *cptr)
   struct irc_in_addr canon;
 
   IPregistry_canonicalize(&canon, &cptr->ip);
-  CALCULATE_HASH(canon);
-  entry = IPregistry_find(hash, canon);
+  entry = IPregistry_find(&canon);
   return (entry ? entry->connected : 0);
 }
 
 #if defined(BDD_CLONES)
 int IPbusca_clones(aClient *cptr)
 {
-  struct db_reg *reg;
+  const struct db_reg *reg;
 
   if (!IsUnixSocket(cptr))
   {
@@ -21,6 +21,7 @@
 #include "sys.h"
 #include <signal.h>
 #include <sys/socket.h>         /* Needed for send() */
+#include <sys/uio.h>            /* Needed for writev() */
 #include "h.h"
 #include "s_debug.h"
 #include "struct.h"
@@ -34,40 +35,18 @@ int writeb[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 #endif
 
 /*
- * deliver_it
- *   Attempt to send a sequence of bytes to the connection.
- *   Returns
- *
- *   < 0     Some fatal error occurred, (but not EWOULDBLOCK).
- *           This return is a request to close the socket and
- *           clean up the link.
- *
- *   >= 0    No real error occurred, returns the number of
- *           bytes actually transferred. EWOULDBLOCK and other
- *           possibly similar conditions should be mapped to
- *           zero return. Upper level routine will have to
- *           decide what to do with those unwritten bytes...
- *
- *   *NOTE*  alarm calls have been preserved, so this should
- *           work equally well whether blocking or non-blocking
- *           mode is used...
- *
- *   We don't use blocking anymore, that is impossible with the
- *      net.loads today anyway. Commented out the alarms to save cpu.
- *      --Run
+ * deliver_done
+ *   Common bookkeeping for deliver_it and deliver_iov once the
+ *   write call returned 'retval'.
  */
-int deliver_it(aClient *cptr, const char *str, int len)
+static int deliver_done(aClient *cptr, int retval)
 {
-  int retval;
   aClient *acpt = cptr->acpt;
 
 #if defined(DEBUGMODE)
   writecalls++;
 #endif
-#if defined(VMS)
-  retval = netwrite(cptr->fd, str, len);
-#else
-  retval = send(cptr->fd, str, len, 0);
+#if !defined(VMS)
   /*
    * Convert WOULDBLOCK to a return of "0 bytes moved". This
    * should occur only if socket was non-blocking. Note, that
@@ -142,3 +121,50 @@ int deliver_it(aClient *cptr, const char *str, int len)
   }
   return (retval);
 }
+
+/*
+ * deliver_it
+ *   Attempt to send a sequence of bytes to the connection.
+ *   Returns
+ *
+ *   < 0     Some fatal error occurred, (but not EWOULDBLOCK).
+ *           This return is a request to close the socket and
+ *           clean up the link.
+ *
+ *   >= 0    No real error occurred, returns the number of
+ *           bytes actually transferred. EWOULDBLOCK and other
+ *           possibly similar conditions should be mapped to
+ *           zero return. Upper level routine will have to
+ *           decide what to do with those unwritten bytes...
+ *
+ *   *NOTE*  alarm calls have been preserved, so this should
+ *           work equally well whether blocking or non-blocking
+ *           mode is used...
+ *
+ *   We don't use blocking anymore, that is impossible with the
+ *      net.loads today anyway. Commented out the alarms to save cpu.
+ *      --Run
+ */
+int deliver_it(aClient *cptr, const char *str, int len)
+{
+  int retval;
+
+#if defined(VMS)
+  retval = netwrite(cptr->fd, str, len);
+#else
+  retval = send(cptr->fd, str, len, 0);
+#endif
+  return deliver_done(cptr, retval);
+}
+
+/*
+ * deliver_iov
+ *   Same as deliver_it, but gathers 'count' blocks into a single
+ *   writev() call. Returns the number of bytes actually transferred
+ *   (which may end in the middle of any block), 0 if the socket
+ *   would block or < 0 on a fatal error.
+ */
+int deliver_iov(aClient *cptr, const struct iovec *iov, int count)
+{
+  return deliver_done(cptr, writev(cptr->fd, iov, count));
+}
@@ -194,6 +194,285 @@ static char *make_nick_user_ip(char *nick, char *name, struct irc_in_addr *ip)
   return ipbuf;
 }
 
+/*
+ * Cache de bans compilados.
+ *
+ * is_banned() pasaba cada ban por match() contra el nick!user@host del
+ * cliente (y con BDD_VIP otras dos veces, contra los hosts virtuales).
+ * Ahora cada canal guarda sus bans ya preparados en un solo bloque,
+ * que se rehace la primera vez que hace falta despues de un +b/-b:
+ *
+ * - Los bans de IP (1.2.3.*, 1.2.3.0/24, IPv6) se comprueban con
+ *   ipmask_check(), sin pasar la IP del cliente a texto.
+ * - Los de host sin comodines van a un hash por host; solo se mira
+ *   la parte nick!user de los que coinciden con el del cliente.
+ * - El resto se compilan con matchcomp() y se usan con matchexec().
+ */
+#define BAN_IP          1
+#define BAN_EXACT       2
+#define BAN_WILD        3
+
+struct CompiledBan {
+  struct CompiledBan *hnext;    /* Siguiente en la cadena del hash */
+  Link *ban;
+  char *cmask;                  /* nick!user compilado, o la mascara entera */
+  int minlen;
+  const char *host;             /* BAN_EXACT: el host, dentro de banstr */
+  struct irc_in_addr addr;      /* BAN_IP: la mascara */
+  unsigned char bits;
+};
+
+struct BanCache {
+  size_t size;                  /* Taman~o del bloque */
+  unsigned int nip, nexact, nwild;
+  struct CompiledBan *ip;
+  struct CompiledBan *wild;
+  struct CompiledBan **hash;    /* Bans de host exacto */
+  unsigned int hmask;
+};
+
+static unsigned int ban_host_hash(const char *host)
+{
+  unsigned int hash = 0;
+
+  while (*host)
+    hash = (hash << 5) - hash + (unsigned char)toLower(*host++);
+  return hash;
+}
+
+/*
+ * ban_classify
+ *
+ * Decide como se compara el ban; para los de IP devuelve tambien
+ * la mascara.
+ */
+static int ban_classify(Link *ban, struct irc_in_addr *addr,
+    unsigned char *bits)
+{
+  char *host;
+  int len;
+
+  if (!(host = strrchr(ban->value.ban.banstr, '@')))
+    return BAN_WILD;
+  host++;
+  if (((ban->flags & CHFL_BAN_IPMASK) || strchr(host, ':')
+      || strchr(host, '/')) && (len = ipmask_parse(host, addr, bits))
+      && !host[len])
+    return BAN_IP;
+  /* Si no se pudo leer como IP, se compara con la IP en texto */
+  if ((ban->flags & CHFL_BAN_IPMASK) || !*host || strpbrk(host, "*?\\"))
+    return BAN_WILD;
+  return BAN_EXACT;
+}
+
+static void ban_cache_clear(aChannel *chptr)
+{
+  if (chptr->bancache)
+  {
+    RunFree(chptr->bancache);
+    chptr->bancache = NULL;
+  }
+}
+
+/*
+ * ban_cache_build
+ *
+ * Compila la lista de bans del canal. El bloque lleva la cabecera,
+ * los bans de IP, los exactos y los generales, el hash y, al final,
+ * las mascaras compiladas.
+ */
+static struct BanCache *ban_cache_build(aChannel *chptr)
+{
+  struct BanCache *bc;
+  struct CompiledBan *cb, *ipcb, *exactcb, *wildcb;
+  struct irc_in_addr addr;
+  unsigned char bits;
+  unsigned int nip = 0, nexact = 0, nwild = 0, hsize = 0, h;
+  size_t size, masks = 0, len;
+  char prefix[BUFSIZE];
+  char *pool, *mask, *at;
+  int charset;
+  Link *ban;
+
+  for (ban = chptr->banlist; ban; ban = ban->next)
+  {
+    switch (ban_classify(ban, &addr, &bits))
+    {
+      case BAN_IP:
+        nip++;
+        break;
+      case BAN_EXACT:
+        nexact++;
+        break;
+      default:
+        nwild++;
+    }
+    masks += strlen(ban->value.ban.banstr) + 1;
+  }
+  if (nexact)
+    for (hsize = 4; hsize < 2 * nexact; hsize <<= 1);
+
+  size = sizeof(struct BanCache)
+      + (nip + nexact + nwild) * sizeof(struct CompiledBan)
+      + hsize * sizeof(struct CompiledBan *) + masks;
+  bc = (struct BanCache *)RunMalloc(size);
+  memset(bc, 0, size - masks);
+  bc->size = size;
+  bc->nip = nip;
+  bc->nexact = nexact;
+  bc->nwild = nwild;
+  bc->ip = ipcb = (struct CompiledBan *)(bc + 1);
+  exactcb = ipcb + nip;
+  bc->wild = wildcb = exactcb + nexact;
+  bc->hash = (struct CompiledBan **)(wildcb + nwild);
+  bc->hmask = hsize - 1;
+  pool = (char *)(bc->hash + hsize);
+
+  for (ban = chptr->banlist; ban; ban = ban->next)
+  {
+    h = ban_classify(ban, &addr, &bits);
+    if (h == BAN_WILD)
+    {
+      cb = wildcb++;
+      mask = ban->value.ban.banstr;
+    }
+    else
+    {
+      /* Solo se compila el nick!user; el host va aparte */
+      at = strrchr(ban->value.ban.banstr, '@');
+      if ((len = at - ban->value.ban.banstr) >= sizeof(prefix))
+        len = sizeof(prefix) - 1;
+      memcpy(prefix, ban->value.ban.banstr, len);
+      prefix[len] = '\0';
+      mask = prefix;
+      if (h == BAN_IP)
+      {
+        cb = ipcb++;
+        memcpy(&cb->addr, &addr, sizeof(addr));
+        cb->bits = bits;
+      }
+      else
+      {
+        cb = exactcb++;
+        cb->host = at + 1;
+        h = ban_host_hash(cb->host) & bc->hmask;
+        cb->hnext = bc->hash[h];
+        bc->hash[h] = cb;
+      }
+    }
+    cb->ban = ban;
+    cb->cmask = pool;
+    pool += matchcomp(pool, &cb->minlen, &charset, mask) + 1;
+  }
+
+  chptr->bancache = bc;
+  return bc;
+}
+
+/*
+ * ban_cache_exact
+ *
+ * Busca en el hash los bans de host exacto que cubren `host'.
+ */
+static int ban_cache_exact(struct BanCache *bc, char *nu, char *host)
+{
+  struct CompiledBan *cb;
+
+  for (cb = bc->hash[ban_host_hash(host) & bc->hmask]; cb; cb = cb->hnext)
+    if (!strCasediff(cb->host, host) && !matchexec(nu, cb->cmask, cb->minlen))
+      return 1;
+  return 0;
+}
+
+/*
+ * ban_cache_match
+ *
+ * Igual que el bucle de match() de antes: los bans de IP se miran
+ * solo contra la IP del cliente, y el resto contra su host (y con
+ * BDD_VIP contra sus hosts virtuales; el primero distingue mayusculas).
+ */
+static int ban_cache_match(struct BanCache *bc, aClient *cptr)
+{
+  struct CompiledBan *cb;
+  char nu[NICKLEN + USERLEN + 2];
+  char s[NICKLEN + USERLEN + HOSTLEN + 3];
+  char *username = PunteroACadena(cptr->user->username);
+  char *host = PunteroACadena(cptr->user->host);
+  char *ip_s = NULL;
+  unsigned int i;
+#if defined(BDD_VIP)
+  char vs[NICKLEN + USERLEN + HOSTLEN + 3];
+  char ps[NICKLEN + USERLEN + HOSTLEN + 3];
+  char *vhost;
+#endif
+
+  sprintf_irc(nu, "%s!%s", cptr->name, username);
+
+  for (i = 0, cb = bc->ip; i < bc->nip; i++, cb++)
+    if (ipmask_check(&cptr->ip, &cb->addr, cb->bits)
+        && !matchexec(nu, cb->cmask, cb->minlen))
+      return 1;
+
+  if (bc->nexact)
+  {
+    if (ban_cache_exact(bc, nu, host))
+      return 1;
+#if defined(BDD_VIP)
+    vhost = get_virtualhost(cptr, 0);
+    for (cb = bc->hash[ban_host_hash(vhost) & bc->hmask]; cb; cb = cb->hnext)
+    {
+      if (strcmp(cb->host, vhost))
+        continue;
+      sprintf_irc(vs, "%s@%s", nu, vhost);
+      if (!match_case(cb->ban->value.ban.banstr, vs))
+        return 1;
+    }
+    if (IsVhostPerso(cptr) && ban_cache_exact(bc, nu, get_virtualhost(cptr, 1)))
+      return 1;
+#endif
+  }
+
+  if (!bc->nwild)
+    return 0;
+
+  sprintf_irc(s, "%s@%s", nu, host);
+#if defined(BDD_VIP)
+  sprintf_irc(vs, "%s@%s", nu, get_virtualhost(cptr, 0));
+  if (IsVhostPerso(cptr))
+    sprintf_irc(ps, "%s@%s", nu, get_virtualhost(cptr, 1));
+#endif
+  for (i = 0, cb = bc->wild; i < bc->nwild; i++, cb++)
+  {
+    if ((cb->ban->flags & CHFL_BAN_IPMASK))
+    {
+      if (!ip_s)
+        ip_s = make_nick_user_ip(cptr->name, username, &cptr->ip);
+      if (!matchexec(ip_s, cb->cmask, cb->minlen))
+        return 1;
+      continue;
+    }
+    if (!matchexec(s, cb->cmask, cb->minlen))
+      return 1;
+#if defined(BDD_VIP)
+    if (!match_case(cb->ban->value.ban.banstr, vs))
+      return 1;
+    if (IsVhostPerso(cptr) && !matchexec(ps, cb->cmask, cb->minlen))
+      return 1;
+#endif
+  }
+  return 0;
+}
+
+/*
+ * ban_cache_memory
+ *
+ * Memoria de la cache de bans del canal, para /STATS z.
+ */
+size_t ban_cache_memory(aChannel *chptr)
+{
+  return chptr->bancache ? chptr->bancache->size : 0;
+}
+
 /*
  * add_banid
  *
@@ -229,6 +508,8 @@ static int add_banid(aClient *cptr, aChannel *chptr, char *banid,
     if (prev_ban || removed_bans_list)
       MyCoreDump;               /* Memory leak */
   }
+  if (change)
+    ban_cache_clear(chptr);
   if (MyUser(cptr))
   {
     fix_string(banid); /* Elimino caracteres control */
@@ -366,6 +647,7 @@ static int del_banid(aChannel *chptr, char *banid, int change)
       if (change)
       {
         *ban = tmp->next;
+        ban_cache_clear(chptr);
         RunFree(tmp->value.ban.banstr);
         RunFree(tmp->value.ban.who);
         free_link(tmp);
@@ -386,7 +668,7 @@ static int del_banid(aChannel *chptr, char *banid, int change)
 Link *IsMember(aClient *cptr, aChannel *chptr)
 {
   Link *lp;
-  return (((lp = find_user_link(chptr->members, cptr)) &&
+  return (((lp = FindMember(chptr, cptr)) &&
       !(lp->flags & CHFL_ZOMBIE)) ? lp : NULL);
 }
 
@@ -395,8 +677,7 @@ Link *IsMember(aClient *cptr, aChannel *chptr)
  */
 static int is_banned(aClient *cptr, aChannel *chptr, Link *member)
 {
-  Reg1 Link *tmp;
-  char *s, *ip_s = NULL;
+  int banned;
 
   if (!IsUser(cptr))
     return 0;
@@ -407,61 +688,22 @@ static int is_banned(aClient *cptr, aChannel *chptr, Link *member)
       return (member->flags & CHFL_BANNED);
   }
 
-#if !defined(BDD_VIP)
-  s = make_nick_user_host(cptr->name, PunteroACadena(cptr->user->username),
-      PunteroACadena(cptr->user->host));
-#endif
-
-  for (tmp = chptr->banlist; tmp; tmp = tmp->next)
-  {
-    if ((tmp->flags & CHFL_BAN_IPMASK))
-    {
-      if (!ip_s)
-        ip_s =
-            make_nick_user_ip(cptr->name, PunteroACadena(cptr->user->username),
-            &cptr->ip);
-      if (match(tmp->value.ban.banstr, ip_s) == 0)
-        break;
-    }
-    else
-#if defined(BDD_VIP)
-    {
-      s = make_nick_user_host(cptr->name, PunteroACadena(cptr->user->username),
-          PunteroACadena(cptr->user->host));
-#endif
-      if (match(tmp->value.ban.banstr, s) == 0)
-        break;
-#if defined(BDD_VIP)
-      s = make_nick_user_host(cptr->name, PunteroACadena(cptr->user->username),
-          get_virtualhost(cptr, 0));
-      if (match_case(tmp->value.ban.banstr, s) == 0)
-        break;
-      if (IsVhostPerso(cptr)) {
-        s = make_nick_user_host(cptr->name, PunteroACadena(cptr->user->username),
-            get_virtualhost(cptr, 1));
-        if (match(tmp->value.ban.banstr, s) == 0)
-          break;
-      }
-    }
-#endif
-  }
+  if (!chptr->banlist)
+    banned = 0;
+  else
+    banned = ban_cache_match(chptr->bancache ? chptr->bancache :
+        ban_cache_build(chptr), cptr);
 
   if (member)
   {
     member->flags |= CHFL_BANVALID;
-    if (tmp)
-    {
+    if (banned)
       member->flags |= CHFL_BANNED;
-      return 1;
-    }
     else
-    {
       member->flags &= ~CHFL_BANNED;
-      return 0;
-    }
   }
 
-  return (tmp != NULL);
+  return banned;
 }
 
 /*
@@ -480,6 +722,8 @@ static void add_user_to_channel(aChannel *chptr, aClient *who, int flags)
     ptr->next = chptr->members;
     chptr->members = ptr;
     chptr->users++;
+    hChannelUsers(chptr, chptr->users - 1);
+    hAddMember(chptr, who, ptr);
 
     ptr = make_link();
     ptr->value.chptr = chptr;
@@ -504,6 +748,7 @@ void remove_user_from_channel(aClient *sptr, aChannel *chptr)
       {
         *curr = tmp->next;
         free_link(tmp);
+        hRemMember(chptr, sptr);
         break;
       }
     for (curr = &sptr->user->channel; (tmp = *curr); curr = &tmp->next)
@@ -530,7 +775,7 @@ int is_chan_owner(aClient *cptr, aChannel *chptr)
   Reg1 Link *lp;
 
   if (chptr)
-    if ((lp = find_user_link(chptr->members, cptr)) &&
+    if ((lp = FindMember(chptr, cptr)) &&
         !(lp->flags & CHFL_ZOMBIE))
       return (lp->flags & CHFL_OWNER);
 
@@ -542,7 +787,7 @@ int is_chan_op(aClient *cptr, aChannel *chptr)
   Reg1 Link *lp;
 
   if (chptr)
-    if ((lp = find_user_link(chptr->members, cptr)) &&
+    if ((lp = FindMember(chptr, cptr)) &&
         !(lp->flags & CHFL_ZOMBIE))
       return (lp->flags & CHFL_CHANOP);
 
@@ -554,7 +799,7 @@ static int is_deopped(aClient *cptr, aChannel *chptr)
   Reg1 Link *lp;
 
   if (chptr)
-    if ((lp = find_user_link(chptr->members, cptr)))
+    if ((lp = FindMember(chptr, cptr)))
       return (lp->flags & CHFL_DEOPPED);
 
   return (IsUser(cptr) ? 1 : 0);
@@ -565,7 +810,7 @@ int is_zombie(aClient *cptr, aChannel *chptr)
   Reg1 Link *lp;
 
   if (chptr)
-    if ((lp = find_user_link(chptr->members, cptr)))
+    if ((lp = FindMember(chptr, cptr)))
       return (lp->flags & CHFL_ZOMBIE);
 
   return 0;
@@ -576,7 +821,7 @@ int has_voice(aClient *cptr, aChannel *chptr)
   Reg1 Link *lp;
 
   if (chptr)
-    if ((lp = find_user_link(chptr->members, cptr)) &&
+    if ((lp = FindMember(chptr, cptr)) &&
         !(lp->flags & CHFL_ZOMBIE))
       return (lp->flags & CHFL_VOICE);
 
@@ -735,6 +980,30 @@ static int send_mode_list(aClient *cptr, char *chname, time_t creationtime,
   return sent;
 }
 
+/*
+ * Para el BURST los miembros van agrupados por modo: sin modo, +ov,
+ * +v y +o, en ese orden. send_channel_modes los reparte en estas
+ * tablas con una sola pasada por la lista; se reutilizan de un canal
+ * a otro y solo crecen.
+ */
+#define BURST_CLASSES 4
+
+static const unsigned char burst_class_of[(CHFL_CHANOP | CHFL_VOICE) + 1] = {
+  0,                            /* sin modo */
+  3,                            /* CHFL_CHANOP */
+  2,                            /* CHFL_VOICE */
+  1                             /* CHFL_CHANOP | CHFL_VOICE */
+};
+static Link **burst_class[BURST_CLASSES];
+static unsigned int burst_class_max[BURST_CLASSES];
+
+static void burst_class_grow(unsigned int k)
+{
+  burst_class_max[k] = burst_class_max[k] ? 2 * burst_class_max[k] : 64;
+  burst_class[k] = (Link **)RunRealloc(burst_class[k],
+      burst_class_max[k] * sizeof(Link *));
+}
+
 /*
  * send "cptr" a full list of the modes for channel chptr.
  */
@@ -780,55 +1049,60 @@ void send_channel_modes(aClient *cptr, aChannel *chptr)
   else
 #endif
   {
-    static unsigned int current_flags[8] =
-        { 0,
-          CHFL_CHANOP | CHFL_VOICE,
-          CHFL_VOICE,
-          CHFL_CHANOP,
-          CHFL_OWNER,
-          CHFL_OWNER | CHFL_CHANOP | CHFL_VOICE,
-          CHFL_OWNER | CHFL_VOICE,
-          CHFL_OWNER | CHFL_CHANOP };
-    int first = 1, full = 1, flag_cnt = 0, new_mode = 0;
-    size_t len, sblen;
-    Link *lp1 = chptr->members;
+    Link *lp1;
     Link *lp2 = chptr->banlist;
+    unsigned int n[BURST_CLASSES], cls = 0, i = 0;
+    int first = 1, full = 1, new_mode = 0;
+    size_t len, sblen, mlen = 0, plen = 0;
+    char *s;
+
+    /* Una sola pasada: cada miembro a la tabla de su grupo */
+    memset(n, 0, sizeof(n));
+    for (lp1 = chptr->members; lp1; lp1 = lp1->next)
+    {
+      unsigned int k = burst_class_of[lp1->flags & (CHFL_CHANOP | CHFL_VOICE)];
+      if (n[k] == burst_class_max[k])
+        burst_class_grow(k);
+      burst_class[k][n[k]++] = lp1;
+    }
+    if (modebuf[1])
+    {
+      mlen = strlen(modebuf);
+      plen = strlen(parabuf);
+    }
+
     for (first = 1; full; first = 0)  /* Loop for multiple messages */
     {
       full = 0;                 /* Assume by default we get it
                                    all in one message */
 
       /* (Continued) prefix: "<Y> BURST <channel> <TS>" */
-      sprintf_irc(sendbuf, "%s " TOK_BURST " %s " TIME_T_FMT, NumServ(&me),
-          chptr->chname, chptr->creationtime);
-      sblen = strlen(sendbuf);
+      sblen = sprintf_irc(sendbuf, "%s " TOK_BURST " %s " TIME_T_FMT,
+          NumServ(&me), chptr->chname, chptr->creationtime) - sendbuf;
 
       if (first && modebuf[1])  /* Add simple modes (iklmnpst)
                                    if first message */
       {
         /* prefix: "<Y> BURST <channel> <TS>[ <modes>[ <params>]]" */
         sendbuf[sblen++] = ' ';
-        strcpy(sendbuf + sblen, modebuf);
-        sblen += strlen(modebuf);
-        if (*parabuf)
+        memcpy(sendbuf + sblen, modebuf, mlen);
+        sblen += mlen;
+        if (plen)
         {
           sendbuf[sblen++] = ' ';
-          strcpy(sendbuf + sblen, parabuf);
-          sblen += strlen(parabuf);
+          memcpy(sendbuf + sblen, parabuf, plen);
+          sblen += plen;
         }
       }
 
-      /* Attach nicks, comma seperated " nick[:modes],nick[:modes],..." */
-      /* Run 4 times over all members, to group the members with the
-       * same mode together */
-      for (first = 1; flag_cnt < 8;
-          lp1 = chptr->members, new_mode = 1, flag_cnt++)
+      /* Attach nicks, comma seperated " nick[:modes],nick[:modes],..."
+       * group by group, so that only the first of each group needs
+       * its ":modes" */
+      for (first = 1; cls < BURST_CLASSES; cls++, i = 0, new_mode = 1)
       {
-        for (; lp1; lp1 = lp1->next)
+        for (; i < n[cls]; i++)
         {
-          if ((lp1->flags & (CHFL_CHANOP | CHFL_VOICE)) !=
-              current_flags[flag_cnt])
-            continue;           /* Skip members with different flags */
+          lp1 = burst_class[cls][i];
           if (sblen + NUMNICKLEN + 4 > BUFSIZE - 3)
             /* The 4 is a possible ",:ov"
                The -3 is for the "\r\n\0" that is added in send.c */
@@ -837,14 +1111,16 @@ void send_channel_modes(aClient *cptr, aChannel *chptr)
                                    sending it so far */
     	    /* Ensure the new BURST line contains the current
     	     * ":mode", except when there is no mode yet. */
-    	    new_mode = (flag_cnt > 0) ? 1 : 0;
+    	    new_mode = (cls > 0) ? 1 : 0;
             break;              /* Do not add this member to this message */
           }
           sendbuf[sblen++] = first ? ' ' : ',';
           first = 0;            /* From now on, us comma's to add new nicks */
 
-          sprintf_irc(sendbuf + sblen, "%s%s", NumNick(lp1->value.cptr));
-          sblen += strlen(sendbuf + sblen);
+          for (s = lp1->value.cptr->user->server->yxx; *s; s++)
+            sendbuf[sblen++] = *s;
+          for (s = lp1->value.cptr->yxx; *s; s++)
+            sendbuf[sblen++] = *s;
 
           if (new_mode)         /* Do we have a nick with a new mode ? */
           {
@@ -926,7 +1202,7 @@ int m_botmode(aClient *cptr, aClient *sptr, int parc, char *parv[])
   int badop, sendts;
   aChannel *chptr;
   char *botname;
-  struct db_reg *r;
+  const struct db_reg *r;
 
   if (!IsServer(cptr))
     return 0;
@@ -1560,7 +1836,7 @@ static int set_mode_local(aClient *cptr, aClient *sptr, aChannel *chptr,
          */
         if (!(who = find_chasing(sptr, parv[0], NULL)))
           break;
-        if (!(member = find_user_link(chptr->members, who)) ||
+        if (!(member = FindMember(chptr, who)) ||
             ((member->flags & CHFL_ZOMBIE)))
         {
           sendto_one(cptr, err_str(ERR_USERNOTINCHANNEL),
@@ -2141,7 +2417,7 @@ static int set_mode_local(aClient *cptr, aClient *sptr, aChannel *chptr,
           break;
         case MODE_CHANOP:
         case MODE_VOICE:
-          tmp = find_user_link(chptr->members, lp->value.cptr);
+          tmp = FindMember(chptr, lp->value.cptr);
           if (lp->flags & MODE_ADD)
           {
             change = (~tmp->flags) & CHFL_OVERLAP & lp->flags;
@@ -2495,7 +2771,7 @@ static int set_mode_remoto(aClient *cptr, aClient *sptr, aChannel *chptr,
         if (whatt == MODE_ADD && IsServer(sptr) && who->from != sptr->from &&
             !buscar_uline(cptr->confs, sptr->name))
           break;
-        if (!(member = find_user_link(chptr->members, who)))
+        if (!(member = FindMember(chptr, who)))
         {
           sendto_one(cptr, err_str(ERR_USERNOTINCHANNEL),
               me.name, cptr->name, who->name, chptr->chname);
@@ -3042,7 +3318,7 @@ static int set_mode_remoto(aClient *cptr, aClient *sptr, aChannel *chptr,
           break;
         case MODE_CHANOP:
         case MODE_VOICE:
-          tmp = find_user_link(chptr->members, lp->value.cptr);
+          tmp = FindMember(chptr, lp->value.cptr);
           if (lp->flags & MODE_ADD)
           {
             change = (~tmp->flags) & CHFL_OVERLAP & lp->flags;
@@ -3688,7 +3964,10 @@ void sub1_from_channel(aChannel *chptr)
   Link *obtmp;
 
   if (chptr->users)             /* Can be 0, called for an empty channel too */
+  {
     --chptr->users;
+    hChannelUsers(chptr, chptr->users + 1);
+  }
 
   if (chptr->users)
     return;
@@ -3728,6 +4007,8 @@ void sub1_from_channel(aChannel *chptr)
     RunFree(obtmp->value.ban.who);
     free_link(obtmp);
   }
+  ban_cache_clear(chptr);
+  burst_channel_gone(chptr);
   if (chptr->prevch)
     chptr->prevch->nextch = chptr->nextch;
   else
@@ -3773,7 +4054,7 @@ int m_join(aClient *cptr, aClient *sptr, int parc, char *parv[])
   size_t jlen = 0, mlen = 0;
   size_t *buflen;
   char *p = NULL, *bufptr;
-  struct db_reg *ch_redir = NULL;
+  const struct db_reg *ch_redir = NULL;
   char *usernojoin = NULL;
 
   if (IsServer(sptr))           /* Un servidor entrando en un canal? */
@@ -3956,7 +4237,7 @@ int m_join(aClient *cptr, aClient *sptr, int parc, char *parv[])
         }
       }
       chptr = get_channel(sptr, name, CREATE);
-      if (chptr && (lp = find_user_link(chptr->members, sptr)))
+      if (chptr && (lp = FindMember(chptr, sptr)))
       {
         if (lp->flags & CHFL_ZOMBIE)
         {
@@ -4257,7 +4538,7 @@ int m_svsjoin(aClient *cptr, aClient *sptr, int parc, char *parv[])
       continue;
 
 
-    if (chptr && (lp = find_user_link(chptr->members, acptr)))
+    if (chptr && (lp = FindMember(chptr, acptr)))
     {
       if (lp->flags & CHFL_ZOMBIE)
       {
@@ -5471,6 +5752,7 @@ int m_burst(aClient *cptr, aClient *sptr, int parc, char *parv[])
         cancel_mode(sptr, chptr, 'b', tmp->value.ban.banstr, &count);
         /* Copied from del_banid(): */
         *ban = tmp->next;
+        ban_cache_clear(chptr);
         RunFree(tmp->value.ban.banstr);
         RunFree(tmp->value.ban.who);
         free_link(tmp);
@@ -5620,7 +5902,7 @@ int m_part(aClient *cptr, aClient *sptr, int parc, char *parv[])
     if (*name == '&' && !MyUser(sptr))
       continue;
     /* Do not use IsMember here: zombies must be able to part too */
-    if (!(lp = find_user_link(chptr->members, sptr)))
+    if (!(lp = FindMember(chptr, sptr)))
     {
       /* Normal to get when our client did a kick
          for a remote client (who sends back a PART),
@@ -5746,7 +6028,7 @@ int m_svspart(aClient *cptr, aClient *sptr, int parc, char *parv[])
     return 0;
 
   /* Do not use IsMember here: zombies must be able to part too */
-  if (!(lp = find_user_link(chptr->members, acptr)))
+  if (!(lp = FindMember(chptr, acptr)))
     return 0;
 
   /* Send part to all clients */
@@ -5836,7 +6118,7 @@ int m_kick(aClient *cptr, aClient *sptr, int parc, char *parv[])
     return 0;
   }
 
-  lp2 = find_user_link(chptr->members, sptr);
+  lp2 = FindMember(chptr, sptr);
   if (MyUser(sptr) 
 #if !defined(NO_PROTOCOL9)
       || Protocol(cptr) < 10
@@ -5859,7 +6141,7 @@ int m_kick(aClient *cptr, aClient *sptr, int parc, char *parv[])
     return 0;
   }
 
-  if (((lp = find_user_link(chptr->members, who)) &&
+  if (((lp = FindMember(chptr, who)) &&
       !(lp->flags & CHFL_ZOMBIE)) || IsServer(sptr))
   {
     /* if the user is +k, prevent a kick from local user */
@@ -6440,7 +6722,7 @@ static struct ListingArgs la_init = {
   0,                          /* flags */
   2147483647,                 /* max_topic_time */
   0,                          /* min_topic_time */
-  0,                          /* bucket */
+  0,                          /* level */
   {0}                         /* wildcard */
 };
 
@@ -6452,7 +6734,7 @@ static struct ListingArgs la_default = {
   0,                          /* flags */
   2147483647,                 /* max_topic_time */
   0,                          /* min_topic_time */
-  0,                          /* bucket */
+  0,                          /* level */
   {0}                         /* wildcard */
 };
 
@@ -6687,8 +6969,7 @@ int m_list(aClient *UNUSED(cptr), aClient *sptr, int parc, char *parv[])
 
   if (sptr->listing)            /* Already listing ? */
   {
-    RunFree(sptr->listing);
-    sptr->listing = NULL;
+    list_stop_channels(sptr);
     sendto_one(sptr, rpl_str(RPL_LISTEND), me.name, sptr->name);
     UpdateWrite(sptr);
     if (parc < 2 || !strcmp("STOP", parv[1]))
@@ -6734,7 +7015,7 @@ int m_list(aClient *UNUSED(cptr), aClient *sptr, int parc, char *parv[])
       sptr->listing = (aListingArgs *)RunMalloc(sizeof(aListingArgs));
       assert(0 != sptr->listing);
       memcpy(sptr->listing, &args, sizeof(aListingArgs));
-      list_next_channels(sptr);
+      list_start_channels(sptr);
       return 0;
     }
     sendto_one(sptr, rpl_str(RPL_LISTEND), me.name, parv[0]);
@@ -25,6 +25,7 @@
 #include "dbuf.h"
 #include "s_serv.h"
 #include "list.h"
+#include "slab_alloc.h"
 
 #if defined(ESNET_NEG) && defined(ZLIB_ESNET)
 #include "send.h"
@@ -32,6 +33,7 @@
 
 #include <assert.h>
 #include <string.h>
+#include <sys/uio.h>
 
 /*
  * dbuf is a collection of functions which can be used to
@@ -43,18 +45,37 @@
 
 int DBufAllocCount = 0;
 int DBufUsedCount = 0;
+int DBufRefCount = 0;
+int DBufSharedAllocCount = 0;
+int DBufSharedUsedCount = 0;
 
-static struct DBufBuffer *dbufFreeList = 0;
+static int DBufRefAllocCount = 0;
 
 #define DBUF_SIZE 2048
 
+/*
+ * A DBufBuffer either holds its own copy of the data (shared == NULL),
+ * or it is a small reference node whose start/end point into the data
+ * of a DBufShared message. Reference nodes are allocated without the
+ * 'data' array, see DBUF_REF_SIZE.
+ */
 struct DBufBuffer {
   struct DBufBuffer *next;      /* Next data buffer, NULL if last */
   char *start;                  /* data starts here */
   char *end;                    /* data ends here */
+  struct DBufShared *shared;    /* Shared message referenced, if any */
   char data[DBUF_SIZE];         /* Actual data stored here */
 };
 
+#define DBUF_REF_SIZE offsetof(struct DBufBuffer, data)
+
+static struct SlabPool dbuf_pool =
+    SLAB_POOL_INIT("DBufBuffer", sizeof(struct DBufBuffer));
+static struct SlabPool dbuf_ref_pool =
+    SLAB_POOL_INIT("DBuf ref", DBUF_REF_SIZE);
+static struct SlabPool dbuf_shared_pool =
+    SLAB_POOL_INIT("DBuf shared", sizeof(struct DBufShared));
+
 void dbuf_count_memory(size_t *allocated, size_t *used)
 {
   assert(0 != allocated);
@@ -63,39 +84,99 @@ void dbuf_count_memory(size_t *allocated, size_t *used)
   *used = DBufUsedCount * sizeof(struct DBufBuffer);
 }
 
+void dbuf_count_shared_memory(size_t *refs, size_t *shared)
+{
+  assert(0 != refs);
+  assert(0 != shared);
+  *refs = DBufRefAllocCount * DBUF_REF_SIZE;
+  *shared = DBufSharedAllocCount * sizeof(struct DBufShared);
+}
+
+/*
+ * dbuf_shared_alloc - allocates a shared message from its pool.
+ * The caller owns the first reference and must drop it with
+ * dbuf_shared_free() once it has been queued everywhere.
+ */
+struct DBufShared *dbuf_shared_alloc(void)
+{
+  struct DBufShared *shared;
+
+  if (!(shared = (struct DBufShared *)SlabAlloc(&dbuf_shared_pool)))
+    return NULL;
+  if (++DBufSharedUsedCount > DBufSharedAllocCount)
+    DBufSharedAllocCount = DBufSharedUsedCount;
+  shared->refcount = 1;
+  shared->length = 0;
+  return shared;
+}
+
 /*
- * dbuf_alloc - allocates a DBufBuffer structure from the free list or
- * creates a new one.
+ * dbuf_shared_free - drop one reference to a shared message, returning
+ * it to its pool when nobody uses it anymore.
+ */
+void dbuf_shared_free(struct DBufShared *shared)
+{
+  assert(0 != shared);
+  assert(shared->refcount > 0);
+
+  if (--shared->refcount)
+    return;
+  --DBufSharedUsedCount;
+  SlabFree(&dbuf_shared_pool, shared);
+}
+
+/*
+ * dbuf_ref_alloc - allocates a reference node from its pool.
+ */
+static struct DBufBuffer *dbuf_ref_alloc(void)
+{
+  struct DBufBuffer *db;
+
+  if (!(db = (struct DBufBuffer *)SlabAlloc(&dbuf_ref_pool)))
+    return NULL;
+  if (++DBufRefCount > DBufRefAllocCount)
+    DBufRefAllocCount = DBufRefCount;
+  return db;
+}
+
+/*
+ * dbuf_alloc - allocates a DBufBuffer structure from its pool, as long
+ * as the pool stays within BUFFERPOOL. DBufAllocCount is the number of
+ * buffers ever in use at once, the pool keeps them for reuse.
  */
 static struct DBufBuffer *dbuf_alloc(void)
 {
-  struct DBufBuffer *db = dbufFreeList;
+  struct DBufBuffer *db = NULL;
 
-  if (db)
+  if (DBufUsedCount < DBufAllocCount || DBufAllocCount * DBUF_SIZE < BUFFERPOOL)
   {
-    ++DBufUsedCount;
-    dbufFreeList = db->next;
-  }
-  else if (DBufAllocCount * DBUF_SIZE < BUFFERPOOL)
-  {
-    if ((db = (struct DBufBuffer *)RunMalloc(sizeof(struct DBufBuffer))))
+    if ((db = (struct DBufBuffer *)SlabAlloc(&dbuf_pool)))
     {
-      ++DBufAllocCount;
-      ++DBufUsedCount;
+      if (++DBufUsedCount > DBufAllocCount)
+        DBufAllocCount = DBufUsedCount;
+      db->shared = NULL;
     }
   }
   return db;
 }
 
 /*
- * dbuf_free - return a struct DBufBuffer structure to the freelist
+ * dbuf_free - return a struct DBufBuffer structure to its pool,
+ * dropping the reference to the shared message if it was a reference node
  */
 static void dbuf_free(struct DBufBuffer *db)
 {
   assert(0 != db);
+  if (db->shared)
+  {
+    dbuf_shared_free(db->shared);
+    db->shared = NULL;
+    --DBufRefCount;
+    SlabFree(&dbuf_ref_pool, db);
+    return;
+  }
   --DBufUsedCount;
-  db->next = dbufFreeList;
-  dbufFreeList = db;
+  SlabFree(&dbuf_pool, db);
 }
 
 /*
@@ -271,7 +352,8 @@ static int dbuf_put2(struct Client *cptr, struct DBuf *dyn, const char *buf,
       db->next = 0;
       db->start = db->end = db->data;
     }
-    chunk = (db->data + DBUF_SIZE) - db->end;
+    /* Never append to a reference node, it points to shared data */
+    chunk = db->shared ? 0 : (db->data + DBUF_SIZE) - db->end;
     if (chunk)
     {
       if (chunk > length)
@@ -395,6 +477,111 @@ int dbuf_put(struct Client *cptr, struct DBuf *dyn, const char *buf,
 #endif
 }
 
+/*
+ * dbuf_put_shared - Append a reference to a shared message to the buffer.
+ * No data is copied; the message is kept alive until it has been removed
+ * from every buffer that references it.
+ *
+ * Links with an outgoing compressed stream can't share the raw bytes,
+ * for those the message is simply copied (and compressed) by dbuf_put.
+ * If the last buffer holds its own data and the message fits in it, it
+ * is copied there too: a reference node would force the next private
+ * line into a fresh DBufBuffer, one per line on a busy sendQ.
+ *
+ * Returns > 0, if operation successful
+ *           0, if failed (due memory allocation problem); 'dyn' is
+ *              emptied
+ */
+int dbuf_put_shared(struct Client *cptr, struct DBuf *dyn,
+    struct DBufShared *shared)
+{
+  struct DBufBuffer *db;
+
+  assert(0 != dyn);
+  assert(0 != shared);
+  assert(0 < shared->length);
+
+#if defined(ESNET_NEG) && defined(ZLIB_ESNET)
+  if ((cptr != NULL) && MyConnect(cptr) && (cptr->negociacion & ZLIB_ESNET_OUT))
+    return dbuf_put(cptr, dyn, shared->data, shared->length);
+#endif
+
+  if (dyn->length && !(db = dyn->tail)->shared &&
+      (size_t)((db->data + DBUF_SIZE) - db->end) >= shared->length)
+  {
+    memcpy(db->end, shared->data, shared->length);
+    db->end += shared->length;
+    dyn->length += shared->length;
+    return 1;
+  }
+
+  if (0 == (db = dbuf_ref_alloc()))
+    return dbuf_malloc_error(dyn);
+
+  ++shared->refcount;
+  db->shared = shared;
+  db->next = 0;
+  db->start = shared->data;
+  db->end = shared->data + shared->length;
+
+  if (!dyn->length)
+    dyn->head = db;
+  else
+    dyn->tail->next = db;
+  dyn->tail = db;
+  dyn->length += shared->length;
+  return 1;
+}
+
+/*
+ * dbuf_append - Move the whole content of 'src' to the end of 'dst',
+ * leaving 'src' empty. The buffers themselves are relinked, nothing is
+ * copied, except for links with an outgoing compressed stream: there
+ * the data still has to go through dbuf_put.
+ *
+ * Returns > 0, if operation successful
+ *           0, if failed (due memory allocation problem); both 'dst'
+ *              and 'src' are emptied
+ */
+int dbuf_append(struct Client *cptr, struct DBuf *dst, struct DBuf *src)
+{
+  assert(0 != dst);
+  assert(0 != src);
+
+  if (!src->length)
+    return 1;
+
+#if defined(ESNET_NEG) && defined(ZLIB_ESNET)
+  if ((cptr != NULL) && MyConnect(cptr) && (cptr->negociacion & ZLIB_ESNET_OUT))
+  {
+    const char *buf;
+    size_t length;
+    int f;
+
+    while ((buf = dbuf_map(src, &length)))
+    {
+      if ((f = dbuf_put(cptr, dst, buf, length)) <= 0)
+      {
+        DBufClear(src);
+        return f;
+      }
+      dbuf_delete(src, length);
+    }
+    return 1;
+  }
+#endif
+
+  if (!dst->length)
+    dst->head = src->head;
+  else
+    dst->tail->next = src->head;
+  dst->tail = src->tail;
+  dst->length += src->length;
+  src->head = src->tail = 0;
+  src->length = 0;
+  return 1;
+}
+
 /*
  * dbuf_map, dbuf_delete
  *
@@ -439,6 +626,41 @@ const char *dbuf_map(const struct DBuf *dyn, size_t *length)
   return dyn->head->start;
 }
 
+/*
+ * dbuf_mapiov - scatter/gather version of dbuf_map
+ *
+ * Fills at most 'count' iovecs with the blocks at the front of the
+ * buffer, so that a single writev() can flush several of them.
+ * Returns the number of iovecs used (0 if the buffer is empty) and
+ * places the total number of bytes they hold into 'length'.
+ *
+ * dyn:         Dynamic buffer header
+ * iov:         Array of at least 'count' iovecs
+ * count:       Size of the iov array
+ * length:      Return number of bytes accessible
+ */
+int dbuf_mapiov(const struct DBuf *dyn, struct iovec *iov, int count,
+    size_t *length)
+{
+  struct DBufBuffer *db;
+  int i = 0;
+
+  assert(0 != dyn);
+  assert(0 != iov);
+  assert(0 != length);
+
+  *length = 0;
+  for (db = dyn->head; db && i < count; db = db->next)
+  {
+    if (db->end == db->start)
+      continue;
+    iov[i].iov_base = db->start;
+    iov[i].iov_len = db->end - db->start;
+    *length += iov[i++].iov_len;
+  }
+  return i;
+}
+
 /*
  * dbuf_delete - delete length bytes from DBuf
  *
@@ -32,6 +32,7 @@
 #include "m_watch.h"
 #include "hash.h"
 #include "channel.h"
+#include "list.h"
 #include "send.h"
 #include "match.h"
 #include "s_serv.h"
@@ -39,6 +40,8 @@
 #include "support.h"
 #include "numeric.h"
 #include "s_err.h"
+#include "s_bsd.h"
+#include "random.h"
 
 /************************* Nemesi's hash alghoritm ***********************/
 
@@ -173,7 +176,36 @@ static HASHMEMS hash_weight_table[CHAR_MAX - CHAR_MIN + 1];
    so that I can use one hash function and one transformation map */
 static aClient *clientTable[HASHSIZE];
 static aChannel *channelTable[HASHSIZE];
-static aWatch *watchTable[HASHSIZE];
+
+/* The WATCH table is hashed with db_hash_registro() and grows with the
+   number of watched nicks (see hAddWatch) */
+#define WATCHHASH_MIN 1024
+
+static aWatch **watchTable;
+static unsigned int watch_hash_size;
+static unsigned int watch_hash_count;
+static unsigned int watch_hash_resizes;
+static void watch_hash_resize(unsigned int size);
+
+/* The channel membership table is keyed by pointers, it doesn't use the
+   maps above and grows on its own (see hAddMember) */
+#define MEMBERHASH_MIN HASHSIZE
+
+struct MemberHash {
+  aChannel *chptr;
+  aClient *cptr;
+  Link *member;
+  unsigned int dups;            /* Links repetidos del mismo cliente */
+};
+
+static struct MemberHash *memberTable;
+static unsigned int member_hash_size;
+static unsigned int member_hash_count;
+static unsigned int member_hash_resizes;
+static unsigned int member_hash_lookups;
+static unsigned int member_hash_probes;
+static unsigned int member_hash_maxprobe;
+static void member_hash_resize(unsigned int size);
 
 /* This is what the hash function will consider "equal" chars, this function 
    MUST be transitive, if HASHEQ(y,x)&&HASHEQ(y,z) then HASHEQ(y,z), and MUST
@@ -192,9 +224,14 @@ void hash_init(void)
   {
     channelTable[l] = (aChannel *)NULL;
     clientTable[l] = (aClient *)NULL;
-    watchTable[l] = (aWatch *) NULL;
   };
 
+  watch_hash_resize(WATCHHASH_MIN);
+  watch_hash_resizes = 0;
+
+  member_hash_resize(MEMBERHASH_MIN);
+  member_hash_resizes = 0;
+
   /* Here is to what we "map" a char before working on it */
   for (i = CHAR_MIN; i <= CHAR_MAX; i++)
     hash_weight(i) = (HASHMEMS) (HASHSTEP * ((unsigned char)i));
@@ -288,6 +325,153 @@ int hAddClient(aClient *cptr)
   return 0;
 }
 
+/*
+ * Indices de canales para /LIST
+ *
+ * En vez de recorrer todas las cubetas de channelTable, /LIST usa
+ * dos indices que se mantienen al vuelo:
+ *
+ * - Por usuarios: una lista por cada numero de usuarios (los de
+ *   LIST_LEVELS - 1 o mas comparten la ultima). Entrar o salir de un
+ *   canal lo cambia de lista en O(1). /LIST las recorre de mayor a
+ *   menor saltandose las que no pueden cumplir >N ni <N, y puede
+ *   detenerse a mitad de una: el canal donde se para lleva la cuenta
+ *   en 'listed' y, si sale de su lista, el listado pasa al siguiente.
+ *
+ * - Por nombre: una skip list ordenada sin distinguir mayusculas. Si
+ *   el comodin empieza por un prefijo fijo ("#foo*"), /LIST solo
+ *   recorre los canales con ese prefijo, y para continuar busca el
+ *   siguiente al ultimo enviado.
+ */
+#define LIST_LEVELS 256
+#define LIST_NAME_LEVELS 16     /* Skip list con p = 1/4 */
+
+#define list_level(users) \
+  ((users) < LIST_LEVELS - 1 ? (int)(users) : LIST_LEVELS - 1)
+
+static aChannel *listTable[LIST_LEVELS];
+static aChannel *nameIndex[LIST_NAME_LEVELS];
+
+static int list_name_cmp(const char *a, const char *b)
+{
+  while (*a && toLower(*a) == toLower(*b))
+  {
+    a++;
+    b++;
+  }
+  return (unsigned char)toLower(*a) - (unsigned char)toLower(*b);
+}
+
+static int list_name_prefix(const char *prefix, const char *name)
+{
+  for (; *prefix; prefix++, name++)
+    if (toLower(*prefix) != toLower(*name))
+      return 0;
+  return 1;
+}
+
+/*
+ * list_name_seek
+ *
+ * Devuelve el puntero al primer canal cuyo nombre es >= `name'.
+ * Si `update' no es NULL, recibe el puntero anterior en cada nivel.
+ */
+static aChannel **list_name_seek(const char *name, aChannel ***update)
+{
+  aChannel **fwd = nameIndex;
+  int i;
+
+  for (i = LIST_NAME_LEVELS - 1; i >= 0; i--)
+  {
+    while (fwd[i] && list_name_cmp(fwd[i]->chname, name) < 0)
+      fwd = fwd[i]->snext;
+    if (update)
+      update[i] = &fwd[i];
+  }
+  return &fwd[0];
+}
+
+static void list_name_insert(aChannel *chptr)
+{
+  aChannel **update[LIST_NAME_LEVELS];
+  int i, levels = 1;
+
+  while (levels < LIST_NAME_LEVELS && !(ircrandom() & 3))
+    levels++;
+
+  list_name_seek(chptr->chname, update);
+  chptr->snext = (aChannel **)RunMalloc(levels * sizeof(aChannel *));
+  for (i = 0; i < levels; i++)
+  {
+    chptr->snext[i] = *update[i];
+    *update[i] = chptr;
+  }
+}
+
+static void list_name_remove(aChannel *chptr)
+{
+  aChannel **update[LIST_NAME_LEVELS];
+  int i;
+
+  list_name_seek(chptr->chname, update);
+  for (i = 0; i < LIST_NAME_LEVELS && *update[i] == chptr; i++)
+    *update[i] = chptr->snext[i];
+  RunFree(chptr->snext);
+  chptr->snext = NULL;
+}
+
+static void list_link(aChannel *chptr)
+{
+  aChannel **head = &listTable[list_level(chptr->users)];
+
+  if ((chptr->lnext = *head))
+    chptr->lnext->lprevp = &chptr->lnext;
+  chptr->lprevp = head;
+  *head = chptr;
+}
+
+/*
+ * list_unlink
+ *
+ * Saca el canal de su lista de usuarios. Los listados parados en el
+ * pasan al siguiente de la misma lista, o a la lista de debajo.
+ */
+static void list_unlink(aChannel *chptr)
+{
+  aListingArgs *args;
+  int i;
+
+  for (i = 0; chptr->listed && i <= highest_fd; i++)
+  {
+    if (!loc_clients[i] || !(args = loc_clients[i]->listing) ||
+        args->chptr != chptr)
+      continue;
+    if ((args->chptr = chptr->lnext))
+      args->chptr->listed++;
+    else
+      args->level--;
+    chptr->listed--;
+  }
+
+  if ((*chptr->lprevp = chptr->lnext))
+    chptr->lnext->lprevp = chptr->lprevp;
+  chptr->lnext = NULL;
+  chptr->lprevp = NULL;
+}
+
+/*
+ * hChannelUsers
+ *
+ * Llamar cuando cambia chptr->users; `old_users' es el valor anterior.
+ */
+void hChannelUsers(aChannel *chptr, unsigned int old_users)
+{
+  if (list_level(old_users) == list_level(chptr->users))
+    return;
+  list_unlink(chptr);
+  list_link(chptr);
+}
+
 /*
  * hAddChannel
  * Adds a channel's name in the proper hash linked list, can't fail.
@@ -302,6 +486,9 @@ int hAddChannel(aChannel *chptr)
   chptr->hnextch = channelTable[hashv];
   channelTable[hashv] = chptr;
 
+  list_link(chptr);
+  list_name_insert(chptr);
+
   return 0;
 }
 
@@ -367,6 +554,9 @@ int hRemChannel(aChannel *chptr)
   HASHREGS hashv = strhash(chptr->chname);
   aChannel *tmp = channelTable[hashv];
 
+  list_unlink(chptr);
+  list_name_remove(chptr);
+
   if (tmp == chptr)
   {
     channelTable[hashv] = chptr->hnextch;
@@ -461,10 +651,22 @@ int m_hash(aClient *UNUSED(cptr), aClient *sptr, int UNUSED(parc), char *parv[])
  *
  * calcula el hash de una clave ...
  *                                      1999/06/23 savage@apostols.org
+ *
+ * Las tablas de la BDD pueden crecer por encima de HASHSIZE, asi que
+ * no sirve strhash(): se usa FNV-1a, con los 32 bits. La clave se
+ * pasa a minusculas sobre la marcha, para no tener que copiarla.
  */
-int db_hash_registro(char *clave, int hash_size)
+int db_hash_registro(const char *clave, int hash_size)
 {
-  return (unsigned int)(strhash(clave) & (hash_size - 1));
+  unsigned int h = 2166136261u;
+
+  while (*clave)
+  {
+    h ^= (unsigned char)toLower(*clave);
+    clave++;
+    h *= 16777619u;
+  }
+  return (unsigned int)(h & (hash_size - 1));
 }
 
 /*
@@ -472,7 +674,44 @@ int db_hash_registro(char *clave, int hash_size)
  *
  * 2002/05/20 zoltan <zoltan@irc-dev.net>
  *
+ * La tabla es de encadenamiento y de taman~o variable: se dobla cuando
+ * hay mas nicks que cubetas y se reduce a la mitad cuando quedan menos
+ * de 1/8, sin bajar de WATCHHASH_MIN.
  *
+ *
+ * watch_hash_resize()
+ *
+ * Pasa todas las entradas a una tabla nueva de 'size' cubetas.
+ */
+static void watch_hash_resize(unsigned int size)
+{
+  aWatch **old = watchTable;
+  unsigned int old_size = watch_hash_size;
+  unsigned int i, hashv;
+  aWatch *wptr, *next;
+
+  watchTable = (aWatch **)RunCalloc(size, sizeof(aWatch *));
+  if (!watchTable)
+    outofmemory();
+  watch_hash_size = size;
+  watch_hash_resizes++;
+
+  for (i = 0; i < old_size; i++)
+  {
+    for (wptr = old[i]; wptr; wptr = next)
+    {
+      next = wptr->next;
+      hashv = db_hash_registro(wptr->nick, size);
+      wptr->next = watchTable[hashv];
+      watchTable[hashv] = wptr;
+    }
+  }
+
+  if (old)
+    RunFree(old);
+}
+
+/*
  * hAddWatch()
  *
  * Agrega un nick en la lista de watch's.
@@ -480,8 +719,12 @@ int db_hash_registro(char *clave, int hash_size)
  */
 int hAddWatch(aWatch * wptr)
 {
-  HASHREGS hashv = strhash(wptr->nick);
+  unsigned int hashv;
+
+  if (++watch_hash_count > watch_hash_size)
+    watch_hash_resize(watch_hash_size * 2);
 
+  hashv = db_hash_registro(wptr->nick, watch_hash_size);
   wptr->next = watchTable[hashv];
   watchTable[hashv] = wptr;
 
@@ -497,23 +740,20 @@ int hAddWatch(aWatch * wptr)
  */
 int hRemWatch(aWatch * wptr)
 {
-  HASHREGS hashv = strhash(wptr->nick);
-  aWatch *tmp = watchTable[hashv];
+  unsigned int hashv = db_hash_registro(wptr->nick, watch_hash_size);
+  aWatch **tmp;
 
-  if (tmp == wptr)
-  {
-    watchTable[hashv] = wptr->next;
-    return 0;
-  }
-  while (tmp)
+  for (tmp = &watchTable[hashv]; *tmp; tmp = &(*tmp)->next)
   {
-    if (tmp->next == wptr)
+    if (*tmp == wptr)
     {
-      tmp->next = tmp->next->next;
+      *tmp = wptr->next;
+      if (--watch_hash_count < watch_hash_size / 8 &&
+          watch_hash_size > WATCHHASH_MIN)
+        watch_hash_resize(watch_hash_size / 2);
       return 0;
-    };
-    tmp = tmp->next;
-  };
+    }
+  }
   return -1;
 }
 
@@ -525,7 +765,7 @@ int hRemWatch(aWatch * wptr)
  */
 aWatch *hSeekWatch(char *nick)
 {
-  HASHREGS hashv = strhash(nick);
+  unsigned int hashv = db_hash_registro(nick, watch_hash_size);
   aWatch *wptr = watchTable[hashv];
   aWatch *prv;
 
@@ -544,59 +784,699 @@ aWatch *hSeekWatch(char *nick)
 
 }
 
+/*
+ * watch_hash_mem()
+ *
+ * Envia lo que ocupan la tabla y las listas de WATCH (cada vigilante
+ * cuesta dos Link, uno en el aWatch y otro en el usuario) y devuelve
+ * el total.
+ */
+size_t watch_hash_mem(aClient *cptr, char *nick)
+{
+  size_t tm = watch_hash_size * sizeof(aWatch *);
+  size_t wm = 0;
+  unsigned int i, links = 0;
+  aWatch *wptr;
+  Link *lp;
+
+  for (i = 0; i < watch_hash_size; i++)
+  {
+    for (wptr = watchTable[i]; wptr; wptr = wptr->next)
+    {
+      wm += sizeof(aWatch) + strlen(wptr->nick) + 1;
+      for (lp = wptr->watch; lp; lp = lp->next)
+        links++;
+    }
+  }
+
+  sendto_one(cptr, ":%s %d %s :Hash: watch %u/%u(" SIZE_T_FMT
+      ") resizes %u", me.name, RPL_STATSDEBUG, nick, watch_hash_count,
+      watch_hash_size, tm, watch_hash_resizes);
+  sendto_one(cptr, ":%s %d %s :Watch nicks %u(" SIZE_T_FMT
+      ") links %u(" SIZE_T_FMT ")", me.name, RPL_STATSDEBUG, nick,
+      watch_hash_count, wm, links, 2 * links * sizeof(Link));
+
+  return tm + wm + 2 * links * sizeof(Link);
+}
+
+/*
+ * FUNCIONES HASH de MIEMBROS DE CANAL.
+ *
+ * Tabla global de direccionamiento abierto (sondeo lineal) indexada por
+ * el par (canal, cliente), que devuelve el Link de chptr->members con sus
+ * flags CHFL_* sin recorrer la lista de miembros.  Crece (y decrece) al
+ * doble (o la mitad) para mantener la carga entre 1/8 y 1/2; los borrados
+ * desplazan hacia atras la cadena de sondeo, asi que no hay lapidas.
+ */
+
+static unsigned int member_hash(aChannel *chptr, aClient *cptr)
+{
+  unsigned long h;
+
+  h = (unsigned long)chptr ^ ((unsigned long)cptr * 2654435761UL);
+  h ^= h >> 15;
+  h *= 2246822519UL;
+  h ^= h >> 13;
+  h *= 3266489917UL;
+  h ^= h >> 16;
+
+  return (unsigned int)h & (member_hash_size - 1);
+}
+
+static void member_hash_resize(unsigned int size)
+{
+  struct MemberHash *old = memberTable;
+  unsigned int old_size = member_hash_size;
+  unsigned int i, j;
+
+  memberTable = (struct MemberHash *)RunCalloc(size, sizeof(struct MemberHash));
+  if (!memberTable)
+    outofmemory();
+  member_hash_size = size;
+  member_hash_resizes++;
+
+  for (i = 0; i < old_size; i++)
+  {
+    if (!old[i].chptr)
+      continue;
+    for (j = member_hash(old[i].chptr, old[i].cptr); memberTable[j].chptr;
+        j = (j + 1) & (size - 1));
+    memberTable[j] = old[i];
+  }
+
+  if (old)
+    RunFree(old);
+}
+
+/*
+ * member_hash_find
+ *
+ * Devuelve la posicion del par (chptr, cptr) o la del hueco
+ * libre donde deberia insertarse.
+ */
+static unsigned int member_hash_find(aChannel *chptr, aClient *cptr)
+{
+  unsigned int i = member_hash(chptr, cptr);
+  unsigned int probes = 1;
+
+  while (memberTable[i].chptr &&
+      (memberTable[i].chptr != chptr || memberTable[i].cptr != cptr))
+  {
+    i = (i + 1) & (member_hash_size - 1);
+    probes++;
+  }
+
+  member_hash_lookups++;
+  member_hash_probes += probes;
+  if (probes > member_hash_maxprobe)
+    member_hash_maxprobe = probes;
+
+  return i;
+}
+
+/*
+ * hAddMember()
+ *
+ * Indexa el Link de miembro recien insertado en chptr->members.
+ * Si el cliente ya tenia otro Link en el canal, el nuevo (que queda
+ * el primero de la lista) es el que se devuelve a partir de ahora,
+ * igual que haria find_user_link().
+ */
+int hAddMember(aChannel *chptr, aClient *cptr, Link *member)
+{
+  unsigned int i;
+
+  if ((member_hash_count + 1) * 2 > member_hash_size)
+    member_hash_resize(member_hash_size * 2);
+
+  i = member_hash_find(chptr, cptr);
+  if (memberTable[i].chptr)
+  {
+    memberTable[i].member = member;
+    memberTable[i].dups++;
+    return 0;
+  }
+
+  memberTable[i].chptr = chptr;
+  memberTable[i].cptr = cptr;
+  memberTable[i].member = member;
+  memberTable[i].dups = 0;
+  member_hash_count++;
+
+  return 0;
+}
+
+/*
+ * hRemMember()
+ *
+ * Borra el par (chptr, cptr) despues de sacar de chptr->members
+ * el primer Link del cliente.
+ */
+int hRemMember(aChannel *chptr, aClient *cptr)
+{
+  unsigned int i, j, k;
+
+  i = member_hash_find(chptr, cptr);
+  if (!memberTable[i].chptr)
+    return -1;
+
+  if (memberTable[i].dups)
+  {
+    memberTable[i].dups--;
+    memberTable[i].member = find_user_link(chptr->members, cptr);
+    return 0;
+  }
+
+  /* Desplaza hacia atras las entradas que sondearon sobre este hueco */
+  for (j = i;;)
+  {
+    memberTable[i].chptr = NULL;
+    do
+    {
+      j = (j + 1) & (member_hash_size - 1);
+      if (!memberTable[j].chptr)
+        goto done;
+      k = member_hash(memberTable[j].chptr, memberTable[j].cptr);
+    }
+    while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+    memberTable[i] = memberTable[j];
+    i = j;
+  }
+
+done:
+  member_hash_count--;
+  if (member_hash_size > MEMBERHASH_MIN &&
+      member_hash_count * 8 < member_hash_size)
+    member_hash_resize(member_hash_size / 2);
+
+  return 0;
+}
+
+/*
+ * hSeekMember()
+ *
+ * Busca el Link de cptr en chptr->members (zombies incluidos).
+ */
+Link *hSeekMember(aChannel *chptr, aClient *cptr)
+{
+  unsigned int i;
+
+  if (!cptr)
+    return NULL;
+
+  i = member_hash_find(chptr, cptr);
+  return memberTable[i].chptr ? memberTable[i].member : NULL;
+}
+
+/*
+ * member_hash_mem()
+ *
+ * Envia las estadisticas de sondeo de la tabla de miembros
+ * y devuelve la memoria que ocupa.
+ */
+size_t member_hash_mem(aClient *cptr, char *nick)
+{
+  size_t mem = member_hash_size * sizeof(struct MemberHash);
+
+  sendto_one(cptr, ":%s %d %s :Hash: members %u/%u(" SIZE_T_FMT
+      ") resizes %u lookups %u probes %u max %u",
+      me.name, RPL_STATSDEBUG, nick, member_hash_count, member_hash_size,
+      mem, member_hash_resizes, member_hash_lookups, member_hash_probes,
+      member_hash_maxprobe);
+
+  return mem;
+}
+
+/*
+ * list_send_channel
+ *
+ * Envia el canal si cumple los filtros del listado.
+ */
+static void list_send_channel(aClient *cptr, aListingArgs *args,
+    aChannel *chptr)
+{
+  if (chptr->users > args->min_users
+      && chptr->users < args->max_users
+      && chptr->creationtime > args->min_time
+      && chptr->creationtime < args->max_time
+      && (!args->wildcard[0] || (args->flags & LISTARG_NEGATEWILDCARD) ||
+          (!match(args->wildcard, chptr->chname)))
+      && (!(args->flags & LISTARG_NEGATEWILDCARD) ||
+          match(args->wildcard, chptr->chname))
+      && (!(args->flags & LISTARG_TOPICLIMITS)
+          || (chptr->topic[0]
+              && chptr->topic_time > args->min_topic_time
+              && chptr->topic_time < args->max_topic_time))
+      && ((args->flags & LISTARG_SHOWSECRET)
+          || ShowChannel(cptr, chptr)))
+  {
+    if (args->flags & LISTARG_SHOWMODES) {
+      char modebuf[MODEBUFLEN];
+      char parabuf[MODEBUFLEN];
+
+      modebuf[0] = modebuf[1] = parabuf[0] = '\0';
+      channel_modes(cptr, modebuf, parabuf, chptr);
+
+      sendto_one(cptr, ":%s %d %s %s %u :[%s%s%s] %s",
+                 me.name, RPL_LIST, cptr->name, chptr->chname, chptr->users,
+                 modebuf, parabuf ? "" : " ", parabuf, PunteroACadena(chptr->topic)); 
+    } else {
+      sendto_one(cptr, rpl_str(RPL_LIST), me.name, cptr->name,
+        chptr->chname, chptr->users, PunteroACadena(chptr->topic));
+    }
+  }
+}
+
+/*
+ * list_start_channels
+ *
+ * Empieza el listado de cptr->listing, eligiendo indice: por nombre
+ * si el comodin tiene un prefijo fijo, si no por usuarios.
+ */
+void list_start_channels(aClient *cptr)
+{
+  aListingArgs *args = cptr->listing;
+  char *s, *d;
+
+  args->chptr = NULL;
+  args->last[0] = '\0';
+  args->level = list_level(args->max_users - 1);
+
+  d = args->prefix;
+  if (!(args->flags & LISTARG_NEGATEWILDCARD))
+  {
+    for (s = args->wildcard; *s && *s != '*' && *s != '?' && *s != '\\';)
+      *d++ = *s++;
+  }
+  *d = '\0';
+  if (d - args->prefix < 2)     /* Solo "#" no reduce nada */
+    args->prefix[0] = '\0';
+
+  list_next_channels(cptr);
+}
+
 void list_next_channels(aClient *cptr)
 {
-  aListingArgs *args;
+  aListingArgs *args = cptr->listing;
   aChannel *chptr;
 
-  /* Walk consecutive buckets until we hit the end. */
-  for (args = cptr->listing; args->bucket < HASHSIZE; args->bucket++)
+  if (args->prefix[0])
+  {
+    chptr = *list_name_seek(args->last[0] ? args->last : args->prefix, NULL);
+    if (args->last[0] && chptr && !list_name_cmp(chptr->chname, args->last))
+      chptr = chptr->snext[0];
+
+    for (; chptr && list_name_prefix(args->prefix, chptr->chname);
+        chptr = chptr->snext[0])
+    {
+      list_send_channel(cptr, args, chptr);
+      /* If client sendq is more than half full, stop. */
+      if (DBufLength(&cptr->sendQ) > get_sendq(cptr) / 2)
+      {
+        strcpy(args->last, chptr->chname);
+        return;
+      }
+    }
+  }
+  else
   {
-    /* Send all the matching channels in the bucket. */
-    for (chptr = channelTable[args->bucket]; chptr; chptr = chptr->hnextch)
+    /* De mas a menos usuarios, mientras pueda haber alguno > min_users */
+    while (args->level >= 0 && (args->level == LIST_LEVELS - 1 ||
+        (unsigned int)args->level > args->min_users))
     {
-      if (chptr->users > args->min_users
-          && chptr->users < args->max_users
-          && chptr->creationtime > args->min_time
-          && chptr->creationtime < args->max_time
-          && (!args->wildcard[0] || (args->flags & LISTARG_NEGATEWILDCARD) ||
-              (!match(args->wildcard, chptr->chname)))
-          && (!(args->flags & LISTARG_NEGATEWILDCARD) ||
-              match(args->wildcard, chptr->chname))
-          && (!(args->flags & LISTARG_TOPICLIMITS)
-              || (chptr->topic[0]
-                  && chptr->topic_time > args->min_topic_time
-                  && chptr->topic_time < args->max_topic_time))
-          && ((args->flags & LISTARG_SHOWSECRET)
-              || ShowChannel(cptr, chptr)))
+      if ((chptr = args->chptr))
+      {
+        chptr->listed--;
+        args->chptr = NULL;
+      }
+      else
+        chptr = listTable[args->level];
+
+      for (; chptr; chptr = chptr->lnext)
       {
-        if (args->flags & LISTARG_SHOWMODES) {
-          char modebuf[MODEBUFLEN];
-          char parabuf[MODEBUFLEN];
-
-          modebuf[0] = modebuf[1] = parabuf[0] = '\0';
-          channel_modes(cptr, modebuf, parabuf, chptr);
-
-          sendto_one(cptr, ":%s %d %s %s %u :[%s%s%s] %s",
-                     me.name, RPL_LIST, cptr->name, chptr->chname, chptr->users,
-                     modebuf, parabuf ? "" : " ", parabuf, PunteroACadena(chptr->topic)); 
-        } else {
-          sendto_one(cptr, rpl_str(RPL_LIST), me.name, cptr->name,
-            chptr->chname, chptr->users, PunteroACadena(chptr->topic));
+        list_send_channel(cptr, args, chptr);
+        /* If client sendq is more than half full, stop. */
+        if (DBufLength(&cptr->sendQ) > get_sendq(cptr) / 2)
+        {
+          if ((args->chptr = chptr->lnext))
+            args->chptr->listed++;
+          else
+            args->level--;
+          return;
         }
       }
+      args->level--;
+    }
+  }
+
+  /* We are done: clean the client and send RPL_LISTEND. */
+  list_stop_channels(cptr);
+  sendto_one(cptr, rpl_str(RPL_LISTEND), me.name, cptr->name);
+}
+
+/*
+ * list_stop_channels
+ *
+ * Libera el listado en curso (sin enviar RPL_LISTEND).
+ */
+void list_stop_channels(aClient *cptr)
+{
+  if (cptr->listing->chptr)
+    cptr->listing->chptr->listed--;
+  RunFree(cptr->listing);
+  cptr->listing = NULL;
+}
+
+/*
+ * Indices de /WHO
+ *
+ * Arboles crit-bit (PATRICIA) sobre las claves de los usuarios, para
+ * que /WHO con mascaras de IP o de sufijo no tenga que recorrer toda
+ * la red:
+ *
+ * - WHO_INDEX_IP: los 128 bits de acptr->ip; una mascara CIDR es un
+ *   prefijo de bits, con la misma semantica que ipmask_check().
+ * - WHO_INDEX_HOST y WHO_INDEX_USER: el host real y el username al
+ *   reves y en minusculas, asi "*.isp.com" es el prefijo "moc.psi.".
+ *
+ * Cada hoja guarda la lista de usuarios con esa clave, y cada nodo
+ * interno el numero de usuarios bajo el, que es lo que usa el
+ * planificador de /WHO para estimar el coste de cada indice.
+ */
+struct WhoLeaf {
+  aClient *clients;             /* Usuarios con esta clave */
+  unsigned int count;
+  unsigned int len;             /* Bytes de la clave */
+  unsigned char key[1];         /* Reservado a medida */
+};
+
+struct WhoNode {
+  void *child[2];               /* Hoja, o nodo interno con el bit 0 a 1 */
+  unsigned int bit;             /* Primer bit en que difieren los hijos */
+  unsigned int count;           /* Usuarios en el subarbol */
+};
+
+#define who_internal(p)   ((size_t)(p) & 1)
+#define who_node(p)       ((struct WhoNode *)((size_t)(p) - 1))
+#define who_tag(n)        ((void *)((size_t)(n) + 1))
+
+static void *whoTree[WHO_INDICES];
+static unsigned int who_leaves, who_nodes;
+static size_t who_leaf_mem;
+
+/* Bit `bit' de la clave, los bytes de mas alla del final valen 0 */
+static int who_bit(const unsigned char *key, unsigned int len,
+    unsigned int bit)
+{
+  if ((bit >> 3) >= len)
+    return 0;
+  return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/* Clave invertida y en minusculas de `s'; devuelve su longitud */
+static unsigned int who_reverse_key(const char *s, unsigned char *key)
+{
+  unsigned int len = strlen(s), i;
+
+  if (len > HOSTLEN)
+    len = HOSTLEN;
+  for (i = 0; i < len; i++)
+    key[i] = toLower(s[len - 1 - i]);
+  return len;
+}
+
+static unsigned int who_key(int idx, aClient *acptr, unsigned char *key)
+{
+  switch (idx)
+  {
+    case WHO_INDEX_IP:
+      memcpy(key, &acptr->ip, sizeof(struct irc_in_addr));
+      return sizeof(struct irc_in_addr);
+    case WHO_INDEX_HOST:
+      return who_reverse_key(PunteroACadena(acptr->user->host), key);
+    default:
+      return who_reverse_key(PunteroACadena(acptr->user->username), key);
+  }
+}
+
+static unsigned int who_count(void *p)
+{
+  return who_internal(p) ? who_node(p)->count : ((struct WhoLeaf *)p)->count;
+}
+
+/*
+ * who_leaf_get
+ *
+ * Devuelve la hoja de la clave, creandola si no existe.
+ */
+static struct WhoLeaf *who_leaf_get(int idx, const unsigned char *key,
+    unsigned int len)
+{
+  void **where = &whoTree[idx], *p;
+  struct WhoLeaf *leaf;
+  struct WhoNode *node = NULL;
+  unsigned int i, max, bit;
+  unsigned char a = 0, b = 0;
+
+  if ((p = *where))
+  {
+    while (who_internal(p))
+      p = who_node(p)->child[who_bit(key, len, who_node(p)->bit)];
+    leaf = (struct WhoLeaf *)p;
+
+    max = (len > leaf->len) ? len : leaf->len;
+    for (i = 0; i < max; i++)
+    {
+      a = (i < len) ? key[i] : 0;
+      b = (i < leaf->len) ? leaf->key[i] : 0;
+      if (a != b)
+        break;
+    }
+    if (i == max)
+      return leaf;
+
+    for (bit = i << 3, a ^= b; !(a & 0x80); a <<= 1)
+      bit++;
+
+    /* El nodo nuevo va encima del primer subarbol que discrimina despues */
+    while (who_internal(*where) && who_node(*where)->bit < bit)
+      where = &who_node(*where)->child[who_bit(key, len,
+          who_node(*where)->bit)];
+
+    node = (struct WhoNode *)RunMalloc(sizeof(struct WhoNode));
+    node->bit = bit;
+    node->count = who_count(*where);
+    node->child[!who_bit(key, len, bit)] = *where;
+    *where = who_tag(node);
+    where = &node->child[who_bit(key, len, bit)];
+    who_nodes++;
+  }
+
+  leaf = (struct WhoLeaf *)RunMalloc(sizeof(struct WhoLeaf) + len);
+  leaf->clients = NULL;
+  leaf->count = 0;
+  leaf->len = len;
+  memcpy(leaf->key, key, len);
+  *where = leaf;
+  who_leaves++;
+  who_leaf_mem += sizeof(struct WhoLeaf) + len;
+  return leaf;
+}
+
+/*
+ * who_index_add
+ *
+ * Mete un usuario recien registrado en los indices de /WHO.
+ */
+void who_index_add(aClient *acptr)
+{
+  unsigned char key[HOSTLEN + 1];
+  struct WhoLink *wl;
+  unsigned int len;
+  void *p;
+  int idx;
+
+  for (idx = 0; idx < WHO_INDICES; idx++)
+  {
+    wl = &acptr->user->who[idx];
+    if (wl->leaf)
+      continue;
+    len = who_key(idx, acptr, key);
+    wl->leaf = who_leaf_get(idx, key, len);
+
+    wl->prev = NULL;
+    if ((wl->next = wl->leaf->clients))
+      wl->next->user->who[idx].prev = acptr;
+    wl->leaf->clients = acptr;
+
+    for (p = whoTree[idx]; who_internal(p);
+        p = who_node(p)->child[who_bit(key, len, who_node(p)->bit)])
+      who_node(p)->count++;
+    wl->leaf->count++;
+  }
+}
+
+/*
+ * who_index_del
+ *
+ * Saca al usuario de los indices de /WHO, borrando las hojas que
+ * se quedan vacias.
+ */
+void who_index_del(aClient *acptr)
+{
+  struct WhoLink *wl;
+  struct WhoLeaf *leaf;
+  struct WhoNode *node;
+  void **where, **up, *p;
+  int idx, dir = 0;
+
+  for (idx = 0; idx < WHO_INDICES; idx++)
+  {
+    wl = &acptr->user->who[idx];
+    if (!(leaf = wl->leaf))
+      continue;
+
+    if (wl->prev)
+      wl->prev->user->who[idx].next = wl->next;
+    else
+      leaf->clients = wl->next;
+    if (wl->next)
+      wl->next->user->who[idx].prev = wl->prev;
+    wl->leaf = NULL;
+    wl->prev = wl->next = NULL;
+    leaf->count--;
+
+    up = NULL;
+    where = &whoTree[idx];
+    while (who_internal(p = *where))
+    {
+      node = who_node(p);
+      node->count--;
+      dir = who_bit(leaf->key, leaf->len, node->bit);
+      up = where;
+      where = &node->child[dir];
+    }
+
+    if (leaf->count)
+      continue;
+
+    /* El hermano de la hoja ocupa el sitio de su padre */
+    if (up)
+    {
+      node = who_node(*up);
+      *up = node->child[!dir];
+      RunFree(node);
+      who_nodes--;
     }
-    /* If, at the end of the bucket, client sendq is more than half
-     * full, stop. */
-    if (DBufLength(&cptr->sendQ) > get_sendq(cptr) / 2)
-      break;
+    else
+      *where = NULL;
+    who_leaf_mem -= sizeof(struct WhoLeaf) + leaf->len;
+    RunFree(leaf);
+    who_leaves--;
+  }
+}
+
+/*
+ * who_index_find
+ *
+ * Devuelve el subarbol con las claves que empiezan por los `bits'
+ * primeros bits de `key', o NULL si no hay ninguna.
+ */
+static void *who_index_find(int idx, const unsigned char *key,
+    unsigned int len, unsigned int bits)
+{
+  void *p, *top;
+  struct WhoLeaf *leaf;
+  unsigned int i;
+
+  if (!(p = top = whoTree[idx]))
+    return NULL;
+  while (who_internal(p))
+  {
+    p = who_node(p)->child[who_bit(key, len, who_node(p)->bit)];
+    if (who_node(top)->bit < bits)
+      top = p;
   }
 
-  /* If we did all buckets, clean the client and send RPL_LISTEND. */
-  if (args->bucket >= HASHSIZE)
+  /* Todas las hojas de `top' comparten esos bits, basta con mirar una */
+  leaf = (struct WhoLeaf *)p;
+  for (i = 0; i < bits; i++)
+    if (who_bit(key, len, i) != who_bit(leaf->key, leaf->len, i))
+      return NULL;
+  return top;
+}
+
+/*
+ * who_index_suffix
+ *
+ * Subarbol de los usuarios cuyo host (o username) acaba en `suffix',
+ * o es exactamente `suffix' si `exact'.
+ */
+void *who_index_suffix(int idx, const char *suffix, int exact)
+{
+  unsigned char key[HOSTLEN + 1];
+  unsigned int len = who_reverse_key(suffix, key);
+
+  return who_index_find(idx, key, len, (len + (exact ? 1 : 0)) << 3);
+}
+
+/*
+ * who_index_ip
+ *
+ * Subarbol de los usuarios que cumplen ipmask_check(ip, mask, bits).
+ */
+void *who_index_ip(const struct irc_in_addr *mask, unsigned char bits)
+{
+  return who_index_find(WHO_INDEX_IP, (const unsigned char *)mask,
+      sizeof(struct irc_in_addr), (bits > 128) ? 128 : bits);
+}
+
+/* Numero de usuarios en un subarbol de who_index_*() */
+unsigned int who_index_count(void *p)
+{
+  return p ? who_count(p) : 0;
+}
+
+/*
+ * who_index_walk
+ *
+ * Llama a `fn' con cada usuario del subarbol.
+ */
+void who_index_walk(void *p, void (*fn)(aClient *))
+{
+  aClient *acptr, *next;
+  int idx;
+
+  if (!p)
+    return;
+  if (who_internal(p))
   {
-    RunFree(cptr->listing);
-    cptr->listing = NULL;
-    sendto_one(cptr, rpl_str(RPL_LISTEND), me.name, cptr->name);
+    who_index_walk(who_node(p)->child[0], fn);
+    who_index_walk(who_node(p)->child[1], fn);
+    return;
   }
+  acptr = ((struct WhoLeaf *)p)->clients;
+  if (!acptr)
+    return;
+  for (idx = 0; acptr->user->who[idx].leaf != p; idx++);
+  for (; acptr; acptr = next)
+  {
+    next = acptr->user->who[idx].next;
+    fn(acptr);
+  }
+}
+
+/*
+ * who_index_mem()
+ *
+ * Envia el tamano de los indices de /WHO y devuelve su memoria.
+ */
+size_t who_index_mem(aClient *cptr, char *nick)
+{
+  size_t mem = who_leaf_mem + who_nodes * sizeof(struct WhoNode);
+
+  sendto_one(cptr, ":%s %d %s :Who index leaves %u nodes %u(" SIZE_T_FMT
+      ")", me.name, RPL_STATSDEBUG, nick, who_leaves, who_nodes, mem);
+
+  return mem;
 }
@@ -100,10 +100,8 @@ int nicklen = 30;
 
 struct event   ev_nextconnect;
 struct event   ev_nextdnscheck;
-struct event   ev_nextexpire;
 struct timeval tm_nextconnect;
 struct timeval tm_nextdnscheck;
-struct timeval tm_nextexpire;
 
 time_t now;                     /* Updated every time we leave select(),
 
@@ -432,27 +430,14 @@ void update_nextconnect(int timeout) {
   assert(evtimer_add(&ev_nextconnect, &tm_nextconnect)!=-1);  
 }
 
-void update_nextexpire(int timeout) {
-  assert(timeout<now);
-  event_del(&ev_nextexpire);
-  evutil_timerclear(&tm_nextexpire);
-  tm_nextexpire.tv_usec=0;
-  tm_nextexpire.tv_sec=timeout;
-  Debug((DEBUG_DEBUG, "update_nextexpire timeout: %d", timeout));
-  assert(evtimer_add(&ev_nextexpire, &tm_nextexpire)!=-1);
-}
-
 void init_timers(void)
 {
   event_del(&ev_nextconnect);
   event_del(&ev_nextdnscheck);
-  event_del(&ev_nextexpire);
   evtimer_set(&ev_nextconnect,  (void *)event_try_connections_callback, (void *)&ev_nextconnect);
   evtimer_set(&ev_nextdnscheck, (void *)event_timeout_query_list_callback, (void *)&ev_nextdnscheck);
-  evtimer_set(&ev_nextexpire,   (void *)event_expire_cache_callback, (void *)&ev_nextexpire);
   update_nextdnscheck(0);
   update_nextconnect(0);
-  update_nextexpire(0);
 }
 
 int main(int argc, char *argv[])
@@ -810,14 +795,18 @@ int main(int argc, char *argv[])
   geoip_init();
 #endif
 
+  /*
+   * Each pass services every ready socket and timer first, and only
+   * then writes the sendQs that got data meanwhile.
+   */
   for (;;)
   {
-    event_dispatch();
+    /* Con clientes pendientes no hay que quedarse esperando */
+    event_loop(io_pending() ? EVLOOP_ONCE | EVLOOP_NONBLOCK : EVLOOP_ONCE);
     update_now();
-    
-    assert(dorehash || restartFlag);
 
-    Debug((DEBUG_DEBUG, "Got message(s)"));
+    io_dispatch();
+    flush_dirty_sendqs();
 
     if (dorehash)
     {
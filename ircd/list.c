@@ -54,6 +54,23 @@ static struct liststats {
 
 void outofmemory();
 
+/*
+ * Contador de presentaciones: cada cliente recibe un numero al entrar
+ * en la lista (y los locales otra vez al registrarse), de modo que
+ * quien recorre la lista sabe si un cliente llego despues que el.
+ */
+unsigned int client_seq = 0;
+
+/* Pools de los objetos de taman~o fijo de este fichero */
+static struct SlabPool client_local_pool =
+    SLAB_POOL_INIT("Client local", CLIENT_LOCAL_SIZE);
+static struct SlabPool client_remote_pool =
+    SLAB_POOL_INIT("Client remote", CLIENT_REMOTE_SIZE);
+static struct SlabPool user_pool = SLAB_POOL_INIT("User", sizeof(anUser));
+static struct SlabPool link_pool = SLAB_POOL_INIT("Link", sizeof(Link));
+static struct SlabPool dlink_pool = SLAB_POOL_INIT("Dlink", sizeof(Dlink));
+static struct SlabPool watch_pool = SLAB_POOL_INIT("Watch", sizeof(aWatch));
+
 #if defined(DEBUGMODE)
 void initlists(void)
 {
@@ -90,13 +107,14 @@ aClient *make_client(aClient *from, int status)
   Reg2 size_t size = CLIENT_REMOTE_SIZE;
 
   /*
-   * Check freelists first to see if we can grab a client without
-   * having to call malloc.
+   * Local and remote clients have their own pools since they
+   * differ in size.
    */
   if (!from)
     size = CLIENT_LOCAL_SIZE;
 
-  if (!(cptr = (aClient *)RunMalloc(size)))
+  if (!(cptr = (aClient *)SlabAlloc(from ? &client_remote_pool :
+      &client_local_pool)))
     outofmemory();
   memset(cptr, 0, size);        /* All variables are 0 by default */
 
@@ -162,16 +180,9 @@ void free_client(aClient *cptr)
       assert(cptr->tm_timer);
       RunFree(cptr->tm_timer);
     }
-
-    if(cptr->evcheckping)
-    {
-      RunFree(cptr->evcheckping);
-      assert(cptr->tm_checkping);
-      RunFree(cptr->tm_checkping);
-    }
   }
 
-  RunFree(cptr);
+  SlabFree(MyConnect(cptr) ? &client_local_pool : &client_remote_pool, cptr);
 }
 
 /*
@@ -185,7 +196,7 @@ anUser *make_user(aClient *cptr)
   user = cptr->user;
   if (!user)
   {
-    if (!(user = (anUser *)RunMalloc(sizeof(anUser))))
+    if (!(user = (anUser *)SlabAlloc(&user_pool)))
       outofmemory();
     memset(user, 0, sizeof(anUser));  /* All variables are 0 by default */
 #if defined(DEBUGMODE)
@@ -240,7 +251,7 @@ void free_user(anUser *user)
     if (user->host)
       SlabStringFree(user->host);
 
-    RunFree(user);
+    SlabFree(&user_pool, user);
 #if defined(DEBUGMODE)
     users.inuse--;
 #endif
@@ -254,6 +265,7 @@ void free_user(anUser *user)
 void remove_client_from_list(aClient *cptr)
 {
   checklist();
+  burst_client_gone(cptr);
   if (cptr->prev)
     cptr->prev->next = cptr->next;
   else
@@ -313,6 +325,7 @@ void add_client_to_list(aClient *cptr)
   client = cptr;
   if (cptr->next)
     cptr->next->prev = cptr;
+  cptr->seq = ++client_seq;
   return;
 }
 
@@ -335,7 +348,8 @@ Link *make_link(void)
 {
   Reg1 Link *lp;
 
-  lp = (Link *)RunMalloc(sizeof(Link));
+  if (!(lp = (Link *)SlabAlloc(&link_pool)))
+    outofmemory();
 #if defined(DEBUGMODE)
   links.inuse++;
 #endif
@@ -344,7 +358,7 @@ Link *make_link(void)
 
 void free_link(Link *lp)
 {
-  RunFree(lp);
+  SlabFree(&link_pool, lp);
 #if defined(DEBUGMODE)
   links.inuse--;
 #endif
@@ -353,7 +367,8 @@ void free_link(Link *lp)
 Dlink *add_dlink(Dlink **lpp, aClient *cp)
 {
   Dlink *lp;
-  lp = (Dlink *)RunMalloc(sizeof(Dlink));
+  if (!(lp = (Dlink *)SlabAlloc(&dlink_pool)))
+    outofmemory();
   lp->value.cptr = cp;
   lp->prev = NULL;
   if ((lp->next = *lpp))
@@ -371,7 +386,7 @@ void remove_dlink(Dlink **lpp, Dlink *lp)
   }
   else if ((*lpp = lp->next))
     lp->next->prev = NULL;
-  RunFree(lp);
+  SlabFree(&dlink_pool, lp);
 }
 
 aConfClass *make_class(void)
@@ -441,10 +456,28 @@ void free_conf(aConfItem *aconf)
   return;
 }
 
+/*
+ * Las G-lines de usuario estan indexadas por su mascara de host en
+ * gline_index (ver s_mask.c), y cada una lleva un temporizador que la
+ * borra al caducar.
+ */
+struct MaskIndex gline_index = MASK_INDEX_INIT("G-line");
+
+static void gline_expire(void *data)
+{
+  aGline *agline = (aGline *)data;
+
+  if (agline->expire > TStime())
+    timer_add(&agline->gl_timer, agline->expire - TStime()); /* Prorrogada */
+  else
+    free_gline(agline);
+}
+
 aGline *make_gline(char *host, char *reason,
     char *name, time_t expire, time_t lastmod, time_t lifetime)
 {
   Reg4 aGline *agline;
+  aGline **head;
   const char *error_str;
   int erroffset;
   int gtype = 0;
@@ -452,6 +485,7 @@ aGline *make_gline(char *host, char *reason,
     gtype = 1;                  /* BAD CHANNEL GLINE */
 
   agline = (struct Gline *)RunMalloc(sizeof(aGline)); /* alloc memory */
+  memset(agline, 0, sizeof(aGline));
   DupString(agline->host, host);  /* copy vital information */
   DupString(agline->reason, reason);
   DupString(agline->name, name);
@@ -473,83 +507,86 @@ aGline *make_gline(char *host, char *reason,
       SetGlineIsIpMask(agline);
   }
 
+  timer_set(&agline->gl_timer, gline_expire, agline);
+  timer_add(&agline->gl_timer, expire - TStime());
+
   if (gtype)
+    head = &badchan;
+  else
   {
-    agline->next = badchan;     /* link it into the list */
-    return (badchan = agline);
+    mask_index_add(&gline_index, &agline->gl_index,
+        GlineIsRealName(agline) ? NULL : agline->host,
+        GlineIsIpMask(agline) ? &agline->gl_addr : NULL, agline->gl_bits,
+        agline);
+    head = &gline;
   }
 
-  agline->next = gline;         /* link it into the list */
-  return (gline = agline);
+  if ((agline->next = *head))   /* link it into the list */
+    agline->next->prevp = &agline->next;
+  agline->prevp = head;
+  return (*head = agline);
 }
 
-aGline *find_gline(aClient *cptr, aGline **pgline)
-{
-  Reg3 aGline *agline = gline, *a2gline = NULL;
-  char cptr_info_low[REALLEN+1];
-  char *tmp;
+struct GlineMatch {
+  aClient *cptr;
+  char *info_low;               /* Realname en minusculas */
+};
 
-  /* Paso el realname a minusculas para matcheo en pcre */
-  strncpy(cptr_info_low, PunteroACadena(cptr->info), REALLEN);
-  cptr_info_low[REALLEN]='\0';
+static int gline_check(void *data, void *arg)
+{
+  aGline *agline = (aGline *)data;
+  struct GlineMatch *gm = (struct GlineMatch *)arg;
+  aClient *cptr = gm->cptr;
 
-  tmp=cptr_info_low;
+  if (!GlineIsActive(agline) || agline->expire <= TStime())
+    return 0;
 
-  while (*tmp) {
-    *tmp=toLower(*tmp);
-    *tmp++;
+  /* El indice ya ha comprobado la IP o el host, salvo en las wild */
+  if (GlineIsRealName(agline))
+  {
+    if (match_pcre(agline->re, GlineIsRealNameCI(agline) ? gm->info_low :
+        PunteroACadena(cptr->info)))
+      return 0;
   }
+  else if (MaskEntryIsWild(&agline->gl_index) &&
+      match(agline->host, PunteroACadena(cptr->sockhost)))
+    return 0;
 
-  while (agline)
-  {                             /* look through all glines */
-    if (agline->expire <= TStime())
-    {                           /* handle expired glines */
-      free_gline(agline, a2gline);
-      agline = a2gline ? a2gline->next : gline;
-      if (!agline)
-        break;                  /* agline == NULL means gline == NULL */
-      continue;
-    }
+  return !match(agline->name, PunteroACadena(cptr->user->username));
+}
 
-    if(GlineIsRealNameCI(agline))
-      tmp=cptr_info_low;
-    else if(GlineIsRealName(agline))
-      tmp=PunteroACadena(cptr->info);
+/*
+ * find_gline
+ *
+ * Devuelve una G-line activa que afecte al cliente, o NULL.
+ */
+aGline *find_gline(aClient *cptr)
+{
+  struct GlineMatch gm;
+  char cptr_info_low[REALLEN+1];
+  char *tmp;
 
-    /* Does gline match? */
-    /* Added a check against the user's IP address as well -Kev */
+  /* Paso el realname a minusculas para matcheo en pcre */
+  strncpy(cptr_info_low, PunteroACadena(cptr->info), REALLEN);
+  cptr_info_low[REALLEN]='\0';
 
-    if ((GlineIsIpMask(agline) ? ipmask_check(&cptr->ip, &agline->gl_addr, agline->gl_bits) == 0 :
-    	(GlineIsRealName(agline) ? match_pcre(agline->re, tmp) :
-    	  match(agline->host, PunteroACadena(cptr->sockhost)))) == 0 &&
-    	  match(agline->name, PunteroACadena(cptr->user->username)) == 0)
-    {
-      if (pgline)
-        *pgline = a2gline;      /* If they need it, give them the previous gline
-                                   entry (probably for free_gline, below) */
-      return agline;
-    }
+  for (tmp = cptr_info_low; *tmp; tmp++)
+    *tmp = toLower(*tmp);
 
-    a2gline = agline;
-    agline = agline->next;
-  }
+  gm.cptr = cptr;
+  gm.info_low = cptr_info_low;
 
-  return NULL;                  /* found no glines */
+  return (aGline *)mask_index_find(&gline_index,
+      PunteroACadena(cptr->sockhost), &cptr->ip, gline_check, &gm);
 }
 
-void free_gline(aGline *agline, aGline *pgline)
+void free_gline(aGline *agline)
 {
-  if (pgline)
-    pgline->next = agline->next;  /* squeeze agline out */
-  else
-  {
-    if (*agline->host == '#' || *agline->host == '&' || *agline->host == '+')
-    {
-      badchan = agline->next;
-    }
-    else
-      gline = agline->next;
-  }
+  if ((*agline->prevp = agline->next))  /* squeeze agline out */
+    agline->next->prevp = agline->prevp;
+  if (agline->gl_index.prevp)
+    mask_index_del(&gline_index, &agline->gl_index);
+  timer_del(&agline->gl_timer);
 
   RunFree(agline->host);        /* and free up the memory */
   RunFree(agline->reason);
@@ -594,7 +631,7 @@ aWatch *make_watch(char *nick)
   if (BadPtr(nick))
     return NULL;
 
-  wptr = (aWatch *) RunMalloc(sizeof(aWatch));
+  wptr = (aWatch *) SlabAlloc(&watch_pool);
   if (!wptr)
     outofmemory();
   memset(wptr, 0, sizeof(aWatch));
@@ -616,7 +653,7 @@ void free_watch(aWatch * wptr)
 
   hRemWatch(wptr);
   RunFree(wptr->nick);
-  RunFree(wptr);
+  SlabFree(&watch_pool, wptr);
 
 #if defined(DEBUGMODE)
   watchs.inuse--;
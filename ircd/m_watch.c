@@ -30,6 +30,7 @@
 #include "s_err.h"
 #include "s_user.h"
 #include "send.h"
+#include "sprintf_irc.h"
 #include "struct.h"
 #include "support.h"
 #include "m_watch.h"
@@ -81,6 +82,15 @@ de los clientes por flood. Reduzca MAXWATCH o incremente CLIENT_FLOOD en 'make c
  * 2002/05/20 zoltan <zoltan@irc-dev.net>
  */
 
+/*
+ * Clases de visibilidad de un nick vigilado: quien lo vigila ve su host
+ * real o su host virtual. El aviso se formatea una vez por clase, con
+ * el nick del destinatario vacio, y luego solo hay que insertarlo:
+ * ":servidor NNN " <destinatario> " nick user host ts :texto".
+ */
+#define WATCH_REAL      0
+#define WATCH_VIRTUAL   1
+
 /*
  * chequea_estado_watch()
  *
@@ -91,6 +101,9 @@ void chequea_estado_watch(aClient *sptr, int raw)
   Reg1 aWatch *wptr;
   Reg2 Link *lp;
   char *username;
+  char aviso[2][BUFSIZE];
+  size_t len[2], cab, nlen;
+  int clase;
 
 /*
 ** Ocurre cuando el usuario no completa
@@ -107,20 +120,38 @@ void chequea_estado_watch(aClient *sptr, int raw)
   wptr->lasttime = TStime();
 
   username = PunteroACadena(sptr->user->username);
+  cab = strlen(me.name) + 6;    /* ":" servidor " NNN " */
+  len[WATCH_REAL] = len[WATCH_VIRTUAL] = 0;
 
   /*
    * Mandamos el aviso a todos los usuarios
    * que lo tengan en el notify.
    */
   for (lp = wptr->watch; lp; lp = lp->next)
-    sendto_one(lp->value.cptr, watch_str(raw), me.name, lp->value.cptr->name,
-        sptr->name, username,
+  {
+    clase = WATCH_REAL;
 #if defined(BDD_VIP)
-        get_visiblehost(sptr, lp->value.cptr, 1),
+    if (IsHidden(sptr) && lp->value.cptr != sptr &&
+        !can_viewhost(lp->value.cptr, sptr, 1))
+      clase = WATCH_VIRTUAL;
+#endif
+    if (!len[clase])
+      len[clase] = sprintf_irc(aviso[clase], watch_str(raw), me.name, "",
+          sptr->name, username,
+#if defined(BDD_VIP)
+          (clase == WATCH_REAL) ? PunteroACadena(sptr->user->host) :
+          get_visiblehost(sptr, NULL, 0),
 #else
-        sptr->user->host,
+          PunteroACadena(sptr->user->host),
 #endif
-        wptr->lasttime);
+          wptr->lasttime) - aviso[clase];
+
+    nlen = strlen(lp->value.cptr->name);
+    memcpy(sendbuf, aviso[clase], cab);
+    memcpy(sendbuf + cab, lp->value.cptr->name, nlen);
+    memcpy(sendbuf + cab + nlen, aviso[clase] + cab, len[clase] - cab + 1);
+    sendbufto_one(lp->value.cptr);
+  }
 }
 
 
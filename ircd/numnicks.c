@@ -241,7 +241,7 @@ void SetServerYXX(struct Client *cptr, struct Client *server, const char *yxx)
   else
   {
     char buffer[1024];
-    struct db_reg *reg;
+    const struct db_reg *reg;
 
     strcpy(buffer, "p09:");
     strcat(buffer, server->name);
@@ -456,6 +456,45 @@ int markMatchexServer(const char *cmask, int minlen)
   return cnt;
 }
 
+/*
+ * markedServerSlots()
+ * Return the number of numeric nick slots of the servers marked
+ * by markMatchexServer(), i.e. the cost of walking their clients
+ */
+unsigned int markedServerSlots(void)
+{
+  unsigned int slots = 0;
+  int i;
+  struct Client *acptr;
+
+  for (i = 0; i < lastNNServer; i++)
+    if ((acptr = server_list[i]) && (acptr->flags & FLAGS_MAP) &&
+        acptr->serv->client_list)
+      slots += acptr->serv->nn_mask + 1;
+  return slots;
+}
+
+/*
+ * walkMarkedServerClients()
+ * Call fn() for every client of the servers marked by markMatchexServer()
+ */
+void walkMarkedServerClients(void (*fn)(struct Client *))
+{
+  unsigned int slot;
+  int i;
+  struct Client *acptr;
+
+  for (i = 0; i < lastNNServer; i++)
+  {
+    if (!(acptr = server_list[i]) || !(acptr->flags & FLAGS_MAP) ||
+        !acptr->serv->client_list)
+      continue;
+    for (slot = 0; slot <= acptr->serv->nn_mask; slot++)
+      if (acptr->serv->client_list[slot])
+        fn(acptr->serv->client_list[slot]);
+  }
+}
+
 struct Client *find_match_server(char *mask)
 {
   struct Client *acptr;
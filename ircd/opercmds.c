@@ -77,8 +77,8 @@
 
 static int propaga_gline(aClient *cptr, aClient *sptr, int active, time_t expire, time_t lastmod, time_t lifetime, int parc, char **parv);
 static int modifica_gline(aClient *cptr, aClient *sptr, aGline *agline, int gtype, time_t expire, time_t lastmod, time_t lifetime, char *who);
-static int ms_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2gline, int parc, char *parv[]);
-static int mo_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2gline, int parc, char *parv[]);
+static int ms_gline(aClient *cptr, aClient *sptr, int parc, char *parv[]);
+static int mo_gline(aClient *cptr, aClient *sptr, int parc, char *parv[]);
 
 /*
  *  m_squit
@@ -326,7 +326,7 @@ int m_stats(aClient *cptr, aClient *sptr, int parc, char *parv[])
   static char Lformat[] = ":%s %d %s %s %u %u %u %u%% %u %u %u%% :" TIME_T_FMT;
   aMessage *mptr;
   aClient *acptr;
-  aGline *agline, *a2gline;
+  aGline *agline;
   aConfItem *aconf;
   unsigned char stat = parc > 1 ? parv[1][0] : '\0';
   Reg1 int i;
@@ -516,17 +516,10 @@ int m_stats(aClient *cptr, aClient *sptr, int parc, char *parv[])
       }
 
       /* send glines */
-      for (agline = gline, a2gline = NULL; agline; agline = agline->next)
+      for (agline = gline; agline; agline = agline->next)
       {
         if (agline->expire <= TStime())
-        {                       /* handle expired glines */
-          free_gline(agline, a2gline);
-          agline = a2gline ? a2gline : gline; /* make sure to splice
-                                                 list together */
-          if (!agline)
-            break;              /* last gline; break out of loop */
-          continue;             /* continue! */
-        }
+          continue;             /* su temporizador la borrara */
 
         /*
          * Comprobacion longitud de gline
@@ -547,7 +540,6 @@ int m_stats(aClient *cptr, aClient *sptr, int parc, char *parv[])
         sendto_one(sptr, rpl_str(RPL_STATSGLINE), me.name,
             sptr->name, 'G', agline->name, agline->host,
             agline->expire, comtemp, date(agline->expire));
-        a2gline = agline;
       }
       break;
     }
@@ -740,7 +732,8 @@ int m_stats(aClient *cptr, aClient *sptr, int parc, char *parv[])
       for (mptr = msgtab; mptr->cmd; mptr++)
         if (mptr->count)
           sendto_one(sptr, rpl_str(RPL_STATSCOMMANDS),
-              me.name, parv[0], mptr->cmd, mptr->count, mptr->bytes);
+              me.name, parv[0], mptr->cmd, mptr->count, mptr->bytes,
+              (unsigned int)(mptr->nsec / 1000000));
       break;
 #if defined(ESNET_NEG)
     case 'n':
@@ -2308,44 +2301,15 @@ static void add_gline(aClient *cptr, aClient *sptr, char *host, char *comment,
  */
 int m_gline(aClient *cptr, aClient *sptr, int parc, char *parv[])
 {
-  aGline *agline, *a2gline;
-
-  /* Remove expired G-lines */
-  for (agline = gline, a2gline = NULL; agline; agline = agline->next)
-  {
-    if (agline->expire <= TStime())
-    {
-      free_gline(agline, a2gline);
-      agline = a2gline ? a2gline : gline;
-      if (!agline)
-        break;
-      continue;
-    }
-    a2gline = agline;
-  }
-
-  /* Remove expired bad channels */
-  for (agline = badchan, a2gline = NULL; agline; agline = agline->next)
-  {
-    if (agline->expire <= TStime())
-    {
-      free_gline(agline, a2gline);
-      agline = a2gline ? a2gline : badchan;
-      if (!agline)
-        break;
-      continue;
-    }
-    a2gline = agline;
-  }
-
+  /* Las G-lines caducadas las borra su temporizador (ver make_gline) */
 
   if (IsServer(cptr)) /* Si la gline la manda un servidor */
-    ms_gline(cptr, sptr, agline, a2gline, parc, parv);
+    ms_gline(cptr, sptr, parc, parv);
   else if (IsUser(sptr) && IsAnOper(sptr)) {
     if (buscar_uline(cptr->confs, sptr->name))
-      ms_gline(cptr, sptr, agline, a2gline, parc, parv);
+      ms_gline(cptr, sptr, parc, parv);
     else
-      mo_gline(cptr, sptr, agline, a2gline, parc, parv);
+      mo_gline(cptr, sptr, parc, parv);
   }
 
   return 0;
@@ -2363,8 +2327,9 @@ int m_gline(aClient *cptr, aClient *sptr, int parc, char *parv[])
  * parv[parc - 1] = Comment
  *
  */
-static int ms_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2gline, int parc, char *parv[])
+static int ms_gline(aClient *cptr, aClient *sptr, int parc, char *parv[])
 {
+  aGline *agline;
   char *user, *host;
   int active, gtype = 0;
   time_t expire = 0, lastmod = 0, lifetime = 0;
@@ -2432,15 +2397,13 @@ static int ms_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2glin
   if (*host == '#' || *host == '&' || *host == '+')
     gtype = 1;              /* BAD CHANNEL GLINE */
 
-  for (agline = (gtype) ? badchan : gline, a2gline = NULL; agline;
-      agline = agline->next)
+  for (agline = (gtype) ? badchan : gline; agline; agline = agline->next)
   {
     if (!strCasediff(agline->name, user)
         && ((GlineIsRealName(agline) && !strcmp(agline->host, host)) ||
             (!GlineIsRealName(agline) && !strCasediff(agline->host, host)))
        ) /* No chequeo casediff por si es pcre */
       break;
-    a2gline = agline;
   }
 
   if (!active && agline)
@@ -2458,7 +2421,7 @@ static int ms_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2glin
         agline->host);
 #endif /* GPATH */
 
-    free_gline(agline, a2gline);  /* remove the gline */
+    free_gline(agline);  /* remove the gline */
   }
   else if (active)
   {                         /* must be adding a gline */
@@ -2494,8 +2457,9 @@ static int ms_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2glin
  * parv[3] = Comment
  *
  */
-static int mo_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2gline, int parc, char *parv[])
+static int mo_gline(aClient *cptr, aClient *sptr, int parc, char *parv[])
 {
+  aGline *agline;
   char *user, *host;
   int active, gtype = 0;
   time_t expire = 0, lastmod = 0, lifetime = 0;
@@ -2584,13 +2548,11 @@ static int mo_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2glin
         gtype = 1;                /* BAD CHANNEL */
     }
 
-    for (agline = gtype ? badchan : gline, a2gline = NULL; agline;
-        agline = agline->next)
+    for (agline = gtype ? badchan : gline; agline; agline = agline->next)
     {
       if (!mmatch(agline->name, user) &&
           !mmatch(agline->host, host))
         break;
-      a2gline = agline;
     }
 
     if (!agline)
@@ -2667,7 +2629,7 @@ static int mo_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2glin
             cptr->user->host, gtype ? "BADCHAN" : "GLINE", agline->name,
             agline->host);
 #endif /* GPATH */
-        free_gline(agline, a2gline);  /* remove the gline */
+        free_gline(agline);  /* remove the gline */
         return 0;
       }
       else
@@ -2677,7 +2639,10 @@ static int mo_gline(aClient *cptr, aClient *sptr, aGline *agline, aGline *a2glin
       active = -1;              /* for later sendto_ops and logging functions */
 
     if (expire)
+    {
       agline->expire = expire;  /* reset expiration time */
+      timer_add(&agline->gl_timer, expire - TStime());
+    }
 
     /* inform the operators what's up */
     if (active != -1)
@@ -2851,6 +2816,7 @@ static int modifica_gline(aClient *cptr, aClient *sptr, aGline *agline, int gtyp
     lastmod = TStime();
 
   agline->expire = expire;  /* reset the expire time */
+  timer_add(&agline->gl_timer, expire - TStime());
   agline->lastmod = lastmod;
   agline->lifetime = lifetime;
 
@@ -2859,20 +2825,18 @@ static int modifica_gline(aClient *cptr, aClient *sptr, aGline *agline, int gtyp
 
 void spam_gline(aClient *sptr, time_t gexpire, char *reason)
 {
-  aGline *agline, *a2gline;
+  aGline *agline;
   time_t expire, lastmod = 0, lifetime= 0;
   char *host = (char *)ircd_ntoa_cidr(&sptr->ip, 0);
   char *user = "*";
 
-  for (agline = gline, a2gline = NULL; agline;
-      agline = agline->next)
+  for (agline = gline; agline; agline = agline->next)
   {
     if (!strCasediff(agline->name, user)
         && ((GlineIsRealName(agline) && !strcmp(agline->host, host)) ||
             (!GlineIsRealName(agline) && !strCasediff(agline->host, host)))
        ) /* No chequeo casediff por si es pcre */
       break;
-    a2gline = agline;
   }
 
   expire = gexpire + TStime();  /* expire time? */
@@ -217,8 +217,11 @@ int dopacket(aClient *cptr, char *buffer, int length)
 
 /*
  * client_dopacket - handle client messages
+ *
+ * buffer holds one complete line of length bytes, already
+ * terminated with '\0'; it may be cptr->buffer or the read buffer.
  */
-int client_dopacket(aClient *cptr, size_t length)
+int client_dopacket(aClient *cptr, char *buffer, size_t length)
 {
   assert(0 != cptr);
 
@@ -240,7 +243,7 @@ int client_dopacket(aClient *cptr, size_t length)
   ++me.receiveM;                /* Update messages received */
   ++cptr->receiveM;
 
-  if (CPTR_KILLED == parse_client(cptr, cptr->buffer, cptr->buffer + length))
+  if (CPTR_KILLED == parse_client(cptr, buffer, buffer + length))
     return CPTR_KILLED;
   else if (IsDead(cptr))
     return exit_client(cptr, cptr, &me, LastDeadComment(cptr));
@@ -19,6 +19,7 @@
  */
 
 #include "sys.h"
+#include <time.h>
 #include "h.h"
 #include "s_debug.h"
 #include "struct.h"
@@ -148,127 +149,133 @@ extern int sdbflag;
 static char *para[MAXPARA + 2]; /* leave room for prefix and null */
 
 /*
- * Message Tree stuff mostly written by orabidoo, with changes by Dianora.
- * Adapted to Undernet, adding token support, etc by comstud 10/06/97
+ * Tablas de despacho
+ *
+ * Los nombres largos y los tokens se buscan en dos tablas con
+ * dispersion perfecta minima (hash and displace): la dispersion de la
+ * cadena elige un grupo, y la semilla de ese grupo la recoloca en una
+ * casilla que no comparte con ninguna otra entrada de msgtab. Buscar
+ * es recorrer la cadena una vez, dos multiplicaciones y una sola
+ * comparacion, sin ramas por cada caracter como hacia el arbol.
+ *
+ * msgtab no cambia en ejecucion, asi que las semillas se calculan al
+ * arrancar en initmsgtree(): salen siempre las mismas y no hace falta
+ * generar codigo al compilar. Como el arbol, no distingue mayusculas.
  */
+struct MsgHash {
+  unsigned int n;               /* Entradas (y casillas) */
+  unsigned int gmask;           /* Grupos - 1, potencia de 2 */
+  unsigned int *seed;           /* Semilla de cada grupo */
+  aMessage **table;
+};
 
-static aMessageTree msg_tree_cmd;
-static aMessageTree msg_tree_tok;
+static struct MsgHash msg_hash_cmd;
+static struct MsgHash msg_hash_tok;
 
-/*
- * Guts of making the token tree...
- */
-static aMessage **do_msg_tree_tok(aMessageTree *mtree, char *prefix,
-    aMessage **mptr)
+static unsigned int msg_hash(const char *s)
 {
-  char newprefix[64];           /* Must be longer than every command name */
-  int c, c2, lp;
-  aMessageTree *mtree1;
+  unsigned int h = 2166136261U;
 
-  lp = strlen(prefix);
-  if (!lp || !strncmp((*mptr)->tok, prefix, lp))
+  while (*s)
   {
-    if (!mptr[1] || (lp && strncmp(mptr[1]->tok, prefix, lp)))
-    {
-      /* last command in the message struct or last command in this prefix */
-      mtree->final = (*mptr)->tok + lp;
-      mtree->msg = *mptr;
-      for (c = 0; c < 26; ++c)
-        mtree->pointers[c] = NULL;
-      return mptr + 1;
-    }
-    /* command in this prefix */
-    if (!strCasediff((*mptr)->tok, prefix))
-    {
-      mtree->final = "";
-      mtree->msg = *mptr++;
-    }
-    else
-      mtree->final = NULL;
-
-    for (c = 'A'; c <= 'Z'; ++c)
-    {
-      if ((*mptr)->tok[lp] == c)
-      {
-        mtree1 = (aMessageTree *)RunMalloc(sizeof(aMessageTree));
-        mtree1->final = NULL;
-        mtree->pointers[c - 'A'] = mtree1;
-        strcpy(newprefix, prefix);
-        newprefix[lp] = c;
-        newprefix[lp + 1] = '\0';
-        mptr = do_msg_tree_tok(mtree1, newprefix, mptr);
-        if (!*mptr || strncmp((*mptr)->tok, prefix, lp))
-        {
-          for (c2 = c + 1 - 'A'; c2 < 26; ++c2)
-            mtree->pointers[c2] = NULL;
-          return mptr;
-        }
-      }
-      else
-        mtree->pointers[c - 'A'] = NULL;
-    }
-    return mptr;
+    h ^= 0xdf & (unsigned char)*s++;
+    h *= 16777619;
   }
-  MyCoreDump;                   /* This should never happen */
-  exit(1);
+  return h;
+}
+
+static unsigned int msg_hash_slot(const struct MsgHash *mh, unsigned int h)
+{
+  unsigned int x = (h ^ mh->seed[h & mh->gmask]) * 0x9e3779b1U;
+
+  x ^= x >> 16;
+  return (unsigned int)(((uint64_t)x * mh->n) >> 32);
+}
+
+static aMessage *msg_hash_find(const struct MsgHash *mh, char *cmd, int tok)
+{
+  aMessage *mptr = mh->table[msg_hash_slot(mh, msg_hash(cmd))];
+
+  return strCasediff(tok ? mptr->tok : mptr->cmd, cmd) ? NULL : mptr;
 }
 
 /*
- * Guts of making the command tree...
+ * msg_hash_build
+ *
+ * Coloca las `n' entradas de `keys' grupo a grupo, de mayor a menor,
+ * probando semillas hasta que todas las del grupo caen en casillas libres.
  */
-static aMessage *do_msg_tree_cmd(aMessageTree *mtree, char *prefix,
-    aMessage *mptr)
+static void msg_hash_build(struct MsgHash *mh, aMessage **keys,
+    unsigned int n, int tok)
 {
-  char newprefix[64];           /* Must be longer than every command name */
-  int c, c2, lp;
-  aMessageTree *mtree1;
-
-  lp = strlen(prefix);
-  if (!lp || !strncmp(mptr->cmd, prefix, lp))
+  unsigned int *hash, *order, *count, *slot;
+  unsigned int groups, g, i, j, k, m;
+  char *used;
+
+  for (groups = 1; 2 * groups < n; groups *= 2);
+  mh->n = n;
+  mh->gmask = groups - 1;
+  mh->seed = (unsigned int *)RunCalloc(groups, sizeof(unsigned int));
+  mh->table = (aMessage **)RunCalloc(n, sizeof(aMessage *));
+
+  hash = (unsigned int *)RunMalloc(n * sizeof(unsigned int));
+  slot = (unsigned int *)RunMalloc(n * sizeof(unsigned int));
+  order = (unsigned int *)RunMalloc(groups * sizeof(unsigned int));
+  count = (unsigned int *)RunCalloc(groups, sizeof(unsigned int));
+  used = (char *)RunCalloc(n, 1);
+
+  for (i = 0; i < n; i++)
   {
-    if (!mptr[1].cmd || (lp && strncmp(mptr[1].cmd, prefix, lp)))
-    {
-      /* last command in the message struct or last command in this prefix */
-      mtree->final = mptr->cmd + lp;
-      mtree->msg = mptr;
-      for (c = 0; c < 26; ++c)
-        mtree->pointers[c] = NULL;
-      return mptr + 1;
-    }
-    /* command in this prefix */
-    if (!strCasediff(mptr->cmd, prefix))
+    hash[i] = msg_hash(tok ? keys[i]->tok : keys[i]->cmd);
+    count[hash[i] & mh->gmask]++;
+  }
+  for (g = 0; g < groups; g++)
+    order[g] = g;
+  for (g = 1; g < groups; g++)  /* Pocos grupos: insercion */
+    for (j = g; j > 0 && count[order[j]] > count[order[j - 1]]; j--)
     {
-      mtree->final = "";
-      mtree->msg = mptr++;
+      k = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = k;
     }
-    else
-      mtree->final = NULL;
 
-    for (c = 'A'; c <= 'Z'; ++c)
+  for (g = 0; g < groups && count[order[g]]; g++)
+  {
+    for (mh->seed[order[g]] = 1;; mh->seed[order[g]]++)
     {
-      if (mptr->cmd[lp] == c)
+      for (m = 0, i = 0; i < n; i++)
       {
-        mtree1 = (aMessageTree *)RunMalloc(sizeof(aMessageTree));
-        mtree1->final = NULL;
-        mtree->pointers[c - 'A'] = mtree1;
-        strcpy(newprefix, prefix);
-        newprefix[lp] = c;
-        newprefix[lp + 1] = '\0';
-        mptr = do_msg_tree_cmd(mtree1, newprefix, mptr);
-        if (!mptr->cmd || strncmp(mptr->cmd, prefix, lp))
-        {
-          for (c2 = c + 1 - 'A'; c2 < 26; ++c2)
-            mtree->pointers[c2] = NULL;
-          return mptr;
-        }
+        if ((hash[i] & mh->gmask) != order[g])
+          continue;
+        k = msg_hash_slot(mh, hash[i]);
+        for (j = 0; j < m && slot[j] != k; j++);
+        if (used[k] || j < m)
+          break;
+        slot[m++] = k;
       }
-      else
-        mtree->pointers[c - 'A'] = NULL;
+      if (i == n)
+        break;
+      if (mh->seed[order[g]] > 10000000)
+      {
+        /* Dos cadenas con la misma dispersion de 32 bits */
+        MyCoreDump;
+        exit(1);
+      }
+    }
+    for (m = 0, i = 0; i < n; i++)
+    {
+      if ((hash[i] & mh->gmask) != order[g])
+        continue;
+      used[slot[m]] = 1;
+      mh->table[slot[m++]] = keys[i];
     }
-    return mptr;
   }
-  MyCoreDump;                   /* This should never happen */
-  exit(1);
+
+  RunFree(hash);
+  RunFree(slot);
+  RunFree(order);
+  RunFree(count);
+  RunFree(used);
 }
 
 static int mcmdcmp(const struct Message *m1, const struct Message *m2)
@@ -276,80 +283,49 @@ static int mcmdcmp(const struct Message *m1, const struct Message *m2)
   return strcmp(m1->cmd, m2->cmd);
 }
 
-static int mtokcmp(const struct Message **m1, const struct Message **m2)
-{
-  return strcmp((*m1)->tok, (*m2)->tok);
-}
-
 /*
- * Sort the command names.
- * Create table of pointers into msgtab for tokens.
- * Create trees for ->cmd and ->tok and free the token pointers.
+ * Sort the command names (for /STATS m and /HELP).
+ * Build the dispatch tables for ->cmd and ->tok.
  */
 void initmsgtree(void)
 {
   Reg1 int i;
   Reg2 aMessage *msg = msgtab;
   Reg3 int ii;
-  aMessage **msgtab_tok;
-  aMessage **msgtok;
+  aMessage **keys;
 
   for (i = 0; msg->cmd; ++i, ++msg)
     continue;
   qsort(msgtab, i, sizeof(aMessage),
       (int (*)(const void *, const void *))mcmdcmp);
-  msgtab_tok = (aMessage **)RunMalloc((i + 1) * sizeof(aMessage *));
+  keys = (aMessage **)RunMalloc(i * sizeof(aMessage *));
   for (ii = 0; ii < i; ++ii)
-    msgtab_tok[ii] = msgtab + ii;
-  msgtab_tok[i] = NULL;         /* Needed by `do_msg_tree_tok' */
-  qsort(msgtab_tok, i, sizeof(aMessage *),
-      (int (*)(const void *, const void *))mtokcmp);
-  msg = do_msg_tree_cmd(&msg_tree_cmd, "", msgtab);
-  msgtok = do_msg_tree_tok(&msg_tree_tok, "", msgtab_tok);
-  RunFree(msgtab_tok);
-}
-
-/*
- * Generic tree parser which works for both commands and tokens.
- * Optimized by Run.
- */
-static struct Message *msg_tree_parse(char *cmd, aMessageTree *root)
-{
-  aMessageTree *mtree;
-  unsigned char r = (0xdf & (unsigned char)*cmd) - 'A';
-  if (r > 25 || !(mtree = root->pointers[r]))
-    return NULL;
-  for (;;)
-  {
-    r = 0xdf & (unsigned char)*++cmd;
-    if (mtree->final && *mtree->final == r)
-      return mtree->msg;
-    if ((r -= 'A') > 25 || !(mtree = mtree->pointers[r]))
-      return NULL;
-  }
+    keys[ii] = msgtab + ii;
+  msg_hash_build(&msg_hash_cmd, keys, i, 0);
+  msg_hash_build(&msg_hash_tok, keys, i, 1);
+  RunFree(keys);
 }
 
 /*
- * This one is identical to the one above, but it is slower because it
- * makes sure that `cmd' matches the _full_ command, exactly.
- * This is to avoid confusion with commands like /quake on clients
- * that send unknown commands directly to the server.
+ * parse_call
+ *
+ * Llama al manejador del comando y le suma el tiempo que ha tardado
+ * (para /STATS m). Se mide tiempo de reloj monotono, que en un
+ * servidor de un solo hilo es practicamente su CPU y cuesta mucho
+ * menos de consultar.
  */
-static struct Message *msg_tree_parse_client(char *cmd,
-    aMessageTree *root)
+static int parse_call(aMessage *mptr, aClient *cptr, aClient *from,
+    int parc, char *parv[])
 {
-  aMessageTree *mtree;
-  unsigned char q = (0xdf & (unsigned char)*cmd) - 'A';
-  if (q > 25 || !(mtree = root->pointers[q]))
-    return NULL;
-  for (;;)
-  {
-    q = 0xdf & (unsigned char)*++cmd;
-    if (mtree->final && !strCasediff(mtree->final, cmd))
-      return mtree->msg;
-    if ((q -= 'A') > 25 || !(mtree = mtree->pointers[q]))
-      return NULL;
-  }
+  struct timespec t0, t1;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  ret = (*mptr->func) (cptr, from, parc, parv);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  mptr->nsec += (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+      t1.tv_nsec - t0.tv_nsec;
+  return ret;
 }
 
 /*
@@ -413,7 +389,7 @@ int parse_client(aClient *cptr, char *buffer, char *bufend)
    * This is a client/unregistered entity.
    * Check long command list only.
    */
-  if (!(mptr = msg_tree_parse_client(ch, &msg_tree_cmd)))
+  if (!(mptr = msg_hash_find(&msg_hash_cmd, ch, 0)))
   {
     /*
      * Note: Give error message *only* to recognized
@@ -512,7 +488,7 @@ int parse_client(aClient *cptr, char *buffer, char *bufend)
 #endif
       from->user->last = now;
 
-  return (*mptr->func) (cptr, from, i, para);
+  return parse_call(mptr, cptr, from, i, para);
 }
 
 int parse_server(aClient *cptr, char *buffer, char *bufend)
@@ -731,16 +707,14 @@ int parse_server(aClient *cptr, char *buffer, char *bufend)
      * This is a server. Check the token command list.
      * -record!jegelhof@cloud9.net
      */
-    mptr = msg_tree_parse(ch, &msg_tree_tok);
+    mptr = msg_hash_find(&msg_hash_tok, ch, 1);
 
 #if 1                           /* for 2.10.0/2.10.10 */
     /*
      * This code supports 2.9 and 2.10.0 sending long commands.
-     * It makes more calls to strCasediff() than the above
-     * so it will be somewhat slower.
      */
     if (!mptr)
-      mptr = msg_tree_parse(ch, &msg_tree_cmd);
+      mptr = msg_hash_find(&msg_hash_cmd, ch, 0);
 #endif /* 1 */
 
     if (!mptr)
@@ -818,5 +792,5 @@ int parse_server(aClient *cptr, char *buffer, char *bufend)
     return (do_numeric(numeric, (*buffer != ':'), cptr, from, i, para));
   mptr->count++;
 
-  return (*mptr->func) (cptr, from, i, para);
+  return parse_call(mptr, cptr, from, i, para);
 }
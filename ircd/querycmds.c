@@ -411,7 +411,7 @@ int m_motd(aClient *cptr, aClient *sptr, int parc, char *parv[])
   int count;
   aMotdItem *temp;
   int i = 0;
-  struct db_reg *reg;
+  const struct db_reg *reg;
   char tmp_str[16];
 
 #if defined(NODEFAULTMOTD)
@@ -39,6 +39,8 @@ extern int dn_skipname(const unsigned char *, const unsigned char *);
 #include "s_bsd.h"
 #include "ircd.h"
 #include "s_ping.h"
+#include "s_timer.h"
+#include "s_auth.h"
 #include "support.h"
 #include "common.h"
 #include "sprintf_irc.h"
@@ -54,8 +56,12 @@ extern int dn_skipname(const unsigned char *, const unsigned char *);
 #define ALIASDLEN (MAXPACKET)
 #define MAXGETHOSTLEN (ALIASBLEN + ADDRSBLEN + ADDRSDLEN + ALIASDLEN)
 
-#define ARES_CACSIZE	512
-#define MAXCACHED	2048
+#define MAXCACHED	32768	/* Al pasar de aqui sale la menos usada */
+#define CACHE_HASH_MIN	512	/* Cubetas iniciales de cada indice */
+#define CACHE_MINTTL	60	/* Para que un TTL 0 no cueste una consulta por conexion */
+#define CACHE_MAXTTL	86400
+#define CACHE_NEGTTL	300	/* Respuestas negativas sin SOA */
+#define CACHE_NEGMAXTTL	3600
 
 #if !defined(INT16SZ)
 #define INT16SZ 2
@@ -144,25 +150,43 @@ typedef struct reslist {
   aHostent he;
 } ResRQ;
 
+/*
+ * Cada entrada de la cache tiene una clave por nombre, alias y
+ * direccion; todas apuntan a la entrada y se buscan en dos tablas
+ * hash que crecen con la cache.
+ */
+struct CacheKey {
+  struct CacheKey *next;        /* Siguiente en la cubeta */
+  struct cache *cp;             /* Entrada a la que pertenece */
+  unsigned int hashv;
+  const char *name;             /* Nombre o alias; NULL si es direccion */
+  struct irc_in_addr addr;
+};
+
+struct CacheIndex {
+  struct CacheKey **table;
+  unsigned int size;            /* Cubetas, potencia de 2 */
+  unsigned int count;           /* Claves */
+};
+
 typedef struct cache {
   time_t expireat;
   time_t ttl;
-  aHostent he;
-  struct cache *hname_next, *hnum_next, *list_next;
+  aHostent he;                  /* he.buf es NULL en las negativas */
+  struct irc_in_addr negaddr;   /* IP sin PTR, en las negativas */
+  struct cache *lru_next, *lru_prev;
+  struct WheelTimer expire;
+  struct CacheKey *keys;
+  int nkeys;
 } aCache;
 
-typedef struct cachetable {
-  aCache *num_list;
-  aCache *name_list;
-} CacheTable;
-
 extern int resfd;               /* defined in s_bsd.c */
 
 static char hostbuf[HOSTLEN + 1];
 static char dot[] = ".";
 static int incache = 0;
-static CacheTable hashtable[ARES_CACSIZE];
-static aCache *cachetop = NULL;
+static struct CacheIndex name_index, addr_index;
+static aCache *cachetop = NULL, *cachebottom = NULL;
 static ResRQ *last, *first;
 
 static void rem_cache(aCache *);
@@ -174,14 +198,16 @@ static int proc_answer(ResRQ *, HEADER *, unsigned char *, unsigned char *);
 static int query_name(char *, int, int, ResRQ *);
 static aCache *make_cache(ResRQ *);
 static aCache *find_cache_name(char *);
-static aCache *find_cache_number(ResRQ *, struct in_addr *);
+static aCache *find_cache_number(ResRQ *, struct irc_in_addr *, int *);
+static void make_negative(struct in_addr *, time_t);
+static void cache_addr_key(struct irc_in_addr *, const char *, int);
+static time_t negative_ttl(HEADER *, unsigned char *, unsigned char *);
 static int add_request(ResRQ *);
 static ResRQ *make_request(Link *);
 static int send_res_msg(char *, int, int);
 static ResRQ *find_id(int);
-static int hash_number(unsigned char *);
 static void update_list(ResRQ *, aCache *);
-static int hash_name(const char *);
+static unsigned int hash_name(const char *);
 
 static struct cacheinfo {
   int ca_adds;
@@ -191,6 +217,11 @@ static struct cacheinfo {
   int ca_na_hits;
   int ca_nu_hits;
   int ca_updates;
+  int ca_na_misses;
+  int ca_nu_misses;
+  int ca_neg_adds;
+  int ca_neg_hits;
+  int ca_resizes;
 } cainfo;
 
 static struct resinfo {
@@ -213,7 +244,6 @@ int init_resolver(void)
 
   memset(&reinfo, 0, sizeof(reinfo));
   memset(&cainfo, 0, sizeof(cainfo));
-  memset(hashtable, 0, sizeof(hashtable));
 
   first = last = NULL;
 
@@ -322,6 +352,7 @@ static ResRQ *make_request(Link *lp)
     memset(&nreq->cinfo, 0, sizeof(Link));
   nreq->timeout = 4;            /* start at 4 and exponential inc. */
   nreq->addr.s_addr = INADDR_NONE;
+  nreq->ttl = CACHE_MAXTTL;     /* proc_answer se queda con el menor */
 
   nreq->he.h.h_addrtype = AF_INET;
   nreq->he.h.h_length = sizeof(struct in_addr);
@@ -363,6 +394,7 @@ void event_timeout_query_list_callback(int fd, short event, struct event *ev)
         switch (rptr->cinfo.flags)
         {
           case ASYNC_CLIENT:
+            auth_stage_done(cptr, AUTH_STAGE_DNS);
             ClearDNS(cptr);
             if (!DoingAuth(cptr))
               SetAccess(cptr);
@@ -492,8 +524,10 @@ struct hostent *gethost_byname(char *name, Link *lp)
   aCache *cp;
 
   reinfo.re_na_look++;
+  cainfo.ca_lookups++;
   if ((cp = find_cache_name(name)))
     return &cp->he.h;
+  cainfo.ca_na_misses++;
   if (lp)
     do_query_name(lp, name, NULL);
   return NULL;
@@ -503,13 +537,34 @@ struct hostent *gethost_byaddr(struct irc_in_addr *addr, Link *lp)
 {
   aCache *cp;
   struct in_addr addrreal;
+  struct irc_in_addr key;
+  int negative;
+
+  reinfo.re_nu_look++;
+  cainfo.ca_lookups++;
+  /* El resolver solo sabe preguntar in-addr.arpa */
+  if (!irc_in_addr_is_ipv4(addr))
+  {
+    cainfo.ca_nu_misses++;
+    h_errno = HOST_NOT_FOUND;
+    return NULL;
+  }
 
   /* Pasamos de irc_in_addr a in_addr */
   addrreal.s_addr = (addr->in6_16[6] | addr->in6_16[7] << 16);
+  cache_addr_key(&key, (char *)&addrreal, sizeof(addrreal));
 
-  reinfo.re_nu_look++;
-  if ((cp = find_cache_number(NULL, &addrreal)))
+  if ((cp = find_cache_number(NULL, &key, &negative)))
     return &cp->he.h;
+  if (negative)
+  {
+    /* Sin PTR hace poco: ni se pregunta ni hay que esperar */
+    cainfo.ca_neg_hits++;
+    h_errno = HOST_NOT_FOUND;
+    return NULL;
+  }
+  cainfo.ca_nu_misses++;
+  h_errno = TRY_AGAIN;
   if (!lp)
     return NULL;
   do_query_number(lp, &addrreal, NULL);
@@ -648,6 +703,7 @@ static int proc_answer(ResRQ *rptr, HEADER * hptr, unsigned char *buf,
   char *endp;                   /* end of our buffer */
   struct hostent *hp = &rptr->he.h;
   int addr_class, type, dlen, ans = 0, n;
+  time_t ttl;
   int addr_count = 0;
   int alias_count = 0;
 
@@ -743,10 +799,13 @@ static int proc_answer(ResRQ *rptr, HEADER * hptr, unsigned char *buf,
     cp += INT16SZ;
     addr_class = ((u_int16_t) cp[0] << 8) | ((u_int16_t) cp[1]);
     cp += INT16SZ;
-    rptr->ttl =
+    ttl =
         ((u_int32_t) cp[0] << 24) | ((u_int32_t) cp[1] << 16) | ((u_int32_t)
         cp[2] << 8) | ((u_int32_t) cp[3]);
     cp += INT32SZ;
+    /* La entrada dura lo que el registro mas corto de la respuesta */
+    if (ttl < rptr->ttl)
+      rptr->ttl = ttl;
     dlen = ((u_int16_t) cp[0] << 8) | ((u_int16_t) cp[1]);
     cp += INT16SZ;
 
@@ -925,6 +984,19 @@ struct hostent *get_res(char *lp)
         break;
     }
     reinfo.re_errors++;
+    /*
+     * Una IP sin PTR (NXDOMAIN, o NOERROR sin respuestas) se guarda
+     * como negativa y el cliente deja de esperar ya.
+     */
+    if (rptr->type == T_PTR &&
+        (hptr->rcode == NXDOMAIN || hptr->rcode == NOERROR))
+    {
+      make_negative(&rptr->addr, negative_ttl(hptr, buf, &buf[rc]));
+      if (lp)
+        memcpy(lp, &rptr->cinfo, sizeof(Link));
+      rem_request(rptr);
+      return NULL;
+    }
     /*
      * If a bad error was returned, we stop here and dont send
      * send any more (no retries granted).
@@ -1202,68 +1274,225 @@ static int update_hostent(aHostent *hp, char **addr, char **alias)
   return 0;
 }
 
-static int hash_number(unsigned char *ip)
+/*
+ * hash_name
+ *
+ * FNV-1a sobre el nombre completo en minusculas; antes solo se
+ * miraba la primera etiqueta y todo "*.isp.net" acababa en la
+ * misma cubeta.
+ */
+static unsigned int hash_name(const char *name)
 {
-  unsigned int hashv = 0;
-
-  /* could use loop but slower */
-  hashv += (int)*ip++;
-  hashv += hashv + (int)*ip++;
-  hashv += hashv + (int)*ip++;
-  hashv += hashv + (int)*ip++;
-  hashv %= ARES_CACSIZE;
-  return (hashv);
+  unsigned int hashv = 2166136261U;
+
+  for (; *name; name++)
+  {
+    hashv ^= (unsigned char)toLower(*name);
+    hashv *= 16777619U;
+  }
+  return hashv;
 }
 
-static int hash_name(const char *name)
+static unsigned int hash_addr(const struct irc_in_addr *addr)
 {
-  unsigned int hashv = 0;
+  const unsigned char *p = (const unsigned char *)addr;
+  unsigned int hashv = 2166136261U;
+  size_t i;
 
-  for (; *name && *name != '.'; name++)
-    hashv += *name;
-  hashv %= ARES_CACSIZE;
-  return (hashv);
+  for (i = 0; i < sizeof(*addr); i++)
+  {
+    hashv ^= p[i];
+    hashv *= 16777619U;
+  }
+  return hashv;
 }
 
 /*
- * Add a new cache item to the queue and hash table.
+ * cache_addr_key
+ *
+ * Las direcciones se indexan siempre como irc_in_addr; las IPv4
+ * van mapeadas (::ffff:a.b.c.d), igual que en los clientes.
  */
-static aCache *add_to_cache(aCache *ocp)
+static void cache_addr_key(struct irc_in_addr *key, const char *addr, int len)
 {
-  aCache *cp = NULL;
-  int hashv;
+  memset(key, 0, sizeof(*key));
+  if (len == sizeof(struct in_addr))
+  {
+    key->in6_16[5] = 0xffff;
+    memcpy(&key->in6_16[6], addr, sizeof(struct in_addr));
+  }
+  else
+    memcpy(key, addr, MIN(len, (int)sizeof(*key)));
+}
+
+static void index_resize(struct CacheIndex *idx, unsigned int size)
+{
+  struct CacheKey **table, *key, *next;
+  unsigned int i;
+
+  table = (struct CacheKey **)RunCalloc(size, sizeof(struct CacheKey *));
+  for (i = 0; i < idx->size; i++)
+  {
+    for (key = idx->table[i]; key; key = next)
+    {
+      next = key->next;
+      key->next = table[key->hashv & (size - 1)];
+      table[key->hashv & (size - 1)] = key;
+    }
+  }
+  if (idx->table)
+    RunFree(idx->table);
+  idx->table = table;
+  idx->size = size;
+  cainfo.ca_resizes++;
+}
+
+static void index_add(struct CacheIndex *idx, struct CacheKey *key)
+{
+  struct CacheKey **head;
+
+  /* Factor de carga 1: se dobla al llenarse */
+  if (idx->count >= idx->size)
+    index_resize(idx, idx->size ? 2 * idx->size : CACHE_HASH_MIN);
+  head = &idx->table[key->hashv & (idx->size - 1)];
+  key->next = *head;
+  *head = key;
+  idx->count++;
+}
+
+static void index_del(struct CacheIndex *idx, struct CacheKey *key)
+{
+  struct CacheKey **kp;
+
+  for (kp = &idx->table[key->hashv & (idx->size - 1)]; *kp;
+      kp = &(*kp)->next)
+  {
+    if (*kp == key)
+    {
+      *kp = key->next;
+      idx->count--;
+      return;
+    }
+  }
+}
+
+/*
+ * cache_index
+ *
+ * Da de alta en los indices el nombre, cada alias y cada direccion
+ * de la entrada. Las negativas solo tienen la direccion sin PTR.
+ */
+static void cache_index(aCache *cp)
+{
+  struct hostent *hp = &cp->he.h;
+  struct CacheKey *key;
+  int i, n = 1;
+
+  if (cp->he.buf)
+  {
+    for (i = 0; hp->h_aliases[i]; i++)
+      n++;
+    for (i = 0; hp->h_addr_list[i]; i++)
+      n++;
+  }
+  key = cp->keys = (struct CacheKey *)RunCalloc(n, sizeof(struct CacheKey));
+  cp->nkeys = n;
 
-  Debug((DEBUG_DNS,
-      "add_to_cache:ocp %p he %p name %p addrl %p 0 %p",
-      ocp, &ocp->he, ocp->he.h.h_name, ocp->he.h.h_addr_list,
-      ocp->he.h.h_addr_list[0]));
+  if (!cp->he.buf)
+  {
+    key->cp = cp;
+    key->addr = cp->negaddr;
+    key->hashv = hash_addr(&key->addr);
+    index_add(&addr_index, key);
+    return;
+  }
+
+  key->cp = cp;
+  key->name = hp->h_name;
+  key->hashv = hash_name(key->name);
+  index_add(&name_index, key++);
+  for (i = 0; hp->h_aliases[i]; i++, key++)
+  {
+    key->cp = cp;
+    key->name = hp->h_aliases[i];
+    key->hashv = hash_name(key->name);
+    index_add(&name_index, key);
+  }
+  for (i = 0; hp->h_addr_list[i]; i++, key++)
+  {
+    key->cp = cp;
+    cache_addr_key(&key->addr, hp->h_addr_list[i], hp->h_length);
+    key->hashv = hash_addr(&key->addr);
+    index_add(&addr_index, key);
+  }
+}
 
-  ocp->list_next = cachetop;
-  cachetop = ocp;
+static void cache_unindex(aCache *cp)
+{
+  int i;
 
-  hashv = hash_name(ocp->he.h.h_name);
-  ocp->hname_next = hashtable[hashv].name_list;
-  hashtable[hashv].name_list = ocp;
+  for (i = 0; i < cp->nkeys; i++)
+    index_del(cp->keys[i].name ? &name_index : &addr_index, &cp->keys[i]);
+  if (cp->keys)
+    RunFree(cp->keys);
+  cp->keys = NULL;
+  cp->nkeys = 0;
+}
 
-  hashv = hash_number((unsigned char *)ocp->he.h.h_addr_list[0]);
-  ocp->hnum_next = hashtable[hashv].num_list;
-  hashtable[hashv].num_list = ocp;
+/*
+ * Lista LRU doblemente enlazada: cachetop es la mas reciente,
+ * cachebottom la primera en salir.
+ */
+static void lru_unlink(aCache *cp)
+{
+  if (cp->lru_prev)
+    cp->lru_prev->lru_next = cp->lru_next;
+  else
+    cachetop = cp->lru_next;
+  if (cp->lru_next)
+    cp->lru_next->lru_prev = cp->lru_prev;
+  else
+    cachebottom = cp->lru_prev;
+}
 
-  Debug((DEBUG_DNS, "add_to_cache:added %s[%p] cache %p.",
-      ocp->he.h.h_name, ocp->he.h.h_addr_list[0], ocp));
-  Debug((DEBUG_DNS,
-      "add_to_cache:h1 %d h2 %#x lnext %p namnext %p numnext %p",
-      hash_name(ocp->he.h.h_name), hashv, ocp->list_next,
-      ocp->hname_next, ocp->hnum_next));
+static void lru_link(aCache *cp)
+{
+  cp->lru_prev = NULL;
+  cp->lru_next = cachetop;
+  if (cachetop)
+    cachetop->lru_prev = cp;
+  else
+    cachebottom = cp;
+  cachetop = cp;
+}
+
+static void expire_cache(void *data)
+{
+  cainfo.ca_expires++;
+  rem_cache((aCache *)data);
+}
+
+/*
+ * Add a new cache item to the queue and hash table.
+ */
+static aCache *add_to_cache(aCache *ocp)
+{
+  Debug((DEBUG_DNS, "add_to_cache:ocp %p he %p name %s ttl %d",
+      ocp, &ocp->he, ocp->he.buf ? ocp->he.h.h_name : "(negativa)",
+      (int)ocp->ttl));
+
+  lru_link(ocp);
+  cache_index(ocp);
+
+  ocp->expireat = now + ocp->ttl;
+  timer_set(&ocp->expire, expire_cache, ocp);
+  timer_add(&ocp->expire, ocp->ttl);
 
   /*
    * LRU deletion of excessive cache entries.
    */
   if (++incache > MAXCACHED)
-  {
-    for (cp = cachetop; cp->list_next; cp = cp->list_next);
-    rem_cache(cp);
-  }
+    rem_cache(cachebottom);
   cainfo.ca_adds++;
 
   return ocp;
@@ -1278,7 +1507,6 @@ static aCache *add_to_cache(aCache *ocp)
  */
 static void update_list(ResRQ *rptr, aCache *cp)
 {
-  aCache **cpp;
   char *s;
   char **ap;
   const char *t;
@@ -1287,21 +1515,15 @@ static void update_list(ResRQ *rptr, aCache *cp)
   static char *aliases[RES_MAXALIASES + 1];
 
   /*
-   * Search for the new cache item in the cache list by hostname.
-   * If found, move the entry to the top of the list and return.
+   * Move the entry to the top of the list.
    */
   cainfo.ca_updates++;
 
-  for (cpp = &cachetop; *cpp; cpp = &((*cpp)->list_next))
+  if (cachetop != cp)
   {
-    if (cp == *cpp)
-      break;
+    lru_unlink(cp);
+    lru_link(cp);
   }
-  if (!*cpp)
-    return;
-  *cpp = cp->list_next;
-  cp->list_next = cachetop;
-  cachetop = cp;
   if (!rptr)
     return;
 
@@ -1348,110 +1570,88 @@ static void update_list(ResRQ *rptr, aCache *cp)
     }
   }
   if (*addrs || *aliases)
+  {
+    /* Las claves apuntan al buffer viejo: se rehacen */
+    cache_unindex(cp);
     update_hostent(&cp->he, addrs, aliases);
+    cache_index(cp);
+  }
 }
 
 static aCache *find_cache_name(char *name)
 {
-  aCache *cp;
-  const char *s;
-  int hashv;
-  int i;
+  struct CacheKey *key;
+  unsigned int hashv;
 
-  hashv = hash_name(name);
-
-  cp = hashtable[hashv].name_list;
-  Debug((DEBUG_DNS, "find_cache_name:find %s : hashv = %d", name, hashv));
+  if (!name_index.size)
+    return NULL;
 
-  for (; cp; cp = cp->hname_next)
-  {
-    for (i = 0, s = cp->he.h.h_name; s; s = cp->he.h.h_aliases[i++])
-    {
-      if (strCasediff(s, name) == 0)
-      {
-        cainfo.ca_na_hits++;
-        update_list(0, cp);
-        return cp;
-      }
-    }
-  }
+  hashv = hash_name(name);
+  Debug((DEBUG_DNS, "find_cache_name:find %s : hashv = %u", name, hashv));
 
-  for (cp = cachetop; cp; cp = cp->list_next)
+  for (key = name_index.table[hashv & (name_index.size - 1)]; key;
+      key = key->next)
   {
-    /*
-     * If no aliases or the hash value matches, we've already
-     * done this entry and all possiblilities concerning it.
-     */
-    if (!*cp->he.h.h_aliases)
-      continue;
-    if (hashv == hash_name(cp->he.h.h_name))
-      continue;
-    for (i = 0; (s = cp->he.h.h_aliases[i]); ++i)
+    if (key->hashv == hashv && !strCasediff(key->name, name))
     {
-      if (!strCasediff(name, s))
-      {
-        cainfo.ca_na_hits++;
-        update_list(0, cp);
-        return cp;
-      }
+      cainfo.ca_na_hits++;
+      update_list(0, key->cp);
+      return key->cp;
     }
   }
   return NULL;
 }
 
 /*
- * Find a cache entry by ip# and update its expire time
+ * Find a cache entry by ip# and update its expire time.
+ * Las negativas no se devuelven; si hay una se indica en *negative.
  */
-static aCache *find_cache_number(ResRQ *rptr, struct in_addr *numb)
+static aCache *find_cache_number(ResRQ *rptr, struct irc_in_addr *addr,
+    int *negative)
 {
-  Reg1 aCache *cp;
-  Reg2 int hashv, i;
-
-  hashv = hash_number((unsigned char *)numb);
+  struct CacheKey *key;
+  unsigned int hashv;
+  int neg = 0;
 
-  cp = hashtable[hashv].num_list;
-  Debug((DEBUG_DNS, "find_cache_number:find %s[%08x]: hashv = %d",
-      inetntoa(*numb), ntohl(numb->s_addr), hashv));
+  if (negative)
+    *negative = 0;
+  if (!addr_index.size)
+    return NULL;
 
-  for (; cp; cp = cp->hnum_next)
+  hashv = hash_addr(addr);
+  for (key = addr_index.table[hashv & (addr_index.size - 1)]; key;
+      key = key->next)
   {
-    for (i = 0; cp->he.h.h_addr_list[i]; ++i)
+    if (key->hashv != hashv || memcmp(&key->addr, addr, sizeof(*addr)))
+      continue;
+    if (!key->cp->he.buf)
     {
-      if (!memcmp(cp->he.h.h_addr_list[i], (char *)numb,
-          sizeof(struct in_addr)))
-      {
-        cainfo.ca_nu_hits++;
-        update_list(rptr, cp);
-        return cp;
-      }
+      neg = 1;
+      continue;
     }
+    cainfo.ca_nu_hits++;
+    update_list(rptr, key->cp);
+    return key->cp;
   }
+  if (negative)
+    *negative = neg;
+  return NULL;
+}
 
-  for (cp = cachetop; cp; cp = cp->list_next)
+/*
+ * cache_ttl
+ *
+ * El TTL de la respuesta (el menor de sus registros) acotado para que
+ * un TTL 0 no nos obligue a preguntar en cada conexion.
+ */
+static time_t cache_ttl(time_t ttl, time_t max)
+{
+  if (ttl < CACHE_MINTTL)
   {
-    /*
-     * Single address entry...would have been done by hashed search above...
-     */
-    if (!cp->he.h.h_addr_list[1])
-      continue;
-    /*
-     * If the first IP# has the same hashnumber as the IP# we
-     * are looking for, its been done already.
-     */
-    if (hashv == hash_number((unsigned char *)cp->he.h.h_addr_list[0]))
-      continue;
-    for (i = 1; cp->he.h.h_addr_list[i]; ++i)
-    {
-      if (!memcmp(cp->he.h.h_addr_list[i], (char *)numb,
-          sizeof(struct in_addr)))
-      {
-        cainfo.ca_nu_hits++;
-        update_list(rptr, cp);
-        return cp;
-      }
-    }
+    reinfo.re_shortttl++;
+    return CACHE_MINTTL;
   }
-  return NULL;
+  return (ttl > max) ? max : ttl;
 }
 
 static aCache *make_cache(ResRQ *rptr)
@@ -1459,6 +1659,7 @@ static aCache *make_cache(ResRQ *rptr)
   aCache *cp;
   int i;
   struct hostent *hp = &rptr->he.h;
+  struct irc_in_addr addr;
 
   /*
    * Shouldn't happen but it just might...
@@ -1471,7 +1672,8 @@ static aCache *make_cache(ResRQ *rptr)
    */
   for (i = 0; hp->h_addr_list[i]; ++i)
   {
-    if ((cp = find_cache_number(rptr, (struct in_addr *)hp->h_addr_list[i])))
+    cache_addr_key(&addr, hp->h_addr_list[i], hp->h_length);
+    if ((cp = find_cache_number(rptr, &addr, NULL)))
       return cp;
   }
 
@@ -1481,20 +1683,100 @@ static aCache *make_cache(ResRQ *rptr)
   if ((cp = (aCache *)RunMalloc(sizeof(aCache))) == NULL)
     return NULL;
   memset(cp, 0, sizeof(aCache));
-  dup_hostent(&cp->he, hp);
-
-  if (rptr->ttl < 600)
+  if (dup_hostent(&cp->he, hp) || !cp->he.buf)
   {
-    reinfo.re_shortttl++;
-    cp->ttl = 600;
+    RunFree(cp);
+    return NULL;
   }
-  else
-    cp->ttl = rptr->ttl;
-  cp->expireat = now + cp->ttl;
+  cp->ttl = cache_ttl(rptr->ttl, CACHE_MAXTTL);
   Debug((DEBUG_INFO, "make_cache:made cache %p", cp));
   return add_to_cache(cp);
 }
 
+/*
+ * make_negative
+ *
+ * Recuerda que una IP no tiene PTR, para no volver a preguntar
+ * por cada reconexion desde ella mientras dure el TTL negativo.
+ */
+static void make_negative(struct in_addr *numb, time_t ttl)
+{
+  aCache *cp;
+  struct irc_in_addr addr;
+  int negative;
+
+  cache_addr_key(&addr, (char *)numb, sizeof(struct in_addr));
+  if (find_cache_number(NULL, &addr, &negative) || negative)
+    return;
+
+  if ((cp = (aCache *)RunMalloc(sizeof(aCache))) == NULL)
+    return;
+  memset(cp, 0, sizeof(aCache));
+  cp->negaddr = addr;
+  cp->ttl = cache_ttl(ttl, CACHE_NEGMAXTTL);
+  cainfo.ca_neg_adds++;
+  add_to_cache(cp);
+}
+
+/*
+ * negative_ttl
+ *
+ * TTL de una respuesta negativa segun RFC 2308: el menor entre el
+ * TTL del SOA de la seccion de autoridad y su campo MINIMUM.
+ */
+static time_t negative_ttl(HEADER * hptr, unsigned char *buf,
+    unsigned char *eob)
+{
+  unsigned char *cp = buf + sizeof(HEADER);
+  int n, type, dlen, rr = hptr->ancount + hptr->nscount;
+  int qd = hptr->qdcount;
+  u_int32_t ttl, minimum;
+
+  while (qd-- > 0)
+  {
+    if ((n = dn_skipname(cp, eob)) < 0)
+      return CACHE_NEGTTL;
+    cp += n + QFIXEDSZ;
+  }
+  while (rr-- > 0 && cp < eob)
+  {
+    if ((n = dn_skipname(cp, eob)) < 0)
+      break;
+    cp += n;
+    if (cp + INT16SZ + INT16SZ + INT32SZ + INT16SZ > eob)
+      break;
+    type = ((u_int16_t) cp[0] << 8) | ((u_int16_t) cp[1]);
+    cp += INT16SZ + INT16SZ;
+    ttl = ((u_int32_t) cp[0] << 24) | ((u_int32_t) cp[1] << 16) |
+        ((u_int32_t) cp[2] << 8) | ((u_int32_t) cp[3]);
+    cp += INT32SZ;
+    dlen = ((u_int16_t) cp[0] << 8) | ((u_int16_t) cp[1]);
+    cp += INT16SZ;
+    if (cp + dlen > eob)
+      break;
+    if (type == T_SOA)
+    {
+      unsigned char *rd = cp;
+
+      /* MNAME y RNAME, luego serial, refresh, retry, expire y minimum */
+      if ((n = dn_skipname(rd, cp + dlen)) < 0)
+        break;
+      rd += n;
+      if ((n = dn_skipname(rd, cp + dlen)) < 0)
+        break;
+      rd += n;
+      if (rd + 5 * INT32SZ > cp + dlen)
+        break;
+      rd += 4 * INT32SZ;
+      minimum = ((u_int32_t) rd[0] << 24) | ((u_int32_t) rd[1] << 16) |
+          ((u_int32_t) rd[2] << 8) | ((u_int32_t) rd[3]);
+      return (time_t) MIN(ttl, minimum);
+    }
+    cp += dlen;
+  }
+  return CACHE_NEGTTL;
+}
+
 /*
  * rem_cache
  *
@@ -1503,65 +1785,29 @@ static aCache *make_cache(ResRQ *rptr)
  */
 static void rem_cache(aCache *ocp)
 {
-  aCache **cp;
   struct hostent *hp = &ocp->he.h;
-  int hashv;
+  int i;
   aClient *cptr;
 
   Debug((DEBUG_DNS, "rem_cache: ocp %p hp %p l_n %p aliases %p",
-      ocp, hp, ocp->list_next, hp->h_aliases));
+      ocp, hp, ocp->lru_next, hp->h_aliases));
 
   /*
    * Cleanup any references to this structure by destroying the pointer.
+   * Las negativas nunca se dan a un cliente.
    */
-  for (hashv = highest_fd; hashv >= 0; --hashv)
-  {
-    if ((cptr = loc_clients[hashv]) && (cptr->hostp == hp))
-      cptr->hostp = NULL;
-  }
-  /*
-   * Remove cache entry from linked list.
-   */
-  for (cp = &cachetop; *cp; cp = &((*cp)->list_next))
-  {
-    if (*cp == ocp)
-    {
-      *cp = ocp->list_next;
-      break;
-    }
-  }
-  /*
-   * Remove cache entry from hashed name lists.
-   */
-  hashv = hash_name(hp->h_name);
-
-  Debug((DEBUG_DNS, "rem_cache: h_name %s hashv %d next %p first %p",
-      hp->h_name, hashv, ocp->hname_next, hashtable[hashv].name_list));
-
-  for (cp = &hashtable[hashv].name_list; *cp; cp = &((*cp)->hname_next))
+  if (ocp->he.buf)
   {
-    if (*cp == ocp)
+    for (i = highest_fd; i >= 0; --i)
     {
-      *cp = ocp->hname_next;
-      break;
+      if ((cptr = loc_clients[i]) && (cptr->hostp == hp))
+        cptr->hostp = NULL;
     }
   }
-  /*
-   * Remove cache entry from hashed number list
-   */
-  hashv = hash_number((unsigned char *)hp->h_addr_list[0]);
 
-  Debug((DEBUG_DNS, "rem_cache: h_addr %s hashv %d next %p first %p",
-      inetntoa(*((struct in_addr *)hp->h_addr_list[0])), hashv,
-      ocp->hnum_next, hashtable[hashv].num_list));
-  for (cp = &hashtable[hashv].num_list; *cp; cp = &((*cp)->hnum_next))
-  {
-    if (*cp == ocp)
-    {
-      *cp = ocp->hnum_next;
-      break;
-    }
-  }
+  lru_unlink(ocp);
+  cache_unindex(ocp);
+  timer_del(&ocp->expire);
 
   if (ocp->he.buf)
     RunFree(ocp->he.buf);
@@ -1571,33 +1817,6 @@ static void rem_cache(aCache *ocp)
   cainfo.ca_dels++;
 }
 
-
-void event_expire_cache_callback(int fd, short event, struct event *ev)
-{
-  Reg1 aCache *cp, *cp2;
-  Reg2 time_t next = 0;
-
-  Debug((DEBUG_DEBUG, "event_expire_cache_callback event: %d", (int)event));
-  
-  assert(event & EV_TIMEOUT);
-  
-  update_now();
-  
-  for (cp = cachetop; cp; cp = cp2)
-  {
-    cp2 = cp->list_next;
-
-    if (now >= cp->expireat)
-    {
-      cainfo.ca_expires++;
-      rem_cache(cp);
-    }
-    else if (!next || next > cp->expireat)
-      next = cp->expireat;
-  }
-  update_nextexpire((next > now) ? (next - now) : (AR_TTL));
-}
-
 /*
  * Remove all dns cache entries.
  */
@@ -1622,9 +1841,16 @@ int m_dns(aClient *cptr, aClient *sptr, int UNUSED(parc), char *parv[])
       sendto_one(sptr, err_str(ERR_NOPRIVILEGES), me.name, parv[0]);
       return 0;
     }
-    for (cp = cachetop; cp; cp = cp->list_next)
+    for (cp = cachetop; cp; cp = cp->lru_next)
     {
       h = &cp->he.h;
+      if (!cp->he.buf)
+      {
+        sendto_one(sptr, "NOTICE %s :Ex %d ttl %d host %s (sin PTR)",
+            parv[0], (int)(cp->expireat - now), (int)cp->ttl,
+            ircd_ntoa(&cp->negaddr));
+        continue;
+      }
       sendto_one(sptr, "NOTICE %s :Ex %d ttl %d host %s(%s)",
           parv[0], (int)(cp->expireat - now), (int)cp->ttl,
           h->h_name, inetntoa(*((struct in_addr *)h->h_addr_list[0])));
@@ -1641,6 +1867,11 @@ int m_dns(aClient *cptr, aClient *sptr, int UNUSED(parc), char *parv[])
       sptr->name, cainfo.ca_adds, cainfo.ca_dels, cainfo.ca_expires,
       cainfo.ca_lookups, cainfo.ca_na_hits, cainfo.ca_nu_hits,
       cainfo.ca_updates);
+  sendto_one(sptr, "NOTICE %s :Cm %d:%d Cn %d/%d Cs %d/%d Ck %u/%u:%u/%u Cr %d",
+      sptr->name, cainfo.ca_na_misses, cainfo.ca_nu_misses,
+      cainfo.ca_neg_adds, cainfo.ca_neg_hits, incache, MAXCACHED,
+      name_index.count, name_index.size, addr_index.count, addr_index.size,
+      cainfo.ca_resizes);
   sendto_one(sptr, "NOTICE %s :Re %d Rl %d/%d Rp %d Rq %d",
       sptr->name, reinfo.re_errors, reinfo.re_nu_look,
       reinfo.re_na_look, reinfo.re_replies, reinfo.re_requests);
@@ -1657,9 +1888,11 @@ size_t cres_mem(aClient *sptr)
   int i;
   size_t nm = 0, im = 0, sm = 0, ts = 0;
 
-  for (; c; c = c->list_next)
+  for (; c; c = c->lru_next)
   {
-    sm += sizeof(*c);
+    sm += sizeof(*c) + c->nkeys * sizeof(struct CacheKey);
+    if (!c->he.buf)
+      continue;
     h = &c->he.h;
     for (i = 0; h->h_addr_list[i]; i++)
     {
@@ -1677,7 +1910,7 @@ size_t cres_mem(aClient *sptr)
     if (h->h_name)
       nm += strlen(h->h_name);
   }
-  ts = ARES_CACSIZE * sizeof(CacheTable);
+  ts = (name_index.size + addr_index.size) * sizeof(struct CacheKey *);
   sendto_one(sptr, ":%s %d %s :RES table " SIZE_T_FMT,
       me.name, RPL_STATSDEBUG, sptr->name, ts);
   sendto_one(sptr, ":%s %d %s :Structs " SIZE_T_FMT
@@ -1685,4 +1918,3 @@ size_t cres_mem(aClient *sptr)
       me.name, RPL_STATSDEBUG, sptr->name, sm, im, nm);
   return ts + sm + im + nm;
 }
-
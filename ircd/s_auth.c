@@ -52,14 +52,152 @@
 #include "slab_alloc.h"
 #include "sprintf_irc.h"
 #include "s_bdd.h"
+#include "numeric.h"
 
 #define IDENT_START ":%s NOTICE IDENT_LOOKUP :*** Checking Ident\r\n"
 #define IDENT_OK ":%s NOTICE IDENT_LOOKUP :*** Got ident response\r\n"
 #define IDENT_FAIL ":%s NOTICE IDENT_LOOKUP :*** No ident response, prefixing user with ~\r\n"
 #define IDENT_BAD ":%s NOTICE IDENT_LOOKUP :*** Bad reply response, prefixing user with ~\r\n"
 
+/*
+ * Histogramas de latencia del registro de clientes locales, en
+ * milisegundos desde el accept(). La casilla i cuenta los que
+ * tardaron menos de 2^i ms; la ultima, todos los demas.
+ */
+#define AUTH_HIST 16
+
+static unsigned int auth_hist[AUTH_STAGES][AUTH_HIST];
+static unsigned int auth_hist_max[AUTH_STAGES];
+static const char *auth_stage_name[AUTH_STAGES] = {
+  "dns", "ident", "registro"
+};
+
+/*
+ * auth_stage_done
+ *
+ * Apunta lo que ha tardado 'cptr' en terminar una fase del registro.
+ */
+void auth_stage_done(aClient *cptr, int stage)
+{
+  struct timeval tv;
+  long ms;
+  int i;
+
+  if (!cptr->regstart.tv_sec)
+    return;
+  gettimeofday(&tv, NULL);
+  ms = (tv.tv_sec - cptr->regstart.tv_sec) * 1000L +
+      (tv.tv_usec - cptr->regstart.tv_usec) / 1000L;
+  if (ms < 0)
+    ms = 0;
+  for (i = 0; i < AUTH_HIST - 1 && ms >= (1L << i); i++);
+  auth_hist[stage][i]++;
+  if ((unsigned long)ms > auth_hist_max[stage])
+    auth_hist_max[stage] = ms;
+  if (stage == AUTH_STAGE_TOTAL)
+    cptr->regstart.tv_sec = 0;
+}
+
+/*
+ * auth_percentile
+ *
+ * Cota superior, en ms, de la casilla que contiene el percentil 'pct'.
+ */
+static unsigned int auth_percentile(unsigned int *hist, unsigned int total,
+    unsigned int pct)
+{
+  unsigned int sum = 0, want = (total * pct + 99) / 100;
+  int i;
+
+  for (i = 0; i < AUTH_HIST - 1; i++)
+    if ((sum += hist[i]) >= want)
+      break;
+  return 1U << i;
+}
+
+void auth_report(aClient *cptr, char *name)
+{
+  char buf[512];
+  unsigned int total;
+  int stage, i;
+
+  for (stage = 0; stage < AUTH_STAGES; stage++)
+  {
+    char *p = buf;
+
+    for (total = 0, i = 0; i < AUTH_HIST; i++)
+      total += auth_hist[stage][i];
+    sendto_one(cptr, ":%s %d %s :%s n %u p50 <%u p90 <%u p99 <%u max %u ms",
+        me.name, RPL_STATSDEBUG, name, auth_stage_name[stage], total,
+        auth_percentile(auth_hist[stage], total, 50),
+        auth_percentile(auth_hist[stage], total, 90),
+        auth_percentile(auth_hist[stage], total, 99), auth_hist_max[stage]);
+    for (i = 0; i < AUTH_HIST; i++)
+      p = sprintf_irc(p, " %u:%u", 1U << i, auth_hist[stage][i]);
+    sendto_one(cptr, ":%s %d %s :%s ms%s", me.name, RPL_STATSDEBUG, name,
+        auth_stage_name[stage], buf);
+  }
+}
 
+/*
+ * auth_notice
+ *
+ * Aviso de progreso a un cliente que aun no se ha registrado.
+ * Se escribe directamente en el socket, como los de IP_LOOKUP.
+ */
+static void auth_notice(aClient *cptr, const char *fmt)
+{
+  if (IsUserPort(cptr))
+  {
+    sprintf_irc(sendbuf, fmt, me.name);
+    write(cptr->fd, sendbuf, strlen(sendbuf));
+  }
+}
 
+/*
+ * auth_close
+ *
+ * Quita los eventos del socket ident y lo cierra. Los eventos van
+ * antes que el close(): con el fd ya cerrado (o reutilizado) el
+ * event_del podria tocar el de otro descriptor.
+ */
+void auth_close(aClient *cptr)
+{
+  DelRWAuthEvent(cptr);
+  ClearWRAuth(cptr);
+  if (cptr->authfd >= 0)
+  {
+    close(cptr->authfd);
+    if (cptr->authfd == highest_fd)
+      while (!loc_clients[highest_fd])
+        highest_fd--;
+    cptr->authfd = -1;
+  }
+}
+
+/*
+ * auth_end
+ *
+ * Cierra la consulta ident, sea cual sea el resultado, y deja pasar
+ * al cliente si el DNS ya habia terminado.
+ */
+static void auth_end(aClient *cptr, const char *notice)
+{
+  auth_close(cptr);
+  ClearAuth(cptr);
+  if (notice)
+    auth_notice(cptr, notice);
+  auth_stage_done(cptr, AUTH_STAGE_IDENT);
+  if (!DoingDNS(cptr))
+    SetAccess(cptr);
+}
+
+static unsigned short int *auth_port(struct sockaddr_storage *sa)
+{
+  if (sa->ss_family == AF_INET6)
+    return &((struct sockaddr_in6 *)sa)->sin6_port;
+  return &((struct sockaddr_in *)sa)->sin_port;
+}
 
 /*
  * start_auth
@@ -69,11 +207,14 @@
  * into 'non-blocking' mode.  Should the connect or any later phase of the
  * identifing process fail, it is aborted and the user is given a username
  * of "unknown".
+ *
+ * Se conecta desde la IP local por la que entro el cliente y con su
+ * misma familia, asi que vale igual para IPv4 que para IPv6.
  */
 void start_auth(aClient *cptr)
 {
-  struct sockaddr_in sock;
-  int err;
+  struct sockaddr_storage us, them;
+  socklen_t ulen = sizeof(us), tlen = sizeof(them);
 
   /* Sin IDENT */
   if (desactivar_ident)
@@ -93,15 +234,17 @@ void start_auth(aClient *cptr)
   Debug((DEBUG_NOTICE, "start_auth(%p) fd %d status %d",
       cptr, cptr->fd, cptr->status));
 
-  if (IsUserPort(cptr))
+  auth_notice(cptr, IDENT_START);
+
+  if (getsockname(cptr->fd, (struct sockaddr *)&us, &ulen) ||
+      getpeername(cptr->fd, (struct sockaddr *)&them, &tlen))
   {
-    sprintf_irc(sendbuf, IDENT_START, me.name);
-    write(cptr->fd, sendbuf, strlen(sendbuf));
+    ircstp->is_abad++;
+    auth_end(cptr, IDENT_FAIL);
+    return;
   }
 
-  cptr->authfd = socket(AF_INET, SOCK_STREAM, 0);
-  err = errno;
-
+  cptr->authfd = socket(them.ss_family, SOCK_STREAM, 0);
   if (cptr->authfd < 0)
   {
 #if defined(USE_SYSLOG)
@@ -109,60 +252,45 @@ void start_auth(aClient *cptr)
         get_client_name(cptr, FALSE));
 #endif
     Debug((DEBUG_ERROR, "Unable to create auth socket for %s:%s",
-        get_client_name(cptr, FALSE), strerror(get_sockerr(cptr))));
-    if (!DoingDNS(cptr))
-      SetAccess(cptr);
+        get_client_name(cptr, FALSE), strerror(errno)));
     ircstp->is_abad++;
+    auth_end(cptr, IDENT_FAIL);
     return;
   }
   if (cptr->authfd >= (MAXCONNECTIONS - 2))
   {
-    close(cptr->authfd);
-    cptr->authfd = -1;
+    auth_end(cptr, IDENT_FAIL);
     return;
   }
-  
-#if defined(VIRTUAL_HOST)
-  if (bind(cptr->authfd, (struct sockaddr *)&vserv, sizeof(vserv)) == -1)
+  if (cptr->authfd > highest_fd)
+    highest_fd = cptr->authfd;
+
+  /* Antes del connect(), que si no bloquea hasta el SYN-ACK */
+  set_non_blocking(cptr->authfd, cptr);
+
+  *auth_port(&us) = 0;
+  if (bind(cptr->authfd, (struct sockaddr *)&us, ulen) == -1)
   {
     report_error("binding auth stream socket %s: %s", cptr);
-    close(cptr->authfd);
-    cptr->authfd = -1;
+    auth_end(cptr, IDENT_FAIL);
     return;
   }
-#endif
-  memcpy(&sock.sin_addr, &cptr->ip, sizeof(struct in_addr));
 
-  sock.sin_port = htons(113);
-  sock.sin_family = AF_INET;
-
-  if (connect(cptr->authfd, (struct sockaddr *)&sock,
-      sizeof(sock)) == -1 && errno != EINPROGRESS)
+  *auth_port(&them) = htons(113);
+  if (connect(cptr->authfd, (struct sockaddr *)&them, tlen) == -1 &&
+      errno != EINPROGRESS)
   {
     ircstp->is_abad++;
     /*
      * No error report from this...
      */
-    close(cptr->authfd);
-    cptr->authfd = -1;
-    if (!DoingDNS(cptr))
-      SetAccess(cptr);
-
-    if (IsUserPort(cptr))
-    {
-      sprintf_irc(sendbuf, IDENT_FAIL, me.name);
-      write(cptr->fd, sendbuf, strlen(sendbuf));
-    }
+    auth_end(cptr, IDENT_FAIL);
     return;
   }
   SetAuth(cptr);
   SetWRAuth(cptr);
-  set_non_blocking(cptr->authfd, cptr);
-  
+
   CreateRWAuthEvent(cptr);
-  
-  if (cptr->authfd > highest_fd)
-    highest_fd = cptr->authfd;
   return;
 }
 
@@ -177,7 +305,7 @@ void start_auth(aClient *cptr)
  */
 void send_authports(aClient *cptr)
 {
-  struct sockaddr_in us, them;
+  struct sockaddr_storage us, them;
   char authbuf[32];
   socklen_t ulen, tlen;
 
@@ -194,36 +322,22 @@ void send_authports(aClient *cptr)
     goto authsenderr;
   }
 
-  sprintf_irc(authbuf, "%u , %u\r\n", (unsigned int)ntohs(them.sin_port),
-      (unsigned int)ntohs(us.sin_port));
+  sprintf_irc(authbuf, "%u , %u\r\n",
+      (unsigned int)ntohs(*auth_port(&them)),
+      (unsigned int)ntohs(*auth_port(&us)));
 
   Debug((DEBUG_SEND, "sending [%s] to auth port %s.113",
-      authbuf, inetntoa(them.sin_addr)));
+      authbuf, ircd_ntoa_c(cptr)));
   if (write(cptr->authfd, authbuf, strlen(authbuf)) != (int)strlen(authbuf))
   {
   authsenderr:
     ircstp->is_abad++;
-    close(cptr->authfd);
-    if (cptr->authfd == highest_fd)
-      while (!loc_clients[highest_fd])
-        highest_fd--;
-    cptr->authfd = -1;
-
-    ClearAuth(cptr);
-    DelRAuthEvent(cptr);
-    
-    if (IsUserPort(cptr))
-    {
-      sprintf_irc(sendbuf, IDENT_FAIL, me.name);
-      write(cptr->fd, sendbuf, strlen(sendbuf));
-    }
-
-    if (!DoingDNS(cptr))
-      SetAccess(cptr);
+    auth_end(cptr, IDENT_FAIL);
+    return;
   }
   ClearWRAuth(cptr);
   DelWAuthEvent(cptr);
-  
+
   return;
 }
 
@@ -283,22 +397,10 @@ void read_authports(aClient *cptr)
     Debug((DEBUG_ERROR, "local %d remote %d", locp, remp));
     Debug((DEBUG_ERROR, "bad auth reply in [%s]", cptr->buffer));
     *ruser = '\0';
-    if (IsUserPort(cptr))
-    {
-      sprintf_irc(sendbuf, IDENT_BAD, me.name);
-      write(cptr->fd, sendbuf, strlen(sendbuf));
-    }
+    auth_notice(cptr, IDENT_BAD);
   }
-  close(cptr->authfd);
-  if (cptr->authfd == highest_fd)
-    while (!loc_clients[highest_fd])
-      highest_fd--;
   cptr->count = 0;
-  cptr->authfd = -1;
-  ClearAuth(cptr);
-  DelRWAuthEvent(cptr);
-  if (!DoingDNS(cptr))
-    SetAccess(cptr);
+  auth_end(cptr, NULL);
   if (len > 0)
     Debug((DEBUG_INFO, "ident reply: [%s]", cptr->buffer));
 
@@ -312,10 +414,6 @@ void read_authports(aClient *cptr)
   if (strncmp(system, "OTHER", 5))
     cptr->flags |= FLAGS_GOTID;
   Debug((DEBUG_INFO, "got username [%s]", ruser));
-  if (IsUserPort(cptr))
-  {
-    sprintf_irc(sendbuf, IDENT_OK, me.name);
-    write(cptr->fd, sendbuf, strlen(sendbuf));
-  }
+  auth_notice(cptr, IDENT_OK);
   return;
 }
@@ -21,7 +21,7 @@
 /*
 ** ATENCION: Lo que sigue debe incrementarse cuando se toque alguna estructura de la BDD
 */
-#define MMAP_CACHE_VERSION 4
+#define MMAP_CACHE_VERSION 5
 
 
 
@@ -34,6 +34,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -118,15 +120,6 @@ unsigned char bdd_initialized = 0;
 
 #define DB_MAX_TABLA      256
 
-/*
-** Numero de peticiones de registros
-** antes de que haya que empezar a reciclar
-*/
-#define DB_BUF_CACHE  32
-
-static struct db_reg db_buf_cache[DB_BUF_CACHE];
-static int db_buf_cache_i = 0;
-
 struct tabla_en_memoria {
   char *posicion;
   unsigned int len;
@@ -156,10 +149,132 @@ static struct db_reg **tabla_datos[DB_MAX_TABLA];
 static unsigned int tabla_serie[DB_MAX_TABLA];
 static unsigned int tabla_hash_hi[DB_MAX_TABLA];
 static unsigned int tabla_hash_lo[DB_MAX_TABLA];
+static unsigned int tabla_len[DB_MAX_TABLA];
 #if defined(BDD_MMAP)
 static struct portable_stat tabla_stats[DB_MAX_TABLA];
 #endif
 
+/*
+** Redimensionado incremental de las tablas hash.
+**
+** "tabla_residente_y_len" es el taman~o inicial (y minimo) de cada
+** tabla; el actual esta en "tabla_len". Cuando la carga pasa de
+** DB_CARGA_MAX registros por cubeta se pide una tabla del doble, y
+** cuando baja de 1/DB_CARGA_MIN (sin pasar del taman~o inicial) una
+** de la mitad. Los registros no se mueven de golpe: cada alta o baja
+** pasa DB_REHASH_PASO cubetas de la tabla vieja a la nueva. Mientras
+** tanto, un registro esta en la vieja si su cubeta de la vieja no se
+** ha pasado aun, y en la nueva si ya se paso.
+**
+** Las busquedas no mueven nada. Antes de guardar el MMAP cache se
+** termina cualquier redimensionado pendiente, asi que de esto solo
+** se persiste "tabla_len".
+*/
+#define DB_CARGA_MAX	2
+#define DB_CARGA_MIN	8
+#define DB_REHASH_PASO	16
+#define DB_LEN_MAX	(1 << 24)
+
+static struct db_reg **tabla_datos_old[DB_MAX_TABLA];
+static unsigned int tabla_len_old[DB_MAX_TABLA];
+static unsigned int tabla_rehash_pos[DB_MAX_TABLA];
+static unsigned int tabla_redimensiones[DB_MAX_TABLA];
+
+/*
+** Diario de cada tabla: cada DB_DIARIO_PASO registros del fichero
+** se apunta el numero de serie, donde empieza el siguiente registro
+** y el HASH acumulado hasta ese punto. Con eso se puede calcular el
+** HASH que tenia la tabla en cualquier numero de serie leyendo como
+** mucho DB_DIARIO_PASO registros, y truncar la tabla en una marca.
+**
+** En un NetJoin el leaf manda su HASH junto con su numero de serie;
+** si no coincide con el del HUB en ese mismo punto, van probando
+** marcas cada vez mas antiguas hasta encontrar una en la que si
+** coincidan, el leaf trunca su tabla ahi y solo se transmite lo
+** que viene detras.
+**
+** No se guarda en el MMAP cache: se construye al necesitarlo,
+** leyendo el fichero, y se descarta cuando la tabla se borra o
+** se compacta.
+*/
+#define DB_DIARIO_PASO	256
+
+struct db_marca {
+  unsigned int serie;
+  unsigned int offset;          /* Principio del registro siguiente */
+  unsigned int hash_hi;
+  unsigned int hash_lo;
+};
+
+struct db_diario {
+  struct db_marca *marcas;      /* NULL si no esta construido */
+  unsigned int n;
+  unsigned int max;
+  unsigned int pendientes;      /* Registros desde la ultima marca */
+};
+
+static struct db_diario tabla_diario[DB_MAX_TABLA];
+
+/*
+** Registros enviados por cada "J" antes de pedir
+** confirmacion con un "B". Si el enlace va comprimido
+** se puede mandar mucho mas de golpe.
+*/
+#define DB_BURST_VENTANA	1000
+#define DB_BURST_VENTANA_ZLIB	20000
+
+/*
+** Foto binaria de cada tabla ("tabla.X.bin").
+**
+** La escribe el hijo que compacta, con lo que queda vivo en el
+** fichero hasta el CheckPoint: una cabecera, las cubetas, los
+** registros y una arena con las claves (ya en minusculas) y los
+** valores. Todo son desplazamientos, asi que se puede mapear tal
+** cual, y lleva una suma de control de todo el fichero.
+**
+** Al arrancar, si la foto es valida y el fichero de la tabla sigue
+** teniendo el CheckPoint donde dice la foto, solo se leen los
+** registros posteriores. Si al final el HASH no cuadra, se descarta
+** la foto y se lee el fichero entero, como siempre.
+**
+** En las tablas cuyas altas no tienen efectos al arrancar, los
+** registros apuntan directamente a la arena y no se copian; en las
+** demas (y con BDD_MMAP, porque la tabla tiene que estar en la
+** memoria persistente) se dan de alta uno a uno.
+*/
+#define DB_SNAP_VERSION	1
+
+struct db_snap_cab {
+  char magia[4];                /* "BDDS" */
+  unsigned int version;
+  unsigned int tabla;
+  unsigned int serie;           /* La del CheckPoint */
+  unsigned int hash_hi;
+  unsigned int hash_lo;
+  unsigned int log_len;         /* Bytes de "tabla.X" que recoge */
+  unsigned int cuantos;
+  unsigned int len;             /* Cubetas */
+  unsigned int arena;
+  unsigned int suma;            /* De todo el fichero, con esto a 0 */
+};
+
+struct db_snap_reg {
+  unsigned int clave;           /* Desplazamientos en la arena */
+  unsigned int valor;
+  unsigned int next;            /* Indice + 1, 0 al final de la cadena */
+};
+
+struct db_snap {
+  char *map;                    /* Foto mapeada, si se usa directamente */
+  unsigned int map_len;
+  struct db_reg *regs;          /* Registros que apuntan a la arena */
+  unsigned int cuantos;
+};
+
+static struct db_snap tabla_snap[DB_MAX_TABLA];
+static unsigned int db_snap_tablas = 0;
+static unsigned int db_snap_registros = 0;
+
 #if defined(BDD_MMAP)
 static void *mmap_cache_pos = NULL;
 #endif
@@ -184,6 +299,17 @@ int db_persistent_hit(void)
 #define p_free(a)	RunFree(a)
 #endif
 
+/*
+** Los registros cargados de la foto no se liberan uno a uno
+*/
+static void db_libera_reg(unsigned char tabla, struct db_reg *reg)
+{
+  struct db_snap *s = &tabla_snap[tabla];
+
+  if (!s->regs || (reg < s->regs) || (reg >= s->regs + s->cuantos))
+    p_free(reg);
+}
+
 static struct portable_stat *get_stat(int handle, struct portable_stat *st)
 {
   struct stat st2;
@@ -246,7 +372,7 @@ void tea(unsigned int v[], unsigned int k[], unsigned int x[])
   x[1] = z;
 }
 
-static void actualiza_hash(char *registro, unsigned char que_bdd)
+static void calcula_hash(char *registro, unsigned int *hi, unsigned int *lo)
 {
   unsigned int buffer[129 * sizeof(unsigned int)];
   unsigned int *p = buffer;
@@ -263,8 +389,8 @@ static void actualiza_hash(char *registro, unsigned char que_bdd)
   while ((p2 = strchr((char *)buffer, '\r')))
     *p2 = '\0';
   k[0] = k[1] = 0;
-  x[0] = tabla_hash_hi[que_bdd];
-  x[1] = tabla_hash_lo[que_bdd];
+  x[0] = *hi;
+  x[1] = *lo;
   while (*p)
   {
     v[0] = ntohl(*p);
@@ -273,8 +399,120 @@ static void actualiza_hash(char *registro, unsigned char que_bdd)
     p++;                        /* No se puede hacer a la vez porque la linea anterior puede ser una expansion de macros */
     tea(v, k, x);
   }
-  tabla_hash_hi[que_bdd] = x[0];
-  tabla_hash_lo[que_bdd] = x[1];
+  *hi = x[0];
+  *lo = x[1];
+}
+
+static void actualiza_hash(char *registro, unsigned char que_bdd)
+{
+  calcula_hash(registro, &tabla_hash_hi[que_bdd], &tabla_hash_lo[que_bdd]);
+}
+
+/*
+** db_cubeta
+**
+** Cubeta en la que esta (o debe ir) la clave.
+*/
+static struct db_reg **db_cubeta(unsigned char tabla, const char *clave,
+    unsigned int *hashi)
+{
+  unsigned int h;
+
+  if (tabla_datos_old[tabla])
+  {
+    h = db_hash_registro(clave, tabla_len_old[tabla]);
+    if (h >= tabla_rehash_pos[tabla])
+    {
+      *hashi = h;
+      return &tabla_datos_old[tabla][h];
+    }
+  }
+  h = db_hash_registro(clave, tabla_len[tabla]);
+  *hashi = h;
+  return &tabla_datos[tabla][h];
+}
+
+/*
+** db_rehash_paso
+**
+** Pasa hasta "n" cubetas de la tabla vieja a la nueva.
+*/
+static void db_rehash_paso(unsigned char tabla, unsigned int n)
+{
+  struct db_reg **old = tabla_datos_old[tabla];
+  struct db_reg **datos = tabla_datos[tabla];
+  struct db_reg *reg, *reg2;
+  unsigned int h;
+
+  if (!old)
+    return;
+
+  while (n-- > 0 && tabla_rehash_pos[tabla] < tabla_len_old[tabla])
+  {
+    for (reg = old[tabla_rehash_pos[tabla]]; reg != NULL; reg = reg2)
+    {
+      reg2 = reg->next;
+      h = db_hash_registro(reg->clave, tabla_len[tabla]);
+      reg->next = datos[h];
+      datos[h] = reg;
+    }
+    old[tabla_rehash_pos[tabla]++] = NULL;
+  }
+
+  if (tabla_rehash_pos[tabla] >= tabla_len_old[tabla])
+  {
+    p_free(old);
+    tabla_datos_old[tabla] = NULL;
+    tabla_len_old[tabla] = 0;
+    tabla_rehash_pos[tabla] = 0;
+  }
+}
+
+static void db_rehash_completa(unsigned char tabla)
+{
+  if (tabla_datos_old[tabla])
+    db_rehash_paso(tabla, tabla_len_old[tabla]);
+}
+
+/*
+** db_redimensiona
+**
+** Tras un alta o una baja: avanza el redimensionado en curso o,
+** si no hay ninguno, empieza uno si la carga lo pide.
+*/
+static void db_redimensiona(unsigned char tabla)
+{
+  unsigned int len = tabla_len[tabla], nuevo, i;
+
+  if (tabla_datos_old[tabla])
+  {
+    db_rehash_paso(tabla, DB_REHASH_PASO);
+    return;
+  }
+
+  if (tabla_cuantos[tabla] > len * DB_CARGA_MAX && len < DB_LEN_MAX)
+    nuevo = len * 2;
+  else if (tabla_cuantos[tabla] * DB_CARGA_MIN < len
+      && len > tabla_residente_y_len[tabla])
+    nuevo = len / 2;
+  else
+    return;
+
+  Debug((DEBUG_INFO, "BDD tabla '%c': %u registros, %u -> %u cubetas",
+      tabla, tabla_cuantos[tabla], len, nuevo));
+
+  tabla_datos_old[tabla] = tabla_datos[tabla];
+  tabla_len_old[tabla] = len;
+  tabla_rehash_pos[tabla] = 0;
+
+  tabla_datos[tabla] = p_malloc(nuevo * sizeof(struct db_reg *));
+  assert(tabla_datos[tabla]);
+  for (i = 0; i < nuevo; i++)
+    tabla_datos[tabla][i] = NULL;
+  tabla_len[tabla] = nuevo;
+  tabla_redimensiones[tabla]++;
+
+  db_rehash_paso(tabla, DB_REHASH_PASO);
 }
 
 /*
@@ -316,7 +554,8 @@ static struct db_reg *db_iterador()
 struct db_reg *db_iterador_init(unsigned char tabla)
 {
   assert((tabla >= ESNET_BDD) && (tabla <= ESNET_BDD_END));
-  db_iterador_hash_len = tabla_residente_y_len[tabla];
+  db_rehash_completa(tabla);
+  db_iterador_hash_len = tabla_len[tabla];
   assert(db_iterador_hash_len);
   db_iterador_hash_pos = 0;
   db_iterador_datos = tabla_datos[tabla];
@@ -335,36 +574,20 @@ struct db_reg *db_iterador_next(void)
 
 /*
 ** db_busca_db_reg
+**
+** No copia la clave: tanto el hash como la comparacion la pasan
+** a minusculas sobre la marcha (las guardadas ya lo estan).
 */
-static struct db_reg *db_busca_db_reg(unsigned char tabla, char *clave)
+static struct db_reg *db_busca_db_reg(unsigned char tabla, const char *clave)
 {
-  static char *c = NULL;
-  static int c_len = 0;
-  int i, hashi;
+  unsigned int hashi;
   struct db_reg *reg;
+  const char *p, *q;
 
-  if ((strlen(clave) + 1 > c_len) || (!c))
-  {
-    c_len = strlen(clave) + 1;
-    if (c)
-      RunFree(c);
-    c = RunMalloc(c_len);
-    if (!c)
-      return 0;
-  }
-  strcpy(c, clave);
-  /* paso a minusculas */
-  i = 0;
-  while (c[i] != 0)
-  {
-    c[i] = toLower(c[i]);
-    i++;
-  }
-  hashi = db_hash_registro(c, tabla_residente_y_len[tabla]);
-
-  for (reg = tabla_datos[tabla][hashi]; reg != NULL; reg = reg->next)
+  for (reg = *db_cubeta(tabla, clave, &hashi); reg != NULL; reg = reg->next)
   {
-    if (!strcmp(reg->clave, c))
+    for (p = clave, q = reg->clave; *q && toLower(*p) == *q; p++, q++);
+    if (!*p && !*q)
       return reg;
   }
   return NULL;
@@ -401,7 +624,8 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
   int mode;
   struct db_reg *reg, *reg2, **reg3;
   aChannel *chptr;
-  int hashi, i = 0;
+  unsigned int hashi;
+  int i = 0;
   static char *c = NULL;
   static int c_len = 0;
 
@@ -424,9 +648,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
     i++;
   }
 
-  hashi = db_hash_registro(c, tabla_residente_y_len[tabla]);
-  
-  reg3 = &tabla_datos[tabla][hashi];
+  reg3 = db_cubeta(tabla, c, &hashi);
 
   for (reg = *reg3; reg != NULL; reg = reg2)
   {
@@ -521,7 +743,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if (bot_nickserv)
               {
-                RunFree(bot_nickserv);
+                SlabStringFree(bot_nickserv);
                 bot_nickserv=NULL;
               }
             }
@@ -529,7 +751,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if (bot_chanserv)
               {
-                RunFree(bot_chanserv);
+                SlabStringFree(bot_chanserv);
                 bot_chanserv=NULL;
               }
             }
@@ -537,7 +759,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if (bot_clonesserv)
               {
-                RunFree(bot_clonesserv);
+                SlabStringFree(bot_clonesserv);
                 bot_clonesserv=NULL;
               }
             }
@@ -545,7 +767,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if (bot_spamserv)
               {
-                RunFree(bot_spamserv);
+                SlabStringFree(bot_spamserv);
                 bot_spamserv=NULL;
               }
             }
@@ -609,7 +831,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(mensaje_demasiados_clones)
               {
-                RunFree(mensaje_demasiados_clones);
+                SlabStringFree(mensaje_demasiados_clones);
                 mensaje_demasiados_clones=NULL;
               }
             }
@@ -633,7 +855,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(auto_usermodes)
               {
-                RunFree(auto_usermodes);
+                SlabStringFree(auto_usermodes);
                 auto_usermodes=NULL;
               }
             }
@@ -645,7 +867,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(mensaje_gline)
               {
-                RunFree(mensaje_gline);
+                SlabStringFree(mensaje_gline);
                 mensaje_gline=NULL;
               }
             }
@@ -653,7 +875,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(mensaje_quit_personalizado)
               {
-                RunFree(mensaje_quit_personalizado);
+                SlabStringFree(mensaje_quit_personalizado);
                 mensaje_quit_personalizado=NULL;
               }
             }
@@ -661,7 +883,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(mensaje_part_personalizado)
               {
-                RunFree(mensaje_part_personalizado);
+                SlabStringFree(mensaje_part_personalizado);
                 mensaje_part_personalizado=NULL;
               }
             }
@@ -669,7 +891,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(mensaje_capacidad_superada)
               {
-                RunFree(mensaje_capacidad_superada);
+                SlabStringFree(mensaje_capacidad_superada);
                 mensaje_capacidad_superada=NULL;
               }
             }
@@ -677,7 +899,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(network)
               {
-                RunFree(network);
+                SlabStringFree(network);
                 network=NULL;
               }
             }
@@ -685,7 +907,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(canal_operadores)
               {
-                RunFree(canal_operadores);
+                SlabStringFree(canal_operadores);
                 canal_operadores=NULL;
               }
             }
@@ -693,7 +915,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(canal_debug)
               {
-                RunFree(canal_debug);
+                SlabStringFree(canal_debug);
                 canal_debug=NULL;
               }
             }
@@ -729,7 +951,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(geo_msg_kill)
               {
-                RunFree(geo_msg_kill);
+                SlabStringFree(geo_msg_kill);
                 geo_msg_kill=NULL;
               }
             }
@@ -737,7 +959,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(geo_url_validation)
               {
-                RunFree(geo_url_validation);
+                SlabStringFree(geo_url_validation);
                 geo_url_validation=NULL;
               }
             }
@@ -777,7 +999,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(canal_connexitdebug)
               {
-                RunFree(canal_connexitdebug);
+                SlabStringFree(canal_connexitdebug);
                 canal_connexitdebug=NULL;
               }
             }
@@ -785,7 +1007,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(canal_privsdebug)
               {
-                RunFree(canal_privsdebug);
+                SlabStringFree(canal_privsdebug);
                 canal_privsdebug=NULL;
               }
             }
@@ -793,7 +1015,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(canal_geodebug)
               {
-                RunFree(canal_geodebug);
+                SlabStringFree(canal_geodebug);
                 canal_geodebug=NULL;
               }
             }
@@ -801,7 +1023,7 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             {
               if(canal_spamdebug)
               {
-                RunFree(canal_spamdebug);
+                SlabStringFree(canal_spamdebug);
                 canal_spamdebug=NULL;
               }
             }
@@ -861,8 +1083,9 @@ static void db_eliminar_registro(unsigned char tabla, char *clave,
             }
           }
       }
-      p_free(reg);
+      db_libera_reg(tabla, reg);
       tabla_cuantos[tabla]--;
+      db_redimensiona(tabla);
       break;
     }
     reg3 = &(reg->next);
@@ -1016,8 +1239,8 @@ static inline void crea_canal_persistente(char *nombre, char *valor, int virgen)
 static void db_insertar_registro(unsigned char tabla, char *clave, char *valor,
     aClient *cptr, aClient *sptr)
 {
-  struct db_reg *reg;
-  int hashi;
+  struct db_reg *reg, **cubeta;
+  unsigned int hashi;
   char *c, *v;
   int i = 0;
 
@@ -1053,7 +1276,7 @@ static void db_insertar_registro(unsigned char tabla, char *clave, char *valor,
   reg->next = NULL;
 
   /* busco hash */
-  hashi = db_hash_registro(reg->clave, tabla_residente_y_len[tabla]);
+  cubeta = db_cubeta(tabla, reg->clave, &hashi);
 
   /*
      sendto_ops("Inserto T='%c' C='%s' H=%u",tabla, reg->clave, hashi);
@@ -1062,10 +1285,11 @@ static void db_insertar_registro(unsigned char tabla, char *clave, char *valor,
     sendto_op_mask(SNO_SERVICE,
         "%s DB INSERT T='%c' C='%s' H=0x%x", sptr->name, tabla, reg->clave, hashi);
   
-  reg->next = tabla_datos[tabla][hashi];
-  tabla_datos[tabla][hashi] = reg;
+  reg->next = *cubeta;
+  *cubeta = reg;
 
   tabla_cuantos[tabla]++;
+  db_redimensiona(tabla);
 
   switch (tabla)
   {
@@ -1531,53 +1755,19 @@ static void db_insertar_registro(unsigned char tabla, char *clave, char *valor,
   }
 }
 
-static void copia_en_malloc(char *buf, int len, char **p)
-{
-  char *p2;
-
-  p2 = *p;
-  if ((p2 != NULL) && (strlen(p2) < len))
-  {
-    RunFree(p2);
-    p2 = NULL;
-  }
-  if (!p2)
-  {
-    p2 = RunMalloc(len + 1);    /* El '\0' final */
-    *p = p2;
-  }
-  memcpy(p2, buf, len);
-  p2[len] = '\0';
-}
-
-
-struct db_reg *db_buscar_registro(unsigned char tabla, char *clave)
+/*
+** db_buscar_registro
+**
+** Devuelve el propio registro, sin copias. El puntero vale
+** mientras el registro no se modifique ni se borre.
+*/
+const struct db_reg *db_buscar_registro(unsigned char tabla,
+    const char *clave)
 {
-  struct db_reg *reg;
-  char *clave_init, *clave_end;
-  char *valor_init, *valor_end;
-
   if (!tabla_residente_y_len[tabla])
     return NULL;
 
-  reg = db_busca_db_reg(tabla, clave);
-  if (!reg)
-    return NULL;
-
-/* Lo que sigue lo sustituye */
-  clave_init = reg->clave;
-  clave_end = clave_init + strlen(clave_init);
-  valor_init = reg->valor;
-  valor_end = valor_init + strlen(valor_init);
-
-  copia_en_malloc(clave_init, clave_end - clave_init,
-      &db_buf_cache[db_buf_cache_i].clave);
-  copia_en_malloc(valor_init, valor_end - valor_init,
-      &db_buf_cache[db_buf_cache_i].valor);
-  if (++db_buf_cache_i >= DB_BUF_CACHE)
-    db_buf_cache_i = 0;
-
-  return reg;
+  return db_busca_db_reg(tabla, clave);
 }
 
 /*
@@ -1991,7 +2181,7 @@ static int mmap_cache(void)
     memset(mmap_cache_pos, 0,
         4096 + hlen + sizeof(tabla_residente_y_len) + sizeof(tabla_stats) +
         sizeof(tabla_cuantos) + sizeof(tabla_datos) + sizeof(tabla_serie) +
-        sizeof(tabla_hash_hi) + sizeof(tabla_hash_lo));
+        sizeof(tabla_hash_hi) + sizeof(tabla_hash_lo) + sizeof(tabla_len));
 
   p_char = (unsigned char *)pos;
   memcpy(tabla_cuantos, p_char, sizeof(tabla_cuantos));
@@ -2004,6 +2194,8 @@ static int mmap_cache(void)
   p_char += sizeof(tabla_hash_hi);
   memcpy(tabla_hash_lo, p_char, sizeof(tabla_hash_lo));
   p_char += sizeof(tabla_hash_lo);
+  memcpy(tabla_len, p_char, sizeof(tabla_len));
+  p_char += sizeof(tabla_len);
 
   persistent_init(p_char, len - (p_char - (unsigned char *)mmap_cache_pos) - 64,
       flag_problemas ? NULL : (unsigned char *)mmap_cache_pos + len_used);
@@ -2032,6 +2224,7 @@ void db_persistent_commit(void)
   {
     if ((i < ESNET_BDD) || (i > ESNET_BDD_END))
       continue;
+    db_rehash_completa(i);
     sprintf_irc(path_buf, "%s/tabla.%c", DBPATH, i);
     handle = open(path_buf, O_RDONLY, S_IRUSR | S_IWUSR);
     assert(handle != -1);
@@ -2084,6 +2277,8 @@ void db_persistent_commit(void)
   p2 += sizeof(tabla_hash_hi);
   memcpy(p2, tabla_hash_lo, sizeof(tabla_hash_lo));
   p2 += sizeof(tabla_hash_lo);
+  memcpy(p2, tabla_len, sizeof(tabla_len));
+  p2 += sizeof(tabla_len);
 
   p = p_base + 2;               /* Nos saltamos el HASH inicial */
   p_limite = p_base + len_used / sizeof(unsigned int);
@@ -2226,6 +2421,177 @@ static void lee_hash(unsigned char que_bdd, unsigned int *hi, unsigned int *lo)
   *lo = base64toint(path + 6);
 }
 
+/*
+** db_diario_borra
+*/
+static void db_diario_borra(unsigned char que_bdd)
+{
+  struct db_diario *d = &tabla_diario[que_bdd];
+
+  if (d->marcas)
+    RunFree(d->marcas);
+  memset(d, 0, sizeof(*d));
+}
+
+static void db_diario_marca(unsigned char que_bdd, unsigned int serie,
+    unsigned int offset, unsigned int hi, unsigned int lo)
+{
+  struct db_diario *d = &tabla_diario[que_bdd];
+
+  if (d->n == d->max)
+  {
+    d->max *= 2;
+    d->marcas = RunRealloc(d->marcas, d->max * sizeof(struct db_marca));
+    assert(d->marcas);
+  }
+  d->marcas[d->n].serie = serie;
+  d->marcas[d->n].offset = offset;
+  d->marcas[d->n].hash_hi = hi;
+  d->marcas[d->n].hash_lo = lo;
+  d->n++;
+  d->pendientes = 0;
+}
+
+/*
+** db_diario_apunta
+**
+** Tras an~adir un registro al fichero, si el diario esta construido.
+*/
+static void db_diario_apunta(unsigned char que_bdd, unsigned int serie,
+    unsigned int offset)
+{
+  struct db_diario *d = &tabla_diario[que_bdd];
+
+  if (d->marcas && (++d->pendientes >= DB_DIARIO_PASO))
+    db_diario_marca(que_bdd, serie, offset, tabla_hash_hi[que_bdd],
+        tabla_hash_lo[que_bdd]);
+}
+
+/*
+** db_diario_construye
+**
+** Recorre el fichero de la tabla calculando el HASH
+** y poniendo las marcas.
+*/
+static void db_diario_construye(unsigned char que_bdd)
+{
+  struct db_diario *d = &tabla_diario[que_bdd];
+  struct tabla_en_memoria mapeo;
+  char buf[1024];
+  unsigned int hi = 0, lo = 0;
+
+  if (d->marcas)
+    return;
+
+  d->max = 64;
+  d->marcas = RunMalloc(d->max * sizeof(struct db_marca));
+  assert(d->marcas);
+  d->n = d->pendientes = 0;
+
+#if defined(BDD_MMAP)
+  if (abrir_db(0, buf, que_bdd, &mapeo, NULL) != -1)
+#else
+  if (abrir_db(0, buf, que_bdd, &mapeo) != -1)
+#endif
+  {
+    do
+    {
+      calcula_hash(buf, &hi, &lo);
+      if (++d->pendientes >= DB_DIARIO_PASO)
+        db_diario_marca(que_bdd, atol(buf),
+            mapeo.puntero_r - mapeo.posicion, hi, lo);
+    }
+    while (leer_db(&mapeo, buf) != -1);
+  }
+  cerrar_db(&mapeo);
+}
+
+/*
+** db_diario_busca
+**
+** Ultima marca con numero de serie menor o igual que "serie",
+** o -1 si no hay ninguna.
+*/
+static int db_diario_busca(unsigned char que_bdd, unsigned int serie)
+{
+  struct db_diario *d = &tabla_diario[que_bdd];
+  int lo = 0, hi = d->n, mid;
+
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (d->marcas[mid].serie <= serie)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+
+/*
+** db_hash_en_serie
+**
+** HASH que tenia la tabla justo tras el registro "serie".
+** Devuelve 0 si no tenemos ese registro.
+*/
+static int db_hash_en_serie(unsigned char que_bdd, unsigned int serie,
+    unsigned int *hi, unsigned int *lo)
+{
+  struct db_marca *m;
+  struct tabla_en_memoria mapeo;
+  char buf[1024];
+  unsigned int v;
+  int i, encontrado = 0;
+
+  if (serie == tabla_serie[que_bdd])
+  {
+    *hi = tabla_hash_hi[que_bdd];
+    *lo = tabla_hash_lo[que_bdd];
+    return 1;
+  }
+  *hi = *lo = 0;
+  if (!serie)
+    return 1;
+  if (serie > tabla_serie[que_bdd])
+    return 0;
+
+  db_diario_construye(que_bdd);
+  i = db_diario_busca(que_bdd, serie);
+  if (i >= 0)
+  {
+    m = &tabla_diario[que_bdd].marcas[i];
+    *hi = m->hash_hi;
+    *lo = m->hash_lo;
+    if (m->serie == serie)
+      return 1;
+  }
+
+#if defined(BDD_MMAP)
+  if (abrir_db(0, buf, que_bdd, &mapeo, NULL) != -1)
+#else
+  if (abrir_db(0, buf, que_bdd, &mapeo) != -1)
+#endif
+  {
+    if (i >= 0)
+      mapeo.puntero_r = mapeo.posicion + m->offset;
+    else
+      mapeo.puntero_r = mapeo.posicion;
+    while (leer_db(&mapeo, buf) != -1)
+    {
+      if ((v = atol(buf)) > serie)
+        break;
+      calcula_hash(buf, hi, lo);
+      if (v == serie)
+      {
+        encontrado = 1;
+        break;
+      }
+    }
+  }
+  cerrar_db(&mapeo);
+  return encontrado;
+}
+
 /*
  * db_alta
  *
@@ -2289,6 +2655,7 @@ static void db_alta(char *registro, unsigned char que_bdd, aClient *cptr, aClien
     close(db_file);
 
     almacena_hash(que_bdd);
+    db_diario_apunta(que_bdd, atol(registro), offset + strlen(registro));
   }
 
   p0 = strtok(registro, " ");   /* serie */
@@ -2313,139 +2680,623 @@ static void db_alta(char *registro, unsigned char que_bdd, aClient *cptr, aClien
 }
 
 /*
-** db_pack
+** Compactacion en segundo plano.
 **
-** Elimina los registro superfluos
-** de una Base de Datos Local.
-** 
-** Se invoca cuando se recibe un CheckPoint, y el
-** formato es "serie destino id * texto"
+** Al llegar un CheckPoint se an~ade al fichero como un registro mas,
+** y un proceso hijo escribe "tabla.X.tmp" con los registros que
+** siguen vivos antes de el, mas el propio CheckPoint. El hijo no mira
+** la BDD en memoria (con BDD_MMAP esta en memoria compartida y la
+** seguimos modificando), sino el fichero: un registro sigue vivo si
+** el ultimo registro para nosotros con esa clave no es un borrado y
+** tiene el mismo valor. Es lo mismo que se hacia comparando con la
+** memoria, y el resultado (y el HASH) tiene que ser identico en
+** todos los nodos.
+**
+** Mientras tanto se siguen an~adiendo registros al fichero de
+** siempre, y el HASH es el del fichero sin compactar, que es lo que
+** hay en disco si el servidor cae a medias. Cuando el hijo termina
+** avisa por una pipe; entonces se copian detras los registros que
+** han ido llegando, se recalcula su HASH y se cambia un fichero por
+** otro con rename().
+**
+** Nunca se espera al hijo. Las CheckPoint que llegan mientras tanto
+** se guardan y se compactan por orden al acabar, porque el resultado
+** depende de cada una. Lo que trunca el fichero olvida las que se
+** pierden, y mata al hijo si se pierde la que se esta compactando;
+** lo demas puede leer el fichero sin compactar, que sigue intacto.
+**
+** Si no se puede crear el hijo se compacta aqui mismo, como antes.
 */
-static void db_pack(char *registro, unsigned char que_bdd)
-{
-  int db_file;
-  char path[1024];
-  char *map;
-  char *lectura, *escritura, *p;
-  char *clave, *valor;
-  char c;
-  unsigned int len, len2;
-  struct portable_stat estado;
-  struct db_reg *reg;
+#define DB_COMPACTA_BUF	65536
+
+struct db_compacta_cp {
+  struct db_compacta_cp *next;
+  unsigned int inicio;          /* Donde empieza en el fichero */
+  char registro[1];
+};
+
+struct db_compacta {
+  pid_t pid;                    /* 0 si no hay hijo */
+  int fd;                       /* Pipe por la que avisa el hijo */
+  int cancelada;                /* Al hijo se le ha matado */
+  unsigned int cola;            /* Lo que sigue en el fichero es nuevo */
+  struct db_compacta_cp *espera;  /* CheckPoint pendientes */
+  struct timeval inicio;
+  struct event ev;
+};
+
+static struct db_compacta tabla_compacta[DB_MAX_TABLA];
+static unsigned int db_compactaciones = 0;
+static unsigned int db_compacta_ms = 0;
+static unsigned int db_compacta_max_ms = 0;
 
 /*
-** El primer valor es el numero de serie actual
+** db_compacta_linea
+**
+** Separa la clave y el valor (si no es un borrado) de la linea
+** que empieza en "p", y dice si es para nosotros. Devuelve donde
+** empieza la siguiente linea.
 */
-  tabla_serie[que_bdd] = atol(registro);
+static char *db_compacta_linea(char *p, char *fin, char **clave,
+    int *clave_len, char **valor, int *valor_len, int *para_mi)
+{
+  char buf[1024];
+  char *e, *s1, *s2, *k;
 
-  sprintf_irc(path, "%s/tabla.%c", DBPATH, que_bdd);
-  db_file = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-  get_stat(db_file, &estado);
-  len = estado.size;
+  for (e = p; (e < fin) && (*e != '\n') && (*e != '\r'); e++);
+  *clave = *valor = NULL;
+  *para_mi = 0;
 
-#if defined(BDD_MMAP)
-  if (memcmp(&estado, &tabla_stats[que_bdd], sizeof(estado)))
-    db_die_persistent(&estado, &tabla_stats[que_bdd],
-        "Se detecta una modificacion no autorizada de la BDD (COMPACT)",
-        que_bdd);
-#endif
+  if ((s1 = memchr(p, ' ', e - p)) && (s2 = memchr(s1 + 1, ' ', e - s1 - 1))
+      && (k = memchr(s2 + 1, ' ', e - s2 - 1)))
+  {
+    *clave = ++k;
+    while ((k < e) && (*k != ' '))
+      k++;
+    *clave_len = k - *clave;
+    if (k + 1 < e)
+    {
+      *valor = k + 1;
+      *valor_len = e - *valor;
+    }
 
-  map = mmap(NULL, len, PROT_READ | PROT_WRITE,
-      MAP_SHARED | MAP_NORESERVE, db_file, 0);
-  close(db_file);
+    if ((s2 - s1 == 2) && (s1[1] == '*'))
+      *para_mi = 1;
+    else if (s2 - s1 - 1 < (int)sizeof(buf))
+    {
+      memcpy(buf, s1 + 1, s2 - s1 - 1);
+      buf[s2 - s1 - 1] = '\0';
+      collapse(buf);
+      *para_mi = !match(buf, me.name);
+    }
+  }
+
+  while ((e < fin) && ((*e == '\n') || (*e == '\r')))
+    e++;
+  return e;
+}
+
+/*
+** db_compacta_hueco
+**
+** Hueco de la tabla del hijo para la clave: o el que tiene el ultimo
+** registro con esa clave (desplazamiento + 1), o uno vacio.
+*/
+static unsigned int db_compacta_hueco(char *map, char *fin,
+    unsigned int *huecos, unsigned int tam, char *clave, int clave_len)
+{
+  char buf[1024];
+  char *clave2, *valor2;
+  int clave2_len, valor2_len, para_mi, i;
+  unsigned int h;
+
+  memcpy(buf, clave, clave_len);
+  buf[clave_len] = '\0';
+  for (h = db_hash_registro(buf, tam); huecos[h]; h = (h + 1) & (tam - 1))
+  {
+    db_compacta_linea(map + huecos[h] - 1, fin, &clave2, &clave2_len, &valor2, &valor2_len, &para_mi);
+    if (clave2_len != clave_len)
+      continue;
+    for (i = 0; (i < clave_len) && (toLower(clave[i]) == toLower(clave2[i]));
+        i++);
+    if (i == clave_len)
+      break;
+  }
+  return h;
+}
+
+static int db_compacta_vuelca(int fd, char *salida, int *usado)
+{
+  if (*usado && (write(fd, salida, *usado) != *usado))
+    return -1;
+  *usado = 0;
+  return 0;
+}
+
+/*
+** db_snap_suma
+**
+** FNV-1a de un trozo de la foto.
+*/
+static unsigned int db_snap_suma(unsigned int h, const char *p,
+    unsigned int len)
+{
+  while (len--)
+  {
+    h ^= (unsigned char)*p++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+** db_snap_escribe
+**
+** El hijo que compacta escribe "tabla.X.bin.tmp" a partir del ultimo
+** registro para nosotros de cada clave ("huecos"). "log_len" es lo
+** que ocupa el fichero compactado, CheckPoint incluido.
+*/
+static void db_snap_escribe(unsigned char que_bdd, char *map, char *fin,
+    unsigned int *huecos, unsigned int tam, unsigned int serie,
+    unsigned int log_len, unsigned int hi, unsigned int lo)
+{
+  struct db_snap_cab cab;
+  struct db_snap_reg *regs;
+  unsigned int *cubetas, i, j, n = 0, len, h;
+  char path[1024], buf[1024];
+  char *arena, *clave, *valor;
+  int clave_len, valor_len, para_mi, fd, ok;
+
+  for (i = 0; i < tam; i++)
+  {
+    if (!huecos[i])
+      continue;
+    db_compacta_linea(map + huecos[i] - 1, fin, &clave, &clave_len, &valor,
+        &valor_len, &para_mi);
+    if (valor)
+      n++;
+  }
+
+  len = tabla_residente_y_len[que_bdd];
+  while ((n > len * DB_CARGA_MAX) && (len < DB_LEN_MAX))
+    len <<= 1;
+
+  memset(&cab, 0, sizeof(cab));
+  memcpy(cab.magia, "BDDS", 4);
+  cab.version = DB_SNAP_VERSION;
+  cab.tabla = que_bdd;
+  cab.serie = serie;
+  cab.hash_hi = hi;
+  cab.hash_lo = lo;
+  cab.log_len = log_len;
+  cab.len = len;
+
+  cubetas = RunMalloc(len * sizeof(unsigned int));
+  memset(cubetas, 0, len * sizeof(unsigned int));
+  regs = RunMalloc((n + 1) * sizeof(struct db_snap_reg));
+  arena = RunMalloc(fin - map + 1);
+
+  for (i = 0; i < tam; i++)
+  {
+    if (!huecos[i])
+      continue;
+    db_compacta_linea(map + huecos[i] - 1, fin, &clave, &clave_len, &valor,
+        &valor_len, &para_mi);
+    if (!valor)
+      continue;
+
+    regs[cab.cuantos].clave = cab.arena;
+    for (j = 0; j < clave_len; j++)
+      arena[cab.arena++] = buf[j] = toLower(clave[j]);
+    arena[cab.arena++] = buf[j] = '\0';
+    regs[cab.cuantos].valor = cab.arena;
+    memcpy(arena + cab.arena, valor, valor_len);
+    cab.arena += valor_len;
+    arena[cab.arena++] = '\0';
+
+    h = db_hash_registro(buf, len);
+    regs[cab.cuantos].next = cubetas[h];
+    cubetas[h] = ++cab.cuantos;
+  }
+
+  cab.suma = db_snap_suma(2166136261u, (char *)&cab, sizeof(cab));
+  cab.suma = db_snap_suma(cab.suma, (char *)cubetas, len * sizeof(unsigned int));
+  cab.suma = db_snap_suma(cab.suma, (char *)regs,
+      cab.cuantos * sizeof(struct db_snap_reg));
+  cab.suma = db_snap_suma(cab.suma, arena, cab.arena);
+
+  sprintf_irc(path, "%s/tabla.%c.bin.tmp", DBPATH, que_bdd);
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) != -1)
+  {
+    ok = (write(fd, &cab, sizeof(cab)) == sizeof(cab))
+        && (write(fd, cubetas, len * sizeof(unsigned int)) ==
+        len * sizeof(unsigned int))
+        && (write(fd, regs, cab.cuantos * sizeof(struct db_snap_reg)) ==
+        cab.cuantos * sizeof(struct db_snap_reg))
+        && (write(fd, arena, cab.arena) == cab.arena);
+    close(fd);
+    if (!ok)
+      unlink(path);
+  }
+
+  RunFree(arena);
+  RunFree(regs);
+  RunFree(cubetas);
+}
+
+/*
+** db_compacta_escribe
+**
+** Lo que hace el hijo: escribe "tabla.X.tmp" con lo que sigue vivo en
+** los primeros "inicio" bytes del fichero, mas el CheckPoint.
+*/
+static int db_compacta_escribe(unsigned char que_bdd, char *registro,
+    unsigned int inicio, unsigned int *hi, unsigned int *lo)
+{
+  static char salida[DB_COMPACTA_BUF];
+  char path[1024], buf[1024];
+  char *map = NULL, *fin, *p, *q;
+  char *clave, *valor, *clave2, *valor2;
+  int clave_len, valor_len, clave2_len, valor2_len, para_mi;
+  int db_file, tmp_file, usado = 0, res = 0;
+  unsigned int *huecos = NULL, tam = 16, h, n = 0, escrito = 0;
+
+  *hi = *lo = 0;
+
+  sprintf_irc(path, "%s/tabla.%c.tmp", DBPATH, que_bdd);
+  tmp_file = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (tmp_file == -1)
+    return -1;
+
+  if (inicio)
+  {
+    sprintf_irc(path, "%s/tabla.%c", DBPATH, que_bdd);
+    db_file = open(path, O_RDONLY);
+    map = mmap(NULL, inicio, PROT_READ, MAP_SHARED | MAP_NORESERVE, db_file, 0);
+    close(db_file);
+    if ((db_file == -1) || (map == MAP_FAILED))
+    {
+      close(tmp_file);
+      return -1;
+    }
+    fin = map + inicio;
+
+    for (p = map; (p = memchr(p, '\n', fin - p)); p++)
+      if (tam < 2 * ++n)
+        tam <<= 1;
+    huecos = RunMalloc(tam * sizeof(unsigned int));
+    memset(huecos, 0, tam * sizeof(unsigned int));
+
+/*
+** Primera pasada: ultimo registro para nosotros de cada clave
+*/
+    for (p = map; p < fin; p = q)
+    {
+      q = db_compacta_linea(p, fin, &clave, &clave_len, &valor, &valor_len,
+          &para_mi);
+      if (!clave || !para_mi || (clave_len >= sizeof(buf))
+          || ((clave_len == 1) && (*clave == '*')))
+        continue;
+      h = db_compacta_hueco(map, fin, huecos, tam, clave, clave_len);
+      huecos[h] = p - map + 1;
+    }
+
+/*
+** Segunda pasada: se queda cualquier registro con el valor
+** que tiene ahora su clave
+*/
+    for (p = map; p < fin; p = q)
+    {
+      q = db_compacta_linea(p, fin, &clave, &clave_len, &valor, &valor_len,
+          &para_mi);
+      if (!clave || !valor || (q - p >= sizeof(buf))
+          || ((clave_len == 1) && (*clave == '*')))
+        continue;
+      h = db_compacta_hueco(map, fin, huecos, tam, clave, clave_len);
+      if (!huecos[h])
+        continue;
+      db_compacta_linea(map + huecos[h] - 1, fin, &clave2, &clave2_len,
+          &valor2, &valor2_len, &para_mi);
+      if (!valor2 || (valor2_len != valor_len)
+          || memcmp(valor, valor2, valor_len))
+        continue;
+
+      memcpy(buf, p, valor + valor_len - p);
+      buf[valor + valor_len - p] = '\0';
+      calcula_hash(buf, hi, lo);
+
+      if ((usado + (q - p) > sizeof(salida))
+          && (db_compacta_vuelca(tmp_file, salida, &usado) == -1))
+      {
+        res = -1;
+        break;
+      }
+      memcpy(salida + usado, p, q - p);
+      usado += q - p;
+      escrito += q - p;
+    }
+  }
+
+  if ((res != -1) && (db_compacta_vuelca(tmp_file, salida, &usado) != -1)
+      && (write(tmp_file, registro, strlen(registro)) != -1))
+  {
+    calcula_hash(registro, hi, lo);
+    escrito += strlen(registro);
+    if (huecos)
+      db_snap_escribe(que_bdd, map, fin, huecos, tam, atol(registro),
+          escrito, *hi, *lo);
+  }
+  else
+    res = -1;
+
+  if (huecos)
+  {
+    RunFree(huecos);
+    munmap(map, inicio);
+  }
+  close(tmp_file);
+  return res;
+}
+
+/*
+** db_compacta_cambia
+**
+** El hijo ha terminado bien: se copia detras lo que ha llegado
+** mientras tanto y se cambia el fichero.
+*/
+static void db_compacta_cambia(unsigned char que_bdd, unsigned int hi,
+    unsigned int lo)
+{
+  struct db_compacta *c = &tabla_compacta[que_bdd];
+  struct db_compacta_cp *cp;
+  struct tabla_en_memoria mapeo;
+  struct portable_stat estado;
+  struct timeval t;
+  char path[1024], path2[1024], buf[1024];
+  int db_file, tmp_file;
+  unsigned int len, ms, base;
+
+  sprintf_irc(path, "%s/tabla.%c", DBPATH, que_bdd);
+  sprintf_irc(path2, "%s/tabla.%c.tmp", DBPATH, que_bdd);
+  db_file = open(path, O_RDONLY);
   if (db_file == -1)
     db_die("Error al intentar compactar (open)", que_bdd);
-  if ((len != 0) && (map == MAP_FAILED))
-    db_die("Error al intentar compactar (mmap)", que_bdd);
+  get_stat(db_file, &estado);
 
-  if (!tabla_residente_y_len[que_bdd])
-  {                             /* No residente -> No pack */
-    escritura = map + len;
-    goto fin;
-  }
+#if defined(BDD_MMAP)
+  if (memcmp(&estado, &tabla_stats[que_bdd], sizeof(estado)))
+    db_die_persistent(&estado, &tabla_stats[que_bdd],
+        "Se detecta una modificacion no autorizada de la BDD (COMPACT)",
+        que_bdd);
+#endif
 
-  tabla_hash_hi[que_bdd] = 0;
-  tabla_hash_lo[que_bdd] = 0;
+  tmp_file = open(path2, O_WRONLY | O_APPEND);
+  if (tmp_file == -1)
+    db_die("Error al intentar compactar (open-2)", que_bdd);
+  base = lseek(tmp_file, 0, SEEK_END);
 
-  p = lectura = escritura = map;
-  while (lectura < map + len)
+  len = estado.size - c->cola;
+  if (len)
   {
-    p = strchr(p, ' ') + 1;     /* Destino */
-    p = strchr(p, ' ') + 1;     /* BDD */
-    valor = clave = p = strchr(p, ' ') + 1; /* Clave */
-    while ((p < map + len) && (*p != '\n') && (*p != '\r'))
-      p++;
-    while ((*valor != ' ') && (valor < p))
-      valor++;
-    valor++;                    /* Nos saltamos el espacio */
+    mapeo.len = estado.size;
+    mapeo.posicion = mmap(NULL, mapeo.len, PROT_READ,
+        MAP_SHARED | MAP_NORESERVE, db_file, 0);
+    if (mapeo.posicion == MAP_FAILED)
+      db_die("Error al intentar compactar (mmap)", que_bdd);
+    if (write(tmp_file, mapeo.posicion + c->cola, len) != len)
+      db_die("Error al intentar compactar (write)", que_bdd);
+    mapeo.puntero_r = mapeo.posicion + c->cola;
+    while (leer_db(&mapeo, buf) != -1)
+      calcula_hash(buf, &hi, &lo);
+    cerrar_db(&mapeo);
+  }
+  close(db_file);
+
+#if defined(BDD_MMAP)
+  get_stat(tmp_file, &tabla_stats[que_bdd]);
+#endif
+  close(tmp_file);
+
+  if (rename(path2, path) == -1)
+    db_die("Error al intentar compactar (rename)", que_bdd);
+
+  sprintf_irc(path, "%s/tabla.%c.bin", DBPATH, que_bdd);
+  sprintf_irc(path2, "%s/tabla.%c.bin.tmp", DBPATH, que_bdd);
+  if (rename(path2, path) == -1)
+    unlink(path);               /* La que hubiera ya no vale */
+
+  tabla_hash_hi[que_bdd] = hi;
+  tabla_hash_lo[que_bdd] = lo;
+  almacena_hash(que_bdd);
+  db_diario_borra(que_bdd);
 
 /*
-** Los registros "*" son borrados automaticamente
-** al compactar, porque no aparecen en la
-** base de datos en memoria.
+** Las CheckPoint pendientes estan en la cola, que se ha movido
+*/
+  for (cp = c->espera; cp; cp = cp->next)
+    cp->inicio = cp->inicio - c->cola + base;
+
+  gettimeofday(&t, NULL);
+  ms = (t.tv_sec - c->inicio.tv_sec) * 1000 +
+      (t.tv_usec - c->inicio.tv_usec) / 1000;
+  db_compactaciones++;
+  db_compacta_ms = ms;
+  if (ms > db_compacta_max_ms)
+    db_compacta_max_ms = ms;
+  Debug((DEBUG_INFO, "BDD '%c' compactada en %u ms", que_bdd, ms));
+}
+
+static void db_compacta_termina(unsigned char que_bdd);
+static void event_db_compacta_callback(int fd, short event, void *arg);
+
+/*
+** db_compacta_lanza
 **
-** Solo se mantiene el nuevo, porque es
-** el que se graba tras la compactacion
+** Compacta hasta la CheckPoint "registro", que empieza en "inicio".
 */
-    if (valor < p)
-    {                           /* Nuevo registro, no un borrado */
-      *(valor - 1) = '\0';
-      reg = db_buscar_registro(que_bdd, clave);
-      *(valor - 1) = ' ';
-      if (reg != NULL)
-      {                         /* El registro sigue existiendo */
+static void db_compacta_lanza(unsigned char que_bdd, char *registro,
+    unsigned int inicio)
+{
+  struct db_compacta *c = &tabla_compacta[que_bdd];
+  unsigned int res[2];
+  int pi[2], i;
+
+  gettimeofday(&c->inicio, NULL);
+  c->cola = inicio + strlen(registro);
+
+  if ((pipe(pi) == -1) || ((c->pid = fork()) == -1))
+  {
+    if (c->pid == -1)
+    {
+      close(pi[0]);
+      close(pi[1]);
+    }
+    c->pid = 0;
+    if (db_compacta_escribe(que_bdd, registro, inicio, &res[0], &res[1]) == -1)
+      db_die("Error al intentar compactar", que_bdd);
+    db_compacta_cambia(que_bdd, res[0], res[1]);
+    return;
+  }
 
-        len2 = strlen(reg->valor);
-        if ((valor + len2 == p) && (!strncmp(valor, reg->valor, len2)))
-        {                       /* !!El mismo!! */
+  if (!c->pid)
+  {                             /* Hijo */
+    close(pi[0]);
+    for (i = 3; i < MAXCONNECTIONS; i++)
+      if (i != pi[1])
+        close(i);
+    if (db_compacta_escribe(que_bdd, registro, inicio, &res[0], &res[1]) == -1)
+      _exit(1);
+    write(pi[1], res, sizeof(res));
+    _exit(0);
+  }
+
+  close(pi[1]);
+  c->fd = pi[0];
+  event_set(&c->ev, c->fd, EV_READ, event_db_compacta_callback,
+      (void *)(long)que_bdd);
+  if (event_add(&c->ev, NULL) == -1)
+    db_compacta_termina(que_bdd);       /* Sin evento hay que esperarle */
+}
 
 /*
-** Actualizamos HASH
+** db_compacta_termina
+**
+** El hijo ha avisado (o ha muerto): se le recoge y se sigue con
+** las CheckPoint que estuvieran esperando.
 */
-          if ((*p == '\n') || (*p == '\r'))
-          {
-            c = *p;
-            *p = '\0';
-            actualiza_hash(lectura, que_bdd);
-            *p = c;
-          }
-          else
-          {                     /* Estamos al final y no hay retorno de carro */
-            char temp[1024];
+static void db_compacta_termina(unsigned char que_bdd)
+{
+  struct db_compacta *c = &tabla_compacta[que_bdd];
+  struct db_compacta_cp *cp;
+  unsigned int res[2];
+  char path[1024];
+  int n;
 
-            memcpy(temp, lectura, p - lectura);
-            temp[p - lectura] = '\0';
-            actualiza_hash(temp, que_bdd);
-          }
+  if (!c->pid)
+    return;
 
-          while ((p < map + len) && ((*p == '\n') || (*p == '\r')))
-            p++;
-          memcpy(escritura, lectura, p - lectura);
-          escritura += p - lectura;
-          lectura = p;
-          continue;             /* MUY IMPORTANTE */
-        }                       /* Hay otro mas moderno que este */
-      }                         /* El registro fue borrado */
-    }                           /* Es un borrado */
-    while ((p < map + len) && ((*p == '\n') || (*p == '\r')))
-      p++;
-    lectura = p;
+  event_del(&c->ev);
+  n = read(c->fd, res, sizeof(res));
+  close(c->fd);
+  waitpid(c->pid, NULL, 0);     /* Ya ha cerrado la pipe */
+  c->pid = 0;
+
+  if ((n == sizeof(res)) && !c->cancelada)
+    db_compacta_cambia(que_bdd, res[0], res[1]);
+  else
+  {
+    if (!c->cancelada)
+      sendto_ops("Error al compactar la BDD '%c'. Se deja sin compactar",
+          que_bdd);
+    sprintf_irc(path, "%s/tabla.%c.tmp", DBPATH, que_bdd);
+    unlink(path);
+    sprintf_irc(path, "%s/tabla.%c.bin.tmp", DBPATH, que_bdd);
+    unlink(path);
   }
+  c->cancelada = 0;
 
-fin:
+  while (!c->pid && (cp = c->espera))
+  {
+    c->espera = cp->next;
+    db_compacta_lanza(que_bdd, cp->registro, cp->inicio);
+    RunFree(cp);
+  }
+}
 
-  munmap(map, len);
+static void event_db_compacta_callback(int UNUSED(fd), short UNUSED(event),
+    void *arg)
+{
+  db_compacta_termina((unsigned char)(long)arg);
+}
 
-  if (truncate(path, escritura - map) == -1)
+/*
+** db_compacta_recorta
+**
+** El fichero se va a quedar en "len" bytes: se olvidan las CheckPoint
+** que se pierden y, si se pierde la que se esta compactando, se mata
+** al hijo. Se le recoge igualmente en event_db_compacta_callback.
+*/
+static void db_compacta_recorta(unsigned char que_bdd, unsigned int len)
+{
+  struct db_compacta *c = &tabla_compacta[que_bdd];
+  struct db_compacta_cp **p, *cp;
+
+  for (p = &c->espera; *p && ((*p)->inicio < len); p = &(*p)->next);
+  while ((cp = *p))
+  {
+    *p = cp->next;
+    RunFree(cp);
+  }
+
+  if (c->pid && !c->cancelada && (c->cola > len))
   {
-    db_die("Error al intentar compactar (truncate)", que_bdd);
+    kill(c->pid, SIGKILL);
+    c->cancelada = !0;
   }
+}
+
+/*
+** db_pack
+**
+** Elimina los registro superfluos
+** de una Base de Datos Local.
+** 
+** Se invoca cuando se recibe un CheckPoint, y el
+** formato es "serie destino id * texto"
+*/
+static void db_pack(char *registro, unsigned char que_bdd)
+{
+  struct db_compacta *c = &tabla_compacta[que_bdd];
+  struct db_compacta_cp **p, *cp;
+  struct portable_stat estado;
+  char path[1024];
+  int db_file;
+  unsigned int inicio;
+
+/*
+** El primer valor es el numero de serie actual
+*/
+  tabla_serie[que_bdd] = atol(registro);
+
+  sprintf_irc(path, "%s/tabla.%c", DBPATH, que_bdd);
   db_file = open(path, O_RDWR | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
   if (db_file == -1)
+    db_die("Error al intentar compactar (open)", que_bdd);
+  get_stat(db_file, &estado);
+  inicio = estado.size;
+
+#if defined(BDD_MMAP)
+  if (memcmp(&estado, &tabla_stats[que_bdd], sizeof(estado)))
+    db_die_persistent(&estado, &tabla_stats[que_bdd],
+        "Se detecta una modificacion no autorizada de la BDD (COMPACT)",
+        que_bdd);
+#endif
+
+  if (write(db_file, registro, strlen(registro)) == -1) /* CheckPoint */
   {
-    db_die("Error al intentar compactar (open-2)", que_bdd);
+    ftruncate(db_file, inicio);
+    db_die("Error al intentar compactar (write)", que_bdd);
   }
-  write(db_file, registro, strlen(registro)); /* CheckPoint */
 
 #if defined(BDD_MMAP)
   get_stat(db_file, &tabla_stats[que_bdd]);
@@ -2454,6 +3305,46 @@ fin:
   close(db_file);
   actualiza_hash(registro, que_bdd);
   almacena_hash(que_bdd);
+  db_diario_apunta(que_bdd, tabla_serie[que_bdd], inicio + strlen(registro));
+
+  if (!tabla_residente_y_len[que_bdd])
+    return;                     /* No residente -> No pack */
+
+/*
+** Si aun no ha terminado la anterior, espera su turno
+*/
+  if (c->pid)
+  {
+    for (p = &c->espera; *p; p = &(*p)->next);
+    *p = cp = RunMalloc(sizeof(struct db_compacta_cp) + strlen(registro));
+    assert(cp);
+    cp->next = NULL;
+    cp->inicio = inicio;
+    strcpy(cp->registro, registro);
+    return;
+  }
+
+  db_compacta_lanza(que_bdd, registro, inicio);
+}
+
+/*
+ * db_report
+ *
+ * Compactaciones y fotos de la BDD, para /STATS t.
+ */
+void db_report(aClient *cptr, char *name)
+{
+  unsigned int i, en_curso = 0;
+
+  for (i = 0; i < DB_MAX_TABLA; i++)
+    if (tabla_compacta[i].pid)
+      en_curso++;
+
+  sendto_one(cptr, ":%s %d %s :bdd compactions %u running %u "
+      "last %u ms max %u ms", me.name, RPL_STATSDEBUG, name,
+      db_compactaciones, en_curso, db_compacta_ms, db_compacta_max_ms);
+  sendto_one(cptr, ":%s %d %s :bdd snapshots loaded %u records %u",
+      me.name, RPL_STATSDEBUG, name, db_snap_tablas, db_snap_registros);
 }
 
 /*
@@ -2472,27 +3363,42 @@ static void borrar_db(unsigned char que_bdd)
   tabla_cuantos[que_bdd] = 0;
   tabla_hash_hi[que_bdd] = 0;
   tabla_hash_lo[que_bdd] = 0;
+  db_diario_borra(que_bdd);
 
   n = tabla_residente_y_len[que_bdd];
   if (!n)
     return;
 
+  db_rehash_completa(que_bdd);
+
   if (tabla_datos[que_bdd])
   {
-    for (i = 0; i < n; i++)
+    for (i = 0; i < tabla_len[que_bdd]; i++)
     {
       for (reg = tabla_datos[que_bdd][i]; reg != NULL; reg = reg2)
       {
         reg2 = reg->next;
-        p_free(reg);
+        db_libera_reg(que_bdd, reg);
       }
     }
+    if (tabla_len[que_bdd] != n)
+    {                           /* Vuelve al taman~o inicial */
+      p_free(tabla_datos[que_bdd]);
+      tabla_datos[que_bdd] = NULL;
+    }
   }
-  else
+  if (tabla_snap[que_bdd].map)
+  {
+    RunFree(tabla_snap[que_bdd].regs);
+    munmap(tabla_snap[que_bdd].map, tabla_snap[que_bdd].map_len);
+    memset(&tabla_snap[que_bdd], 0, sizeof(tabla_snap[que_bdd]));
+  }
+  if (!tabla_datos[que_bdd])
   {                             /* NO tenemos memoria para esa tabla, asi que la pedimos */
     tabla_datos[que_bdd] = p_malloc(n * sizeof(struct db_reg *));
     assert(tabla_datos[que_bdd]);
   }
+  tabla_len[que_bdd] = n;
 
   for (i = 0; i < n; i++)
   {
@@ -2544,13 +3450,170 @@ static void corta_si_multiples_hubs(aClient *cptr, unsigned char que_bdd,
   }
 }
 
+/*
+** db_snap_directa
+**
+** Si las altas de la tabla no hacen nada al arrancar, los registros
+** pueden apuntar directamente a la foto.
+*/
+static int db_snap_directa(unsigned char tabla)
+{
+#if defined(BDD_MMAP)
+  return 0;
+#else
+  switch (tabla)
+  {
+    case BDD_BOTSDB:
+    case BDD_CHANDB:
+    case BDD_FEATURESDB:
+    case BDD_SPAMDB:
+    case BDD_CONFIGDB:
+    case BDD_IPVIRTUALDB:
+      return 0;
+  }
+  return 1;
+#endif
+}
+
+/*
+** db_snap_carga
+**
+** Carga la foto de la tabla, si es valida y el fichero sigue teniendo
+** el CheckPoint donde ella dice. Devuelve por donde hay que seguir
+** leyendo el fichero, o 0 si no se ha podido usar.
+*/
+static unsigned int db_snap_carga(unsigned char que_bdd)
+{
+  struct db_snap *s = &tabla_snap[que_bdd];
+  struct db_snap_cab cab;
+  struct db_snap_reg *regs;
+  struct portable_stat estado;
+  struct db_reg *reg;
+  unsigned int *cubetas, i, suma, n;
+  char path[1024], buf[1024];
+  char *map, *arena, *p;
+  int fd;
+
+  if (!tabla_residente_y_len[que_bdd])
+    return 0;
+
+  sprintf_irc(path, "%s/tabla.%c.bin", DBPATH, que_bdd);
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return 0;
+  get_stat(fd, &estado);
+  if (estado.size < sizeof(cab))
+  {
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, estado.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  memcpy(&cab, map, sizeof(cab));
+  suma = cab.suma;
+  cab.suma = 0;
+  cubetas = (unsigned int *)(map + sizeof(cab));
+  regs = (struct db_snap_reg *)(cubetas + cab.len);
+  arena = (char *)(regs + cab.cuantos);
+
+  if (memcmp(cab.magia, "BDDS", 4) || (cab.version != DB_SNAP_VERSION)
+      || (cab.tabla != que_bdd) || (cab.len > DB_LEN_MAX)
+      || (cab.len < tabla_residente_y_len[que_bdd])
+      || (cab.len & (cab.len - 1)) || (cab.cuantos > estado.size)
+      || (cab.arena > estado.size) || (estado.size != sizeof(cab) +
+      cab.len * sizeof(unsigned int) +
+      cab.cuantos * sizeof(struct db_snap_reg) + cab.arena)
+      || (cab.arena && arena[cab.arena - 1])
+      || (db_snap_suma(db_snap_suma(2166136261u, (char *)&cab, sizeof(cab)),
+      map + sizeof(cab), estado.size - sizeof(cab)) != suma))
+    goto mala;
+  for (i = 0; i < cab.len; i++)
+    if (cubetas[i] > cab.cuantos)
+      goto mala;
+  for (i = 0; i < cab.cuantos; i++)
+    if ((regs[i].clave >= cab.arena) || (regs[i].valor >= cab.arena)
+        || (regs[i].next > cab.cuantos))
+      goto mala;
+
+/*
+** El CheckPoint tiene que seguir donde estaba
+*/
+  sprintf_irc(path, "%s/tabla.%c", DBPATH, que_bdd);
+  if (!cab.log_len || ((fd = open(path, O_RDONLY)) == -1))
+    goto mala;
+  n = (cab.log_len < sizeof(buf)) ? cab.log_len : sizeof(buf) - 1;
+  i = (pread(fd, buf, n, cab.log_len - n) == n);
+  close(fd);
+  if (!i || (buf[n - 1] != '\n'))
+    goto mala;
+  buf[n - 1] = '\0';
+  if ((p = strrchr(buf, '\n')))
+    p++;
+  else if (n == cab.log_len)
+    p = buf;
+  else
+    goto mala;
+  if ((atol(p) != cab.serie) || !(p = strchr(p, ' '))
+      || !(p = strchr(p + 1, ' ')) || !(p = strchr(p + 1, ' '))
+      || (p[1] != '*') || ((p[2] != ' ') && (p[2] != '\0')))
+    goto mala;
+
+  if (db_snap_directa(que_bdd))
+  {
+    if (cab.len != tabla_len[que_bdd])
+    {
+      p_free(tabla_datos[que_bdd]);
+      tabla_datos[que_bdd] = p_malloc(cab.len * sizeof(struct db_reg *));
+      assert(tabla_datos[que_bdd]);
+      tabla_len[que_bdd] = cab.len;
+    }
+    s->regs = RunMalloc((cab.cuantos + 1) * sizeof(struct db_reg));
+    for (i = 0; i < cab.cuantos; i++)
+    {
+      reg = &s->regs[i];
+      reg->clave = arena + regs[i].clave;
+      reg->valor = arena + regs[i].valor;
+      reg->next = regs[i].next ? &s->regs[regs[i].next - 1] : NULL;
+    }
+    for (i = 0; i < cab.len; i++)
+      tabla_datos[que_bdd][i] = cubetas[i] ? &s->regs[cubetas[i] - 1] : NULL;
+    tabla_cuantos[que_bdd] = cab.cuantos;
+    s->map = map;
+    s->map_len = estado.size;
+    s->cuantos = cab.cuantos;
+  }
+  else
+  {
+    for (i = 0; i < cab.cuantos; i++)
+      db_insertar_registro(que_bdd, arena + regs[i].clave,
+          arena + regs[i].valor, NULL, NULL);
+    munmap(map, estado.size);
+  }
+
+  tabla_serie[que_bdd] = cab.serie;
+  tabla_hash_hi[que_bdd] = cab.hash_hi;
+  tabla_hash_lo[que_bdd] = cab.hash_lo;
+  db_snap_tablas++;
+  db_snap_registros += cab.cuantos;
+  Debug((DEBUG_INFO, "BDD '%c': foto con %u registros hasta el %u",
+      que_bdd, cab.cuantos, cab.serie));
+  return cab.log_len;
+
+mala:
+  munmap(map, estado.size);
+  return 0;
+}
+
 /*
  * initdb2
  *
- * Lee la base de datos de disco
+ * Lee la base de datos de disco (a partir de la foto, si "foto"
+ * y la hay)
  *
  */
-static void initdb2(unsigned char que_bdd)
+static void initdb2(unsigned char que_bdd, int foto)
 {
   unsigned int hi, lo;
   char buf[1024];
@@ -2562,15 +3625,25 @@ static void initdb2(unsigned char que_bdd)
   char *destino, *p = NULL, *p2, *p3;
   int p_len = 0;
   char str[13];
+  unsigned int desde = 0;
 
   borrar_db(que_bdd);
 
+  if (foto && !(bootopt & BOOT_BDDCHECK))
+    desde = db_snap_carga(que_bdd);
+
 #if defined(BDD_MMAP)
   res = abrir_db(0, buf, que_bdd, &mapeo, &tabla_stats[que_bdd]);
 #else
   res = abrir_db(0, buf, que_bdd, &mapeo);
 #endif
 
+  if (desde)
+  {                             /* Solo lo posterior a la foto */
+    mapeo.puntero_r = mapeo.posicion + desde;
+    res = leer_db(&mapeo, buf);
+  }
+
   if (res != -1)
     do
     {
@@ -2656,11 +3729,22 @@ static void initdb2(unsigned char que_bdd)
     str[12]='\0';
     fprintf(stderr, "%c %s\n",que_bdd,str);
   }
+  else if (desde && ((tabla_hash_hi[que_bdd] != hi)
+      || (tabla_hash_lo[que_bdd] != lo)))
+  {
+    sendto_ops("La foto de la BDD '%c' no cuadra. Leyendo la tabla entera...",
+        que_bdd);
+    sprintf_irc(path, "%s/tabla.%c.bin", DBPATH, que_bdd);
+    unlink(path);
+    initdb2(que_bdd, 0);
+    return;
+  }
   else if ((tabla_hash_hi[que_bdd] != hi) || (tabla_hash_lo[que_bdd] != lo))
   {
     sendto_ops("ATENCION - Base de Datos "
         "'%c' aparentemente corrupta. Borrando...", que_bdd);
     borrar_db(que_bdd);
+    db_compacta_recorta(que_bdd, 0);
     sprintf_irc(path, "%s/tabla.%c", DBPATH, que_bdd);
     fd = open(path, O_TRUNC, S_IRUSR | S_IWUSR);
 
@@ -2736,7 +3820,7 @@ void initdb(void)
   char c;
 #if defined(BDD_MMAP)
   int i;
-  struct db_reg *reg;
+  const struct db_reg *reg;
 #endif
 
   if (bdd_initialized == 0)
@@ -2745,9 +3829,9 @@ void initdb(void)
   memset(tabla_residente_y_len, 0, sizeof(tabla_residente_y_len));
 
 /*
-** Las longitudes DEBEN ser potencias de 2,
-** y no deben ser superiores a HASHSIZE, ya que ello
-** solo desperdiciaria memoria.
+** Las longitudes DEBEN ser potencias de 2.
+** Son el taman~o inicial: las tablas crecen (y vuelven
+** a encoger hasta aqui) segun los registros que tengan.
 */
   tabla_residente_y_len[ESNET_NICKDB] = 32768;
 #if defined(BDD_CLONES)
@@ -2779,7 +3863,7 @@ void initdb(void)
   if (!cache)
   {
     for (c = ESNET_BDD; c <= ESNET_BDD_END; c++)
-      initdb2(c);
+      initdb2(c, 1);
   }
   else
   {
@@ -2794,7 +3878,7 @@ void initdb(void)
 */
 
 #if defined(BDD_MMAP)
-    i = tabla_residente_y_len[BDD_CHANDB];
+    i = tabla_len[BDD_CHANDB];
     assert(i);
     for (i--; i >= 0; i--)
     {
@@ -2926,6 +4010,147 @@ static void bdd_init()
   bdd_initialized = 1;
 }
 
+/*
+** db_envia_j
+**
+** Pide a "cptr" los registros posteriores a los nuestros. El HASH
+** va pegado a la tabla, asi que los nodos que no lo entienden solo
+** ven la tabla (solo miran el primer caracter).
+*/
+static void db_envia_j(aClient *cptr, char *destino, unsigned char que_bdd,
+    char tabla)
+{
+  char hash[13];
+
+/*
+** Compactando, nuestro HASH aun es el de sin compactar
+*/
+  if (tabla_compacta[que_bdd].pid)
+  {
+    sendto_one(cptr, "%s DB %s 0 J %u %c", NumServ(&me), destino,
+        tabla_serie[que_bdd], tabla);
+    return;
+  }
+
+  inttobase64(hash, tabla_hash_hi[que_bdd], 6);
+  inttobase64(hash + 6, tabla_hash_lo[que_bdd], 6);
+  sendto_one(cptr, "%s DB %s 0 J %u %c%s", NumServ(&me), destino,
+      tabla_serie[que_bdd], tabla, hash);
+}
+
+/*
+** db_lee_hash
+**
+** HASH pegado a la tabla en un "J" o un "H".
+*/
+static int db_lee_hash(char *param, unsigned int *hi, unsigned int *lo)
+{
+  char buf[7];
+
+  if (strlen(param) != 13)
+    return 0;
+  memcpy(buf, param + 1, 6);
+  buf[6] = '\0';
+  *hi = base64toint(buf);
+  memcpy(buf, param + 7, 6);
+  *lo = base64toint(buf);
+  return 1;
+}
+
+/*
+** db_trunca
+**
+** Deja la tabla como estaba en la marca (o vacia, si no hay marca)
+** y la vuelve a leer.
+*/
+static void db_trunca(unsigned char que_bdd, struct db_marca *m)
+{
+  char path[1024];
+  int db_file;
+
+  db_compacta_recorta(que_bdd, m ? m->offset : 0);
+  sprintf_irc(path, "%s/tabla.%c", DBPATH, que_bdd);
+  if (m)
+  {
+    if (truncate(path, m->offset) == -1)
+      db_die("Error al intentar truncar (truncate)", que_bdd);
+    tabla_hash_hi[que_bdd] = m->hash_hi;
+    tabla_hash_lo[que_bdd] = m->hash_lo;
+    almacena_hash(que_bdd);
+    initdb2(que_bdd, 0);
+    return;
+  }
+
+  db_file = open(path, O_TRUNC, S_IRUSR | S_IWUSR);
+  if (db_file == -1)
+    db_die("Error al intentar truncar (open)", que_bdd);
+#if defined(BDD_MMAP)
+  get_stat(db_file, &tabla_stats[que_bdd]);
+#endif
+  close(db_file);
+  borrar_db(que_bdd);
+  almacena_hash(que_bdd);
+}
+
+/*
+** db_diverge
+**
+** El HUB dice que nuestra tabla no coincide con la suya en "serie".
+** Le proponemos una marca anterior, doblando cada vez la distancia
+** al final del diario; si ya no quedan, empezamos desde cero.
+*/
+static void db_diverge(aClient *cptr, unsigned char que_bdd,
+    unsigned int serie)
+{
+  struct db_marca *m;
+  char hash[13];
+  int n, p, q;
+
+  db_diario_construye(que_bdd);
+  n = tabla_diario[que_bdd].n;
+  p = (serie >= tabla_serie[que_bdd]) ? n : db_diario_busca(que_bdd, serie);
+  q = n - 2 * (n - p) - 1;
+
+  if (q < 0)
+  {
+    sendto_ops("BDD '%c' no coincide con la de %s. Borrando...",
+        que_bdd, cptr->name);
+    db_trunca(que_bdd, NULL);
+    db_envia_j(cptr, cptr->name, que_bdd, que_bdd);
+    return;
+  }
+
+  m = &tabla_diario[que_bdd].marcas[q];
+  inttobase64(hash, m->hash_hi, 6);
+  inttobase64(hash + 6, m->hash_lo, 6);
+  sendto_one(cptr, "%s DB %s 0 H %u %c%s", NumServ(&me), cptr->name,
+      m->serie, que_bdd, hash);
+}
+
+/*
+** db_coincide
+**
+** El HUB confirma que coincidimos hasta "serie" (una marca nuestra):
+** truncamos ahi y le pedimos el resto.
+*/
+static void db_coincide(aClient *cptr, unsigned char que_bdd,
+    unsigned int serie)
+{
+  struct db_marca m;
+  int i;
+
+  db_diario_construye(que_bdd);
+  i = db_diario_busca(que_bdd, serie);
+  if ((i < 0) || (tabla_diario[que_bdd].marcas[i].serie != serie))
+    return;
+
+  m = tabla_diario[que_bdd].marcas[i];
+  sendto_ops("BDD '%c' no coincide con la de %s. "
+      "Se conserva hasta el registro %u", que_bdd, cptr->name, serie);
+  db_trunca(que_bdd, &m);
+  db_envia_j(cptr, cptr->name, que_bdd, que_bdd);
+}
+
 /*
  * reload_db
  *
@@ -2962,14 +4187,12 @@ void tx_num_serie_dbs(aClient *cptr)
 #endif
 
 /* La tabla 'n' es un poco especial... */
-  sendto_one(cptr, "%s DB * 0 J %u 2", NumServ(&me),
-      db_num_serie(ESNET_NICKDB));
+  db_envia_j(cptr, "*", ESNET_NICKDB, '2');
 
   for (cont = ESNET_BDD; cont <= ESNET_BDD_END; cont++)
   {
     if (cont != ESNET_NICKDB)   /* No mandamos nicks de nuevo */
-      sendto_one(cptr, "%s DB * 0 J %u %c",
-          NumServ(&me), tabla_serie[cont], cont);
+      db_envia_j(cptr, "*", cont, cont);
   }
 
 #if defined(ESNET_NEG) && defined(ZLIB_ESNET)
@@ -2999,6 +4222,8 @@ int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[])
   unsigned char que_bdd = ESNET_NICKDB;
   unsigned int mascara_bdd = 0;
   int cont;
+  int hay_hash = 0;
+  unsigned int hash_hi = 0, hash_lo = 0, hi, lo;
 #if defined(BDD_MMAP)
   struct portable_stat st;
 #endif
@@ -3014,6 +4239,7 @@ int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[])
     db = atol(parv[4]);
     if (parc == 6)
     {
+      hay_hash = db_lee_hash(parv[5], &hash_hi, &hash_lo);
       que_bdd = *parv[5];
       if ((que_bdd < 'a') || (que_bdd > 'z'))
       {
@@ -3041,8 +4267,33 @@ int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[])
     {
       case 'B':
         if (es_hub)
-          sendto_one(sptr, "%s DB %s 0 J %u %c",
-              NumServ(&me), parv[0], tabla_serie[que_bdd], que_bdd);
+          db_envia_j(sptr, parv[0], que_bdd, que_bdd);
+        return 0;
+        break;
+      case 'H':                /* Prueba de una marca del diario */
+        if ((que_bdd < ESNET_BDD) || (que_bdd > ESNET_BDD_END) || !hay_hash)
+          return 0;
+/*
+** Compactando, el diario sigue siendo el del fichero sin
+** compactar, que es el que hay en disco
+*/
+        if (db_hash_en_serie(que_bdd, db, &hi, &lo) && (hi == hash_hi)
+            && (lo == hash_lo))
+          sendto_one(sptr, "%s DB %s 0 K %u %c",
+              NumServ(&me), sptr->name, db, que_bdd);
+        else
+          sendto_one(sptr, "%s DB %s 0 M %u %c",
+              NumServ(&me), sptr->name, db, que_bdd);
+        return 0;
+        break;
+      case 'M':                /* Nuestra tabla no coincide con la suya */
+        if (es_hub && (que_bdd >= ESNET_BDD) && (que_bdd <= ESNET_BDD_END))
+          db_diverge(sptr, que_bdd, db);
+        return 0;
+        break;
+      case 'K':                /* Coincidimos hasta esa marca */
+        if (es_hub && (que_bdd >= ESNET_BDD) && (que_bdd <= ESNET_BDD_END))
+          db_coincide(sptr, que_bdd, db);
         return 0;
         break;
       case 'J':
@@ -3052,7 +4303,27 @@ int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[])
 ** limitar el LAG y el caudal
 ** consumido.
 */
-        cont = 1000;
+        cont = DB_BURST_VENTANA;
+#if defined(ESNET_NEG) && defined(ZLIB_ESNET)
+        if (cptr->negociacion & ZLIB_ESNET_OUT)
+          cont = DB_BURST_VENTANA_ZLIB;
+#endif
+/*
+** Si nos manda su HASH, comprobamos que hasta su
+** numero de serie tenga lo mismo que nosotros. Si
+** no, se busca donde empiezan a diferir. Si estamos
+** compactando no se puede saber hasta que acabemos.
+*/
+        if (hay_hash && (db <= tabla_serie[que_bdd])
+            && !tabla_compacta[que_bdd].pid
+            && (!db_hash_en_serie(que_bdd, db, &hi, &lo) || (hi != hash_hi)
+            || (lo != hash_lo)))
+        {
+          sptr->serv->esnet_db &= ~mascara_bdd;
+          sendto_one(sptr, "%s DB %s 0 M %u %c",
+              NumServ(&me), sptr->name, db, que_bdd);
+          return 0;
+        }
         if (db >= tabla_serie[que_bdd])
         {                       /* Se le pueden mandar registros individuales */
           sptr->serv->esnet_db |= mascara_bdd;
@@ -3181,6 +4452,7 @@ int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[])
         collapse(parv[1]);
         if (!match(parv[1], me.name))
         {
+          db_compacta_recorta(que_bdd, 0);
           sprintf_irc(path, "%s/tabla.%c", DBPATH, que_bdd);
           db_file = open(path, O_TRUNC, S_IRUSR | S_IWUSR);
           if (db_file == -1)
@@ -3211,8 +4483,7 @@ int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[])
 ** Como no sabemos si el otro extremo nos ha
 ** cerrado el grifo o no, nos curamos en salud
 */
-        sendto_one(cptr, "%s DB %s 0 J %u %c",
-            NumServ(&me), cptr->name, tabla_serie[que_bdd], que_bdd);
+        db_envia_j(cptr, cptr->name, que_bdd, que_bdd);
 
         return 0;
         break;
@@ -3263,6 +4534,9 @@ int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[])
           }
           else
           {                     /* Una tabla en particular */
+/*
+** Compactando, es el HASH del fichero sin compactar
+*/
             inttobase64(db_buf, tabla_hash_hi[que_bdd], 6);
             inttobase64(db_buf + 6, tabla_hash_lo[que_bdd], 6);
             sendto_one(sptr, "%s DB %s 0 R %u-%u-%s-%s %c",
@@ -3356,6 +4630,48 @@ int m_db(aClient *cptr, aClient *sptr, int parc, char *parv[])
   return 0;
 }
 
+/*
+ * db_informe_tabla
+ *
+ * Longitud de las cadenas de una tabla, para "DBQ <Tabla>".
+ */
+static void db_informe_tabla(aClient *sptr, unsigned char tabla)
+{
+  unsigned int hist[6];         /* 0, 1, 2, 3, 4-7, 8+ */
+  unsigned int usadas = 0, max = 0, media, n, i, j;
+  struct db_reg *reg, **datos;
+
+  memset(hist, 0, sizeof(hist));
+  for (j = 0; j < 2; j++)
+  {
+    datos = j ? tabla_datos_old[tabla] : tabla_datos[tabla];
+    if (!datos)
+      continue;
+    for (i = j ? tabla_rehash_pos[tabla] : 0;
+        i < (j ? tabla_len_old[tabla] : tabla_len[tabla]); i++)
+    {
+      for (n = 0, reg = datos[i]; reg != NULL; reg = reg->next)
+        n++;
+      if (n)
+        usadas++;
+      if (n > max)
+        max = n;
+      hist[n < 4 ? n : (n < 8 ? 4 : 5)]++;
+    }
+  }
+  media = usadas ? tabla_cuantos[tabla] * 100 / usadas : 0;
+
+  sendto_one(sptr, ":%s NOTICE %s :DBQ STATS Tabla='%c' Registros=%u "
+      "Cubetas=%u Inicial=%u Rehash=%u/%u Redimensiones=%u", me.name,
+      sptr->name, tabla, tabla_cuantos[tabla], tabla_len[tabla],
+      tabla_residente_y_len[tabla], tabla_rehash_pos[tabla],
+      tabla_len_old[tabla], tabla_redimensiones[tabla]);
+  sendto_one(sptr, ":%s NOTICE %s :DBQ CADENAS Tabla='%c' Usadas=%u "
+      "Media=%u.%02u Max=%u 0=%u 1=%u 2=%u 3=%u 4-7=%u 8+=%u", me.name,
+      sptr->name, tabla, usadas, media / 100, media % 100, max, hist[0],
+      hist[1], hist[2], hist[3], hist[4], hist[5]);
+}
+
 /*
  * m_dbq
  *
@@ -3370,7 +4686,7 @@ int m_dbq(aClient *cptr, aClient *sptr, int parc, char *parv[])
   unsigned char tabla;
   char *clave, *servidor;
   aClient *acptr;
-  struct db_reg *reg;
+  const struct db_reg *reg;
   int nivel_helper = 0;
   static char *cn = NULL;
   static int cl = 0;
@@ -3384,6 +4700,19 @@ int m_dbq(aClient *cptr, aClient *sptr, int parc, char *parv[])
     sendto_one(sptr, err_str(ERR_NOPRIVILEGES), me.name, parv[0]);
     return 0;                   /* No autorizado */
   }
+  /* <Origen> DBQ <Tabla>: estadisticas de la tabla local */
+  if (parc == 2 && MyUser(sptr) && parv[1][0] != '\0' && parv[1][1] == '\0')
+  {
+    tabla = *parv[1];
+    if (!tabla_residente_y_len[tabla])
+      sendto_one(cptr,
+          ":%s NOTICE %s :DBQ ERROR Tabla='%c' TABLA_NO_RESIDENTE",
+          me.name, parv[0], tabla);
+    else
+      db_informe_tabla(sptr, tabla);
+    return 0;
+  }
+
   /* <Origen> DBQ [<server>] <Tabla> <Clave> */
   if ((parc != 3 && parc != 4) ||
       (parc == 3 && (parv[1][0] == '\0' || parv[1][1] != '\0')) ||
@@ -3392,7 +4721,7 @@ int m_dbq(aClient *cptr, aClient *sptr, int parc, char *parv[])
 
     if (!IsServer(sptr))
       sendto_one(cptr,
-          ":%s NOTICE %s :Parametros incorrectos: Formato: DBQ [<server>] <Tabla> <Clave>",
+          ":%s NOTICE %s :Parametros incorrectos: Formato: DBQ [<server>] <Tabla> <Clave> | DBQ <Tabla>",
           me.name, parv[0]);
     return 0;
   }
@@ -423,6 +423,7 @@ void init_sys(void)
   }
 init_dgram:
   event_init();
+  io_init();
   resfd = init_resolver();
   if(resfd>=0) {
     event_set(&evres, resfd, EV_READ|EV_PERSIST, (void *)event_async_dns_callback, NULL);
@@ -903,6 +904,7 @@ void close_connection(aClient *cptr)
   Reg1 aConfItem *aconf;
   Reg2 int i, j;
   int empty = cptr->fd;
+  int registered;
 
   if (IsServer(cptr))
   {
@@ -984,17 +986,19 @@ void close_connection(aClient *cptr)
         HANGONRETRYDELAY : ConfConFreq(aconf);
   }
 
-  if (cptr->authfd >= 0) {
-    close(cptr->authfd);
-    DelRWAuthEvent(cptr);
-  }
+  if (cptr->authfd >= 0)
+    auth_close(cptr);
+
+  if (cptr->burst)
+    burst_stop(cptr);
 
   if (cptr->fd >= 0)
   {
     flush_connections(cptr->fd);
+    sendq_dirty_del(cptr);
     loc_clients[cptr->fd] = NULL;
-    close(cptr->fd);
     DelClientEvent(cptr);
+    close(cptr->fd);
     cptr->fd = -2;
   }
 
@@ -1036,7 +1040,11 @@ void close_connection(aClient *cptr)
         return;
 
       loc_clients[i] = loc_clients[j];
+      /* Hay que quitar el fd viejo del epoll antes de cerrarlo */
+      registered = io_del(loc_clients[i]);
       loc_clients[i]->fd = i;
+      if (registered)
+        io_add(loc_clients[i]);
       DelRWEvent(loc_clients[i]);
       // Renumero tambien los eventos
       if(loc_clients[i]->evread)
@@ -1101,18 +1109,23 @@ static void set_sock_opts(int fd, aClient *cptr)
 #endif
 #if defined(IP_OPTIONS) && defined(IPPROTO_IP)
   {
-    char *s = readbuf, *t = readbuf + sizeof(readbuf) / 2;
+    /*
+     * No readbuf: connect_server() llega aqui desde el parser, que
+     * puede estar trabajando sobre readbuf
+     */
+    static char optbuf[8192];
+    char *s = optbuf, *t = optbuf + sizeof(optbuf) / 2;
 
-    opt = sizeof(readbuf) / 8;
+    opt = sizeof(optbuf) / 8;
     if (getsockopt(fd, IPPROTO_IP, IP_OPTIONS, (OPT_TYPE *)t, &opt) < 0)
     {
 #if defined(DEBUGMODE)
       report_error("getsockopt(IP_OPTIONS) %s: %s", cptr);
 #endif
     }
-    else if (opt > 0 && opt != sizeof(readbuf) / 8)
+    else if (opt > 0 && opt != sizeof(optbuf) / 8)
     {
-      for (*readbuf = '\0'; opt > 0; opt--, s += 3)
+      for (*optbuf = '\0'; opt > 0; opt--, s += 3)
         sprintf(s, "%02x:", *t++);
       *s = '\0';
     }
@@ -1300,6 +1313,7 @@ aClient *add_connection(aClient *cptr, int fd, int type)
   
   lin.flags = ASYNC_CLIENT;
   lin.value.cptr = acptr;
+  gettimeofday(&acptr->regstart, NULL);
 #if defined(NODNS)
   if (!strcmp("127.0.0.1", inetntoa(addr.sin_addr)))
   {
@@ -1311,7 +1325,17 @@ aClient *add_connection(aClient *cptr, int fd, int type)
 #endif
     Debug((DEBUG_DNS, "lookup %s", inetntoa(addr.sin_addr)));
     acptr->hostp = gethost_byaddr(&acptr->ip, &lin);
-    if (!acptr->hostp)
+    if (!acptr->hostp && h_errno == HOST_NOT_FOUND)
+    {
+      /* La cache ya sabe que esta IP no tiene PTR */
+      auth_stage_done(acptr, AUTH_STAGE_DNS);
+      if (IsUserPort(acptr))
+      {
+        sprintf_irc(sendbuf, IP_LOOKUP_FAIL, me.name);
+        write(fd, sendbuf, strlen(sendbuf));
+      }
+    }
+    else if (!acptr->hostp)
     {
       SetDNS(acptr);
       if (IsUserPort(acptr))
@@ -1320,10 +1344,14 @@ aClient *add_connection(aClient *cptr, int fd, int type)
         write(fd, sendbuf, strlen(sendbuf));
       }
     }
-    else if (IsUserPort(acptr))
+    else
     {
-      sprintf_irc(sendbuf, IP_LOOKUP_CACHE, me.name);
-      write(fd, sendbuf, strlen(sendbuf));
+      auth_stage_done(acptr, AUTH_STAGE_DNS);
+      if (IsUserPort(acptr))
+      {
+        sprintf_irc(sendbuf, IP_LOOKUP_CACHE, me.name);
+        write(fd, sendbuf, strlen(sendbuf));
+      }
     }
     update_nextdnscheck(0);
     //nextdnscheck = 1;
@@ -1341,6 +1369,100 @@ aClient *add_connection(aClient *cptr, int fd, int type)
   return acptr;
 }
 
+/*
+ * Una conexion de cliente (no de servidor) que no espera por su ident
+ * guarda en cptr->buffer/cptr->count la linea incompleta que quedo
+ * al final de la ultima lectura.
+ */
+#define HasPartialLine(x) \
+  (!IsServer(x) && !IsConnecting(x) && !IsHandshake(x) && !DoingAuth(x) \
+      && (x)->count)
+
+/*
+ * client_may_parse
+ *
+ * Devuelve si el control de flood deja procesar ahora otra linea
+ * del cliente.
+ */
+static int client_may_parse(aClient *cptr)
+{
+#if !defined(NOFLOODCONTROL)
+  return (IsChannelService(cptr) || IsAnOper(cptr) || IsDocking(cptr)
+      || cptr->since - now < 10);
+#else
+  return 1;
+#endif
+}
+
+/*
+ * parse_lines
+ *
+ * Procesa las lineas completas de lo recien leido directamente sobre
+ * el buffer de lectura, sin pasarlas por la recvQ. Solo se guarda la
+ * linea incompleta del final (en cptr->buffer) o, si el control de
+ * flood corta, lo que quede por procesar (en la recvQ, donde
+ * read_packet lo ira sacando como siempre).
+ *
+ * Devuelve 0 o lo que tenga que devolver read_packet.
+ */
+static int parse_lines(aClient *cptr, char *buf, size_t length)
+{
+  char *end = buf + length;
+  char *ch;
+  int done;
+
+#if !defined(NOFLOODCONTROL)
+  if (IsUser(cptr) && length > CLIENT_FLOOD && !IsDocking(cptr)
+      && !IsAnOper(cptr))
+    return exit_client(cptr, cptr, &me, "Excess Flood");
+#endif
+
+  while (buf < end && client_may_parse(cptr))
+  {
+    /*
+     * Si se acaba de registrar como servidor, el resto ya va
+     * por dopacket.
+     */
+    if (IsServer(cptr))
+    {
+      cptr->count = 0;
+      return dopacket(cptr, buf, end - buf);
+    }
+
+    if (isEol(*buf))
+    {
+      buf++;
+      continue;
+    }
+
+    for (ch = buf; ch < end && ch < buf + BUFSIZE && !isEol(*ch); ch++);
+
+    if (ch == end && ch - buf < BUFSIZE - 2)
+    {
+      /* Linea incompleta, esperamos al resto */
+      memcpy(cptr->buffer, buf, ch - buf);
+      cptr->count = ch - buf;
+      return 0;
+    }
+    if (ch == end || ch == buf + BUFSIZE)
+    {
+      /* Linea demasiado larga, se descarta todo como hacia la recvQ */
+/*      sendto_one(cptr, err_str(ERR_INPUTTOOLONG), me.name, cptr->name); */
+      return 0;
+    }
+
+    *ch = '\0';
+    if ((done = client_dopacket(cptr, buf, ch - buf)))
+      return done;
+    buf = ch + 1;
+  }
+
+  if (buf < end && !dbuf_put(NULL, &cptr->recvQ, buf, end - buf))
+    return exit_client(cptr, cptr, &me, "dbuf_put fail");
+
+  return 0;
+}
+
 /*
  * read_packet
  *
@@ -1348,18 +1470,32 @@ aClient *add_connection(aClient *cptr, int fd, int type)
  * chunks to give a better performance rating (for server connections).
  * Do some tricky stuff for client connections to make sure they don't do
  * any flooding >:-) -avalon
+ *
+ * Client lines are parsed straight from readbuf while nothing is queued;
+ * the recvQ is only used once flood control holds the client back.
  */
 static int read_packet(aClient *cptr, int socket_ready)
 {
   size_t dolen = 0;
+  size_t partial = 0;
   int length = 0;
   int done;
   int ping = IsRegistered(cptr) ? get_client_ping(cptr) : CONNECTTIMEOUT;
 
-  if (socket_ready && !(IsUser(cptr) && DBufLength(&cptr->recvQ) > 6090))
+  if (socket_ready && !RecvQFull(cptr))
   {
+    /* La linea incompleta de la ultima vez va delante de lo nuevo */
+    if (HasPartialLine(cptr))
+    {
+      partial = cptr->count;
+      memcpy(readbuf, cptr->buffer, partial);
+    }
+
     errno = 0;
-    length = recv(cptr->fd, readbuf, sizeof(readbuf), 0);
+    length = recv(cptr->fd, readbuf + partial, sizeof(readbuf) - partial, 0);
+    /* Si no se ha llenado el buffer, el socket ha quedado vacio */
+    if (length < (int)(sizeof(readbuf) - partial))
+      ClearIORead(cptr);
 
     cptr->lasttime = now;
     UpdateCheckPing(cptr, ping);
@@ -1373,6 +1509,16 @@ static int read_packet(aClient *cptr, int socket_ready)
       return 1;
     if (length <= 0)
       return length;
+
+    /*
+     * Solo si la linea venia de aqui: en los servidores cptr->count es
+     * lo que dopacket tiene a medias en cptr->buffer.
+     */
+    if (partial)
+    {
+      length += partial;
+      cptr->count = 0;
+    }
   }
 
   /*
@@ -1385,6 +1531,12 @@ static int read_packet(aClient *cptr, int socket_ready)
       if ((done = dopacket(cptr, readbuf, length)))
         return done;
   }
+  else if (length > 0 && !DBufLength(&cptr->recvQ) && !DoingDNS(cptr)
+      && !DoingAuth(cptr))
+  {
+    if ((done = parse_lines(cptr, readbuf, length)))
+      return done;
+  }
   else
   {
     /*
@@ -1449,7 +1601,7 @@ static int read_packet(aClient *cptr, int socket_ready)
 /*        sendto_one(cptr, err_str(ERR_INPUTTOOLONG), me.name, cptr->name); */
         break;
       }
-      else if (CPTR_KILLED == client_dopacket(cptr, dolen))
+      else if (CPTR_KILLED == client_dopacket(cptr, cptr->buffer, dolen))
         return CPTR_KILLED;
     }
   }
@@ -1601,7 +1753,7 @@ void event_client_read_callback(int fd, short event, aClient *cptr) {
   Debug((DEBUG_DEBUG, "event_client_read_callback event: %d", (int)event));
 
   assert((event & EV_READ) || (event & EV_TIMEOUT));
-  assert(cptr->fd<0 || (cptr->fd == cptr->evread->ev_fd));
+  assert(cptr->fd<0 || !cptr->evread || (cptr->fd == cptr->evread->ev_fd));
 
 #if defined(DEBUGMODE)
   assert(!IsLog(cptr));
@@ -1615,14 +1767,17 @@ void event_client_read_callback(int fd, short event, aClient *cptr) {
   }
 
   if (!IsDead(cptr))
-    length = read_packet(cptr, event & EV_READ ? 1 : 0);
+    length = read_packet(cptr, (event & EV_READ) || IORead(cptr) ? 1 : 0);
   if ((length != CPTR_KILLED) && IsDead(cptr)) { // ERROR LECTURA/ESCRITURA
     deadsocket(cptr);
     return ;
   }
 
   if (length > 0) // Si hay datos pendientes salgo
+  {
+    io_read_again(cptr);
     return;
+  }
 
   /*
    * ...hmm, with non-blocking sockets we might get
@@ -1661,7 +1816,7 @@ void event_client_write_callback(int fd, short event, aClient *cptr) {
   Debug((DEBUG_DEBUG, "event_client_write_callback event: %d", (int)event));
 
   assert(event & EV_WRITE);
-  assert(cptr->fd < 0 || (cptr->fd == cptr->evwrite->ev_fd));
+  assert(cptr->fd < 0 || !cptr->evwrite || (cptr->fd == cptr->evwrite->ev_fd));
 
 #if defined(DEBUGMODE)
   assert(!IsLog(cptr));
@@ -1684,6 +1839,8 @@ void event_client_write_callback(int fd, short event, aClient *cptr) {
     {
       if (cptr->listing && DBufLength(&cptr->sendQ) < 2048)
         list_next_channels(cptr);
+      if (cptr->burst && DBufLength(&cptr->sendQ) < BURST_SENDQ / 2)
+        burst_next(cptr);
       send_queued(cptr);
     }
   if (IsDead(cptr) || write_err) // ERROR DE LECTURA/ESCRITURA
@@ -1788,13 +1945,12 @@ void event_connection_callback(int loc_fd, short event, aClient *cptr)
  *
  * -- FreeMind 20081224
  */
-void event_checkping_callback(int fd, short event, aClient *cptr)
+void event_checkping_callback(aClient *cptr)
 {
   int ping, rflag=0;
 
-  Debug((DEBUG_DEBUG, "event_checkping_callback event: %d", (int)event));
+  Debug((DEBUG_DEBUG, "event_checkping_callback %s", PunteroACadena(cptr->name)));
 
-  assert(event & EV_TIMEOUT);
   assert(!IsMe(cptr));
   assert(!IsLog(cptr));
   assert(!IsPing(cptr));
@@ -1840,10 +1996,13 @@ void event_checkping_callback(int fd, short event, aClient *cptr)
         {
           Debug((DEBUG_NOTICE, "%s/%s timeout %s", DoingDNS(cptr) ? "DNS" : "",
               DoingAuth(cptr) ? "AUTH" : "", get_client_name(cptr, FALSE)));
+          if (DoingDNS(cptr))
+            auth_stage_done(cptr, AUTH_STAGE_DNS);
+          if (DoingAuth(cptr))
+            auth_stage_done(cptr, AUTH_STAGE_IDENT);
           if (cptr->authfd >= 0)
             {
-              close(cptr->authfd);
-              cptr->authfd = -1;
+              auth_close(cptr);
               cptr->count = 0;
               *cptr->buffer = '\0';
             }
@@ -2474,6 +2633,7 @@ static void do_dns_async(void)
             write(cptr->fd, sendbuf, strlen(sendbuf));
           }
         }
+        auth_stage_done(cptr, AUTH_STAGE_DNS);
         ClearDNS(cptr);
         if (!DoingAuth(cptr))
           SetAccess(cptr);
@@ -74,6 +74,7 @@
 #include "hash.h"
 #include "fileio.h"
 #include "slab_alloc.h"
+#include "s_mask.h"
 #if defined(USE_GEOIP2)
 #include "geoip.h"
 #endif
@@ -85,6 +86,7 @@ static int check_time_interval(char *, char *);
 static int lookup_confhost(aConfItem *);
 static int is_comment(char *);
 static void killcomment(aClient *sptr, char *parv, char *filename);
+static void kline_index_clear(void);
 
 aConfItem *conf = NULL;
 #if defined(ESNET_NEG)
@@ -681,6 +683,8 @@ int rehash(aClient *cptr, int sig)
   if (sig == 1)
     sendto_ops("Got signal SIGHUP, reloading ircd conf. file");
 
+  kline_index_clear();          /* Sus aConfItem se van a liberar */
+
 /*
 ** Esto es lento y solo sirve para comprobar
 ** la integridad de la BDD. Debera hacerse de otra forma.
@@ -1396,11 +1400,118 @@ int find_exception(aClient *cptr)
   return 0;
 }
 
+/*
+ * Indice de las K-lines (ver s_mask.c). Se rehace la primera vez que
+ * hace falta tras leer el ircd.conf; find_kill() recoge las que cubren
+ * al cliente y las mira en el orden del fichero, como antes.
+ */
+struct MaskIndex kline_index = MASK_INDEX_INIT("K-line");
+
+struct KlineRef {
+  struct MaskEntry entry;
+  aConfItem *aconf;
+  unsigned int seq;             /* Posicion en la lista conf */
+};
+
+struct KlineMatch {
+  aClient *cptr;
+  char *host;
+  char *username;
+};
+
+static struct KlineRef *kline_refs = NULL;
+static struct KlineRef **kline_found = NULL;
+static unsigned int kline_count = 0;
+static unsigned int kline_nfound;
+static int kline_index_valid = 0;
+
+static void kline_index_clear(void)
+{
+  unsigned int i;
+
+  for (i = 0; i < kline_count; i++)
+    mask_index_del(&kline_index, &kline_refs[i].entry);
+  if (kline_refs)
+  {
+    RunFree(kline_refs);
+    RunFree(kline_found);
+  }
+  kline_refs = NULL;
+  kline_found = NULL;
+  kline_count = 0;
+  kline_index_valid = 0;
+}
+
+static void kline_index_build(void)
+{
+  struct irc_in_addr addr;
+  unsigned char bits;
+  struct KlineRef *ref;
+  aConfItem *tmp;
+  unsigned int n = 0;
+  int len;
+
+  for (tmp = conf; tmp; tmp = tmp->next)
+    if ((tmp->status & CONF_KLINE) && tmp->host && tmp->name)
+      n++;
+  if (n)
+  {
+    kline_refs = (struct KlineRef *)RunMalloc(n * sizeof(struct KlineRef));
+    kline_found = (struct KlineRef **)RunMalloc(n * sizeof(struct KlineRef *));
+  }
+
+  for (tmp = conf; tmp; tmp = tmp->next)
+  {
+    if (!((tmp->status & CONF_KLINE) && tmp->host && tmp->name))
+      continue;
+    ref = &kline_refs[kline_count];
+    ref->aconf = tmp;
+    ref->seq = kline_count++;
+    /*
+     * Las k de IP o CIDR van por direccion: un host no puede casar con
+     * ellas en texto. Las que llevan comodines ("192.168.*") tambien
+     * casan con hosts como "192.168.example.net", asi que van a la
+     * lista wild y se comparan en texto con el host y con la IP.
+     */
+    if (tmp->status != CONF_IPKILL)
+      mask_index_add(&kline_index, &ref->entry, tmp->host, NULL, 0, ref);
+    else if ((len = ipmask_parse(tmp->host, &addr, &bits)) &&
+        !tmp->host[len] && !strchr(tmp->host, '*'))
+      mask_index_add(&kline_index, &ref->entry, NULL, &addr, bits, ref);
+    else
+      mask_index_add(&kline_index, &ref->entry, NULL, NULL, 0, ref);
+  }
+  kline_index_valid = 1;
+}
+
+static int kline_check(void *data, void *arg)
+{
+  struct KlineRef *ref = (struct KlineRef *)data;
+  struct KlineMatch *km = (struct KlineMatch *)arg;
+  aConfItem *tmp = ref->aconf;
+
+  if (MaskEntryIsWild(&ref->entry) && match(tmp->host, km->host) &&
+      !(tmp->status == CONF_IPKILL &&
+      match(tmp->host, ircd_ntoa_c(km->cptr)) == 0))
+    return 0;
+  if ((!km->username || match(tmp->name, km->username) == 0) &&
+      (!tmp->port || (tmp->port == km->cptr->acpt->port)))
+    kline_found[kline_nfound++] = ref;
+  return 0;                     /* Seguimos, hay que verlas todas */
+}
+
+static int kline_cmp(const void *a, const void *b)
+{
+  return (*(struct KlineRef **)a)->seq - (*(struct KlineRef **)b)->seq;
+}
+
 int find_kill(aClient *cptr)
 {
   char reply[256], *host, *name, *username;
   aConfItem *tmp;
   aGline *agline = NULL;
+  struct KlineMatch km;
+  unsigned int i;
 
   if (!cptr->user)
     return 0;
@@ -1421,31 +1532,38 @@ int find_kill(aClient *cptr)
   if (find_exception(cptr))
     return 0;
 
-  for (tmp = conf; tmp; tmp = tmp->next)
-    /* Added a check against the user's IP address as well.
-     * If the line is either CONF_KILL or CONF_IPKILL, check it; if and only
-     * if it's CONF_IPKILL, check the IP address as well (the && below will
-     * short circuit and the match won't even get run) -Kev
+  if (!kline_index_valid)
+    kline_index_build();
+
+  /*
+   * Las K-lines de IP (k) se comparan con la IP del cliente y el
+   * resto con su host.
+   */
+  km.cptr = cptr;
+  km.host = host;
+  km.username = username;
+  kline_nfound = 0;
+  mask_index_find(&kline_index, host, &cptr->ip, kline_check, &km);
+  if (kline_nfound > 1)
+    qsort(kline_found, kline_nfound, sizeof(struct KlineRef *), kline_cmp);
+
+  for (i = 0, tmp = NULL; i < kline_nfound; i++)
+  {
+    tmp = kline_found[i]->aconf;
+    /*
+     * Can short-circuit evaluation - not taking chances
+     * because check_time_interval destroys tmp->passwd
+     * - Mmmm
      */
-    if ((tmp->status & CONF_KLINE) && tmp->host && tmp->name &&
-        (match(tmp->host, host) == 0 ||
-        ((tmp->status == CONF_IPKILL) &&
-        match(tmp->host, ircd_ntoa_c(cptr)) == 0)) &&
-        (!username || match(tmp->name, username) == 0) &&
-        (!tmp->port || (tmp->port == cptr->acpt->port)))
-    {
-      /*
-       * Can short-circuit evaluation - not taking chances
-       * because check_time_interval destroys tmp->passwd
-       * - Mmmm
-       */
-      if (BadPtr(tmp->passwd))
-        break;
-      else if (is_comment(tmp->passwd))
-        break;
-      else if (check_time_interval(tmp->passwd, reply))
-        break;
-    }
+    if (BadPtr(tmp->passwd))
+      break;
+    else if (is_comment(tmp->passwd))
+      break;
+    else if (check_time_interval(tmp->passwd, reply))
+      break;
+  }
+  if (i == kline_nfound)
+    tmp = NULL;
 
   if (reply[0])
     sendto_one(cptr, reply, me.name, ERR_YOUREBANNEDCREEP, name);
@@ -1479,7 +1597,7 @@ int find_kill(aClient *cptr)
 
   /* find active glines */
   /* added a check against the user's IP address to find_gline() -Kev */
-  else if ((agline = find_gline(cptr, NULL)) && GlineIsActive(agline))
+  else if ((agline = find_gline(cptr)))
   {
     char buf[MAXLEN * 2];
     int longitud;
@@ -1504,8 +1622,6 @@ int find_kill(aClient *cptr)
         me.name, ERR_YOUREBANNEDCREEP, name,
         agline->expire, comment, date(agline->expire));
   }
-  else
-    agline = NULL;              /* if a gline was found, it was inactive */
 
   if ((tmp || agline) && mensaje_gline)
       sendto_one(cptr, ":%s NOTICE %s :*** %s",
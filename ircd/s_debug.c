@@ -50,6 +50,7 @@
 #include "channel.h"
 #include "msg.h"
 #include "numnicks.h"
+#include "slab_alloc.h"
 
 /* *INDENT-OFF* */
 
@@ -382,6 +383,7 @@ void count_memory(aClient *cptr, char *nick)
       chu = 0,                  /* channel users */
       chi = 0,                  /* channel invites */
       chb = 0,                  /* channel bans */
+      chc = 0,                  /* channel ban caches */
       wwu = 0,                  /* whowas users */
       cl = 0,                   /* classes */
       co = 0;                   /* conf lines */
@@ -393,6 +395,7 @@ void count_memory(aClient *cptr, char *nick)
 
   size_t chm = 0,               /* memory used by channels */
       chbm = 0,                 /* memory used by channel bans */
+      chcm = 0,                 /* memory used by ban caches */
       lcm = 0,                  /* memory used by local clients */
       rcm = 0,                  /* memory used by remote clients */
       awm = 0,                  /* memory used by aways */
@@ -401,7 +404,13 @@ void count_memory(aClient *cptr, char *nick)
       com = 0,                  /* memory used by conf lines */
       dbufs_allocated = 0,      /* memory used by dbufs */
       dbufs_used = 0,           /* memory used by dbufs */
+      dbufs_refs = 0,           /* memory used by dbuf shared references */
+      dbufs_shared = 0,         /* memory used by dbuf shared messages */
       rm = 0,                   /* res memory used */
+      hm = 0,                   /* channel membership hash memory */
+      wm = 0,                   /* watch table and lists */
+      xm = 0,                   /* /WHO indexes */
+      sm = 0,                   /* memory idle in the slab pools */
       totcl = 0, totch = 0, totww = 0, tot = 0;
 
   count_whowas_memory(&wwu, &wwm, &wwa, &wwam);
@@ -453,6 +462,11 @@ void count_memory(aClient *cptr, char *nick)
       chb++;
       chbm += (strlen(link->value.cp) + 1 + sizeof(Link));
     }
+    if (chptr->bancache)
+    {
+      chc++;
+      chcm += ban_cache_memory(chptr);
+    }
   }
 
   for (aconf = conf; aconf; aconf = aconf->next)
@@ -492,12 +506,14 @@ void count_memory(aClient *cptr, char *nick)
   sendto_one(cptr, ":%s %d %s :Channels %d(" SIZE_T_FMT
       ") Bans %d(" SIZE_T_FMT ")",
       me.name, RPL_STATSDEBUG, nick, ch, chm, chb, chbm);
+  sendto_one(cptr, ":%s %d %s :Ban caches %d(" SIZE_T_FMT ")",
+      me.name, RPL_STATSDEBUG, nick, chc, chcm);
   sendto_one(cptr, ":%s %d %s :Channel membrs %d(" SIZE_T_FMT
       ") invite %d(" SIZE_T_FMT ")",
       me.name, RPL_STATSDEBUG, nick, chu, chu * sizeof(Link),
       chi, chi * sizeof(Link));
 
-  totch = chm + chbm + chu * sizeof(Link) + chi * sizeof(Link);
+  totch = chm + chbm + chcm + chu * sizeof(Link) + chi * sizeof(Link);
 
   sendto_one(cptr, ":%s %d %s :Whowas users %d(" SIZE_T_FMT
       ") away %d(" SIZE_T_FMT ")",
@@ -510,6 +526,9 @@ void count_memory(aClient *cptr, char *nick)
   sendto_one(cptr, ":%s %d %s :Hash: client %d(" SIZE_T_FMT
       "), chan is the same",
       me.name, RPL_STATSDEBUG, nick, HASHSIZE, sizeof(void *) * HASHSIZE);
+  hm = member_hash_mem(cptr, nick);
+  wm = watch_hash_mem(cptr, nick);
+  xm = who_index_mem(cptr, nick);
 
   /*
    * NOTE: this count will be accurate only for the exact instant that this
@@ -524,13 +543,22 @@ void count_memory(aClient *cptr, char *nick)
       ":%s %d %s :DBufs allocated %d(" SIZE_T_FMT ") used %d(" SIZE_T_FMT ")",
       me.name, RPL_STATSDEBUG, nick, DBufAllocCount, dbufs_allocated,
       DBufUsedCount, dbufs_used);
+  dbuf_count_shared_memory(&dbufs_refs, &dbufs_shared);
+  sendto_one(cptr,
+      ":%s %d %s :DBuf refs %d(" SIZE_T_FMT ") shared %d/%d(" SIZE_T_FMT ")",
+      me.name, RPL_STATSDEBUG, nick, DBufRefCount, dbufs_refs,
+      DBufSharedUsedCount, DBufSharedAllocCount, dbufs_shared);
+  dbufs_allocated += dbufs_refs + dbufs_shared;
+
+  sm = slab_count_memory(cptr, nick);
 
   rm = cres_mem(cptr);
 
   tot =
       totww + totch + totcl + com + cl * sizeof(aConfClass) + dbufs_allocated +
       rm;
-  tot += sizeof(void *) * HASHSIZE * 3;
+  tot += sizeof(void *) * HASHSIZE * 2;
+  tot += hm + wm + xm + sm;
 
   sendto_one(cptr, ":%s %d %s :Total: ww " SIZE_T_FMT " ch " SIZE_T_FMT
       " cl " SIZE_T_FMT " co " SIZE_T_FMT " db " SIZE_T_FMT,
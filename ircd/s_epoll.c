@@ -0,0 +1,311 @@
+/*
+ * IRC - Internet Relay Chat, ircd/s_epoll.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Driver epoll propio para los sockets de los clientes (servidores
+ * incluidos).
+ *
+ * Con libevent cada cliente tenia sus struct event de lectura y de
+ * escritura, y UpdateWrite() hacia un event_add/event_del (es decir,
+ * un epoll_ctl) cada vez que la sendQ se llenaba o se vaciaba. Aqui
+ * cada fd se registra una sola vez, con EPOLLIN|EPOLLOUT|EPOLLET, y
+ * lo que antes eran eventos son flags en cptr->ioflags: el interes
+ * por escribir es solo un flag, sin ninguna llamada al sistema.
+ *
+ * El propio fd de epoll se vigila con libevent, que sigue llevando
+ * los listeners, el resolver, el ident y los temporizadores. Cuando
+ * tiene algo, se recogen los eventos y los clientes se apuntan en
+ * una lista de pendientes, que el bucle principal procesa con
+ * io_dispatch() (nunca se llama a un callback con un puntero sacado
+ * directamente de epoll_wait, porque el cliente puede haberse
+ * liberado mientras tanto).
+ *
+ * Al ser edge-triggered, IO_READ sigue puesto mientras la ultima
+ * lectura haya llenado el buffer; entonces el cliente se vuelve a
+ * apuntar para leer otra vez en la siguiente pasada.
+ */
+
+#include "sys.h"
+
+#if defined(HAVE_SYS_EPOLL_H)
+
+#include <sys/epoll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include "h.h"
+#include "s_debug.h"
+#include "struct.h"
+#include "s_epoll.h"
+#include "s_bsd.h"
+#include "s_serv.h"
+#include "ircd.h"
+#include "send.h"
+#include "numeric.h"
+
+#define IO_MAXEVENTS 256        /* Eventos recogidos por epoll_wait */
+
+static int io_fd = -1;
+static struct event ev_io;
+
+/*
+ * Dos listas de pendientes: mientras io_dispatch() recorre una, los
+ * que se apuntan (o se vuelven a apuntar tras ser atendidos) van a la
+ * otra. Un cliente esta como mucho en una casilla, asi que ninguna de
+ * las dos puede pasar de MAXCONNECTIONS.
+ */
+static aClient *io_pend[2][MAXCONNECTIONS];
+static aClient **io_next = io_pend[0];    /* Donde se apuntan */
+static int io_npend = 0;                  /* Apuntados en io_next */
+static aClient *io_current = NULL;        /* El que se esta procesando */
+
+static unsigned int io_ctl = 0;         /* Llamadas a epoll_ctl */
+static unsigned int io_ctl_pass = 0;    /* ... en la pasada actual */
+static unsigned int io_ctl_max = 0;     /* ... maximo en una pasada */
+static unsigned int io_waits = 0;       /* Llamadas a epoll_wait */
+static unsigned int io_events = 0;      /* Eventos recibidos */
+static unsigned int io_passes = 0;      /* Pasadas con trabajo */
+
+static void event_io_callback(int fd, short event, void *arg);
+
+/*
+ * io_init
+ *
+ * Crea el epoll y lo registra en libevent.
+ */
+void io_init(void)
+{
+  if ((io_fd = epoll_create(MAXCONNECTIONS)) < 0)
+  {
+    report_error("epoll_create %s: %s", &me);
+    exit(-1);
+  }
+  fcntl(io_fd, F_SETFD, FD_CLOEXEC);
+
+  event_set(&ev_io, io_fd, EV_READ | EV_PERSIST, event_io_callback, NULL);
+  assert(event_add(&ev_io, NULL) != -1);
+}
+
+static void io_pend_add(aClient *cptr)
+{
+  if (cptr->iopend)
+    return;
+  assert(io_npend < MAXCONNECTIONS);
+  cptr->iopend = &io_next[io_npend++];
+  *cptr->iopend = cptr;
+}
+
+/*
+ * io_add
+ *
+ * Registra el socket del cliente; ya no hay que tocarlo hasta
+ * que se cierre.
+ */
+void io_add(aClient *cptr)
+{
+  struct epoll_event ev;
+
+  assert(MyConnect(cptr));
+  assert(!(cptr->ioflags & IO_REGISTERED));
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = cptr;
+
+  io_ctl++;
+  io_ctl_pass++;
+  if (epoll_ctl(io_fd, EPOLL_CTL_ADD, cptr->fd, &ev) < 0)
+  {
+    Debug((DEBUG_ERROR, "epoll_ctl ADD fd %d: %s", cptr->fd, strerror(errno)));
+    return;
+  }
+  cptr->ioflags = IO_REGISTERED;
+}
+
+/*
+ * io_del
+ *
+ * Quita el socket del epoll (antes del close, por si algun hijo
+ * tuviese una copia del fd) y al cliente de los pendientes.
+ * Devuelve si estaba registrado.
+ */
+int io_del(aClient *cptr)
+{
+  struct epoll_event ev;
+
+  if (!(cptr->ioflags & IO_REGISTERED))
+    return 0;
+
+  if (cptr->iopend)
+  {
+    *cptr->iopend = NULL;
+    cptr->iopend = NULL;
+  }
+  if (io_current == cptr)
+    io_current = NULL;
+
+  io_ctl++;
+  io_ctl_pass++;
+  if (cptr->fd >= 0 && epoll_ctl(io_fd, EPOLL_CTL_DEL, cptr->fd, &ev) < 0)
+    Debug((DEBUG_ERROR, "epoll_ctl DEL fd %d: %s", cptr->fd, strerror(errno)));
+  cptr->ioflags = 0;
+  return 1;
+}
+
+/*
+ * io_update_write
+ *
+ * Equivalente a UpdateWrite(): si hay algo que escribir (o un /LIST
+ * en curso) y el socket no esta bloqueado, que se llame al callback
+ * de escritura en la siguiente pasada. Si esta bloqueado ya avisara
+ * epoll cuando se pueda escribir.
+ */
+void io_update_write(aClient *cptr)
+{
+  if (!(cptr->ioflags & IO_REGISTERED))
+    return;
+
+  if ((DBufLength(&cptr->sendQ) || cptr->listing || cptr->burst)
+      && !(cptr->flags & FLAGS_BLOCKED))
+  {
+    cptr->ioflags |= IO_WRITE;
+    io_pend_add(cptr);
+  }
+  else
+    cptr->ioflags &= ~IO_WRITE;
+}
+
+/*
+ * io_read_again
+ *
+ * Tras leer del cliente: si la lectura lleno el buffer puede quedar
+ * algo en el socket, y epoll no volvera a avisar.
+ */
+void io_read_again(aClient *cptr)
+{
+  if ((cptr->ioflags & IO_READ) && !RecvQFull(cptr))
+    io_pend_add(cptr);
+}
+
+int io_pending(void)
+{
+  return io_npend;
+}
+
+/*
+ * event_io_callback
+ *
+ * libevent dice que el epoll tiene eventos: se recogen y se marcan
+ * los clientes.
+ */
+static void event_io_callback(int UNUSED(fd), short event, void *UNUSED(arg))
+{
+  struct epoll_event events[IO_MAXEVENTS];
+  aClient *cptr;
+  int i, n;
+
+  Debug((DEBUG_DEBUG, "event_io_callback event: %d", (int)event));
+
+  io_waits++;
+  if ((n = epoll_wait(io_fd, events, IO_MAXEVENTS, 0)) < 0)
+  {
+    if (errno != EINTR)
+      Debug((DEBUG_ERROR, "epoll_wait: %s", strerror(errno)));
+    return;
+  }
+  io_events += n;
+
+  for (i = 0; i < n; i++)
+  {
+    cptr = (aClient *)events[i].data.ptr;
+    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      cptr->ioflags |= IO_READ;
+    /*
+     * El flanco de EPOLLOUT solo llega una vez: el socket deja de estar
+     * bloqueado ya, no al llamar al callback, o un send_queued() en la
+     * lectura de esta misma pasada veria FLAGS_BLOCKED, quitaria
+     * IO_WRITE y el sendQ se quedaria sin escribir.
+     */
+    if ((events[i].events & EPOLLOUT)
+        && ((cptr->flags & FLAGS_BLOCKED) || IsConnecting(cptr)))
+    {
+      cptr->flags &= ~FLAGS_BLOCKED;
+      cptr->ioflags |= IO_WRITE;
+    }
+    if (cptr->ioflags & (IO_READ | IO_WRITE))
+      io_pend_add(cptr);
+  }
+}
+
+/*
+ * io_dispatch
+ *
+ * Llama a los callbacks de los clientes pendientes. Los que se
+ * apuntan mientras tanto (o vuelven a apuntarse) van a la otra
+ * lista y quedan para la siguiente pasada.
+ */
+void io_dispatch(void)
+{
+  aClient *cptr, **list = io_next;
+  int i, n = io_npend;
+
+  if (n)
+    io_passes++;
+
+  io_next = (list == io_pend[0]) ? io_pend[1] : io_pend[0];
+  io_npend = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    if (!(cptr = list[i]))
+      continue;
+    list[i] = NULL;
+    cptr->iopend = NULL;
+    io_current = cptr;
+
+    if (cptr->ioflags & IO_READ)
+      event_client_read_callback(cptr->fd, EV_READ, cptr);
+    if (io_current && (cptr->ioflags & IO_WRITE))
+    {
+      cptr->ioflags &= ~IO_WRITE;
+      event_client_write_callback(cptr->fd, EV_WRITE, cptr);
+    }
+  }
+  io_current = NULL;
+
+  if (io_ctl_pass > io_ctl_max)
+    io_ctl_max = io_ctl_pass;
+  io_ctl_pass = 0;
+}
+
+/*
+ * io_report
+ *
+ * Estadisticas del driver para /STATS t.
+ */
+void io_report(aClient *cptr, char *name)
+{
+  sendto_one(cptr, ":%s %d %s :epoll ctl %u (max %u per pass) waits %u "
+      "events %u passes %u pending %d", me.name, RPL_STATSDEBUG, name,
+      io_ctl, io_ctl_max, io_waits, io_events, io_passes, io_npend);
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
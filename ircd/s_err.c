@@ -604,7 +604,7 @@ static Numeric numeric_replies[] = {
 /* 211 */
     {RPL_STATSLINKINFO, (char *)NULL},
 /* 212 */
-    {RPL_STATSCOMMANDS, "%s %u %u"},
+    {RPL_STATSCOMMANDS, "%s %u %u %u"},
 /* 213 */
     {RPL_STATSCLINE, "%c %s * %s %d %d"},
 /* 214 */
@@ -0,0 +1,471 @@
+/*
+ * IRC - Internet Relay Chat, ircd/s_mask.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Indice de mascaras de host, para las G-lines y las K-lines.
+ *
+ * Antes cada cliente que conectaba se comparaba con todas las
+ * G-lines (y todas las K-lines) una por una. Aqui las mascaras se
+ * reparten segun su forma, y una busqueda solo pasa a la funcion de
+ * comprobacion las entradas que pueden cubrir al cliente:
+ *
+ * - IP/CIDR: arbol radix (con los caminos comprimidos) sobre los
+ *   128 bits de la direccion; se baja por los bits de la IP del
+ *   cliente y se recogen las entradas de cada nodo cuyo prefijo la
+ *   cubre.
+ * - Host exacto: tabla hash, sin distinguir mayusculas.
+ * - "*.dominio": arbol de sufijos por etiquetas. Cada sufijo de un
+ *   dominio indexado que empieza tras un '.' tiene su nodo (en la
+ *   misma tabla hash, con un contador de referencias), asi que se
+ *   recorre el host del cliente de derecha a izquierda, etiqueta a
+ *   etiqueta, y se para en cuanto un sufijo no esta.
+ * - El resto (comodines en medio, expresiones regulares de realname)
+ *   van a una lista que se recorre entera; el llamante comprueba su
+ *   mascara (ver MaskEntryIsWild).
+ */
+
+#include "sys.h"
+#include <string.h>
+#include <assert.h>
+#include "h.h"
+#include "struct.h"
+#include "common.h"
+#include "match.h"
+#include "s_mask.h"
+#include "ircd.h"
+#include "send.h"
+#include "numeric.h"
+
+#define NODE_IP         1
+#define NODE_EXACT      2
+#define NODE_SUFFIX     3
+
+#define MASK_HASH_MIN   64
+
+struct MaskNode {
+  struct MaskNode *hnext;       /* Siguiente en la cadena de la tabla hash */
+  struct MaskNode *parent;      /* Radix: nodo padre */
+  struct MaskNode *child[2];    /* Radix: hijos segun el siguiente bit */
+  struct MaskEntry *entries;    /* Entradas de esta mascara */
+  unsigned int refs;            /* Sufijo: entradas en este y en los mas largos */
+  struct irc_in_addr addr;      /* Radix: prefijo, el resto de bits a 0 */
+  unsigned char bits;
+  unsigned char type;
+  char key[1];                  /* Hash: host o dominio */
+};
+
+/*
+ * Tabla hash de hosts exactos y sufijos.
+ */
+
+static unsigned int mask_hash(const char *s)
+{
+  unsigned int hash = 0;
+
+  while (*s)
+    hash = (hash << 5) - hash + (unsigned char)toLower(*s++);
+  return hash;
+}
+
+static struct MaskNode *hash_find(struct MaskIndex *idx, int type,
+    const char *key)
+{
+  struct MaskNode *node;
+
+  if (!idx->hsize)
+    return NULL;
+  for (node = idx->hash[mask_hash(key) & (idx->hsize - 1)]; node;
+      node = node->hnext)
+    if (node->type == type && !strCasediff(node->key, key))
+      return node;
+  return NULL;
+}
+
+static void hash_grow(struct MaskIndex *idx)
+{
+  struct MaskNode **hash, *node;
+  unsigned int hsize, i, h;
+
+  hsize = idx->hsize ? idx->hsize * 2 : MASK_HASH_MIN;
+  hash = (struct MaskNode **)RunMalloc(hsize * sizeof(struct MaskNode *));
+  memset(hash, 0, hsize * sizeof(struct MaskNode *));
+
+  for (i = 0; i < idx->hsize; i++)
+  {
+    while ((node = idx->hash[i]))
+    {
+      idx->hash[i] = node->hnext;
+      h = mask_hash(node->key) & (hsize - 1);
+      node->hnext = hash[h];
+      hash[h] = node;
+    }
+  }
+  if (idx->hash)
+    RunFree(idx->hash);
+  idx->hash = hash;
+  idx->hsize = hsize;
+}
+
+static struct MaskNode *hash_get(struct MaskIndex *idx, int type,
+    const char *key)
+{
+  struct MaskNode *node;
+  unsigned int h;
+
+  if ((node = hash_find(idx, type, key)))
+    return node;
+
+  if (idx->hcount >= idx->hsize)
+    hash_grow(idx);
+
+  node = (struct MaskNode *)RunMalloc(sizeof(struct MaskNode) + strlen(key));
+  memset(node, 0, sizeof(struct MaskNode));
+  node->type = type;
+  strcpy(node->key, key);
+
+  h = mask_hash(key) & (idx->hsize - 1);
+  node->hnext = idx->hash[h];
+  idx->hash[h] = node;
+  idx->hcount++;
+  return node;
+}
+
+static void hash_del(struct MaskIndex *idx, struct MaskNode *node)
+{
+  struct MaskNode **np;
+
+  for (np = &idx->hash[mask_hash(node->key) & (idx->hsize - 1)]; *np;
+      np = &(*np)->hnext)
+  {
+    if (*np == node)
+    {
+      *np = node->hnext;
+      idx->hcount--;
+      RunFree(node);
+      return;
+    }
+  }
+  assert(0);
+}
+
+/*
+ * Arbol de sufijos: un nodo para el dominio y otro para cada sufijo
+ * suyo que empieza tras un '.'.
+ */
+
+static struct MaskNode *suffix_add(struct MaskIndex *idx, const char *domain)
+{
+  struct MaskNode *node;
+  const char *s;
+
+  for (s = domain; (s = strchr(s, '.'));)
+    hash_get(idx, NODE_SUFFIX, ++s)->refs++;
+  node = hash_get(idx, NODE_SUFFIX, domain);
+  node->refs++;
+  return node;
+}
+
+static void suffix_del(struct MaskIndex *idx, struct MaskNode *node)
+{
+  struct MaskNode *snode;
+  const char *s;
+
+  /* El dominio esta en node->key, que se libera el ultimo */
+  for (s = node->key; (s = strchr(s, '.'));)
+  {
+    snode = hash_find(idx, NODE_SUFFIX, ++s);
+    assert(snode && snode->refs);
+    if (!--snode->refs)
+      hash_del(idx, snode);
+  }
+  if (!--node->refs)
+    hash_del(idx, node);
+}
+
+/*
+ * Arbol radix de direcciones.
+ */
+
+static int addr_bit(const struct irc_in_addr *addr, unsigned int n)
+{
+  return (ntohs(addr->in6_16[n >> 4]) >> (15 - (n & 15))) & 1;
+}
+
+/* Bits iniciales iguales en las dos direcciones, como mucho `max' */
+static unsigned int addr_common(const struct irc_in_addr *a,
+    const struct irc_in_addr *b, unsigned int max)
+{
+  unsigned int n = 0, x;
+  int k;
+
+  for (k = 0; k < 8 && n < max; k++)
+  {
+    if ((x = ntohs(a->in6_16[k] ^ b->in6_16[k])))
+    {
+      while (!(x & 0x8000))
+      {
+        x <<= 1;
+        n++;
+      }
+      break;
+    }
+    n += 16;
+  }
+  return (n < max) ? n : max;
+}
+
+static struct MaskNode *radix_node(const struct irc_in_addr *addr,
+    unsigned char bits)
+{
+  struct MaskNode *node;
+  int k;
+
+  node = (struct MaskNode *)RunMalloc(sizeof(struct MaskNode));
+  memset(node, 0, sizeof(struct MaskNode));
+  node->type = NODE_IP;
+  node->bits = bits;
+  for (k = 0; k < 8; k++, bits = (bits > 16) ? bits - 16 : 0)
+  {
+    if (bits >= 16)
+      node->addr.in6_16[k] = addr->in6_16[k];
+    else if (bits)
+      node->addr.in6_16[k] =
+          htons(ntohs(addr->in6_16[k]) & (0xffff << (16 - bits)));
+  }
+  return node;
+}
+
+static struct MaskNode *radix_add(struct MaskIndex *idx,
+    const struct irc_in_addr *addr, unsigned char bits)
+{
+  struct MaskNode **np = &idx->iproot, *parent = NULL, *n, *node, *glue;
+  unsigned int common;
+
+  if (bits > 128)
+    bits = 128;
+
+  while ((n = *np))
+  {
+    common = addr_common(addr, &n->addr, (bits < n->bits) ? bits : n->bits);
+    if (common == n->bits)
+    {
+      if (n->bits == bits)
+        return n;
+      /* El nodo es prefijo de la mascara: bajamos */
+      parent = n;
+      np = &n->child[addr_bit(addr, n->bits)];
+      continue;
+    }
+
+    node = radix_node(addr, bits);
+    if (common == bits)
+    {
+      /* La mascara es prefijo del nodo: va encima */
+      node->child[addr_bit(&n->addr, bits)] = n;
+      node->parent = parent;
+      n->parent = node;
+      *np = node;
+      return node;
+    }
+
+    /* Se separan en el bit `common': nodo intermedio sin entradas */
+    glue = radix_node(addr, common);
+    glue->parent = parent;
+    glue->child[addr_bit(&n->addr, common)] = n;
+    glue->child[addr_bit(addr, common)] = node;
+    n->parent = glue;
+    node->parent = glue;
+    *np = glue;
+    return node;
+  }
+
+  node = radix_node(addr, bits);
+  node->parent = parent;
+  *np = node;
+  return node;
+}
+
+/* Quita los nodos que se han quedado sin entradas y con menos de dos hijos */
+static void radix_prune(struct MaskIndex *idx, struct MaskNode *node)
+{
+  struct MaskNode *parent, *child, **np;
+
+  while (node && !node->entries && !(node->child[0] && node->child[1]))
+  {
+    child = node->child[0] ? node->child[0] : node->child[1];
+    parent = node->parent;
+    np = parent ? &parent->child[parent->child[1] == node] : &idx->iproot;
+    *np = child;
+    if (child)
+      child->parent = parent;
+    RunFree(node);
+    node = parent;
+  }
+}
+
+/*
+ * mask_index_add
+ *
+ * Indexa `data' por su mascara: `addr'/`bits' si es de IP, si no
+ * `host' (NULL si no tiene mascara de host, como las de realname).
+ */
+void mask_index_add(struct MaskIndex *idx, struct MaskEntry *entry,
+    const char *host, const struct irc_in_addr *addr, unsigned char bits,
+    void *data)
+{
+  struct MaskEntry **head;
+  struct MaskNode *node = NULL;
+
+  if (addr)
+  {
+    node = radix_add(idx, addr, bits);
+    idx->nip++;
+  }
+  else if (host && *host && !strpbrk(host, "*?\\"))
+  {
+    node = hash_get(idx, NODE_EXACT, host);
+    idx->nexact++;
+  }
+  else if (host && host[0] == '*' && host[1] == '.' && host[2]
+      && !strpbrk(host + 2, "*?\\"))
+  {
+    node = suffix_add(idx, host + 2);
+    idx->nsuffix++;
+  }
+  else
+    idx->nwild++;
+
+  head = node ? &node->entries : &idx->wild;
+  entry->node = node;
+  entry->data = data;
+  if ((entry->next = *head))
+    entry->next->prevp = &entry->next;
+  entry->prevp = head;
+  *head = entry;
+}
+
+/*
+ * mask_index_del
+ */
+void mask_index_del(struct MaskIndex *idx, struct MaskEntry *entry)
+{
+  struct MaskNode *node = entry->node;
+
+  assert(entry->prevp);
+  if ((*entry->prevp = entry->next))
+    entry->next->prevp = entry->prevp;
+  entry->next = NULL;
+  entry->prevp = NULL;
+  entry->node = NULL;
+
+  if (!node)
+  {
+    idx->nwild--;
+    return;
+  }
+
+  switch (node->type)
+  {
+    case NODE_IP:
+      idx->nip--;
+      radix_prune(idx, node);
+      break;
+    case NODE_EXACT:
+      idx->nexact--;
+      if (!node->entries)
+        hash_del(idx, node);
+      break;
+    case NODE_SUFFIX:
+      idx->nsuffix--;
+      suffix_del(idx, node);
+      break;
+  }
+}
+
+static void *check_entries(struct MaskIndex *idx, struct MaskEntry *entry,
+    int (*check) (void *, void *), void *arg)
+{
+  for (; entry; entry = entry->next)
+  {
+    idx->candidates++;
+    if ((*check) (entry->data, arg))
+      return entry->data;
+  }
+  return NULL;
+}
+
+/*
+ * mask_index_find
+ *
+ * Pasa a `check' las entradas cuya mascara puede cubrir al cliente
+ * con ese host y esa IP, hasta que devuelva distinto de 0. Devuelve
+ * el `data' de esa entrada, o NULL.
+ */
+void *mask_index_find(struct MaskIndex *idx, const char *host,
+    const struct irc_in_addr *ip, int (*check) (void *data, void *arg),
+    void *arg)
+{
+  struct MaskNode *node;
+  size_t len;
+  void *data;
+
+  idx->lookups++;
+
+  if (ip)
+  {
+    for (node = idx->iproot; node && ipmask_check(ip, &node->addr, node->bits);
+        node = (node->bits < 128) ? node->child[addr_bit(ip, node->bits)] : NULL)
+    {
+      if ((data = check_entries(idx, node->entries, check, arg)))
+        return data;
+    }
+  }
+
+  if (host && idx->hcount)
+  {
+    if ((node = hash_find(idx, NODE_EXACT, host))
+        && (data = check_entries(idx, node->entries, check, arg)))
+      return data;
+
+    /* Sufijos, de la ultima etiqueta hacia atras */
+    for (len = strlen(host); len--;)
+    {
+      if (host[len] != '.')
+        continue;
+      if (!(node = hash_find(idx, NODE_SUFFIX, host + len + 1)))
+        break;
+      if ((data = check_entries(idx, node->entries, check, arg)))
+        return data;
+    }
+  }
+
+  return check_entries(idx, idx->wild, check, arg);
+}
+
+/*
+ * mask_index_report
+ *
+ * Estadisticas del indice para /STATS t.
+ */
+void mask_index_report(struct MaskIndex *idx, struct Client *cptr, char *name)
+{
+  sendto_one(cptr, ":%s %d %s :%s index ip %u exact %u suffix %u wild %u "
+      "nodes %u/%u lookups %u candidates %u", me.name, RPL_STATSDEBUG, name,
+      idx->name, idx->nip, idx->nexact, idx->nsuffix, idx->nwild, idx->hcount,
+      idx->hsize, idx->lookups, idx->candidates);
+}
@@ -58,10 +58,13 @@
 #include "sprintf_irc.h"
 #include "querycmds.h"
 #include "IPcheck.h"
+#include "s_auth.h"
 #include "m_watch.h"
 #include "slab_alloc.h"
+#include "s_mask.h"
 #include "s_bdd.h"
 #include "msg.h"
+#include "whocmds.h"
 
 #if defined(ESNET_NEG) && defined(ZLIB_ESNET)
 #include "dbuf.h"
@@ -612,10 +615,7 @@ static void exit_one_client(aClient *bcptr, char *comment)
   {
     /* Stop a running /LIST clean */
     if (MyUser(bcptr) && bcptr->listing)
-    {
-      RunFree(bcptr->listing);
-      bcptr->listing = NULL;
-    }
+      list_stop_channels(bcptr);
 
     if (AskedPing(bcptr))
       cancel_ping(bcptr, NULL);
@@ -648,6 +648,8 @@ static void exit_one_client(aClient *bcptr, char *comment)
     borra_lista_watch(bcptr);
     chequea_estado_watch(bcptr, RPL_LOGOFF);
 
+    who_index_del(bcptr);
+
     if (MyConnect(bcptr) && bcptr->passwd)
       RunFree(bcptr->passwd);
     if (MyConnect(bcptr) && bcptr->passbdd)
@@ -828,6 +830,21 @@ void tstats(aClient *cptr, char *name)
       me.name, RPL_STATSDEBUG, name, sp->is_asuc, sp->is_abad);
   sendto_one(cptr, ":%s %d %s :local connections %u udp packets %u",
       me.name, RPL_STATSDEBUG, name, sp->is_loc, sp->is_udp);
+  sendto_one(cptr, ":%s %d %s :writev calls %u blocks %u syscalls saved %u",
+      me.name, RPL_STATSDEBUG, name, sp->is_wv, sp->is_wvb, sp->is_wvs);
+  sendto_one(cptr, ":%s %d %s :flush passes %u sendQs %u messages %u",
+      me.name, RPL_STATSDEBUG, name, sp->is_dfp, sp->is_dfc, sp->is_dfm);
+  sendto_one(cptr, ":%s %d %s :fan-out formatted %u shared %u",
+      me.name, RPL_STATSDEBUG, name, sp->is_pfr, sp->is_pfs);
+  timer_report(cptr, name);
+  IPcheck_report(cptr, name);
+  auth_report(cptr, name);
+  burst_report(cptr, name);
+  who_report(cptr, name);
+  io_report(cptr, name);
+  mask_index_report(&gline_index, cptr, name);
+  mask_index_report(&kline_index, cptr, name);
+  db_report(cptr, name);
   sendto_one(cptr, ":%s %d %s :Client Server", me.name, RPL_STATSDEBUG, name);
   sendto_one(cptr, ":%s %d %s :connected %u %u",
       me.name, RPL_STATSDEBUG, name, sp->is_cl, sp->is_sv);
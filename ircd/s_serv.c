@@ -43,10 +43,8 @@
 #include "msg.h"
 #if defined(ESNET_NEG)
 #include "m_config.h"
-#if defined(ZLIB_ESNET)
-#include "dbuf.h"
-#endif
 #endif
+#include "dbuf.h"
 #include "match.h"
 #include "crule.h"
 #include "parse.h"
@@ -63,6 +61,7 @@
 static int exit_new_server(aClient *cptr, aClient *sptr,
     char *host, time_t timestamp, char *fmt, ...)
     __attribute__ ((format(printf, 5, 6)));
+static void burst_start(aClient *cptr, time_t start_timestamp);
 
 unsigned int max_connection_count = 0, max_client_count = 0;
 unsigned int max_global_count;
@@ -158,7 +157,7 @@ int m_server(aClient *cptr, aClient *sptr, int parc, char *parv[])
   host = parv[1];
   
   {
-    struct db_reg *reg;
+    const struct db_reg *reg;
    
     reg = db_buscar_registro(BDD_JUPEDB, host);
     if (reg)
@@ -1122,59 +1121,131 @@ int m_server_estab(aClient *cptr, aConfItem *aconf, aConfItem *bconf, time_t sta
     }
   }
 
-  for (acptr = &me; acptr; acptr = acptr->prev)
-  {
-    /* acptr->from == acptr for acptr == cptr */
-    if (acptr->from == cptr)
-      continue;
-    if (IsUser(acptr))
-    {
-#if !defined(NO_PROTOCOL9)
-      if (Protocol(cptr) < 10)
-      {
-        /*
-         * IsUser(x) is true only *BOTH* NICK and USER have
-         * been received. -avalon
-         * Or only NICK in new format. --Run
-         */
-        sendto_one(cptr, ":%s NICK %s %d " TIME_T_FMT " %s %s %s :%s",
-            acptr->user->server->name,
-            acptr->name, acptr->hopcount + 1, acptr->lastnick,
-            PunteroACadena(acptr->user->username),
-            PunteroACadena(acptr->user->host), acptr->user->server->name,
-            PunteroACadena(acptr->info));
-
-        send_umode(cptr, acptr, 0, SEND_UMODES, 0, SEND_HMODES);
-        send_user_joins(cptr, acptr);
-      }
-      else
-#endif
-      {
-        char xxx_buf[25];
-        char *s = umode_str(acptr, NULL);
-        sendto_one(cptr, *s ?
-            "%s " TOK_NICK " %s %d " TIME_T_FMT " %s %s +%s %s %s%s :%s" :
-            "%s " TOK_NICK " %s %d " TIME_T_FMT " %s %s %s%s %s%s :%s",
-            NumServ(acptr->user->server),
-            acptr->name, acptr->hopcount + 1, acptr->lastnick,
-            PunteroACadena(acptr->user->username),
-            PunteroACadena(acptr->user->host), s, iptobase64(xxx_buf,
-            &acptr->ip,
-            sizeof(xxx_buf), 1), NumNick(acptr), PunteroACadena(acptr->info));
-      }
-    }
-  }
-  
-
   /*
-   * Last, send the BURST.
-   * (Or for 2.9 servers: pass all channels plus statuses)
+   * Los usuarios, los canales y las G-lines van poco a poco, segun
+   * el enlace los vaya aceptando; el END_OF_BURST, al final.
    */
+#if defined(ESNET_NEG) && defined(ZLIB_ESNET)
+  completa_microburst();
+#endif
+  burst_start(cptr, start_timestamp);
+  return 0;
+}
+
+/*
+ * Rafaga de red hacia un servidor recien enlazado.
+ *
+ * Los SERVER van de golpe al enlazar; usuarios y canales se generan
+ * poco a poco con un cursor, desde el callback de escritura, segun se
+ * vacia el sendQ (ver burst_next). Mientras dura, el trafico en vivo
+ * para ese enlace se guarda aparte y se suelta tras el END_OF_BURST,
+ * asi que el otro lado lo recibe en el mismo orden que cuando la
+ * rafaga se generaba entera de una vez: primero el estado y luego los
+ * cambios. Esos cambios pueden estar ya incluidos en lo enviado, pero
+ * aplicarlos otra vez no altera el resultado; lo unico que no se
+ * puede repetir es la presentacion de un usuario, y por eso el cursor
+ * se salta los clientes presentados despues de empezar (seq).
+ */
+#define BURST_USERS     0
+#define BURST_CHANNELS  1
+
+struct Burst {
+  struct Burst *next;           /* Rafagas en curso */
+  aClient *cptr;                /* Servidor al que se envia */
+  int phase;
+  int generating;               /* Lo que se envia ahora es de la rafaga */
+  unsigned int seq;             /* client_seq al empezar */
+  aClient *client;              /* Siguiente usuario a enviar */
+  aChannel *channel;            /* Siguiente canal a enviar */
+  time_t start_timestamp;       /* Para las G-lines */
+  time_t started;
+  unsigned int users;           /* Enviados hasta ahora */
+  unsigned int channels;
+  struct DBuf deferred;         /* Trafico en vivo, hasta el END_OF_BURST */
+};
+
+static struct Burst *bursts = NULL;
+
+static unsigned int burst_count = 0;      /* Rafagas terminadas */
+static unsigned int burst_steps = 0;      /* Llamadas a burst_next */
+static size_t burst_max_sendq = 0;        /* Pico del sendQ durante una */
+static size_t burst_max_deferred = 0;     /* Pico de lo diferido */
+
+/*
+ * burst_user
+ *
+ * Presenta un usuario al servidor 'cptr'.
+ */
+static void burst_user(aClient *cptr, aClient *acptr)
+{
+#if !defined(NO_PROTOCOL9)
+  if (Protocol(cptr) < 10)
   {
-    Reg1 aChannel *chptr;
-    for (chptr = channel; chptr; chptr = chptr->nextch)
-      send_channel_modes(cptr, chptr);
+    /*
+     * IsUser(x) is true only *BOTH* NICK and USER have
+     * been received. -avalon
+     * Or only NICK in new format. --Run
+     */
+    sendto_one(cptr, ":%s NICK %s %d " TIME_T_FMT " %s %s %s :%s",
+        acptr->user->server->name,
+        acptr->name, acptr->hopcount + 1, acptr->lastnick,
+        PunteroACadena(acptr->user->username),
+        PunteroACadena(acptr->user->host), acptr->user->server->name,
+        PunteroACadena(acptr->info));
+
+    send_umode(cptr, acptr, 0, SEND_UMODES, 0, SEND_HMODES);
+    send_user_joins(cptr, acptr);
+  }
+  else
+#endif
+  {
+    char xxx_buf[25];
+    char *s = umode_str(acptr, NULL);
+    sendto_one(cptr, *s ?
+        "%s " TOK_NICK " %s %d " TIME_T_FMT " %s %s +%s %s %s%s :%s" :
+        "%s " TOK_NICK " %s %d " TIME_T_FMT " %s %s %s%s %s%s :%s",
+        NumServ(acptr->user->server),
+        acptr->name, acptr->hopcount + 1, acptr->lastnick,
+        PunteroACadena(acptr->user->username),
+        PunteroACadena(acptr->user->host), s, iptobase64(xxx_buf,
+        &acptr->ip,
+        sizeof(xxx_buf), 1), NumNick(acptr), PunteroACadena(acptr->info));
   }
+}
+
+/*
+ * burst_start
+ *
+ * Empieza la rafaga de usuarios y canales hacia 'cptr'.
+ */
+static void burst_start(aClient *cptr, time_t start_timestamp)
+{
+  struct Burst *b;
+
+  b = (struct Burst *)RunCalloc(1, sizeof(struct Burst));
+  b->cptr = cptr;
+  b->phase = BURST_USERS;
+  b->seq = client_seq;
+  /* "me" es el ultimo de la lista: se recorre hacia los mas nuevos */
+  b->client = &me;
+  b->start_timestamp = start_timestamp;
+  b->started = now;
+  b->next = bursts;
+  bursts = b;
+  cptr->burst = b;
+
+  burst_next(cptr);
+}
+
+/*
+ * burst_end
+ *
+ * Ultima parte de la rafaga: G-lines y END_OF_BURST. Despues va
+ * todo lo que se retuvo mientras tanto.
+ */
+static void burst_end(aClient *cptr)
+{
+  struct Burst *b = cptr->burst;
 
 #if defined(HUB)
   /*
@@ -1192,7 +1263,7 @@ int m_server_estab(aClient *cptr, aConfItem *aconf, aConfItem *bconf, time_t sta
         if(!GlineIsLocal(agline) && agline->lastmod &&
             agline->expire >= TStime() && 
             ((TStime() - agline->lastmod) < GLINE_BURST_TIME || 
-                (TStime() - start_timestamp) < GLINE_BURST_TIME))
+                (TStime() - b->start_timestamp) < GLINE_BURST_TIME))
           sendto_one(cptr, "%s " TOK_GLINE " %s +%s " TIME_T_FMT 
               " " TIME_T_FMT " " TIME_T_FMT " :%s", 
               NumServ(&me), NumServ(cptr), agline->host,
@@ -1201,14 +1272,161 @@ int m_server_estab(aClient *cptr, aConfItem *aconf, aConfItem *bconf, time_t sta
       }
   }
 #endif
-  
+
+  if (Protocol(cptr) > 9)
+    sendto_one(cptr, "%s " TOK_END_OF_BURST, NumServ(&me));
+
+  Debug((DEBUG_INFO, "Rafaga a %s: %u usuarios, %u canales, "
+      "%u bytes diferidos, %u segundos", cptr->name, b->users, b->channels,
+      (unsigned int)DBufLength(&b->deferred), (unsigned int)(now - b->started)));
+
+  if (dbuf_append(cptr, &cptr->sendQ, &b->deferred) <= 0)
+    dead_link(cptr, "Buffer allocation error");
+  burst_count++;
+  burst_stop(cptr);
+}
+
+/*
+ * burst_next
+ *
+ * Sigue con la rafaga de 'cptr' hasta que su sendQ tenga BURST_SENDQ
+ * bytes (o se hayan enviado BURST_STEP usuarios o canales, para no
+ * acaparar el bucle si el socket lo traga todo).
+ */
+void burst_next(aClient *cptr)
+{
+  struct Burst *b = cptr->burst;
+  aClient *acptr;
+  aChannel *chptr;
+  int n;
+
+  burst_steps++;
+  b->generating = 1;
+#if defined(ESNET_NEG) && defined(ZLIB_ESNET)
+  inicia_microburst();
+#endif
+
+  for (n = 0; n < BURST_STEP && !IsDead(cptr) &&
+      DBufLength(&cptr->sendQ) < BURST_SENDQ;)
+  {
+    if (b->phase == BURST_USERS)
+    {
+      if (!(acptr = b->client))
+      {
+        b->phase = BURST_CHANNELS;
+        b->channel = channel;
+        continue;
+      }
+      b->client = acptr->prev;
+      /* acptr->from == acptr for acptr == cptr */
+      if (acptr->from == cptr || !IsUser(acptr) ||
+          (int)(acptr->seq - b->seq) > 0)
+        continue;
+      burst_user(cptr, acptr);
+      b->users++;
+    }
+    else
+    {
+      /*
+       * Last, send the BURST.
+       * (Or for 2.9 servers: pass all channels plus statuses)
+       */
+      if (!(chptr = b->channel))
+        break;
+      b->channel = chptr->nextch;
+      send_channel_modes(cptr, chptr);
+      b->channels++;
+    }
+    n++;
+  }
+
+  if (DBufLength(&cptr->sendQ) > burst_max_sendq)
+    burst_max_sendq = DBufLength(&cptr->sendQ);
+  if (DBufLength(&b->deferred) > burst_max_deferred)
+    burst_max_deferred = DBufLength(&b->deferred);
+
+  if (b->phase == BURST_CHANNELS && !b->channel && !IsDead(cptr))
+    burst_end(cptr);
+  else
+    b->generating = 0;
+
 #if defined(ESNET_NEG) && defined(ZLIB_ESNET)
   completa_microburst();
 #endif
+  UpdateWrite(cptr);
+}
 
-  if (Protocol(cptr) > 9)
-    sendto_one(cptr, "%s " TOK_END_OF_BURST, NumServ(&me));
-  return 0;
+/*
+ * burst_stop
+ *
+ * Libera la rafaga de 'cptr', terminada o no (se cierra el enlace).
+ */
+void burst_stop(aClient *cptr)
+{
+  struct Burst **bp, *b = cptr->burst;
+
+  for (bp = &bursts; *bp; bp = &(*bp)->next)
+  {
+    if (*bp == b)
+    {
+      *bp = b->next;
+      break;
+    }
+  }
+  DBufClear(&b->deferred);
+  RunFree(b);
+  cptr->burst = NULL;
+}
+
+/*
+ * burst_queue
+ *
+ * Donde hay que dejar un mensaje para 'cptr', que tiene una rafaga en
+ * curso: en el sendQ si es de la propia rafaga, si no en lo diferido.
+ */
+struct DBuf *burst_queue(aClient *cptr)
+{
+  return cptr->burst->generating ? &cptr->sendQ : &cptr->burst->deferred;
+}
+
+/*
+ * burst_client_gone, burst_channel_gone
+ *
+ * Un cliente o un canal desaparece: que ningun cursor se quede
+ * apuntandole.
+ */
+void burst_client_gone(aClient *cptr)
+{
+  struct Burst *b;
+
+  for (b = bursts; b; b = b->next)
+    if (b->client == cptr)
+      b->client = cptr->prev;
+}
+
+void burst_channel_gone(aChannel *chptr)
+{
+  struct Burst *b;
+
+  for (b = bursts; b; b = b->next)
+    if (b->channel == chptr)
+      b->channel = chptr->nextch;
+}
+
+void burst_report(aClient *cptr, char *name)
+{
+  struct Burst *b;
+
+  sendto_one(cptr, ":%s %d %s :bursts done %u steps %u max sendq %u "
+      "deferred %u", me.name, RPL_STATSDEBUG, name, burst_count, burst_steps,
+      (unsigned int)burst_max_sendq, (unsigned int)burst_max_deferred);
+  for (b = bursts; b; b = b->next)
+    sendto_one(cptr, ":%s %d %s :burst %s %s users %u channels %u "
+        "sendq %u deferred %u secs %u", me.name, RPL_STATSDEBUG, name,
+        b->cptr->name, (b->phase == BURST_USERS) ? "users" : "channels",
+        b->users, b->channels, (unsigned int)DBufLength(&b->cptr->sendQ),
+        (unsigned int)DBufLength(&b->deferred),
+        (unsigned int)(now - b->started));
 }
 
 /*
@@ -0,0 +1,199 @@
+/*
+ * IRC - Internet Relay Chat, ircd/s_timer.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Rueda de temporizadores (hashed timing wheel).
+ *
+ * Los temporizadores de cada conexion (p.ej. el chequeo de ping) se
+ * rearman cada vez que se lee del socket, y con libevent cada rearme
+ * es una operacion O(log n) sobre su min_heap. Como sus plazos son
+ * de segundos, aqui se guardan en WHEEL_SIZE casillas de un segundo:
+ * armar, rearmar y desarmar es O(1), y un unico evento de libevent
+ * procesa una casilla por segundo. Los plazos mayores que una vuelta
+ * se quedan en su casilla hasta que les llega el turno.
+ */
+
+#include "sys.h"
+#include <assert.h>
+#include "h.h"
+#include "s_debug.h"
+#include "struct.h"
+#include "s_timer.h"
+#include "s_bsd.h"
+#include "ircd.h"
+#include "send.h"
+#include "numeric.h"
+
+#define WHEEL_SIZE 512          /* Potencia de 2, mayor que el ping habitual */
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+static struct WheelTimer *wheel[WHEEL_SIZE];
+static time_t wheel_time;       /* Ultimo segundo procesado */
+
+static struct event ev_wheel;
+static struct timeval tm_wheel;
+static int wheel_armed = 0;
+
+static unsigned int wheel_count = 0;  /* Temporizadores armados */
+static unsigned int wheel_adds = 0;   /* Armados y rearmados */
+static unsigned int wheel_fired = 0;  /* Vencidos */
+static unsigned int wheel_ticks = 0;  /* Segundos procesados */
+
+static void event_wheel_callback(int fd, short event, void *arg);
+
+static void wheel_unlink(struct WheelTimer *timer)
+{
+  if ((*timer->prevp = timer->next))
+    timer->next->prevp = timer->prevp;
+  timer->next = NULL;
+  timer->prevp = NULL;
+}
+
+static void wheel_link(struct WheelTimer **head, struct WheelTimer *timer)
+{
+  if ((timer->next = *head))
+    timer->next->prevp = &timer->next;
+  timer->prevp = head;
+  *head = timer;
+}
+
+static void wheel_schedule(void)
+{
+  evutil_timerclear(&tm_wheel);
+  tm_wheel.tv_sec = 1;
+  assert(evtimer_add(&ev_wheel, &tm_wheel) != -1);
+}
+
+/*
+ * timer_set
+ *
+ * Inicializa (o reinicializa, desarmandolo) un temporizador.
+ */
+void timer_set(struct WheelTimer *timer, void (*func) (void *), void *data)
+{
+  if (TimerArmed(timer))
+    timer_del(timer);
+  timer->func = func;
+  timer->data = data;
+}
+
+/*
+ * timer_add
+ *
+ * Arma el temporizador para que venza dentro de 'delay' segundos;
+ * si ya estaba armado se mueve a su nueva casilla.
+ */
+void timer_add(struct WheelTimer *timer, time_t delay)
+{
+  time_t slot;
+
+  assert(timer->func);
+
+  if (TimerArmed(timer))
+    wheel_unlink(timer);
+  else
+    wheel_count++;
+
+  if (!wheel_armed)
+  {
+    evtimer_set(&ev_wheel, event_wheel_callback, NULL);
+    wheel_time = now;
+    wheel_armed = 1;
+    wheel_schedule();
+  }
+
+  timer->expire = now + delay;
+  /* Lo que ya ha vencido sale en el proximo segundo */
+  slot = (timer->expire > wheel_time) ? timer->expire : wheel_time + 1;
+  wheel_link(&wheel[slot & WHEEL_MASK], timer);
+  wheel_adds++;
+}
+
+/*
+ * timer_del
+ *
+ * Desarma el temporizador, si lo estaba.
+ */
+void timer_del(struct WheelTimer *timer)
+{
+  if (!TimerArmed(timer))
+    return;
+  wheel_unlink(timer);
+  wheel_count--;
+}
+
+/*
+ * event_wheel_callback
+ *
+ * Procesa las casillas de todos los segundos transcurridos desde
+ * la ultima vez. Los vencidos se pasan primero a una lista aparte,
+ * porque sus funciones pueden armar o desarmar otros temporizadores
+ * (o liberar el cliente entero).
+ */
+static void event_wheel_callback(int UNUSED(fd), short event, void *UNUSED(arg))
+{
+  struct WheelTimer *timer, *next, *pending;
+
+  Debug((DEBUG_DEBUG, "event_wheel_callback event: %d", (int)event));
+
+  assert(event & EV_TIMEOUT);
+
+  update_now();
+
+  while (wheel_time < now)
+  {
+    wheel_time++;
+    wheel_ticks++;
+
+    pending = NULL;
+    for (timer = wheel[wheel_time & WHEEL_MASK]; timer; timer = next)
+    {
+      next = timer->next;
+      if (timer->expire <= wheel_time)
+      {
+        wheel_unlink(timer);
+        wheel_link(&pending, timer);
+      }
+    }
+
+    while ((timer = pending))
+    {
+      wheel_unlink(timer);
+      wheel_count--;
+      wheel_fired++;
+      (*timer->func) (timer->data);
+    }
+  }
+
+  if (wheel_count)
+    wheel_schedule();
+  else
+    wheel_armed = 0;
+}
+
+/*
+ * timer_report
+ *
+ * Estadisticas de la rueda para /STATS t.
+ */
+void timer_report(struct Client *cptr, char *name)
+{
+  sendto_one(cptr, ":%s %d %s :timer wheel armed %u adds %u fired %u ticks %u",
+      me.name, RPL_STATSDEBUG, name, wheel_count, wheel_adds, wheel_fired,
+      wheel_ticks);
+}
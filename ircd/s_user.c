@@ -73,6 +73,7 @@
 #include "sprintf_irc.h"
 #include "querycmds.h"
 #include "IPcheck.h"
+#include "s_auth.h"
 #include "class.h"
 #include "slab_alloc.h"
 #include "network.h"
@@ -613,6 +614,9 @@ static int register_user(aClient *cptr, aClient *sptr,
   } /* !desactivar_ident */
 
     Count_unknownbecomesclient(sptr, nrof);
+    auth_stage_done(sptr, AUTH_STAGE_TOTAL);
+    /* Para las rafagas en curso es un usuario nuevo */
+    sptr->seq = ++client_seq;
   }
   else
   {
@@ -622,6 +626,7 @@ static int register_user(aClient *cptr, aClient *sptr,
       ++nrof.services;
   }
   SetUser(sptr);
+  who_index_add(sptr);
 
 #if defined(ESNET_NEG)
   config_resolve_speculative(cptr);
@@ -1682,7 +1687,7 @@ int m_webirc(aClient *cptr, aClient *sptr, int parc, char *parv[])
       return exit_client(sptr, sptr, &me, "WEBIRC Password invalid for your host");
 
   } else {
-    struct db_reg *reg;
+    const struct db_reg *reg;
 
     /* Comprobamos tabla w BDD */
     reg = db_buscar_registro(BDD_WEBIRCDB, sptr->sockhost);
@@ -1769,7 +1774,7 @@ int m_webirc(aClient *cptr, aClient *sptr, int parc, char *parv[])
  */
 int m_proxy(aClient *cptr, aClient *sptr, int parc, char *parv[])
 {
-  struct db_reg *reg;
+  const struct db_reg *reg;
 
   if (IsRegistered(sptr))
     return 0;
@@ -3932,7 +3937,7 @@ int m_silence(aClient *cptr, aClient *sptr, int parc, char *parv[])
 int get_status(aClient *sptr)
 {
   int status = 0;
-  struct db_reg *reg;
+  const struct db_reg *reg;
 
   reg = db_buscar_registro(BDD_OPERDB, sptr->name);
 
@@ -4218,7 +4223,7 @@ void make_vhost(aClient *acptr, int mostrar)
  */
 void make_vhostperso(aClient *acptr, int mostrar)
 {
-  struct db_reg *reg = NULL;
+  const struct db_reg *reg = NULL;
 
   assert(!mostrar || MyUser(acptr));
 
@@ -4280,7 +4285,7 @@ void make_vhostperso(aClient *acptr, int mostrar)
  */
 void set_privs(aClient *sptr)
 {
-  struct db_reg *reg;
+  const struct db_reg *reg;
 
   if (!MyConnect(sptr))
     return;
@@ -4589,7 +4594,7 @@ void rename_user(aClient *sptr, char *nick_nuevo)
  */
 
   {
-    struct db_reg *reg;
+    const struct db_reg *reg;
 
     reg = db_buscar_registro(ESNET_NICKDB, sptr->name);
     if (reg)
@@ -4759,7 +4764,7 @@ void rename_user(aClient *sptr, char *nick_nuevo)
 int m_ghost(aClient *cptr, aClient *sptr, int parc, char *parv[])
 {
   aClient *acptr;
-  struct db_reg *reg;
+  const struct db_reg *reg;
   int clave_ok = 0;
   char *clave;
 
@@ -4922,7 +4927,7 @@ int m_svsnick(aClient *cptr, aClient *sptr, int parc, char *parv[])
     rename_user(acptr, NULL);
   else {
     char nick[NICKLEN + 2];
-    struct db_reg *reg;
+    const struct db_reg *reg;
 
     strncpy(nick, parv[2], nicklen + 1);
     nick[nicklen] = 0;
@@ -5001,7 +5006,7 @@ int m_svsnick(aClient *cptr, aClient *sptr, int parc, char *parv[])
  */
 int m_nick_local(aClient *cptr, aClient *sptr, int parc, char *parv[])
 {
-  struct db_reg *reg;
+  const struct db_reg *reg;
   char hflag = '-';
   int clave_ok = 0;             /* Clave correcta */
   int hacer_ghost = 0;          /* Ha especificado nick! */
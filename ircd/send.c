@@ -20,6 +20,8 @@
 
 #include "sys.h"
 #include <stdio.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include "h.h"
 #include "s_debug.h"
 #include "struct.h"
@@ -46,6 +48,8 @@
 char sendbuf[2048];
 static int sentalong[MAXCONNECTIONS];
 static int sentalong_marker;
+static aClient *dirty_list[MAXCONNECTIONS];  /* Local sendQs with new data */
+static int dirty_count;
 struct SLink *opsarray[32];     /* don't use highest bit unless you change
                                    atoi to strtoul in sendto_op_mask() */
 #if defined(GODMODE)
@@ -70,7 +74,7 @@ int sdbflag;
  * like Persons and yet unknown connections...
  */
 
-static void dead_link(aClient *to, char *notice)
+void dead_link(aClient *to, char *notice)
 {
   to->flags |= FLAGS_DEADSOCKET;
   
@@ -114,6 +118,66 @@ void flush_connections(int fd)
     send_queued(cptr);
 }
 
+/*
+ * sendq_dirty_add
+ *
+ * Remember that the local connection 'cptr' has new data in its
+ * sendQ, to write it once at the end of the event loop pass.
+ */
+static void sendq_dirty_add(aClient *cptr)
+{
+  ircstp->is_dfm++;
+  if (cptr->dirty)
+    return;
+  assert(dirty_count < MAXCONNECTIONS);
+  dirty_list[dirty_count++] = cptr;
+  cptr->dirty = dirty_count;
+}
+
+/*
+ * sendq_dirty_del
+ *
+ * Take 'cptr' out of the dirty list; its connection is being closed.
+ */
+void sendq_dirty_del(aClient *cptr)
+{
+  aClient *last;
+
+  if (!cptr->dirty)
+    return;
+  last = dirty_list[--dirty_count];
+  dirty_list[cptr->dirty - 1] = last;
+  last->dirty = cptr->dirty;
+  cptr->dirty = 0;
+}
+
+/*
+ * flush_dirty_sendqs
+ *
+ * Called by the main loop once all ready sockets have been serviced:
+ * every sendQ that got data during the pass is written just once,
+ * instead of once per message queued.
+ */
+void flush_dirty_sendqs(void)
+{
+  aClient *cptr;
+
+  if (!dirty_count)
+    return;
+  ircstp->is_dfp++;
+  /*
+   * send_queued may end up queueing notices for other clients
+   * (dead_link), which are appended and flushed in this same pass.
+   */
+  while (dirty_count)
+  {
+    cptr = dirty_list[--dirty_count];
+    cptr->dirty = 0;
+    ircstp->is_dfc++;
+    send_queued(cptr);
+  }
+}
+
 /*
  * flush_sendq_except - run through local client array and flush
  * the sendq for each client, if the address of the client sendq
@@ -132,6 +196,22 @@ void flush_sendq_except(const struct DBuf *one)
   }
 }
 
+/*
+ * Blocks of a sendQ flushed with a single writev() by send_queued.
+ */
+#if !defined(IOV_MAX)
+#define IOV_MAX 16
+#endif
+#define SENDQ_IOV_MAX IOV_MAX
+
+static struct iovec sendq_iov[SENDQ_IOV_MAX];
+
+/*
+ * Kbytes a sendQ may grow within one event loop pass before it is
+ * written without waiting for the end of the pass.
+ */
+#define SENDQ_BATCH_KB 64
+
 /*
  * send_queued
  *
@@ -169,18 +249,29 @@ void send_queued(aClient *to)
   }
   while (DBufLength(&to->sendQ) > 0)
   {
-    const char *msg;
-    size_t len, rlen;
-    int tmp;
+    size_t len, rlen, blen;
+    int count, tmp, i;
 
-    msg = dbuf_map(&to->sendQ, &len);
-    /* Returns always len > 0 */
-    if ((tmp = deliver_it(to, msg, len)) < 0)
+    count = dbuf_mapiov(&to->sendQ, sendq_iov, SENDQ_IOV_MAX, &len);
+    /* Returns always count > 0 and len > 0 */
+    if ((tmp = deliver_iov(to, sendq_iov, count)) < 0)
     {
       dead_link(to, "Write error, closing link");
       return;
     }
     rlen = tmp;
+
+    /*
+     * Each block touched by this writev() would have cost a send()
+     * of its own.
+     */
+    ircstp->is_wv++;
+    for (i = 0, blen = rlen; i < count && blen > 0; i++)
+      blen -= (blen < sendq_iov[i].iov_len) ? blen : sendq_iov[i].iov_len;
+    ircstp->is_wvb += i;
+    if (i > 1)
+      ircstp->is_wvs += i - 1;
+
     dbuf_delete(&to->sendQ, rlen);
     to->lastsq = DBufLength(&to->sendQ) / 1024;
     if (rlen < len)
@@ -282,6 +373,72 @@ void vsendto_one(aClient *to, char *pattern, va_list vl)
   sendbufto_one(to);
 }
 
+/*
+ * send_to_sendq
+ *
+ * Append a prepared message to the sendQ of the local connection 'to',
+ * either by copying 'buf' or, when 'shared' is given, by queueing a
+ * reference to it. Returns 0 if the link was declared dead.
+ */
+static int send_to_sendq(aClient *to, const char *buf, size_t len,
+    struct DBufShared *shared)
+{
+  /* Durante una rafaga el trafico en vivo espera a que termine */
+  struct DBuf *dyn = to->burst ? burst_queue(to) : &to->sendQ;
+  /* Lo diferido se comprime al pasarlo al sendQ */
+  aClient *zto = (dyn == &to->sendQ) ? to : NULL;
+
+  if (DBufLength(dyn) > get_sendq(to))
+  {
+    if (IsServer(to))
+      sendto_ops("Max SendQ limit exceeded for %s: "
+          SIZE_T_FMT " > " SIZE_T_FMT, to->name,
+          DBufLength(dyn), get_sendq(to));
+    dead_link(to, "Max sendQ exceeded");
+    return 0;
+  }
+
+  if (!(shared ? dbuf_put_shared(zto, dyn, shared) :
+      dbuf_put(zto, dyn, buf, len)))
+  {
+    dead_link(to, "Buffer allocation error");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * send_queue_update
+ *
+ * Bookkeeping after a message was queued for the local connection 'to'.
+ */
+static void send_queue_update(aClient *to)
+{
+  /*
+   * Update statistics. The following is slightly incorrect
+   * because it counts messages even if queued, but bytes
+   * only really sent. Queued bytes get updated in SendQueued.
+   */
+  to->sendM += 1;
+  me.sendM += 1;
+  if (to->acpt != &me)
+    to->acpt->sendM += 1;
+  /*
+   * The write itself waits until the end of the event loop pass, so
+   * that every message queued for 'to' meanwhile goes out together.
+   * But this little bit is to stop the sendQ from growing too large
+   * when there is no need for it to: once SENDQ_BATCH_KB have been
+   * added since the last non-fatal write we try to write right away.
+   * Also stops us from deliberately building a large sendQ and then
+   * trying to flood that link with data (possible during the net
+   * relinking done by servers with a large load).
+   */
+  if (DBufLength(&to->sendQ) / 1024 > to->lastsq + SENDQ_BATCH_KB)
+    send_queued(to);
+  else
+    sendq_dirty_add(to);
+}
+
 void sendbufto_one(aClient *to)
 {
   int len;
@@ -324,21 +481,8 @@ void sendbufto_one(aClient *to)
     return;
   }
 
-  if (DBufLength(&to->sendQ) > get_sendq(to))
-  {
-    if (IsServer(to))
-      sendto_ops("Max SendQ limit exceeded for %s: "
-          SIZE_T_FMT " > " SIZE_T_FMT, to->name,
-          DBufLength(&to->sendQ), get_sendq(to));
-    dead_link(to, "Max sendQ exceeded");
+  if (!send_to_sendq(to, sendbuf, len, NULL))
     return;
-  }
-
-  else if (!dbuf_put(to, &to->sendQ, sendbuf, len))
-  {
-    dead_link(to, "Buffer allocation error");
-    return;
-  }
 #if defined(GODMODE)
 
   if (!sdbflag && !IsUser(to))
@@ -363,88 +507,179 @@ void sendbufto_one(aClient *to)
   }
 
 #endif /* GODMODE */
-  /*
-   * Update statistics. The following is slightly incorrect
-   * because it counts messages even if queued, but bytes
-   * only really sent. Queued bytes get updated in SendQueued.
-   */
-  to->sendM += 1;
-  me.sendM += 1;
-  if (to->acpt != &me)
-    to->acpt->sendM += 1;
-  /*
-   * This little bit is to stop the sendQ from growing too large when
-   * there is no need for it to. Thus we call send_queued() every time
-   * 2k has been added to the queue since the last non-fatal write.
-   * Also stops us from deliberately building a large sendQ and then
-   * trying to flood that link with data (possible during the net
-   * relinking done by servers with a large load).
-   */
-  if (DBufLength(&to->sendQ) / 1024 > to->lastsq)
-    send_queued(to);
-  else
-    UpdateWrite(to);
+  send_queue_update(to);
 }
 
-static void vsendto_prefix_one(aClient *to, aClient *from,
+/*
+ * prefix_class
+ *
+ * What vformat_prefix() builds for 'to' depends only on this class:
+ * local users see the nick!user@host of 'from' (its host as seen by
+ * anyone, not by 'to'), everybody else the pattern as is. A message
+ * going to many recipients is thus formatted once per class.
+ */
+#define PREFIX_RAW      0       /* Server links and non-users */
+#define PREFIX_USER     1       /* Local users, 'from' is a user */
+#define PREFIX_CLASSES  2
+
+struct PrefixCache {
+  struct DBufShared *shared[PREFIX_CLASSES];
+};
+
+static int prefix_class(aClient *to, aClient *from)
+{
+  return (to && from && MyUser(to) && IsUser(from)) ? PREFIX_USER :
+      PREFIX_RAW;
+}
+
+/*
+ * vformat_prefix
+ *
+ * Build in sendbuf the message as it has to be seen by 'to': local
+ * users get the full nick!user@host of 'from' as prefix.
+ */
+static void vformat_prefix(aClient *to, aClient *from,
     char *pattern, va_list vlorig)
 {
   va_list vl;
   va_copy(vl,vlorig);
-  if (to && from && MyUser(to) && IsUser(from))
+  if (prefix_class(to, from) == PREFIX_USER)
   {
-    static char sender[HOSTLEN + NICKLEN + USERLEN + 5];
-    char *par;
-    int flag = 0;
+    Reg1 char *p = sendbuf;
+    Reg2 const char *s;
     Reg3 anUser *user = from->user;
+    const char *host = NULL;
 
-    par = va_arg(vl, char *);
-    strcpy(sender, from->name);
+    (void)va_arg(vl, char *);
+    *p++ = ':';
+    for (s = from->name; *s; *p++ = *s++);
 
     if (user)
     {
       if (user->username)
       {
-        strcat(sender, "!");
-        strcat(sender, user->username);
+        *p++ = '!';
+        for (s = user->username; *s; *p++ = *s++);
       }
-      if (user->host && !MyConnect(from))
+      if (user->host)
       {
-        strcat(sender, "@");
 #if defined(BDD_VIP)
-        strcat(sender, get_visiblehost(from, NULL, 0));
+        host = get_visiblehost(from, NULL, 0);
 #else
-        strcat(sender, user->host);
+        if (!MyConnect(from) || IsUnixSocket(from))
+          host = user->host;
+        else
+          host = from->sockhost;
 #endif
-        flag = 1;
       }
     }
-    /*
-     * Flag is used instead of strchr(sender, '@') for speed and
-     * also since username/nick may have had a '@' in them. -avalon
-     */
-    if (!flag && MyConnect(from) && user->host)
+    if (host)
     {
-      strcat(sender, "@");
-#if defined(BDD_VIP)
-      strcat(sender, get_visiblehost(from, NULL, 0));
-#else
-      if (IsUnixSocket(from))
-        strcat(sender, user->host);
-      else
-        strcat(sender, from->sockhost);
-#endif
+      *p++ = '@';
+      for (s = host; *s; *p++ = *s++);
     }
-    *sendbuf = ':';
-    strcpy(&sendbuf[1], sender);
     /* Assuming 'pattern' always starts with ":%s ..." */
-    vsprintf_irc(sendbuf + strlen(sendbuf), &pattern[3], vl);
+    vsprintf_irc(p, &pattern[3], vl);
   }
   else
     vsprintf_irc(sendbuf, pattern, vl);
+  va_end(vl);
+}
+
+static void vsendto_prefix_one(aClient *to, aClient *from,
+    char *pattern, va_list vl)
+{
+  vformat_prefix(to, from, pattern, vl);
   sendbufto_one(to);
 }
 
+/*
+ * vshare_prefix
+ *
+ * Format the message like vsendto_prefix_one() would for 'to', but
+ * into a shared message that can be queued for every recipient that
+ * sees the same rendering. Returns NULL if no memory is available, in
+ * which case the caller falls back to vsendto_prefix_one().
+ */
+static struct DBufShared *vshare_prefix(aClient *to, aClient *from,
+    char *pattern, va_list vl)
+{
+  struct DBufShared *shared;
+  size_t len;
+
+  if (!(shared = dbuf_shared_alloc()))
+    return NULL;
+
+  vformat_prefix(to, from, pattern, vl);
+  len = strlen(sendbuf);
+  if (len > 510)
+    len = 510;
+  memcpy(shared->data, sendbuf, len);
+  shared->data[len++] = '\r';
+  shared->data[len++] = '\n';
+  shared->data[len] = '\0';
+  shared->length = len;
+  return shared;
+}
+
+/*
+ * sendshared_to_one
+ *
+ * Queue a reference to a shared message for 'to' (or the link it is
+ * behind).
+ */
+static void sendshared_to_one(aClient *to, struct DBufShared *shared)
+{
+  Debug((DEBUG_SEND, "Sending [%s] to %s", shared->data, to->name));
+
+  if (to->from)
+    to = to->from;
+  if (IsDead(to) || to->fd < 0 || IsMe(to))
+    return;
+
+  if (send_to_sendq(to, NULL, 0, shared))
+    send_queue_update(to);
+}
+
+/*
+ * sendto_shared_prefix_one
+ *
+ * Send to 'to' the rendering of its prefix_class() cached in 'cache',
+ * formatting it the first time. Used by the fan-out functions: the
+ * message is formatted once per class instead of once per recipient,
+ * and every sendQ just holds a reference to it.
+ */
+static void sendto_shared_prefix_one(aClient *to, aClient *from,
+    struct PrefixCache *cache, char *pattern, va_list vl)
+{
+  struct DBufShared **shared = &cache->shared[prefix_class(to, from)];
+
+  if (*shared)
+    ircstp->is_pfs++;
+  else if ((*shared = vshare_prefix(to, from, pattern, vl)))
+    ircstp->is_pfr++;
+  else
+  {
+    vsendto_prefix_one(to, from, pattern, vl);
+    return;
+  }
+  sendshared_to_one(to, *shared);
+}
+
+/*
+ * prefix_cache_free
+ *
+ * Drop the creator's reference to every rendering in the cache.
+ */
+static void prefix_cache_free(struct PrefixCache *cache)
+{
+  int i;
+
+  for (i = 0; i < PREFIX_CLASSES; i++)
+    if (cache->shared[i])
+      dbuf_shared_free(cache->shared[i]);
+}
+
 /*
  * send debug message to channel
  */
@@ -457,6 +692,7 @@ void sendto_debug_channel(char *channel, char *pattern, ...)
   Reg4 aChannel *chptr;
   static char fmt[1024];
   char *fmt_target;
+  struct PrefixCache cache = { { NULL } };
 
   chptr = FindChannel(channel);
   if (!chptr)
@@ -477,7 +713,7 @@ void sendto_debug_channel(char *channel, char *pattern, ...)
         (lp->flags & CHFL_ZOMBIE) || IsDeaf(acptr))
       continue;
     if (MyConnect(acptr)) {       /* (It is always a client) */
-      vsendto_prefix_one(acptr, &me, fmt, vl);
+      sendto_shared_prefix_one(acptr, &me, &cache, fmt, vl);
     }
     else if (sentalong[(i = acptr->from->fd)] != sentalong_marker)
     {
@@ -485,10 +721,11 @@ void sendto_debug_channel(char *channel, char *pattern, ...)
       /* Don't send channel messages to links that are still eating
          the net.burst: -- Run 2/1/1997 */
       if (!IsBurstOrBurstAck(acptr->from))
-        vsendto_prefix_one(acptr, &me, fmt, vl);
+        sendto_shared_prefix_one(acptr, &me, &cache, fmt, vl);
     }
   }
   va_end(vl);
+  prefix_cache_free(&cache);
   return;
 }
 
@@ -499,6 +736,7 @@ void sendto_channel_butone(aClient *one, aClient *from, aChannel *chptr,
   Reg1 Link *lp;
   Reg2 aClient *acptr;
   Reg3 int i;
+  struct PrefixCache cache = { { NULL } };
 
   va_start(vl, pattern);
 
@@ -510,7 +748,7 @@ void sendto_channel_butone(aClient *one, aClient *from, aChannel *chptr,
         (lp->flags & CHFL_ZOMBIE) || IsDeaf(acptr))
       continue;
     if (MyConnect(acptr)) {       /* (It is always a client) */
-      vsendto_prefix_one(acptr, from, pattern, vl);
+      sendto_shared_prefix_one(acptr, from, &cache, pattern, vl);
     }
     else if (sentalong[(i = acptr->from->fd)] != sentalong_marker)
     {
@@ -518,10 +756,11 @@ void sendto_channel_butone(aClient *one, aClient *from, aChannel *chptr,
       /* Don't send channel messages to links that are still eating
          the net.burst: -- Run 2/1/1997 */
       if (!IsBurstOrBurstAck(acptr->from))
-        vsendto_prefix_one(acptr, from, pattern, vl);
+        sendto_shared_prefix_one(acptr, from, &cache, pattern, vl);
     }
   }
   va_end(vl);
+  prefix_cache_free(&cache);
   return;
 }
 
@@ -532,6 +771,7 @@ void sendto_channel_color_butone(aClient *one, aClient *from, aChannel *chptr,
   Reg1 Link *lp;
   Reg2 aClient *acptr;
   Reg3 int i;
+  struct PrefixCache cache = { { NULL } };
 
   va_start(vl, pattern);
 
@@ -544,7 +784,7 @@ void sendto_channel_color_butone(aClient *one, aClient *from, aChannel *chptr,
       continue;
     if (MyConnect(acptr)) {       /* (It is always a client) */
       if(!IsStripColor(acptr))
-        vsendto_prefix_one(acptr, from, pattern, vl);
+        sendto_shared_prefix_one(acptr, from, &cache, pattern, vl);
     }
     else if (sentalong[(i = acptr->from->fd)] != sentalong_marker)
     {
@@ -552,10 +792,11 @@ void sendto_channel_color_butone(aClient *one, aClient *from, aChannel *chptr,
       /* Don't send channel messages to links that are still eating
          the net.burst: -- Run 2/1/1997 */
       if (!IsBurstOrBurstAck(acptr->from))
-        vsendto_prefix_one(acptr, from, pattern, vl);
+        sendto_shared_prefix_one(acptr, from, &cache, pattern, vl);
     }
   }
   va_end(vl);
+  prefix_cache_free(&cache);
   return;
 }
 
@@ -565,6 +806,7 @@ void sendto_channel_nocolor_butone(aClient *one, aClient *from, aChannel *chptr,
   va_list vl;
   Reg1 Link *lp;
   Reg2 aClient *acptr;
+  struct PrefixCache cache = { { NULL } };
 
   va_start(vl, pattern);
 
@@ -576,9 +818,10 @@ void sendto_channel_nocolor_butone(aClient *one, aClient *from, aChannel *chptr,
         (lp->flags & CHFL_ZOMBIE) || IsDeaf(acptr))
       continue;
     if (MyConnect(acptr) && IsStripColor(acptr))       /* (It is always a client) */
-      vsendto_prefix_one(acptr, from, pattern, vl);
+      sendto_shared_prefix_one(acptr, from, &cache, pattern, vl);
   }
   va_end(vl);
+  prefix_cache_free(&cache);
   return;
 }
 
@@ -588,6 +831,7 @@ void sendto_lchanops_butone(aClient *one, aClient *from, aChannel *chptr,
   va_list vl;
   Reg1 Link *lp;
   Reg2 aClient *acptr;
+  struct PrefixCache cache = { { NULL } };
 
   va_start(vl, pattern);
 
@@ -599,9 +843,10 @@ void sendto_lchanops_butone(aClient *one, aClient *from, aChannel *chptr,
         (lp->flags & CHFL_ZOMBIE) || IsDeaf(acptr))
       continue;
     if (MyConnect(acptr))       /* (It is always a client) */
-      vsendto_prefix_one(acptr, from, pattern, vl);
+      sendto_shared_prefix_one(acptr, from, &cache, pattern, vl);
   }
   va_end(vl);
+  prefix_cache_free(&cache);
   return;
 }
 
@@ -752,6 +997,7 @@ void sendto_common_channels(aClient *acptr, char *pattern, ...)
   va_list vl;
   Reg1 Link *chan;
   Reg2 Link *member;
+  struct PrefixCache cache = { { NULL } };
 
   va_start(vl, pattern);
 
@@ -767,12 +1013,13 @@ void sendto_common_channels(aClient *acptr, char *pattern, ...)
         if (MyConnect(cptr) && sentalong[cptr->fd] != sentalong_marker)
         {
           sentalong[cptr->fd] = sentalong_marker;
-          vsendto_prefix_one(cptr, acptr, pattern, vl);
+          sendto_shared_prefix_one(cptr, acptr, &cache, pattern, vl);
         }
       }
   if (MyConnect(acptr))
-    vsendto_prefix_one(acptr, acptr, pattern, vl);
+    sendto_shared_prefix_one(acptr, acptr, &cache, pattern, vl);
   va_end(vl);
+  prefix_cache_free(&cache);
   return;
 }
 
@@ -787,11 +1034,13 @@ void sendto_channel_butserv(aChannel *chptr, aClient *from, char *pattern, ...)
   va_list vl;
   Reg1 Link *lp;
   Reg2 aClient *acptr;
+  struct PrefixCache cache = { { NULL } };
 
   for (va_start(vl, pattern), lp = chptr->members; lp; lp = lp->next)
     if (MyConnect(acptr = lp->value.cptr) && !(lp->flags & CHFL_ZOMBIE))
-      vsendto_prefix_one(acptr, from, pattern, vl);
+      sendto_shared_prefix_one(acptr, from, &cache, pattern, vl);
   va_end(vl);
+  prefix_cache_free(&cache);
   return;
 }
 
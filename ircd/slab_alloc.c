@@ -1,13 +1,157 @@
 #include "sys.h"
 #include "runmalloc.h"
+#include "h.h"
+#include "struct.h"
+#include "numeric.h"
+#include "send.h"
+#include "ircd.h"
 #include "slab_alloc.h"
 
 #include <string.h>
 
+/*
+ * Cada bloque que se pide al malloc general tiene este taman~o
+ * (o el de un solo objeto, si es mayor).
+ */
+#define SLAB_BLOCK_SIZE 16384
+#define SLAB_ALIGN      8
+
+static struct SlabPool *slab_pools = NULL;
+
+/*
+ * Las cadenas se reparten en pools por clase de taman~o. El byte
+ * anterior a cada cadena guarda su clase, para que SlabStringFree
+ * sepa a que pool devolverla; las que no caben en la mayor clase
+ * van al malloc general.
+ */
+#define SLAB_STRING_BIG 0xff
+
+static struct SlabPool string_pools[] = {
+  SLAB_POOL_INIT("String 16", 16),
+  SLAB_POOL_INIT("String 32", 32),
+  SLAB_POOL_INIT("String 64", 64),
+  SLAB_POOL_INIT("String 128", 128),
+  SLAB_POOL_INIT("String 256", 256)
+};
+
+#define SLAB_STRING_CLASSES (sizeof(string_pools) / sizeof(string_pools[0]))
+
+static unsigned int string_big = 0;
+
+#if !defined(DEBUGMALLOC)
+/*
+ * slab_grow
+ *
+ * Reserva un bloque nuevo para el pool y mete sus objetos
+ * en la lista libre.
+ */
+static int slab_grow(struct SlabPool *pool)
+{
+  char *block;
+  unsigned int count, i;
+
+  if (!pool->blocks)
+  {
+    pool->size = (pool->size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    if (pool->size < sizeof(void *))
+      pool->size = sizeof(void *);
+    pool->next = slab_pools;
+    slab_pools = pool;
+  }
+
+  if (!(count = SLAB_BLOCK_SIZE / pool->size))
+    count = 1;
+  if (!(block = (char *)RunMalloc(count * pool->size)))
+    return 0;
+
+  for (i = 0; i < count; i++, block += pool->size)
+  {
+    *(void **)block = pool->free;
+    pool->free = block;
+  }
+  pool->blocks++;
+  pool->total += count;
+  return 1;
+}
+#endif
+
+void *SlabAlloc(struct SlabPool *pool)
+{
+  void *obj;
+
+#if defined(DEBUGMALLOC)
+  /* Que el detector de memleaks vea cada objeto */
+  if ((obj = RunMalloc(pool->size)))
+    pool->inuse++;
+#else
+  if (!pool->free && !slab_grow(pool))
+    return NULL;
+  obj = pool->free;
+  pool->free = *(void **)obj;
+  pool->inuse++;
+#endif
+  return obj;
+}
+
+void SlabFree(struct SlabPool *pool, void *obj)
+{
+  pool->inuse--;
+#if defined(DEBUGMALLOC)
+  RunFree(obj);
+#else
+  *(void **)obj = pool->free;
+  pool->free = obj;
+#endif
+}
+
+/*
+ * slab_count_memory
+ *
+ * Envia el estado de cada pool y devuelve la memoria que tienen
+ * retenida en sus listas libres (la que esta en uso ya la cuenta
+ * cada tipo de objeto por su lado).
+ */
+size_t slab_count_memory(aClient *cptr, char *nick)
+{
+  struct SlabPool *pool;
+  size_t mem, total = 0;
+
+  for (pool = slab_pools; pool; pool = pool->next)
+  {
+    mem = pool->total * pool->size;
+    total += (pool->total - pool->inuse) * pool->size;
+    sendto_one(cptr, ":%s %d %s :Slab %s: used %u/%u blocks %u("
+        SIZE_T_FMT ")", me.name, RPL_STATSDEBUG, nick, pool->name,
+        pool->inuse, pool->total, pool->blocks, mem);
+  }
+  sendto_one(cptr, ":%s %d %s :Slab strings over %u bytes: %u",
+      me.name, RPL_STATSDEBUG, nick,
+      (unsigned int)string_pools[SLAB_STRING_CLASSES - 1].size - 1, string_big);
+
+  return total;
+}
 
 char *SlabStringAlloc(size_t size)
 {
-  return RunMalloc(size);
+  char *p;
+  unsigned int i;
+
+  for (i = 0; i < SLAB_STRING_CLASSES; i++)
+  {
+    if (size + 1 <= string_pools[i].size)
+    {
+      if (!(p = (char *)SlabAlloc(&string_pools[i])))
+        return NULL;
+      *p = i;
+      return p + 1;
+    }
+  }
+
+  if (!(p = (char *)RunMalloc(size + 1)))
+    return NULL;
+  *p = (char)SLAB_STRING_BIG;
+  string_big++;
+  return p + 1;
 }
 
 void SlabStringAllocDup(char **old, char *new, size_t max_len)
@@ -15,23 +159,31 @@ void SlabStringAllocDup(char **old, char *new, size_t max_len)
   int len;
 
   if (*old)
-    RunFree(*old);
+    SlabStringFree(*old);
 
   len = strlen(new);
   if ((!max_len) || (len <= max_len))
   {
-    *old = RunMalloc(len + 1);
+    *old = SlabStringAlloc(len + 1);
     strcpy(*old, new);
     return;
   }
 
 /* Nos pasamos de taman~o */
-  *old = RunMalloc(max_len + 1);
+  *old = SlabStringAlloc(max_len + 1);
   strncpy(*old, new, max_len);
   (*old)[max_len] = '\0';
 }
 
 void SlabStringFree(char *string)
 {
-  RunFree(string);
+  unsigned char class = ((unsigned char *)string)[-1];
+
+  if (class == SLAB_STRING_BIG)
+  {
+    string_big--;
+    RunFree(string - 1);
+    return;
+  }
+  SlabFree(&string_pools[class], string - 1);
 }
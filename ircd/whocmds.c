@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #endif
 #include <stdlib.h>
+#include <limits.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -348,6 +349,193 @@ static void do_who(aClient *sptr, aClient *acptr, aChannel *repchan,
       me.name, sptr->name, ++p1);
 }
 
+/*
+ * Planificador del barrido de /WHO
+ *
+ * Cuando la mascara no es un canal ni un nick, en vez de recorrer
+ * todos los clientes se reunen los candidatos de los indices de
+ * hash.c (IP, host y username al reves) y de los numericos de los
+ * servidores marcados, siempre que todos los campos que quedan en
+ * `matchsel' tengan indice y salga mas barato. El predicado de
+ * m_who() se sigue aplicando a cada candidato, y Process() elimina
+ * los repetidos.
+ */
+static aClient **who_cand;
+static unsigned int who_ncand, who_maxcand;
+static unsigned int who_scans, who_indexed, who_candidates, who_last;
+
+static void who_cand_add(aClient *acptr)
+{
+  if (who_ncand == who_maxcand)
+  {
+    who_maxcand = who_maxcand ? who_maxcand * 2 : 256;
+    who_cand = (aClient **)RunRealloc(who_cand,
+        who_maxcand * sizeof(aClient *));
+  }
+  who_cand[who_ncand++] = acptr;
+}
+
+/*
+ * who_literal
+ *
+ * Si la mascara es "*literal" devuelve el literal, y si no tiene
+ * comodines la devuelve entera con `exact' a 1. En otro caso NULL.
+ */
+static const char *who_literal(const char *mask, int *exact)
+{
+  const char *lit;
+
+  *exact = (*mask != '*');
+  lit = *exact ? mask : mask + 1;
+  if (!*lit || strlen(lit) > HOSTLEN || strpbrk(lit, "*?\\"))
+    return NULL;
+  return lit;
+}
+
+#if defined(BDD_VIP)
+/* `s' acaba en `tail', sin distinguir mayusculas */
+static int who_ends(const char *s, const char *tail)
+{
+  size_t ls = strlen(s), lt = strlen(tail);
+
+  return ls >= lt && !strCasediff(s + ls - lt, tail);
+}
+
+/* `s' contiene `lit', sin distinguir mayusculas */
+static int who_contains(const char *s, const char *lit)
+{
+  const char *p, *q;
+
+  for (; *s; s++)
+  {
+    for (p = s, q = lit; *q && toLower(*p) == toLower(*q); p++, q++);
+    if (!*q)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * who_vhosts
+ *
+ * Con +x el host visible puede ser una ip virtual que no esta en el
+ * indice del host real. Las de make_vhost() acaban en ".virtual",
+ * ".v6" o son "no.hay.clave.de.cifrado": si el literal puede casar
+ * con ellas no hay indice que valga. Las personalizadas salen de la
+ * tabla 'v', asi que se anaden como candidatos los nicks cuyo
+ * registro contiene el literal. Devuelve el coste, o UINT_MAX si
+ * hay que recorrerlo todo.
+ */
+static unsigned int who_vhosts(const char *lit, unsigned int limit)
+{
+  static const char *tails[] = { ".virtual", ".v6",
+      "no.hay.clave.de.cifrado", NULL };
+  struct db_reg *reg;
+  aClient *acptr;
+  unsigned int cost;
+  int i;
+
+  for (i = 0; tails[i]; i++)
+    if (who_ends(tails[i], lit) || who_ends(lit, tails[i]))
+      return UINT_MAX;
+
+  if (!(cost = db_cuantos(BDD_IPVIRTUALDB)))
+    return 0;
+  if (cost >= limit)
+    return UINT_MAX;
+  for (reg = db_iterador_init(BDD_IPVIRTUALDB); reg;
+      reg = db_iterador_next())
+    if (who_contains(reg->valor, lit) && (acptr = FindUser(reg->clave)))
+      who_cand_add(acptr);
+  return cost;
+}
+#endif
+
+/*
+ * who_plan
+ *
+ * Reune en who_cand los candidatos de los indices y devuelve cuantos
+ * son, o -1 si hay que recorrer todos los clientes.
+ */
+static int who_plan(const char *mask, int matchsel,
+    const struct irc_in_addr *imask, unsigned char ibits)
+{
+  const char *lit = NULL;
+  unsigned int cost = 0, limit = nrof.clients;
+  void *host = NULL, *user = NULL, *ip = NULL;
+  int exact = 0;
+
+  who_ncand = 0;
+  if (!mask || (matchsel & WHO_FIELD_REN))
+    return -1;
+  if (matchsel & (WHO_FIELD_NIC | WHO_FIELD_UID | WHO_FIELD_HOS))
+  {
+    if (!(lit = who_literal(mask, &exact)))
+      return -1;
+    if ((matchsel & WHO_FIELD_NIC) && !exact)
+      return -1;
+  }
+
+  if (matchsel & WHO_FIELD_HOS)
+    cost += who_index_count(host = who_index_suffix(WHO_INDEX_HOST, lit,
+        exact));
+  if (matchsel & WHO_FIELD_UID)
+    cost += who_index_count(user = who_index_suffix(WHO_INDEX_USER, lit,
+        exact));
+  if (matchsel & WHO_FIELD_NIP)
+    cost += who_index_count(ip = who_index_ip(imask, ibits));
+  if (matchsel & WHO_FIELD_SER)
+    cost += markedServerSlots();
+  if (cost >= limit)
+    return -1;
+
+#if defined(BDD_VIP)
+  if (matchsel & WHO_FIELD_HOS)
+  {
+    unsigned int vcost = who_vhosts(lit, limit - cost);
+
+    if (vcost == UINT_MAX)
+      return -1;
+    cost += vcost;
+  }
+#endif
+
+  if (matchsel & WHO_FIELD_NIC)
+  {
+    aClient *acptr = FindUser((char *)lit);
+
+    if (acptr)
+      who_cand_add(acptr);
+  }
+  who_index_walk(host, who_cand_add);
+  who_index_walk(user, who_cand_add);
+  who_index_walk(ip, who_cand_add);
+  if (matchsel & WHO_FIELD_SER)
+    walkMarkedServerClients(who_cand_add);
+
+  return who_ncand;
+}
+
+/* Siguiente cliente a examinar: el candidato `*i', o el anterior a acptr */
+static aClient *who_next(aClient *acptr, int *i, int ncand)
+{
+  if (ncand < 0)
+    return acptr ? acptr->prev : me.prev;
+  return (*i < ncand) ? who_cand[(*i)++] : NULL;
+}
+
+/*
+ * who_report
+ *
+ * Estadisticas de los barridos de /WHO para /STATS t.
+ */
+void who_report(aClient *cptr, char *name)
+{
+  sendto_one(cptr, ":%s %d %s :who scans %u indexed %u candidates %u "
+      "last %u", me.name, RPL_STATSDEBUG, name, who_scans, who_indexed,
+      who_candidates, who_last);
+}
+
 /*
  *  m_who
  *
@@ -575,7 +763,7 @@ int m_who(aClient *UNUSED(cptr), aClient *sptr, int parc, char *parv[])
      real mask and try to match all relevant fields */
   if (!(commas || (counter < 1)))
   {
-    int minlen, cset;
+    int minlen, cset, i, ncand;
     struct irc_in_addr imask;
     unsigned char ibits;
     if (mask)
@@ -649,9 +837,20 @@ int m_who(aClient *UNUSED(cptr), aClient *sptr, int parc, char *parv[])
         }
 
     /* Loop through all clients :-\, if we still have something to match to 
-       and we can show more clients */
+       and we can show more clients; the indexes narrow it when they can */
     if ((!(counter < 1)) && matchsel)
-      for (acptr = me.prev; acptr; acptr = acptr->prev)
+    {
+      ncand = who_plan(mask, matchsel, &imask, ibits);
+      who_scans++;
+      who_last = (ncand < 0) ? nrof.clients : (unsigned int)ncand;
+      who_candidates += who_last;
+      if (ncand >= 0)
+        who_indexed++;
+      Debug((DEBUG_DEBUG, "WHO %s: %u candidatos%s",
+          BadPtr(mask) ? "*" : mask, who_last, (ncand < 0) ? " (todos)" : ""));
+
+      for (i = 0, acptr = who_next(NULL, &i, ncand); acptr;
+          acptr = who_next(acptr, &i, ncand))
       {
         if (!(IsUser(acptr) && Process(acptr)))
           continue;
@@ -699,6 +898,7 @@ int m_who(aClient *UNUSED(cptr), aClient *sptr, int parc, char *parv[])
           break;
         do_who(sptr, acptr, NULL, fields, bitsel & WHOSELECT_EXTRA, qrt);
       }
+    }
   }
 
   /* Make a clean mask suitable to be sent in the "end of" */
@@ -828,7 +1028,7 @@ int m_whois(aClient *cptr, aClient *sptr, int parc, char *parv[])
         if (user)
         {
 #if defined(BDD_VIP)
-          struct db_reg *reg = db_buscar_registro(BDD_IPVIRTUALDB, name);
+          const struct db_reg *reg = db_buscar_registro(BDD_IPVIRTUALDB, name);
 #endif
           a2cptr = user->server;
 #if defined(BDD_VIP)
@@ -1053,7 +1253,7 @@ int m_whois(aClient *cptr, aClient *sptr, int parc, char *parv[])
       if ((acptr = FindUser(nick)))
       {
 #if defined(BDD_VIP)
-        struct db_reg *reg = db_buscar_registro(BDD_IPVIRTUALDB, nick);
+        const struct db_reg *reg = db_buscar_registro(BDD_IPVIRTUALDB, nick);
 #endif
         found = 2;              /* Make sure we exit the loop after passing it once */
         user = acptr->user;
@@ -0,0 +1,171 @@
+/*
+ * IRC - Internet Relay Chat, tools/bench_ipcheck.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Microbenchmark del registro de IPs de ircd/IPcheck.c.
+ *
+ * Conecta 'ips' direcciones IPv4 distintas, hace tres consultas
+ * por cada una, las vuelve a conectar todas (como una avalancha de
+ * reconexiones de una botnet), las desconecta y deja que el barrido
+ * las caduque en una vuelta.  La base de datos de clones no tiene registros.
+ *
+ * Uso: bench_ipcheck [ips]
+ */
+
+#include "../ircd/IPcheck.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#if defined(DEBUGMALLOC)
+#error "Los benchmarks no tienen sentido con DEBUGMALLOC"
+#endif
+
+/* Lo que en el ircd ponen ircd.c, send.c, s_timer.c, support.c y s_bdd.c */
+aClient me;
+time_t now;
+
+void sendto_one(aClient *UNUSED(to), char *UNUSED(pattern), ...)
+{
+}
+
+void timer_set(struct WheelTimer *UNUSED(timer), void (*func) (void *),
+    void *UNUSED(data))
+{
+}
+
+void timer_add(struct WheelTimer *timer, time_t UNUSED(delay))
+{
+  /* Solo se marca como armado: el barrido lo llama el benchmark */
+  timer->prevp = &timer->next;
+}
+
+const char *ircd_ntoa(const struct irc_in_addr *UNUSED(addr))
+{
+  return "0.0.0.0";
+}
+
+char *ircd_ntoa_c(aClient *UNUSED(cptr))
+{
+  return "0.0.0.0";
+}
+
+const struct db_reg *db_buscar_registro(unsigned char UNUSED(tabla),
+    const char *UNUSED(clave))
+{
+  return NULL;
+}
+
+static double elapsed(struct timeval *start)
+{
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1e6;
+}
+
+static void set_ip(aClient *cptr, unsigned int addr)
+{
+  memset(&cptr->ip, 0, sizeof(cptr->ip));
+  cptr->ip.in6_16[5] = htons(0xffff);
+  cptr->ip.in6_16[6] = htons(addr >> 16);
+  cptr->ip.in6_16[7] = htons(addr & 0xffff);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int ips = (argc > 1) ? atoi(argv[1]) : 1000000;
+  unsigned int *addrs, i, r, tmp, total;
+  aClient client;
+  struct timeval start;
+
+  if (!ips)
+  {
+    fprintf(stderr, "Uso: %s [ips]\n", argv[0]);
+    return 1;
+  }
+
+  /* Direcciones distintas en orden aleatorio */
+  addrs = (unsigned int *)malloc(ips * sizeof(unsigned int));
+  for (i = 0; i < ips; i++)
+    addrs[i] = 0x0a000000 + i;
+  srandom(1);
+  for (i = ips - 1; i > 0; i--)
+  {
+    r = random() % (i + 1);
+    tmp = addrs[i];
+    addrs[i] = addrs[r];
+    addrs[r] = tmp;
+  }
+
+  memset(&client, 0, sizeof(client));
+  client.from = &client;
+  now = me.since = 1000000;
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < ips; i++)
+  {
+    set_ip(&client, addrs[i]);
+    IPcheck_local_connect(&client);
+  }
+  printf("%u conexiones nuevas:   %.3fs\n", ips, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  total = 0;
+  for (i = 0; i < 3 * ips; i++)
+  {
+    set_ip(&client, addrs[random() % ips]);
+    total += IPcheck_nr(&client);
+  }
+  printf("%u consultas:          %.3fs (%u conectados)\n", 3 * ips,
+      elapsed(&start), total);
+
+  now += IPCHECK_CLONE_PERIOD + 1;
+  gettimeofday(&start, NULL);
+  for (i = 0; i < ips; i++)
+  {
+    set_ip(&client, addrs[i]);
+    IPcheck_local_connect(&client);
+  }
+  printf("%u reconexiones:        %.3fs\n", ips, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < 2 * ips; i++)
+  {
+    set_ip(&client, addrs[i % ips]);
+    IPcheck_disconnect(&client);
+  }
+  printf("%u desconexiones:       %.3fs\n", 2 * ips, elapsed(&start));
+  printf("registros %u casillas %u\n", IPregistry_used, IPregistry_size);
+
+  now += 601;
+  gettimeofday(&start, NULL);
+  /* Cada caducado gasta turno, asi que la vuelta dura algo mas */
+  i = 0;
+  do
+  {
+    IPregistry_sweep(NULL);
+    i++;
+  } while (IPregistry_cursor != 0);
+  printf("vuelta del barrido:     %.3fs (%u segundos)\n", elapsed(&start), i);
+  printf("registros %u casillas %u caducados %u\n", IPregistry_used,
+      IPregistry_size, IPregistry_expired);
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * IRC - Internet Relay Chat, tools/bench_timer.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Compara la rueda de temporizadores de ircd/s_timer.c con el
+ * min_heap de libevent, que es lo que usaba antes el chequeo de ping.
+ *
+ * Se simulan 'clientes' conexiones con un plazo de PINGFREQ segundos
+ * que se rearma en cada lectura: 'lecturas' rearmes al azar repartidos
+ * a lo largo de 'segundos' segundos simulados.  En la rueda se cuentan
+ * tambien los ticks de cada segundo; en libevent solo los evtimer_add,
+ * porque sus plazos van con el reloj real y no llegan a vencer.
+ *
+ * Uso: bench_timer [clientes [lecturas [segundos]]]
+ */
+
+#include "../ircd/s_timer.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#if defined(DEBUGMALLOC)
+#error "Los benchmarks no tienen sentido con DEBUGMALLOC"
+#endif
+
+#define PINGFREQ 120
+
+/* Lo que en el ircd ponen ircd.c, s_bsd.c y send.c */
+aClient me;
+time_t now;
+
+void update_now(void)
+{
+  /* El reloj lo avanza el propio benchmark */
+}
+
+void sendto_one(aClient *UNUSED(to), char *UNUSED(pattern), ...)
+{
+}
+
+static unsigned int fired = 0;
+
+static void wheel_expire(void *data)
+{
+  fired++;
+  timer_add((struct WheelTimer *)data, PINGFREQ);
+}
+
+static void heap_expire(int UNUSED(fd), short UNUSED(event), void *UNUSED(arg))
+{
+}
+
+static double elapsed(struct timeval *start)
+{
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int clients = (argc > 1) ? atoi(argv[1]) : 40000;
+  unsigned int reads = (argc > 2) ? atoi(argv[2]) : 10000000;
+  unsigned int seconds = (argc > 3) ? atoi(argv[3]) : 600;
+  unsigned int *order, i, s, per_second;
+  struct WheelTimer *timers;
+  struct event **events;
+  struct timeval start, tm;
+  double t_arm, t_rearm, t_del;
+
+  if (!clients || !seconds)
+  {
+    fprintf(stderr, "Uso: %s [clientes [lecturas [segundos]]]\n", argv[0]);
+    return 1;
+  }
+  per_second = reads / seconds;
+  event_init();
+
+  /* La misma secuencia de lecturas para los dos */
+  order = (unsigned int *)malloc(per_second * seconds * sizeof(unsigned int));
+  srandom(1);
+  for (i = 0; i < per_second * seconds; i++)
+    order[i] = random() % clients;
+
+  printf("%u clientes, %u lecturas en %u segundos\n", clients,
+      per_second * seconds, seconds);
+  printf("%-8s %10s %10s %10s %10s\n", "", "armar", "rearmar", "desarmar",
+      "ns/rearme");
+
+  /* Rueda: los temporizadores van embebidos, como en aClient */
+  timers = (struct WheelTimer *)calloc(clients, sizeof(struct WheelTimer));
+  now = 1000000;
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < clients; i++)
+  {
+    timer_set(&timers[i], wheel_expire, &timers[i]);
+    timer_add(&timers[i], PINGFREQ);
+  }
+  t_arm = elapsed(&start);
+
+  gettimeofday(&start, NULL);
+  for (s = 0; s < seconds; s++)
+  {
+    now++;
+    event_wheel_callback(-1, EV_TIMEOUT, NULL);
+    for (i = s * per_second; i < (s + 1) * per_second; i++)
+      timer_add(&timers[order[i]], PINGFREQ);
+  }
+  t_rearm = elapsed(&start);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < clients; i++)
+    timer_del(&timers[i]);
+  t_del = elapsed(&start);
+
+  printf("%-8s %9.3fs %9.3fs %9.3fs %10.1f\n", "wheel", t_arm, t_rearm, t_del,
+      t_rearm * 1e9 / (per_second * seconds));
+
+  /* min_heap: un struct event reservado por cliente, como antes */
+  events = (struct event **)malloc(clients * sizeof(struct event *));
+  for (i = 0; i < clients; i++)
+    events[i] = (struct event *)malloc(sizeof(struct event));
+  evutil_timerclear(&tm);
+  tm.tv_sec = PINGFREQ;
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < clients; i++)
+  {
+    evtimer_set(events[i], heap_expire, NULL);
+    evtimer_add(events[i], &tm);
+  }
+  t_arm = elapsed(&start);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < per_second * seconds; i++)
+    evtimer_add(events[order[i]], &tm);
+  t_rearm = elapsed(&start);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < clients; i++)
+    evtimer_del(events[i]);
+  t_del = elapsed(&start);
+
+  printf("%-8s %9.3fs %9.3fs %9.3fs %10.1f\n", "min_heap", t_arm, t_rearm,
+      t_del, t_rearm * 1e9 / (per_second * seconds));
+  printf("vencidos en la rueda: %u\n", fired);
+
+  return 0;
+}